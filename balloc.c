@@ -23,9 +23,30 @@
  * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <linux/module.h>
 #include <linux/fs.h>
 #include <linux/bitops.h>
 #include "nova.h"
+#include "nova_trace.h"
+
+/* Size of the recovery pool, 0 to go without */
+static unsigned int recovery_pool_mb = 128;
+module_param(recovery_pool_mb, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(recovery_pool_mb,
+	"MB kept aside to allocate from during background recovery");
+
+/* Smaller pools are not worth mounting early for */
+#define NOVA_POOL_MIN_BLOCKS	1024
+/* Pool blocks handed out per update of s_pool_next */
+#define NOVA_POOL_MARK_STEP	512
+
+/* A deferred free, see nova_defer_free_blocks() */
+struct nova_deferred_free {
+	struct list_head list;
+	unsigned long blocknr;
+	unsigned long num;
+	int log_page;
+};
 
 int nova_alloc_block_free_lists(struct super_block *sb)
 {
@@ -112,6 +133,163 @@ void nova_init_blockmap(struct super_block *sb, int recovery)
 	}
 }
 
+/************************* Recovery pool ***************************/
+
+static void nova_set_recovery_pool(struct super_block *sb,
+	unsigned long start, unsigned long next, unsigned long end)
+{
+	struct nova_super_block *super = nova_get_super(sb);
+	size_t size = 3 * sizeof(__le64);
+
+	if (!nova_has_rebuild_meta(sb))
+		return;
+
+	/* An empty end makes the pool invalid until all fields are set */
+	nova_memunlock_range(sb, &super->s_pool_start, size);
+	super->s_pool_end = 0;
+	nova_flush_buffer(&super->s_pool_end, sizeof(__le64), 1);
+	super->s_pool_start = cpu_to_le64(start);
+	super->s_pool_next = cpu_to_le64(next);
+	nova_flush_buffer(&super->s_pool_start, size, 1);
+	super->s_pool_end = cpu_to_le64(end);
+	nova_memlock_range(sb, &super->s_pool_start, size);
+	nova_flush_buffer(&super->s_pool_end, sizeof(__le64), 1);
+}
+
+/* Returns the number of never used pool blocks, 0 if there is no pool */
+static unsigned long nova_get_recovery_pool(struct super_block *sb,
+	unsigned long *start, unsigned long *next, unsigned long *end)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_super_block *super = nova_get_super(sb);
+
+	if (!nova_has_rebuild_meta(sb))
+		return 0;
+
+	*start = le64_to_cpu(super->s_pool_start);
+	*next = le64_to_cpu(super->s_pool_next);
+	*end = le64_to_cpu(super->s_pool_end);
+
+	if (*start < sbi->reserved_blocks || *next < *start ||
+			*end < *next || *end > sbi->num_blocks)
+		return 0;
+
+	return *end - *next;
+}
+
+/*
+ * Failure recovery is scanning the volume in the background: serve
+ * allocations from the recovery pool, and defer frees until the scan
+ * tells which blocks are in use.
+ */
+int nova_start_restricted_alloc(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	unsigned long start, next, end;
+
+	if (nova_get_recovery_pool(sb, &start, &next, &end) <
+			NOVA_POOL_MIN_BLOCKS)
+		return -ENOSPC;
+
+	/*
+	 * Blocks before next were handed out before the crash, the scan
+	 * finds the ones still in use.
+	 */
+	spin_lock(&sbi->pool_lock);
+	sbi->pool_start = next;
+	sbi->pool_next = next;
+	sbi->pool_end = end;
+	sbi->pool_mark = next;
+	sbi->restricted_alloc = 1;
+	spin_unlock(&sbi->pool_lock);
+
+	nova_info("Allocating from %lu recovery pool blocks until recovery "
+			"is done\n", end - next);
+	return 0;
+}
+
+/*
+ * Bump allocation from the pool. s_pool_next is persisted ahead of the
+ * blocks handed out, so a crash before the scan is done does not hand
+ * them out again. Returns -EAGAIN if the pool is no longer in use.
+ */
+static int nova_new_pool_blocks(struct super_block *sb,
+	unsigned long *blocknr, unsigned long num_blocks, unsigned short btype)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_super_block *super = nova_get_super(sb);
+	unsigned long left;
+
+	spin_lock(&sbi->pool_lock);
+	if (!sbi->restricted_alloc) {
+		spin_unlock(&sbi->pool_lock);
+		return -EAGAIN;
+	}
+
+	left = sbi->pool_end - sbi->pool_next;
+	if (left < num_blocks) {
+		/* Superpage allocation must succeed */
+		if (btype > 0 || left == 0) {
+			spin_unlock(&sbi->pool_lock);
+			return -ENOSPC;
+		}
+		num_blocks = left;
+	}
+
+	*blocknr = sbi->pool_next;
+	sbi->pool_next += num_blocks;
+
+	if (sbi->pool_next > sbi->pool_mark) {
+		sbi->pool_mark = min(sbi->pool_next + NOVA_POOL_MARK_STEP,
+					sbi->pool_end);
+		nova_memunlock_range(sb, &super->s_pool_next, sizeof(__le64));
+		super->s_pool_next = cpu_to_le64(sbi->pool_mark);
+		nova_memlock_range(sb, &super->s_pool_next, sizeof(__le64));
+		nova_flush_buffer(&super->s_pool_next, sizeof(__le64), 1);
+	}
+	spin_unlock(&sbi->pool_lock);
+
+	return num_blocks;
+}
+
+/*
+ * Whether the scan saw a block or not depends on when it was freed, so
+ * frees are kept until the scan is done. Returns true if the free was
+ * deferred.
+ */
+static bool nova_defer_free_blocks(struct super_block *sb,
+	unsigned long blocknr, unsigned long num_blocks, int log_page)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_deferred_free *df;
+
+	if (likely(!READ_ONCE(sbi->restricted_alloc)))
+		return false;
+
+	df = kmalloc(sizeof(struct nova_deferred_free), GFP_NOFS);
+
+	spin_lock(&sbi->pool_lock);
+	if (!sbi->restricted_alloc) {
+		spin_unlock(&sbi->pool_lock);
+		kfree(df);
+		return false;
+	}
+
+	if (df) {
+		df->blocknr = blocknr;
+		df->num = num_blocks;
+		df->log_page = log_page;
+		list_add_tail(&df->list, &sbi->deferred_frees);
+		sbi->deferred_blocks += num_blocks;
+	} else {
+		/* Leaked until the next failure recovery */
+		sbi->leaked_blocks += num_blocks;
+	}
+	spin_unlock(&sbi->pool_lock);
+
+	return true;
+}
+
 static inline int nova_rbtree_compare_rangenode(struct nova_range_node *curr,
 	unsigned long range_low)
 {
@@ -293,6 +471,11 @@ static int nova_free_blocks(struct super_block *sb, unsigned long blocknr,
 		return -EINVAL;
 	}
 
+	num_blocks = nova_get_numblocks(btype) * num;
+	trace_nova_free_blocks(sb, blocknr, num_blocks, log_page);
+	if (nova_defer_free_blocks(sb, blocknr, num_blocks, log_page))
+		return 0;
+
 	cpuid = blocknr / sbi->per_list_blocks;
 	if (cpuid >= sbi->cpus)
 		cpuid = SHARED_CPU;
@@ -309,7 +492,6 @@ static int nova_free_blocks(struct super_block *sb, unsigned long blocknr,
 
 	tree = &(free_list->block_free_tree);
 
-	num_blocks = nova_get_numblocks(btype) * num;
 	block_low = blocknr;
 	block_high = blocknr + num_blocks - 1;
 
@@ -395,7 +577,7 @@ int nova_free_data_blocks(struct super_block *sb, struct nova_inode *pi,
 		nova_err(sb, "Inode %llu: free %d data block from %lu to %lu "
 				"failed!\n", pi->nova_ino, num, blocknr,
 				blocknr + num - 1);
-	NOVA_END_TIMING(free_data_t, free_time);
+	NOVA_END_TIMING(sb, free_data_t, free_time);
 
 	return ret;
 }
@@ -418,11 +600,82 @@ int nova_free_log_blocks(struct super_block *sb, struct nova_inode *pi,
 		nova_err(sb, "Inode %llu: free %d log block from %lu to %lu "
 				"failed!\n", pi->nova_ino, num, blocknr,
 				blocknr + num - 1);
-	NOVA_END_TIMING(free_log_t, free_time);
+	NOVA_END_TIMING(sb, free_log_t, free_time);
 
 	return ret;
 }
 
+/*
+ * The background scan is done and the free lists are built from bitmap,
+ * with the whole pool marked in use. Go back to the free lists, then give
+ * back the unused pool and the deferred frees of blocks the scan found.
+ * The scan may not count a shared block once per file, so deferred data
+ * frees are given up on if any block is shared.
+ */
+void nova_end_restricted_alloc(struct super_block *sb,
+	unsigned long *bitmap)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_deferred_free *df, *tmp;
+	unsigned long next, end, low, high, i;
+	LIST_HEAD(deferred);
+
+	spin_lock(&sbi->pool_lock);
+	sbi->restricted_alloc = 0;
+	next = sbi->pool_next;
+	end = sbi->pool_end;
+	list_splice_init(&sbi->deferred_frees, &deferred);
+	sbi->deferred_blocks = 0;
+	spin_unlock(&sbi->pool_lock);
+
+	/* Forget the pool before its blocks can be handed out */
+	nova_release_recovery_pool(sb);
+	if (next < end)
+		nova_free_blocks(sb, next, end - next, NOVA_BLOCK_TYPE_4K, 0);
+
+	list_for_each_entry_safe(df, tmp, &deferred, list) {
+		if (!df->log_page && sbi->num_shared_blocks) {
+			sbi->leaked_blocks += df->num;
+			goto drop;
+		}
+
+		/* Blocks freed before the scan saw them are free already */
+		low = df->blocknr;
+		high = df->blocknr + df->num;
+		while (low < high) {
+			low = find_next_bit(bitmap, high, low);
+			if (low >= high)
+				break;
+			i = find_next_zero_bit(bitmap, high, low);
+			nova_free_blocks(sb, low, i - low, NOVA_BLOCK_TYPE_4K,
+						df->log_page);
+			low = i;
+		}
+drop:
+		list_del(&df->list);
+		kfree(df);
+	}
+
+	if (sbi->leaked_blocks)
+		nova_info("%lu blocks freed during recovery are left in use\n",
+				sbi->leaked_blocks);
+}
+
+/* Unmount before the background scan is done */
+void nova_discard_restricted_alloc(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_deferred_free *df, *tmp;
+
+	spin_lock(&sbi->pool_lock);
+	list_for_each_entry_safe(df, tmp, &sbi->deferred_frees, list) {
+		list_del(&df->list);
+		kfree(df);
+	}
+	sbi->deferred_blocks = 0;
+	spin_unlock(&sbi->pool_lock);
+}
+
 static unsigned long nova_alloc_blocks_in_free_list(struct super_block *sb,
 	struct free_list *free_list, unsigned short btype,
 	unsigned long num_blocks, unsigned long *new_blocknr)
@@ -477,7 +730,7 @@ static unsigned long nova_alloc_blocks_in_free_list(struct super_block *sb,
 
 	free_list->num_free_blocks -= num_blocks;
 
-	NOVA_STATS_ADD(alloc_steps, step);
+	NOVA_STATS_ADD(sb, alloc_steps, step);
 
 	if (found == 0)
 		return -ENOSPC;
@@ -510,6 +763,7 @@ static int nova_new_blocks(struct super_block *sb, unsigned long *blocknr,
 	unsigned int num, unsigned short btype, int zero,
 	enum alloc_type atype)
 {
+	struct nova_sb_info *sbi = NOVA_SB(sb);
 	struct free_list *free_list;
 	void *bp;
 	unsigned long num_blocks = 0;
@@ -519,12 +773,24 @@ static int nova_new_blocks(struct super_block *sb, unsigned long *blocknr,
 	struct nova_range_node *first;
 	int cpuid;
 	int retried = 0;
+	int allocated;
 
 	num_blocks = num * nova_get_numblocks(btype);
 	if (num_blocks == 0)
 		return -EINVAL;
 
-	cpuid = smp_processor_id();
+	if (unlikely(READ_ONCE(sbi->restricted_alloc))) {
+		allocated = nova_new_pool_blocks(sb, &new_blocknr, num_blocks,
+							btype);
+		if (allocated != -EAGAIN) {
+			if (allocated <= 0)
+				return -ENOSPC;
+			ret_blocks = allocated;
+			goto alloc_done;
+		}
+	}
+
+	cpuid = nova_get_cpuid(sb);
 
 retry:
 	free_list = nova_get_free_list(sb, cpuid);
@@ -567,12 +833,16 @@ retry:
 	if (ret_blocks <= 0 || new_blocknr == 0)
 		return -ENOSPC;
 
+alloc_done:
 	if (zero) {
 		bp = nova_get_block(sb, nova_get_block_off(sb,
 						new_blocknr, btype));
 		memset_nt(bp, 0, PAGE_SIZE * ret_blocks);
+		NOVA_WA_ADD(sb, wa_zero, PAGE_SIZE * ret_blocks);
 	}
 	*blocknr = new_blocknr;
+	trace_nova_new_blocks(sb, new_blocknr, num_blocks, ret_blocks, btype,
+				atype, zero);
 
 	nova_dbg_verbose("Alloc %lu NVMM blocks 0x%lx\n", ret_blocks, *blocknr);
 	return ret_blocks / nova_get_numblocks(btype);
@@ -587,7 +857,7 @@ inline int nova_new_data_blocks(struct super_block *sb, struct nova_inode *pi,
 	NOVA_START_TIMING(new_data_blocks_t, alloc_time);
 	allocated = nova_new_blocks(sb, blocknr, num,
 					pi->i_blk_type, zero, DATA);
-	NOVA_END_TIMING(new_data_blocks_t, alloc_time);
+	NOVA_END_TIMING(sb, new_data_blocks_t, alloc_time);
 	nova_dbgv("Inode %llu, start blk %lu, cow %d, "
 			"alloc %d data blocks from %lu to %lu\n",
 			pi->nova_ino, start_blk, cow, allocated, *blocknr,
@@ -603,7 +873,7 @@ inline int nova_new_log_blocks(struct super_block *sb, struct nova_inode *pi,
 	NOVA_START_TIMING(new_log_blocks_t, alloc_time);
 	allocated = nova_new_blocks(sb, blocknr, num,
 					pi->i_blk_type, zero, LOG);
-	NOVA_END_TIMING(new_log_blocks_t, alloc_time);
+	NOVA_END_TIMING(sb, new_log_blocks_t, alloc_time);
 	nova_dbgv("Inode %llu, alloc %d log blocks from %lu to %lu\n",
 			pi->nova_ino, allocated, *blocknr,
 			*blocknr + allocated - 1);
@@ -624,7 +894,59 @@ unsigned long nova_count_free_blocks(struct super_block *sb)
 
 	free_list = nova_get_free_list(sb, SHARED_CPU);
 	num_free_blocks += free_list->num_free_blocks;
-	return num_free_blocks;
+
+	return num_free_blocks + nova_count_pool_blocks(sb);
+}
+
+/* Recovery pool blocks left to allocate from, 0 outside recovery */
+unsigned long nova_count_pool_blocks(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+
+	if (!READ_ONCE(sbi->restricted_alloc))
+		return 0;
+	return sbi->pool_end - sbi->pool_next;
+}
+
+/* The pool blocks are back in the free lists, or about to be */
+void nova_release_recovery_pool(struct super_block *sb)
+{
+	nova_set_recovery_pool(sb, 0, 0, 0);
+}
+
+/*
+ * Take the recovery pool out of the free lists, if the volume has none.
+ * Called once the free lists are complete: on format, at mount, and when
+ * a background recovery is done.
+ */
+void nova_reserve_recovery_pool(struct super_block *sb)
+{
+	unsigned long num = (unsigned long)recovery_pool_mb <<
+					(20 - PAGE_SHIFT);
+	unsigned long start, next, end;
+	unsigned long blocknr = 0;
+	int allocated;
+
+	if (num == 0 || (sb->s_flags & MS_RDONLY) ||
+			!nova_has_rebuild_meta(sb))
+		return;
+
+	if (nova_get_recovery_pool(sb, &start, &next, &end))
+		return;
+
+	allocated = nova_new_blocks(sb, &blocknr, num, NOVA_BLOCK_TYPE_4K,
+					0, 0);
+	if (allocated <= 0)
+		return;
+
+	if (allocated < NOVA_POOL_MIN_BLOCKS) {
+		nova_free_blocks(sb, blocknr, allocated, NOVA_BLOCK_TYPE_4K, 0);
+		nova_dbg("%s: no room for a recovery pool\n", __func__);
+		return;
+	}
+
+	nova_set_recovery_pool(sb, blocknr, blocknr, blocknr + allocated);
+	nova_dbgv("%s: %d blocks from %lu\n", __func__, allocated, blocknr);
 }
 
 
@@ -28,8 +28,16 @@
 #include <linux/slab.h>
 #include <linux/random.h>
 #include <linux/delay.h>
+#include <linux/module.h>
+#include <linux/rbtree_augmented.h>
 #include "nova.h"
 
+/* Mount right after the inode lists are rebuilt and scan the logs later */
+static bool bg_recovery = true;
+module_param(bg_recovery, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(bg_recovery,
+	"Finish failure recovery in the background after mount");
+
 static inline void set_scan_bm(unsigned long bit,
 	struct single_scan_bm *scan_bm)
 {
@@ -179,6 +187,368 @@ static void nova_destroy_blocknode_trees(struct super_block *sb)
 	nova_destroy_blocknode_tree(sb, SHARED_CPU);
 }
 
+static void nova_destroy_inode_trees(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct inode_map *inode_map;
+	int i;
+
+	for (i = 0; i < sbi->cpus; i++) {
+		inode_map = &sbi->inode_maps[i];
+		nova_destroy_range_node_tree(sb,
+					&inode_map->inode_inuse_tree);
+	}
+}
+
+/*
+ * Saved inode ranges carry their CPU in the top bits of range_low: the
+ * low byte in bits 56-63 as volumes always did, the high byte in 48-55.
+ */
+#define CPUID_MASK 0xffff000000000000
+
+static inline u64 nova_range_cpuid_bits(unsigned long cpuid)
+{
+	return ((u64)(cpuid & 0xff) << 56) | ((u64)(cpuid >> 8) << 48);
+}
+
+static inline unsigned long nova_range_cpuid(u64 range_low)
+{
+	return (range_low >> 56) | (((range_low >> 48) & 0xff) << 8);
+}
+
+/*
+ * Free lists and inode lists saved by nova_save_lists_to_log() are loaded
+ * by several threads, one list at a time. Each tree is built balanced
+ * from the sorted entries of its list, without any search or rebalancing.
+ */
+enum nova_list_type {
+	NOVA_BLOCK_LISTS,
+	NOVA_INODE_LISTS,
+};
+
+struct nova_list_desc {
+	u64 head;
+	u64 tail;
+	unsigned long num_entries;
+	unsigned long pages;		/* Room reserved for a save */
+	unsigned long used;		/* Blocks or inodes in the list */
+};
+
+struct nova_list_work {
+	struct super_block *sb;
+	enum nova_list_type type;
+	bool save;
+	struct nova_list_desc *lists;
+	unsigned long num_lists;
+	atomic_t next_list;
+	atomic_t running;
+	struct completion done;
+	int error;
+};
+
+struct nova_list_cursor {
+	struct nova_list_work *work;
+	unsigned long list;
+	u64 curr_p;
+	unsigned long count;
+	unsigned long prev_high;
+	unsigned long used;
+	int maxdepth;
+	int error;
+};
+
+/* The free lists end with the shared one */
+static unsigned long nova_num_lists(struct nova_sb_info *sbi,
+	enum nova_list_type type)
+{
+	return type == NOVA_BLOCK_LISTS ? sbi->cpus + 1 : sbi->cpus;
+}
+
+static inline int nova_list_cpuid(struct nova_sb_info *sbi,
+	unsigned long list)
+{
+	return list < sbi->cpus ? list : SHARED_CPU;
+}
+
+static struct rb_root *nova_list_tree(struct super_block *sb,
+	enum nova_list_type type, unsigned long list)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+
+	if (type == NOVA_INODE_LISTS)
+		return &sbi->inode_maps[list].inode_inuse_tree;
+
+	return &nova_get_free_list(sb,
+			nova_list_cpuid(sbi, list))->block_free_tree;
+}
+
+static unsigned long nova_list_nodes(struct super_block *sb,
+	enum nova_list_type type, unsigned long list)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+
+	if (type == NOVA_INODE_LISTS)
+		return sbi->inode_maps[list].num_range_node_inode;
+
+	return nova_get_free_list(sb,
+			nova_list_cpuid(sbi, list))->num_blocknode;
+}
+
+static void nova_free_list_tree(struct rb_root *tree)
+{
+	struct nova_range_node *curr, *next;
+
+	rbtree_postorder_for_each_entry_safe(curr, next, tree, node)
+		nova_free_range_node(curr);
+	*tree = RB_ROOT;
+}
+
+static void nova_do_list_work(struct nova_list_work *work);
+
+static int nova_list_thread_func(void *data)
+{
+	nova_do_list_work(data);
+	return 0;
+}
+
+/*
+ * Run work on one thread per online CPU, the caller included, and wait
+ * for it. Returns the last error of any list.
+ */
+static int nova_run_list_work(struct nova_list_work *work)
+{
+	struct task_struct *task;
+	int threads;
+	int i;
+
+	threads = min_t(unsigned long, num_online_cpus(), work->num_lists);
+	atomic_set(&work->next_list, 0);
+	atomic_set(&work->running, threads);
+	init_completion(&work->done);
+	work->error = 0;
+
+	for (i = 1; i < threads; i++) {
+		task = kthread_run(nova_list_thread_func, work,
+					"nova_%s_ls%d", work->sb->s_id, i);
+		if (IS_ERR(task))
+			atomic_dec(&work->running);
+	}
+
+	nova_do_list_work(work);
+	wait_for_completion(&work->done);
+	return work->error;
+}
+
+static u64 nova_next_list_record(struct super_block *sb, u64 curr_p)
+{
+	if (is_last_entry(curr_p, sizeof(struct nova_range_node_lowhigh)))
+		curr_p = next_log_page(sb, curr_p);
+	return curr_p;
+}
+
+static int nova_read_list_entry(struct nova_list_cursor *cur,
+	struct nova_range_node *node)
+{
+	struct super_block *sb = cur->work->sb;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_range_node_lowhigh *entry;
+	unsigned long low, high;
+	int cpuid;
+
+	cur->curr_p = nova_next_list_record(sb, cur->curr_p);
+	if (cur->curr_p == 0)
+		return -EINVAL;
+
+	entry = (struct nova_range_node_lowhigh *)nova_get_block(sb,
+							cur->curr_p);
+	low = le64_to_cpu(entry->range_low);
+	high = le64_to_cpu(entry->range_high);
+
+	if (cur->work->type == NOVA_INODE_LISTS) {
+		if (nova_range_cpuid(low) != cur->list)
+			return -EINVAL;
+		low &= ~CPUID_MASK;
+	} else {
+		cpuid = nova_list_cpuid(sbi, cur->list);
+		if (get_cpuid(sbi, low) != cpuid ||
+				get_cpuid(sbi, high) != cpuid)
+			return -EINVAL;
+	}
+
+	/* Entries are saved in increasing order and never overlap */
+	if (low > high || (cur->count && low <= cur->prev_high))
+		return -EINVAL;
+
+	node->range_low = low;
+	node->range_high = high;
+	cur->prev_high = high;
+	cur->used += high - low + 1;
+	cur->count++;
+	cur->curr_p += sizeof(struct nova_range_node_lowhigh);
+	return 0;
+}
+
+/*
+ * Build the subtree of the next num entries at depth, in order. Only the
+ * nodes on the deepest level are red, so every path has the same number
+ * of black nodes. On error the nodes built so far stay linked for
+ * nova_free_list_tree().
+ */
+static struct rb_node *nova_build_list_tree(struct nova_list_cursor *cur,
+	unsigned long num, int depth)
+{
+	struct nova_range_node *node;
+	struct rb_node *left, *right = NULL;
+	int color;
+
+	if (num == 0 || cur->error)
+		return NULL;
+
+	if (cur->work->type == NOVA_INODE_LISTS)
+		node = nova_alloc_inode_node(cur->work->sb);
+	else
+		node = nova_alloc_blocknode(cur->work->sb);
+	if (!node) {
+		cur->error = -ENOMEM;
+		return NULL;
+	}
+
+	left = nova_build_list_tree(cur, (num - 1) / 2, depth + 1);
+	if (!cur->error)
+		cur->error = nova_read_list_entry(cur, node);
+	if (!cur->error)
+		right = nova_build_list_tree(cur, num - 1 - (num - 1) / 2,
+						depth + 1);
+
+	color = (depth && depth == cur->maxdepth) ? RB_RED : RB_BLACK;
+	rb_set_parent_color(&node->node, NULL, color);
+	node->node.rb_left = left;
+	node->node.rb_right = right;
+	if (left)
+		rb_set_parent(left, &node->node);
+	if (right)
+		rb_set_parent(right, &node->node);
+
+	return &node->node;
+}
+
+static int nova_load_list(struct nova_list_work *work, unsigned long list)
+{
+	struct super_block *sb = work->sb;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_list_desc *desc = &work->lists[list];
+	struct nova_list_cursor cur = {0};
+	struct nova_range_node *first = NULL;
+	struct free_list *free_list;
+	struct inode_map *inode_map;
+	struct rb_root *tree;
+
+	if (desc->num_entries && desc->head == 0)
+		return -EINVAL;
+
+	cur.work = work;
+	cur.list = list;
+	cur.curr_p = desc->head;
+	if (desc->num_entries)
+		cur.maxdepth = ilog2(desc->num_entries);
+
+	tree = nova_list_tree(sb, work->type, list);
+	tree->rb_node = nova_build_list_tree(&cur, desc->num_entries, 0);
+	if (cur.error) {
+		nova_free_list_tree(tree);
+		return cur.error;
+	}
+
+	if (tree->rb_node)
+		first = container_of(rb_first(tree),
+					struct nova_range_node, node);
+	desc->used = cur.used;
+
+	if (work->type == NOVA_INODE_LISTS) {
+		inode_map = &sbi->inode_maps[list];
+		inode_map->num_range_node_inode = desc->num_entries;
+		inode_map->first_inode_range = first;
+	} else {
+		free_list = nova_get_free_list(sb, nova_list_cpuid(sbi, list));
+		free_list->num_blocknode = desc->num_entries;
+		free_list->first_node = first;
+		free_list->num_free_blocks = cur.used;
+	}
+
+	return 0;
+}
+
+static bool nova_lists_saved(struct super_block *sb, struct nova_inode *pi)
+{
+	struct nova_save_header *header;
+
+	header = (struct nova_save_header *)nova_get_block(sb, pi->log_head);
+	return le64_to_cpu(header->magic) == NOVA_SAVE_MAGIC;
+}
+
+static int nova_load_lists_from_inode(struct super_block *sb,
+	struct nova_inode *pi, enum nova_list_type type)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_save_header *header;
+	struct nova_save_list *record;
+	struct nova_list_work work = {0};
+	unsigned long i;
+	u64 curr_p;
+	int ret = 0;
+
+	work.sb = sb;
+	work.type = type;
+	work.num_lists = nova_num_lists(sbi, type);
+
+	header = (struct nova_save_header *)nova_get_block(sb, pi->log_head);
+	if (le64_to_cpu(header->num_lists) != work.num_lists) {
+		nova_err(sb, "%s: %llu lists saved, expect %lu\n", __func__,
+				le64_to_cpu(header->num_lists), work.num_lists);
+		return -EINVAL;
+	}
+
+	work.lists = kcalloc(work.num_lists, sizeof(struct nova_list_desc),
+				GFP_KERNEL);
+	if (!work.lists)
+		return -ENOMEM;
+
+	curr_p = pi->log_head + sizeof(struct nova_save_header);
+	for (i = 0; i < work.num_lists; i++) {
+		curr_p = nova_next_list_record(sb, curr_p);
+		if (curr_p == 0) {
+			ret = -EINVAL;
+			goto out;
+		}
+
+		record = (struct nova_save_list *)nova_get_block(sb, curr_p);
+		work.lists[i].head = le64_to_cpu(record->head);
+		work.lists[i].num_entries = le64_to_cpu(record->num_entries);
+		curr_p += sizeof(struct nova_save_list);
+	}
+
+	ret = nova_run_list_work(&work);
+	if (ret)
+		goto out;
+
+	if (type == NOVA_INODE_LISTS) {
+		sbi->s_inodes_used_count = 0;
+		for (i = 0; i < work.num_lists; i++)
+			sbi->s_inodes_used_count += work.lists[i].used;
+	}
+
+	nova_dbg("%s: %s lists loaded by up to %d threads\n", __func__,
+			type == NOVA_INODE_LISTS ? "inode" : "block",
+			min_t(int, num_online_cpus(), work.num_lists));
+out:
+	if (ret) {
+		for (i = 0; i < work.num_lists; i++)
+			nova_free_list_tree(nova_list_tree(sb, type, i));
+	}
+	kfree(work.lists);
+	return ret;
+}
+
 static int nova_init_blockmap_from_inode(struct super_block *sb)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
@@ -197,6 +567,11 @@ static int nova_init_blockmap_from_inode(struct super_block *sb)
 		return -EINVAL;
 	}
 
+	if (nova_lists_saved(sb, pi)) {
+		ret = nova_load_lists_from_inode(sb, pi, NOVA_BLOCK_LISTS);
+		goto out;
+	}
+
 	while (curr_p != pi->log_tail) {
 		if (is_last_entry(curr_p, size)) {
 			curr_p = next_log_page(sb, curr_p);
@@ -241,21 +616,6 @@ out:
 	return ret;
 }
 
-static void nova_destroy_inode_trees(struct super_block *sb)
-{
-	struct nova_sb_info *sbi = NOVA_SB(sb);
-	struct inode_map *inode_map;
-	int i;
-
-	for (i = 0; i < sbi->cpus; i++) {
-		inode_map = &sbi->inode_maps[i];
-		nova_destroy_range_node_tree(sb,
-					&inode_map->inode_inuse_tree);
-	}
-}
-
-#define CPUID_MASK 0xff00000000000000
-
 static int nova_init_inode_list_from_inode(struct super_block *sb)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
@@ -276,6 +636,11 @@ static int nova_init_inode_list_from_inode(struct super_block *sb)
 		return -EINVAL;
 	}
 
+	if (nova_lists_saved(sb, pi)) {
+		ret = nova_load_lists_from_inode(sb, pi, NOVA_INODE_LISTS);
+		goto out;
+	}
+
 	while (curr_p != pi->log_tail) {
 		if (is_last_entry(curr_p, size)) {
 			curr_p = next_log_page(sb, curr_p);
@@ -292,7 +657,7 @@ static int nova_init_inode_list_from_inode(struct super_block *sb)
 		if (range_node == NULL)
 			NOVA_ASSERT(0);
 
-		cpuid = (entry->range_low & CPUID_MASK) >> 56;
+		cpuid = nova_range_cpuid(entry->range_low);
 		if (cpuid >= sbi->cpus) {
 			nova_err(sb, "Invalid cpuid %lu\n", cpuid);
 			nova_free_inode_node(sb, range_node);
@@ -330,6 +695,49 @@ out:
 	return ret;
 }
 
+static int nova_init_block_refs_from_inode(struct super_block *sb)
+{
+	struct nova_inode *pi = nova_get_inode_by_ino(sb, NOVA_BLOCKREF_INO);
+	struct nova_block_ref_entry *entry;
+	size_t size = sizeof(struct nova_block_ref_entry);
+	u64 curr_p;
+	int ret = 0;
+
+	/* No shared blocks at the last umount */
+	if (pi->log_head == 0 || pi->log_tail == 0)
+		return 0;
+
+	curr_p = pi->log_head;
+	while (curr_p != pi->log_tail) {
+		if (is_last_entry(curr_p, size))
+			curr_p = next_log_page(sb, curr_p);
+
+		if (curr_p == 0) {
+			nova_dbg("%s: curr_p is NULL!\n", __func__);
+			NOVA_ASSERT(0);
+			ret = -EINVAL;
+			break;
+		}
+
+		entry = (struct nova_block_ref_entry *)nova_get_block(sb,
+							curr_p);
+		ret = nova_insert_block_ref_range(sb,
+				le64_to_cpu(entry->range_low),
+				le64_to_cpu(entry->range_high),
+				le64_to_cpu(entry->refcount));
+		if (ret) {
+			nova_err(sb, "%s failed\n", __func__);
+			nova_destroy_block_refs(sb);
+			break;
+		}
+
+		curr_p += size;
+	}
+
+	nova_free_inode_log(sb, pi);
+	return ret;
+}
+
 static bool nova_can_skip_full_scan(struct super_block *sb)
 {
 	struct nova_inode *pi =  nova_get_inode_by_ino(sb, NOVA_BLOCKNODE_INO);
@@ -353,6 +761,15 @@ static bool nova_can_skip_full_scan(struct super_block *sb)
 		return false;
 	}
 
+	ret = nova_init_block_refs_from_inode(sb);
+	if (ret) {
+		nova_err(sb, "init block refs failed, "
+				"fall back to failure recovery\n");
+		nova_destroy_inode_trees(sb);
+		nova_destroy_blocknode_trees(sb);
+		return false;
+	}
+
 	return true;
 }
 
@@ -377,7 +794,7 @@ static u64 nova_append_range_node_entry(struct super_block *sb,
 	entry = (struct nova_range_node_lowhigh *)nova_get_block(sb, curr_p);
 	entry->range_low = cpu_to_le64(curr->range_low);
 	if (cpuid)
-		entry->range_low |= cpu_to_le64(cpuid << 56);
+		entry->range_low |= cpu_to_le64(nova_range_cpuid_bits(cpuid));
 	entry->range_high = cpu_to_le64(curr->range_high);
 	nova_dbgv("append entry block low 0x%lx, high 0x%lx\n",
 			curr->range_low, curr->range_high);
@@ -387,114 +804,288 @@ out:
 	return curr_p;
 }
 
-static u64 nova_save_range_nodes_to_log(struct super_block *sb,
-	struct rb_root *tree, u64 temp_tail, unsigned long cpuid)
+/* Write list to the pages reserved for it, in increasing order */
+static int nova_save_list(struct nova_list_work *work, unsigned long list)
 {
+	struct super_block *sb = work->sb;
+	struct nova_list_desc *desc = &work->lists[list];
 	struct nova_range_node *curr;
+	struct rb_root *tree;
 	struct rb_node *temp;
 	size_t size = sizeof(struct nova_range_node_lowhigh);
-	u64 curr_entry = 0;
+	unsigned long cpuid = 0;
+	unsigned long count = 0;
+	u64 curr_p = desc->head;
 
-	/* Save in increasing order */
+	if (work->type == NOVA_INODE_LISTS)
+		cpuid = list;
+
+	tree = nova_list_tree(sb, work->type, list);
 	temp = rb_first(tree);
 	while (temp) {
+		if (count == desc->pages * RANGENODE_PER_PAGE) {
+			nova_err(sb, "%s: list %lu outgrew %lu pages\n",
+					__func__, list, desc->pages);
+			nova_free_list_tree(tree);
+			return -ENOSPC;
+		}
+
 		curr = container_of(temp, struct nova_range_node, node);
-		curr_entry = nova_append_range_node_entry(sb, curr,
-						temp_tail, cpuid);
-		temp_tail = curr_entry + size;
+		curr_p = nova_append_range_node_entry(sb, curr, curr_p,
+						cpuid) + size;
+		count++;
 		temp = rb_next(temp);
-		rb_erase(&curr->node, tree);
-		nova_free_range_node(curr);
 	}
 
-	return temp_tail;
+	desc->num_entries = count;
+	desc->tail = curr_p;
+	nova_free_list_tree(tree);
+	return 0;
 }
 
-static u64 nova_save_free_list_blocknodes(struct super_block *sb, int cpu,
-	u64 temp_tail)
+static void nova_do_list_work(struct nova_list_work *work)
 {
-	struct free_list *free_list;
+	unsigned long list;
+	int ret;
 
-	free_list = nova_get_free_list(sb, cpu);
-	temp_tail = nova_save_range_nodes_to_log(sb, &free_list->block_free_tree,
-								temp_tail, 0);
-	return temp_tail;
+	while ((list = atomic_inc_return(&work->next_list) - 1) <
+						work->num_lists) {
+		if (work->save)
+			ret = nova_save_list(work, list);
+		else
+			ret = nova_load_list(work, list);
+		if (ret)
+			work->error = ret;
+	}
+
+	if (atomic_dec_and_test(&work->running))
+		complete(&work->done);
 }
 
-void nova_save_inode_list_to_log(struct super_block *sb)
+/* Log pages to save the lists of type: the header, then each list */
+static unsigned long nova_list_log_pages(struct super_block *sb,
+	enum nova_list_type type)
 {
-	struct nova_inode *pi = nova_get_inode_by_ino(sb, NOVA_INODELIST1_INO);
-	struct nova_sb_info *sbi = NOVA_SB(sb);
-	unsigned long num_blocks;
-	unsigned long num_nodes = 0;
-	struct inode_map *inode_map;
+	unsigned long num_lists = nova_num_lists(NOVA_SB(sb), type);
+	unsigned long num_pages;
 	unsigned long i;
-	u64 temp_tail;
-	u64 new_block;
-	int allocated;
-
-	for (i = 0; i < sbi->cpus; i++) {
-		inode_map = &sbi->inode_maps[i];
-		num_nodes += inode_map->num_range_node_inode;
-	}
 
-	num_blocks = num_nodes / RANGENODE_PER_PAGE;
-	if (num_nodes % RANGENODE_PER_PAGE)
-		num_blocks++;
+	num_pages = DIV_ROUND_UP(num_lists + 1, RANGENODE_PER_PAGE);
+	for (i = 0; i < num_lists; i++)
+		num_pages += DIV_ROUND_UP(nova_list_nodes(sb, type, i),
+						RANGENODE_PER_PAGE);
 
-	allocated = nova_allocate_inode_log_pages(sb, pi, num_blocks,
-						&new_block);
-	if (allocated != num_blocks) {
-		nova_dbg("Error saving inode list: %d\n", allocated);
-		return;
-	}
+	return num_pages;
+}
 
-	pi->log_head = new_block;
-	nova_flush_buffer(&pi->log_head, CACHELINE_SIZE, 0);
+/*
+ * Save the lists of type to the log pages from head, each list on pages
+ * of its own, by several threads. The header goes last and the log is
+ * only published once everything is written. On failure the log stays
+ * empty, so the next mount runs the failure recovery, which also takes
+ * the pages back.
+ */
+static int nova_save_lists_to_log(struct super_block *sb,
+	struct nova_inode *pi, enum nova_list_type type, u64 head)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_save_header *header;
+	struct nova_save_list *record;
+	struct nova_list_work work = {0};
+	size_t size = sizeof(struct nova_save_list);
+	unsigned long num_entries = 0;
+	unsigned long i, j;
+	u64 curr_page, curr_p, tail;
+	int ret = -ENOMEM;
+
+	BUILD_BUG_ON(sizeof(struct nova_save_header) !=
+			sizeof(struct nova_range_node_lowhigh));
+	BUILD_BUG_ON(sizeof(struct nova_save_list) !=
+			sizeof(struct nova_range_node_lowhigh));
+
+	work.sb = sb;
+	work.type = type;
+	work.save = true;
+	work.num_lists = nova_num_lists(sbi, type);
+	work.lists = kcalloc(work.num_lists, sizeof(struct nova_list_desc),
+				GFP_KERNEL);
+	if (!work.lists)
+		goto fail;
 
-	temp_tail = new_block;
-	for (i = 0; i < sbi->cpus; i++) {
-		inode_map = &sbi->inode_maps[i];
-		temp_tail = nova_save_range_nodes_to_log(sb,
-				&inode_map->inode_inuse_tree, temp_tail, i);
+	/* Reserve the pages of each list, after those of the header */
+	ret = -ENOSPC;
+	curr_page = head;
+	for (j = 0; j < DIV_ROUND_UP(work.num_lists + 1, RANGENODE_PER_PAGE);
+								j++) {
+		if (curr_page == 0)
+			goto fail;
+		curr_page = next_log_page(sb, curr_page);
 	}
 
-	nova_update_tail(pi, temp_tail);
+	for (i = 0; i < work.num_lists; i++) {
+		work.lists[i].pages = DIV_ROUND_UP(nova_list_nodes(sb, type, i),
+						RANGENODE_PER_PAGE);
+		if (work.lists[i].pages == 0)
+			continue;
+
+		work.lists[i].head = curr_page;
+		for (j = 0; j < work.lists[i].pages; j++) {
+			if (curr_page == 0)
+				goto fail;
+			curr_page = next_log_page(sb, curr_page);
+		}
+	}
+
+	ret = nova_run_list_work(&work);
+	if (ret)
+		goto fail;
+
+	header = (struct nova_save_header *)nova_get_block(sb, head);
+	header->magic = cpu_to_le64(NOVA_SAVE_MAGIC);
+	header->num_lists = cpu_to_le64(work.num_lists);
+	nova_flush_buffer(header, size, 0);
+
+	curr_p = head + size;
+	for (i = 0; i < work.num_lists; i++) {
+		curr_p = nova_next_list_record(sb, curr_p);
+		record = (struct nova_save_list *)nova_get_block(sb, curr_p);
+		if (work.lists[i].num_entries == 0)
+			work.lists[i].head = 0;
+		record->head = cpu_to_le64(work.lists[i].head);
+		record->num_entries = cpu_to_le64(work.lists[i].num_entries);
+		nova_flush_buffer(record, size, 0);
+		curr_p += size;
+	}
+
+	tail = curr_p;
+	for (i = 0; i < work.num_lists; i++) {
+		num_entries += work.lists[i].num_entries;
+		if (work.lists[i].num_entries)
+			tail = work.lists[i].tail;
+	}
+
+	pi->log_head = head;
+	nova_flush_buffer(&pi->log_head, CACHELINE_SIZE, 0);
+	nova_update_tail(sb, pi, tail);
+
+	nova_dbg("%s: %lu %s nodes in %lu lists, pi head 0x%llx, "
+		"tail 0x%llx\n", __func__, num_entries,
+		type == NOVA_INODE_LISTS ? "inode" : "block",
+		work.num_lists, pi->log_head, pi->log_tail);
+	kfree(work.lists);
+	return 0;
 
-	nova_dbg("%s: %lu inode nodes, pi head 0x%llx, tail 0x%llx\n",
-		__func__, num_nodes, pi->log_head, pi->log_tail);
+fail:
+	nova_err(sb, "%s: saving %s lists failed: %d\n", __func__,
+			type == NOVA_INODE_LISTS ? "inode" : "block", ret);
+	/* Saved lists are freed already, free those never got to */
+	for (i = 0; i < work.num_lists; i++)
+		nova_free_list_tree(nova_list_tree(sb, type, i));
+	kfree(work.lists);
+	pi->log_head = pi->log_tail = 0;
+	nova_flush_buffer(&pi->log_head, CACHELINE_SIZE, 1);
+	return ret;
 }
 
-void nova_save_blocknode_mappings_to_log(struct super_block *sb)
+int nova_save_inode_list_to_log(struct super_block *sb)
 {
-	struct nova_inode *pi =  nova_get_inode_by_ino(sb, NOVA_BLOCKNODE_INO);
+	struct nova_inode *pi = nova_get_inode_by_ino(sb, NOVA_INODELIST1_INO);
+	unsigned long num_blocks;
+	u64 new_block;
+	int allocated;
+
+	num_blocks = nova_list_log_pages(sb, NOVA_INODE_LISTS);
+	allocated = nova_allocate_inode_log_pages(sb, pi, num_blocks,
+						&new_block);
+	if (allocated != num_blocks) {
+		nova_dbg("Error saving inode list: %d\n", allocated);
+		return -ENOSPC;
+	}
+
+	return nova_save_lists_to_log(sb, pi, NOVA_INODE_LISTS, new_block);
+}
+
+/*
+ * An empty log means no shared blocks, so on failure the caller must not
+ * save the blocknode mappings either: the next mount then runs failure
+ * recovery, which rebuilds the counts from the file logs.
+ */
+int nova_save_block_refs_to_log(struct super_block *sb)
+{
+	struct nova_inode *pi = nova_get_inode_by_ino(sb, NOVA_BLOCKREF_INO);
 	struct nova_sb_info *sbi = NOVA_SB(sb);
-	struct nova_super_block *super;
-	struct free_list *free_list;
-	unsigned long num_blocknode = 0;
-	unsigned long num_pages;
+	struct nova_block_ref_node *curr;
+	struct nova_block_ref_entry *entry;
+	struct rb_node *temp;
+	size_t size = sizeof(struct nova_block_ref_entry);
+	unsigned long num_nodes = sbi->num_block_ref_nodes;
+	unsigned long num_blocks;
+	u64 curr_p;
+	u64 new_block;
 	int allocated;
-	u64 new_block = 0;
-	u64 temp_tail;
-	int i;
 
-	/* Allocate log pages before save blocknode mappings */
-	for (i = 0; i < sbi->cpus; i++) {
-		free_list = nova_get_free_list(sb, i);
-		num_blocknode += free_list->num_blocknode;
-		nova_dbgv("%s: free list %d: %lu nodes\n", __func__,
-				i, free_list->num_blocknode);
+	pi->log_head = pi->log_tail = 0;
+	nova_flush_buffer(&pi->log_head, CACHELINE_SIZE, 0);
+
+	if (num_nodes == 0)
+		return 0;
+
+	num_blocks = num_nodes / BLOCKREF_PER_PAGE;
+	if (num_nodes % BLOCKREF_PER_PAGE)
+		num_blocks++;
+
+	allocated = nova_allocate_inode_log_pages(sb, pi, num_blocks,
+						&new_block);
+	if (allocated != num_blocks) {
+		nova_dbg("Error saving block refs: %d\n", allocated);
+		return -ENOSPC;
+	}
+
+	pi->log_head = new_block;
+	nova_flush_buffer(&pi->log_head, CACHELINE_SIZE, 0);
+
+	/* Save in increasing order */
+	curr_p = new_block;
+	temp = rb_first(&sbi->block_ref_tree);
+	while (temp) {
+		curr = container_of(temp, struct nova_block_ref_node, node);
+		if (is_last_entry(curr_p, size))
+			curr_p = next_log_page(sb, curr_p);
+
+		entry = (struct nova_block_ref_entry *)nova_get_block(sb,
+							curr_p);
+		entry->range_low = cpu_to_le64(curr->range_low);
+		entry->range_high = cpu_to_le64(curr->range_high);
+		entry->refcount = cpu_to_le64(curr->refcount);
+		entry->padding = 0;
+		nova_flush_buffer(entry, size, 0);
+
+		curr_p += size;
+		temp = rb_next(temp);
 	}
 
-	free_list = nova_get_free_list(sb, SHARED_CPU);
-	num_blocknode += free_list->num_blocknode;
-	nova_dbgv("%s: shared list: %lu nodes\n", __func__,
-				free_list->num_blocknode);
+	nova_update_tail(sb, pi, curr_p);
 
-	num_pages = num_blocknode / RANGENODE_PER_PAGE;
-	if (num_blocknode % RANGENODE_PER_PAGE)
-		num_pages++;
+	nova_dbg("%s: %lu ranges, %lu shared blocks, pi head 0x%llx, "
+		"tail 0x%llx\n", __func__, num_nodes, sbi->num_shared_blocks,
+		pi->log_head, pi->log_tail);
+	return 0;
+}
 
+void nova_save_blocknode_mappings_to_log(struct super_block *sb)
+{
+	struct nova_inode *pi =  nova_get_inode_by_ino(sb, NOVA_BLOCKNODE_INO);
+	struct nova_super_block *super;
+	unsigned long num_pages;
+	int allocated;
+	u64 new_block = 0;
+
+	/*
+	 * Allocate log pages before save blocknode mappings. Allocating
+	 * only shrinks the free lists, so the pages are still enough once
+	 * they are taken.
+	 */
+	num_pages = nova_list_log_pages(sb, NOVA_BLOCK_LISTS);
 	allocated = nova_allocate_inode_log_pages(sb, pi, num_pages,
 						&new_block);
 	if (allocated != num_pages) {
@@ -517,21 +1108,7 @@ void nova_save_blocknode_mappings_to_log(struct super_block *sb)
 	nova_memlock_range(sb, &super->s_wtime, NOVA_FAST_MOUNT_FIELD_SIZE);
 	nova_flush_buffer(super, NOVA_SB_SIZE, 0);
 
-	/* Finally update log head and tail */
-	pi->log_head = new_block;
-	nova_flush_buffer(&pi->log_head, CACHELINE_SIZE, 0);
-
-	temp_tail = new_block;
-	for (i = 0; i < sbi->cpus; i++) {
-		temp_tail = nova_save_free_list_blocknodes(sb, i, temp_tail);
-	}
-
-	temp_tail = nova_save_free_list_blocknodes(sb, SHARED_CPU, temp_tail);
-	nova_update_tail(pi, temp_tail);
-
-	nova_dbg("%s: %lu blocknodes, %lu log pages, pi head 0x%llx, "
-		"tail 0x%llx\n", __func__, num_blocknode, num_pages,
-		pi->log_head, pi->log_tail);
+	nova_save_lists_to_log(sb, pi, NOVA_BLOCK_LISTS, new_block);
 }
 
 static int nova_insert_blocknode_map(struct super_block *sb,
@@ -641,8 +1218,6 @@ static void nova_update_4K_map(struct super_block *sb,
 	}
 }
 
-struct scan_bitmap *global_bm[64];
-
 static int nova_build_blocknode_map(struct super_block *sb,
 	unsigned long initsize)
 {
@@ -651,7 +1226,8 @@ static int nova_build_blocknode_map(struct super_block *sb,
 	struct scan_bitmap *final_bm;
 	unsigned long num_used_block;
 	unsigned long *src, *dst;
-	int i, j;
+	unsigned long i;
+	int j;
 	int num;
 	int ret;
 
@@ -676,7 +1252,7 @@ static int nova_build_blocknode_map(struct super_block *sb,
 	 * and use 4K map to rebuild block map.
 	 */
 	for (i = 0; i < sbi->cpus; i++) {
-		bm = global_bm[i];
+		bm = sbi->global_bm[i];
 		nova_update_4K_map(sb, bm, bm->scan_bm_2M.bitmap,
 			bm->scan_bm_2M.bitmap_size * 8, PAGE_SHIFT_2M - 12);
 		nova_update_4K_map(sb, bm, bm->scan_bm_1G.bitmap,
@@ -689,7 +1265,7 @@ static int nova_build_blocknode_map(struct super_block *sb,
 		num++;
 
 	for (i = 0; i < sbi->cpus; i++) {
-		bm = global_bm[i];
+		bm = sbi->global_bm[i];
 		src = (unsigned long *)bm->scan_bm_4K.bitmap;
 		dst = (unsigned long *)final_bm->scan_bm_4K.bitmap;
 
@@ -702,9 +1278,18 @@ static int nova_build_blocknode_map(struct super_block *sb,
 	for (i = 0; i < num_used_block; i++)
 		set_bm(i, final_bm, BM_4K);
 
+	/* The pool blocks handed out this mount, or to be given back */
+	if (sbi->restricted_alloc) {
+		for (i = sbi->pool_start; i < sbi->pool_end; i++)
+			set_bm(i, final_bm, BM_4K);
+	}
+
 	ret = __nova_build_blocknode_map(sb, final_bm->scan_bm_4K.bitmap,
 			final_bm->scan_bm_4K.bitmap_size * 8, PAGE_SHIFT - 12);
 
+	if (sbi->restricted_alloc)
+		nova_end_restricted_alloc(sb, final_bm->scan_bm_4K.bitmap);
+
 	kfree(final_bm->scan_bm_4K.bitmap);
 	kfree(final_bm);
 
@@ -717,8 +1302,11 @@ static void free_bm(struct super_block *sb)
 	struct scan_bitmap *bm;
 	int i;
 
+	if (!sbi->global_bm)
+		return;
+
 	for (i = 0; i < sbi->cpus; i++) {
-		bm = global_bm[i];
+		bm = sbi->global_bm[i];
 		if (bm) {
 			kfree(bm->scan_bm_4K.bitmap);
 			kfree(bm->scan_bm_2M.bitmap);
@@ -726,6 +1314,9 @@ static void free_bm(struct super_block *sb)
 			kfree(bm);
 		}
 	}
+
+	kfree(sbi->global_bm);
+	sbi->global_bm = NULL;
 }
 
 static int alloc_bm(struct super_block *sb, unsigned long initsize)
@@ -734,12 +1325,17 @@ static int alloc_bm(struct super_block *sb, unsigned long initsize)
 	struct scan_bitmap *bm;
 	int i;
 
+	sbi->global_bm = kcalloc(sbi->cpus, sizeof(struct scan_bitmap *),
+					GFP_KERNEL);
+	if (!sbi->global_bm)
+		return -ENOMEM;
+
 	for (i = 0; i < sbi->cpus; i++) {
 		bm = kzalloc(sizeof(struct scan_bitmap), GFP_KERNEL);
 		if (!bm)
 			return -ENOMEM;
 
-		global_bm[i] = bm;
+		sbi->global_bm[i] = bm;
 
 		bm->scan_bm_4K.bitmap_size =
 				(initsize >> (PAGE_SHIFT + 0x3));
@@ -766,24 +1362,48 @@ static int alloc_bm(struct super_block *sb, unsigned long initsize)
 
 /************************** NOVA recovery ****************************/
 
-#define MAX_PGOFF	262144
+/*
+ * A run of file pages mapped to contiguous blocks by the log walked so
+ * far. The runs of a file are kept in pgoff order and never overlap.
+ */
+struct recovery_extent {
+	struct rb_node node;
+	unsigned long pgoff;
+	unsigned long num;
+	unsigned long blocknr;	/* 4K block of pgoff */
+	int shared;		/* Mapped by a NOVA_WRITE_SHARED entry */
+	struct recovery_extent *next_free;
+};
+
+/*
+ * Work units [next, end) of one recovery thread. A unit is a 4K chunk of
+ * NOVA_CHUNK_INODES inodes of an inode table superpage.
+ */
+struct task_span {
+	spinlock_t lock;
+	unsigned long next;
+	unsigned long end;
+};
 
+/* Pass 0 lists the valid inodes, pass 1 walks their logs */
 struct task_ring {
-	u64 addr[512];
-	int num;
+	struct task_span span[2];
 	int inodes_used_count;
-	u64 *array;
+	unsigned long stolen;
+	struct rb_root extents;
+	struct recovery_extent *free_extents;
+	struct super_block *sb;
+	int cpuid;
 };
 
-static struct task_ring *task_rings;
-static struct task_struct **threads;
-wait_queue_head_t finish_wq;
-int *finished;
-
 void nova_init_header(struct super_block *sb,
 	struct nova_inode_info_header *sih, u16 i_mode)
 {
 	sih->log_pages = 0;
+	sih->live_bytes = 0;
+	sih->dead_bytes = 0;
+	sih->thorough_gc_pending = 0;
+	sih->gc_resume_page = 0;
 	sih->mmap_pages = 0;
 	sih->low_dirty = ULONG_MAX;
 	sih->high_dirty = 0;
@@ -791,6 +1411,13 @@ void nova_init_header(struct super_block *sb,
 	sih->pi_addr = 0;
 	INIT_RADIX_TREE(&sih->tree, GFP_ATOMIC);
 	INIT_RADIX_TREE(&sih->cache_tree, GFP_ATOMIC);
+	sih->dir_buckets = NULL;
+	sih->dir_bits = 0;
+	sih->dir_old_buckets = NULL;
+	sih->dir_old_bits = 0;
+	sih->dir_rehash_next = 0;
+	sih->dir_entries = 0;
+	sih->dir_order = RB_ROOT;
 	sih->i_mode = i_mode;
 }
 
@@ -848,6 +1475,9 @@ static int nova_traverse_dir_inode_log(struct super_block *sb,
 
 	curr_p = pi->log_head;
 	if (curr_p == 0) {
+		/* Deleted under a background scan */
+		if (NOVA_SB(sb)->restricted_alloc)
+			return 0;
 		nova_err(sb, "Dir %llu log is NULL!\n", pi->nova_ino);
 		BUG();
 	}
@@ -869,86 +1499,266 @@ static int nova_traverse_dir_inode_log(struct super_block *sb,
 	return 0;
 }
 
-static int nova_set_ring_array(struct super_block *sb,
-	struct nova_inode_info_header *sih, struct nova_file_write_entry *entry,
-	struct task_ring *ring, unsigned long base)
+static struct recovery_extent *nova_get_extent(struct task_ring *ring)
 {
-	unsigned long start, end;
-	unsigned long pgoff;
+	struct recovery_extent *ext = ring->free_extents;
+
+	if (ext) {
+		ring->free_extents = ext->next_free;
+		return ext;
+	}
+
+	return kmalloc(sizeof(struct recovery_extent), GFP_NOFS);
+}
+
+static void nova_put_extent(struct task_ring *ring,
+	struct recovery_extent *ext)
+{
+	rb_erase(&ext->node, &ring->extents);
+	ext->next_free = ring->free_extents;
+	ring->free_extents = ext;
+}
 
-	start = entry->pgoff;
-	if (start < base)
-		start = base;
+/* First extent that ends after pgoff, NULL if there is none */
+static struct recovery_extent *nova_find_extent(struct task_ring *ring,
+	unsigned long pgoff)
+{
+	struct rb_node *temp = ring->extents.rb_node;
+	struct recovery_extent *ext, *found = NULL;
+
+	while (temp) {
+		ext = container_of(temp, struct recovery_extent, node);
+		if (pgoff < ext->pgoff + ext->num) {
+			found = ext;
+			if (pgoff >= ext->pgoff)
+				break;
+			temp = temp->rb_left;
+		} else {
+			temp = temp->rb_right;
+		}
+	}
+
+	return found;
+}
+
+static inline struct recovery_extent *nova_next_extent(
+	struct recovery_extent *ext)
+{
+	struct rb_node *next = rb_next(&ext->node);
+
+	return next ? container_of(next, struct recovery_extent, node) : NULL;
+}
+
+/*
+ * Drop the mappings of [start, end) that are older than the log entry
+ * being walked. Returns the extent before start, if it is adjacent.
+ */
+static struct recovery_extent *nova_punch_extents(struct task_ring *ring,
+	unsigned long start, unsigned long end, bool *failed)
+{
+	struct recovery_extent *ext, *next, *tail;
+	struct recovery_extent *prev = NULL;
+	unsigned long ext_end, cut;
+	struct rb_node **temp, *parent;
+
+	ext = nova_find_extent(ring, start ? start - 1 : 0);
+	if (ext && start && ext->pgoff + ext->num == start) {
+		prev = ext;
+		ext = nova_next_extent(ext);
+	}
 
-	end = entry->pgoff + entry->num_pages;
-	if (end > base + MAX_PGOFF)
-		end = base + MAX_PGOFF;
+	while (ext && ext->pgoff < end) {
+		next = nova_next_extent(ext);
+		ext_end = ext->pgoff + ext->num;
 
-	for (pgoff = start; pgoff < end; pgoff++)
-		ring->array[pgoff - base] = (u64)(entry->block >> PAGE_SHIFT)
-						+ pgoff - entry->pgoff;
+		if (ext->pgoff < start && ext_end > end) {
+			/* Split around the hole */
+			tail = nova_get_extent(ring);
+			if (!tail) {
+				*failed = true;
+				return NULL;
+			}
+			tail->pgoff = end;
+			tail->num = ext_end - end;
+			tail->blocknr = ext->blocknr + end - ext->pgoff;
+			tail->shared = ext->shared;
+			ext->num = start - ext->pgoff;
+
+			parent = &ext->node;
+			temp = &ext->node.rb_right;
+			while (*temp) {
+				parent = *temp;
+				temp = &(*temp)->rb_left;
+			}
+			rb_link_node(&tail->node, parent, temp);
+			rb_insert_color(&tail->node, &ring->extents);
+			return ext;
+		}
 
+		if (ext->pgoff < start) {
+			ext->num = start - ext->pgoff;
+			prev = ext;
+		} else if (ext_end > end) {
+			cut = end - ext->pgoff;
+			ext->pgoff = end;
+			ext->num -= cut;
+			ext->blocknr += cut;
+		} else {
+			nova_put_extent(ring, ext);
+		}
+		ext = next;
+	}
+
+	return prev;
+}
+
+static void nova_insert_extent(struct task_ring *ring,
+	struct recovery_extent *new)
+{
+	struct rb_node **temp = &ring->extents.rb_node;
+	struct rb_node *parent = NULL;
+	struct recovery_extent *ext;
+
+	while (*temp) {
+		ext = container_of(*temp, struct recovery_extent, node);
+		parent = *temp;
+		if (new->pgoff < ext->pgoff)
+			temp = &(*temp)->rb_left;
+		else
+			temp = &(*temp)->rb_right;
+	}
+
+	rb_link_node(&new->node, parent, temp);
+	rb_insert_color(&new->node, &ring->extents);
+}
+
+/* Can't track the entry: keep its blocks in use, possibly leaking them */
+static void nova_extent_fallback(struct super_block *sb,
+	struct scan_bitmap *bm, unsigned long blocknr, unsigned long num,
+	int shared)
+{
+	unsigned long i;
+
+	for (i = 0; i < num; i++)
+		set_bm(blocknr + i, bm, BM_4K);
+	if (shared)
+		nova_recover_block_refs(sb, blocknr, num);
+}
+
+static int nova_set_file_extent(struct super_block *sb,
+	struct nova_file_write_entry *entry, struct task_ring *ring,
+	struct scan_bitmap *bm)
+{
+	struct recovery_extent *prev, *ext;
+	unsigned long start = entry->pgoff;
+	unsigned long num = entry->num_pages;
+	unsigned long blocknr = entry->block >> PAGE_SHIFT;
+	int shared;
+	bool failed = false;
+
+	shared = entry->flags & cpu_to_le32(NOVA_WRITE_SHARED) ? 1 : 0;
+
+	prev = nova_punch_extents(ring, start, start + num, &failed);
+	if (failed)
+		goto fail;
+
+	/* Appends usually continue the previous run */
+	if (prev && prev->pgoff + prev->num == start &&
+			prev->blocknr + prev->num == blocknr &&
+			prev->shared == shared) {
+		prev->num += num;
+		return 0;
+	}
+
+	ext = nova_get_extent(ring);
+	if (!ext)
+		goto fail;
+
+	ext->pgoff = start;
+	ext->num = num;
+	ext->blocknr = blocknr;
+	ext->shared = shared;
+	nova_insert_extent(ring, ext);
 	return 0;
+
+fail:
+	nova_extent_fallback(sb, bm, blocknr, num, shared);
+	return -ENOMEM;
 }
 
-static int nova_set_file_bm(struct super_block *sb,
-	struct nova_inode_info_header *sih, struct task_ring *ring,
-	struct scan_bitmap *bm, unsigned long base, unsigned long last_blocknr)
+static void nova_drop_extents(struct task_ring *ring)
 {
-	unsigned long nvmm, pgoff;
+	struct rb_node *temp;
 
-	if (last_blocknr >= base + MAX_PGOFF)
-		last_blocknr = MAX_PGOFF - 1;
-	else
-		last_blocknr -= base;
+	while ((temp = rb_first(&ring->extents)) != NULL)
+		nova_put_extent(ring, container_of(temp,
+					struct recovery_extent, node));
+}
 
-	for (pgoff = 0; pgoff <= last_blocknr; pgoff++) {
-		nvmm = ring->array[pgoff];
-		if (nvmm) {
-			set_bm(nvmm, bm, BM_4K);
-			ring->array[pgoff] = 0;
+/* Mark the blocks of the extents up to last_blocknr, and empty the tree */
+static int nova_set_file_bm(struct super_block *sb,
+	struct task_ring *ring, struct scan_bitmap *bm,
+	unsigned long last_blocknr)
+{
+	struct recovery_extent *ext;
+	struct rb_node *temp;
+	unsigned long shared_start = 0, shared_num = 0;
+	unsigned long num, i;
+
+	while ((temp = rb_first(&ring->extents)) != NULL) {
+		ext = container_of(temp, struct recovery_extent, node);
+		num = 0;
+		if (ext->pgoff <= last_blocknr)
+			num = min(ext->num, last_blocknr - ext->pgoff + 1);
+
+		for (i = 0; i < num; i++)
+			set_bm(ext->blocknr + i, bm, BM_4K);
+
+		if (num && ext->shared) {
+			/* Count references in contiguous runs */
+			if (shared_num &&
+				ext->blocknr == shared_start + shared_num) {
+				shared_num += num;
+			} else {
+				nova_recover_block_refs(sb,
+					shared_start, shared_num);
+				shared_start = ext->blocknr;
+				shared_num = num;
+			}
 		}
+
+		nova_put_extent(ring, ext);
 	}
 
+	nova_recover_block_refs(sb, shared_start, shared_num);
+
 	return 0;
 }
 
 static void nova_ring_setattr_entry(struct super_block *sb,
 	struct nova_inode_info_header *sih,
 	struct nova_setattr_logentry *entry, struct task_ring *ring,
-	unsigned long base, unsigned int data_bits)
+	unsigned int data_bits)
 {
-	unsigned long first_blocknr, last_blocknr;
-	unsigned long pgoff;
-	loff_t start, end;
+	unsigned long first_blocknr;
+	loff_t start;
+	bool failed = false;
 
 	if (sih->i_size > entry->size) {
 		start = entry->size;
-		end = sih->i_size;
-
 		first_blocknr = (start + (1UL << data_bits) - 1) >> data_bits;
 
-		if (end > 0)
-			last_blocknr = (end - 1) >> data_bits;
-		else
-			last_blocknr = 0;
-
-		if (first_blocknr > last_blocknr)
-			goto out;
-
-		if (first_blocknr < base)
-			first_blocknr = base;
-
-		if (last_blocknr > base + MAX_PGOFF - 1)
-			last_blocknr = base + MAX_PGOFF - 1;
-
-		for (pgoff = first_blocknr; pgoff <= last_blocknr; pgoff++)
-			ring->array[pgoff - base] = 0;
+		/*
+		 * Nothing is mapped past the old size, so drop everything
+		 * from the new one on. No split, nothing to allocate.
+		 */
+		nova_punch_extents(ring, first_blocknr, ULONG_MAX, &failed);
 	}
-out:
+
 	sih->i_size = entry->size;
 }
 
+/* Single pass over the log, tracking the live mappings in ring->extents */
 static int nova_traverse_file_inode_log(struct super_block *sb,
 	struct nova_inode *pi, struct nova_inode_info_header *sih,
 	struct task_ring *ring, struct scan_bitmap *bm)
@@ -956,12 +1766,12 @@ static int nova_traverse_file_inode_log(struct super_block *sb,
 	struct nova_file_write_entry *entry = NULL;
 	struct nova_setattr_logentry *attr_entry = NULL;
 	struct nova_inode_log_page *curr_page;
-	unsigned long base = 0;
 	unsigned long last_blocknr;
 	u64 ino = pi->nova_ino;
 	void *addr;
 	unsigned int btype;
 	unsigned int data_bits;
+	u64 head, tail;
 	u64 curr_p;
 	u64 next;
 	u8 type;
@@ -969,32 +1779,37 @@ static int nova_traverse_file_inode_log(struct super_block *sb,
 	btype = pi->i_blk_type;
 	data_bits = blk_type_to_shift[btype];
 
-again:
+	/*
+	 * A background scan runs next to writers: walk the log up to the
+	 * tail seen here. Pages dropped after that are not reused until the
+	 * scan is done.
+	 */
+	head = pi->log_head;
+	tail = pi->log_tail;
+
 	sih->i_size = 0;
-	curr_p = pi->log_head;
+	curr_p = head;
 	nova_dbg_verbose("Log head 0x%llx, tail 0x%llx\n",
-				curr_p, pi->log_tail);
-	if (curr_p == 0 && pi->log_tail == 0)
+				curr_p, tail);
+	if (curr_p == 0 && tail == 0)
 		return 0;
+	if (curr_p == 0 || tail == 0)
+		goto broken;
 
-	if (base == 0) {
-		BUG_ON(curr_p & (PAGE_SIZE - 1));
-		set_bm(curr_p >> PAGE_SHIFT, bm, BM_4K);
-	}
+	BUG_ON(curr_p & (PAGE_SIZE - 1));
+	set_bm(curr_p >> PAGE_SHIFT, bm, BM_4K);
 
-	while (curr_p != pi->log_tail) {
+	while (curr_p != tail) {
 		if (goto_next_page(sb, curr_p)) {
 			curr_p = next_log_page(sb, curr_p);
-			if (base == 0) {
+			if (curr_p) {
 				BUG_ON(curr_p & (PAGE_SIZE - 1));
 				set_bm(curr_p >> PAGE_SHIFT, bm, BM_4K);
 			}
 		}
 
-		if (curr_p == 0) {
-			nova_err(sb, "File inode %llu log is NULL!\n", ino);
-			BUG();
-		}
+		if (curr_p == 0)
+			goto broken;
 
 		addr = (void *)nova_get_block(sb, curr_p);
 		type = nova_get_entry_type(addr);
@@ -1003,11 +1818,13 @@ again:
 				attr_entry =
 					(struct nova_setattr_logentry *)addr;
 				nova_ring_setattr_entry(sb, sih, attr_entry,
-							ring, base, data_bits);
-				curr_p += sizeof(struct nova_setattr_logentry);
+							ring, data_bits);
+				curr_p += nova_log_entry_len(sb,
+					sizeof(struct nova_setattr_logentry));
 				continue;
 			case LINK_CHANGE:
-				curr_p += sizeof(struct nova_link_change_entry);
+				curr_p += nova_log_entry_len(sb,
+					sizeof(struct nova_link_change_entry));
 				continue;
 			case FILE_WRITE:
 				break;
@@ -1020,39 +1837,43 @@ again:
 		entry = (struct nova_file_write_entry *)addr;
 		sih->i_size = entry->size;
 
-		if (entry->num_pages != entry->invalid_pages) {
-			if (entry->pgoff < base + MAX_PGOFF &&
-					entry->pgoff + entry->num_pages > base)
-				nova_set_ring_array(sb, sih, entry, ring, base);
-		}
+		if (entry->num_pages != entry->invalid_pages)
+			nova_set_file_extent(sb, entry, ring, bm);
 
-		curr_p += sizeof(struct nova_file_write_entry);
+		curr_p += nova_write_entry_len(sb);
 	}
 
-	if (base == 0) {
-		/* Keep traversing until log ends */
-		curr_p &= PAGE_MASK;
-		curr_page = (struct nova_inode_log_page *)nova_get_block(sb, curr_p);
-		while ((next = curr_page->page_tail.next_page) != 0) {
-			curr_p = next;
-			BUG_ON(curr_p & (PAGE_SIZE - 1));
-			set_bm(curr_p >> PAGE_SHIFT, bm, BM_4K);
-			curr_page = (struct nova_inode_log_page *)
-				nova_get_block(sb, curr_p);
-		}
+	/* Keep traversing until log ends */
+	curr_p &= PAGE_MASK;
+	curr_page = (struct nova_inode_log_page *)nova_get_block(sb, curr_p);
+	while ((next = curr_page->page_tail.next_page) != 0) {
+		curr_p = next;
+		BUG_ON(curr_p & (PAGE_SIZE - 1));
+		set_bm(curr_p >> PAGE_SHIFT, bm, BM_4K);
+		curr_page = (struct nova_inode_log_page *)
+			nova_get_block(sb, curr_p);
 	}
 
-	if (sih->i_size == 0)
+	if (sih->i_size == 0) {
+		nova_drop_extents(ring);
 		return 0;
+	}
 
 	last_blocknr = (sih->i_size - 1) >> data_bits;
-	nova_set_file_bm(sb, sih, ring, bm, base, last_blocknr);
-	if (last_blocknr >= base + MAX_PGOFF) {
-		base += MAX_PGOFF;
-		goto again;
-	}
+	nova_set_file_bm(sb, ring, bm, last_blocknr);
 
 	return 0;
+
+broken:
+	/* Deleted under a background scan */
+	if (NOVA_SB(sb)->restricted_alloc) {
+		sih->i_size = 0;
+		nova_drop_extents(ring);
+		return 0;
+	}
+	nova_err(sb, "File inode %llu log is NULL!\n", ino);
+	BUG();
+	return 0;
 }
 
 static int nova_recover_inode_pages(struct super_block *sb,
@@ -1070,10 +1891,10 @@ static int nova_recover_inode_pages(struct super_block *sb,
 		return 0;
 
 	nova_ino = pi->nova_ino;
-	ring->inodes_used_count++;
 
 	sih->i_mode = __le16_to_cpu(pi->i_mode);
 	sih->ino = nova_ino;
+	nova_recover_index_ckpt(sb, pi, bm);
 
 	nova_dbgv("%s: inode %lu, addr 0x%llx, head 0x%llx, tail 0x%llx\n",
 			__func__, nova_ino, pi_addr, pi->log_head,
@@ -1100,72 +1921,148 @@ static int nova_recover_inode_pages(struct super_block *sb,
 static void free_resources(struct super_block *sb)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct recovery_extent *ext;
 	struct task_ring *ring;
 	int i;
 
-	if (task_rings) {
+	if (sbi->task_rings) {
 		for (i = 0; i < sbi->cpus; i++) {
-			ring = &task_rings[i];
-			vfree(ring->array);
-			ring->array = NULL;
+			ring = &sbi->task_rings[i];
+			nova_drop_extents(ring);
+			while ((ext = ring->free_extents) != NULL) {
+				ring->free_extents = ext->next_free;
+				kfree(ext);
+			}
 		}
 	}
 
-	kfree(task_rings);
-	kfree(threads);
-	kfree(finished);
+	kfree(sbi->task_rings);
+	sbi->task_rings = NULL;
+	kfree(sbi->recovery_threads);
+	sbi->recovery_threads = NULL;
+	vfree(sbi->task_pages);
+	sbi->task_pages = NULL;
+	vfree(sbi->task_summaries);
+	sbi->task_summaries = NULL;
 }
 
 static int failure_thread_func(void *data);
 
 static int allocate_resources(struct super_block *sb, int cpus)
 {
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct task_struct *task;
 	struct task_ring *ring;
 	int i;
 
-	task_rings = kzalloc(cpus * sizeof(struct task_ring), GFP_KERNEL);
-	if (!task_rings)
+	sbi->task_rings = kzalloc(cpus * sizeof(struct task_ring), GFP_KERNEL);
+	if (!sbi->task_rings)
 		goto fail;
 
 	for (i = 0; i < cpus; i++) {
-		ring = &task_rings[i];
-		ring->array = vzalloc(sizeof(u64) * MAX_PGOFF);
-		if (!ring->array)
-			goto fail;
+		ring = &sbi->task_rings[i];
+		ring->extents = RB_ROOT;
+		spin_lock_init(&ring->span[0].lock);
+		spin_lock_init(&ring->span[1].lock);
 	}
 
-	threads = kzalloc(cpus * sizeof(struct task_struct *), GFP_KERNEL);
-	if (!threads)
-		goto fail;
-
-	finished = kzalloc(cpus * sizeof(int), GFP_KERNEL);
-	if (!finished)
+	sbi->recovery_threads = kzalloc(cpus * sizeof(struct task_struct *),
+					GFP_KERNEL);
+	if (!sbi->recovery_threads)
 		goto fail;
 
-	init_waitqueue_head(&finish_wq);
+	atomic_set(&sbi->threads_listing, cpus);
+	atomic_set(&sbi->threads_running, cpus);
+	init_completion(&sbi->recovery_listed);
+	init_completion(&sbi->recovery_finished);
 
+	/* The volume may have more per-CPU structures than online CPUs */
 	for (i = 0; i < cpus; i++) {
-		threads[i] = kthread_create(failure_thread_func,
-						sb, "recovery thread");
-		kthread_bind(threads[i], i);
+		ring = &sbi->task_rings[i];
+		ring->sb = sb;
+		ring->cpuid = i;
+		task = kthread_create(failure_thread_func, ring,
+					"nova_%s_rec%d", sb->s_id, i);
+		if (IS_ERR(task)) {
+			nova_err(sb, "%s: create recovery thread %d failed "
+				"%ld\n", __func__, i, PTR_ERR(task));
+			goto stop;
+		}
+		if (i < nr_cpu_ids && cpu_online(i))
+			kthread_bind(task, i);
+		sbi->recovery_threads[i] = task;
 	}
 
 	return 0;
 
+stop:
+	/* None of them has been woken up yet */
+	while (--i >= 0)
+		kthread_stop(sbi->recovery_threads[i]);
 fail:
 	free_resources(sb);
 	return -ENOMEM;
 }
 
-static void wait_to_finish(int cpus)
+/*
+ * Take the next work unit of a pass. A thread out of work steals the
+ * upper half of the largest span left, so a few huge inodes do not keep
+ * the others idle. Returns false once all units are taken.
+ */
+static bool nova_get_recovery_work(struct task_ring *ring, int pass,
+	int cpus, unsigned long *unit)
 {
-	int i;
+	struct nova_sb_info *sbi = NOVA_SB(ring->sb);
+	struct task_span *span = &ring->span[pass];
+	struct task_span *victim;
+	unsigned long left, max_left, next, end, mid;
+	int i, target;
+
+	spin_lock(&span->lock);
+	if (span->next < span->end) {
+		*unit = span->next++;
+		spin_unlock(&span->lock);
+		return true;
+	}
+	spin_unlock(&span->lock);
 
-	for (i = 0; i < cpus; i++) {
-		while (finished[i] == 0) {
-			wait_event_interruptible_timeout(finish_wq, false,
-							msecs_to_jiffies(1));
+	while (1) {
+		target = -1;
+		max_left = 0;
+		for (i = 0; i < cpus; i++) {
+			victim = &sbi->task_rings[i].span[pass];
+			/* Unlocked peek, checked again under the lock */
+			end = READ_ONCE(victim->end);
+			next = READ_ONCE(victim->next);
+			if (next < end && end - next > max_left) {
+				max_left = end - next;
+				target = i;
+			}
+		}
+
+		if (target < 0)
+			return false;
+
+		victim = &sbi->task_rings[target].span[pass];
+		spin_lock(&victim->lock);
+		left = victim->end - victim->next;
+		if (left == 0) {
+			spin_unlock(&victim->lock);
+			continue;
 		}
+		end = victim->end;
+		mid = end - (left + 1) / 2;
+		victim->end = mid;
+		spin_unlock(&victim->lock);
+
+		spin_lock(&span->lock);
+		span->next = mid + 1;
+		span->end = end;
+		spin_unlock(&span->lock);
+
+		ring->stolen += end - mid;
+		*unit = mid;
+		return true;
 	}
 }
 
@@ -1191,53 +2088,65 @@ static inline int nova_failure_update_inodetree(struct super_block *sb,
 	return 0;
 }
 
+/* Chunks with a clear summary bit hold no valid inode */
+static inline bool nova_chunk_in_use(struct nova_sb_info *sbi,
+	unsigned long unit)
+{
+	unsigned long per_page = sbi->task_chunks_per_page;
+
+	if (!sbi->task_summaries)
+		return true;
+
+	return test_bit_le(unit % per_page,
+			sbi->task_summaries[unit / per_page].bits);
+}
+
 static int failure_thread_func(void *data)
 {
-	struct super_block *sb = data;
+	struct task_ring *ring = data;
+	struct super_block *sb = ring->sb;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
 	struct nova_inode_info_header sih;
-	struct task_ring *ring;
 	struct nova_inode *pi;
 	unsigned long num_inodes_per_page;
 	unsigned long ino_low, ino_high;
 	unsigned long last_blocknr;
+	unsigned long first, last;
+	unsigned long unit;
 	unsigned int data_bits;
 	u64 curr;
-	int cpuid = smp_processor_id();
+	int cpuid = ring->cpuid;
 	unsigned long i;
 	unsigned long max_size = 0;
 	u64 pi_addr = 0;
 	int ret = 0;
-	int count;
 
 	pi = nova_get_inode_by_ino(sb, NOVA_INODETABLE_INO);
 	data_bits = blk_type_to_shift[pi->i_blk_type];
 	num_inodes_per_page = 1 << (data_bits - NOVA_INODE_BITS);
 
-	ring = &task_rings[cpuid];
 	nova_init_header(sb, &sih, 0);
 
-	for (count = 0; count < ring->num; count++) {
-		curr = ring->addr[count];
-		ino_low = ino_high = 0;
+	/*
+	 * First list the valid inodes, which is all the mount needs. Walking
+	 * their logs may go on after the mount returns.
+	 */
+	while (nova_get_recovery_work(ring, 0, sbi->cpus, &unit)) {
+		if (!nova_chunk_in_use(sbi, unit))
+			continue;
 
-		/*
-		 * Note: The inode log page is allocated in 2MB
-		 * granularity, but not aligned on 2MB boundary.
-		 */
-		for (i = 0; i < 512; i++)
-			set_bm((curr >> PAGE_SHIFT) + i, global_bm[cpuid],
-					BM_4K);
+		curr = sbi->task_pages[unit / sbi->task_chunks_per_page];
+		first = (unit % sbi->task_chunks_per_page) * NOVA_CHUNK_INODES;
+		last = min(first + NOVA_CHUNK_INODES, num_inodes_per_page);
+		ino_low = ino_high = 0;
 
-		for (i = 0; i < num_inodes_per_page; i++) {
+		for (i = first; i < last; i++) {
 			pi_addr = curr + i * NOVA_INODE_SIZE;
 			pi = nova_get_block(sb, pi_addr);
 			if (pi->valid) {
-				nova_recover_inode_pages(sb, &sih, ring,
-						pi_addr, global_bm[cpuid]);
+				ring->inodes_used_count++;
 				nova_failure_update_inodetree(sb, pi,
 						&ino_low, &ino_high);
-				if (sih.i_size > max_size)
-					max_size = sih.i_size;
 			}
 		}
 
@@ -1245,65 +2154,188 @@ static int failure_thread_func(void *data)
 			nova_failure_insert_inodetree(sb, ino_low, ino_high);
 	}
 
+	if (atomic_dec_and_test(&sbi->threads_listing))
+		complete(&sbi->recovery_listed);
+
+	while (!sbi->recovery_abort &&
+			nova_get_recovery_work(ring, 1, sbi->cpus, &unit)) {
+		if (!nova_chunk_in_use(sbi, unit))
+			goto next;
+
+		curr = sbi->task_pages[unit / sbi->task_chunks_per_page];
+		first = (unit % sbi->task_chunks_per_page) * NOVA_CHUNK_INODES;
+		last = min(first + NOVA_CHUNK_INODES, num_inodes_per_page);
+
+		for (i = first; i < last; i++) {
+			pi_addr = curr + i * NOVA_INODE_SIZE;
+			pi = nova_get_block(sb, pi_addr);
+			if (pi->valid) {
+				nova_recover_inode_pages(sb, &sih, ring,
+						pi_addr, sbi->global_bm[cpuid]);
+				atomic_long_inc(&sbi->recovery_inodes);
+				if (sih.i_size > max_size)
+					max_size = sih.i_size;
+			}
+		}
+next:
+		atomic_long_inc(&sbi->recovery_scanned);
+	}
+
 	/* Free radix tree */
 	if (max_size) {
 		last_blocknr = (max_size - 1) >> PAGE_SHIFT;
 		nova_delete_file_tree(sb, &sih, 0, last_blocknr, false, false);
 	}
 
-	finished[cpuid] = 1;
-	wake_up_interruptible(&finish_wq);
+	if (atomic_dec_and_test(&sbi->threads_running))
+		complete(&sbi->recovery_finished);
 	do_exit(ret);
 	return ret;
 }
 
+/* Inode table superpages are chained through their last 8 bytes */
+static inline u64 nova_next_table_page(struct super_block *sb, u64 curr)
+{
+	unsigned long curr_addr;
+
+	curr_addr = (unsigned long)nova_get_block(sb, curr);
+	curr_addr += 2097152 - 8;
+	return *(u64 *)(curr_addr);
+}
+
+/*
+ * Collect the inode table superpages and split their chunks evenly
+ * between the threads, in table order. Threads that run out steal.
+ */
 static int nova_failure_recovery_crawl(struct super_block *sb)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
 	struct nova_inode_info_header sih;
 	struct inode_table *inode_table;
+	struct nova_summary_page *spage;
 	struct task_ring *ring;
-	unsigned long curr_addr;
+	struct nova_inode *pi;
 	u64 root_addr = NOVA_ROOT_INO_START;
-	u64 curr;
+	unsigned long num_pages = 0, total;
+	unsigned long num_inodes_per_page;
+	unsigned long j;
+	u64 curr, block;
 	int ret = 0;
 	int cpuid;
-	int ring_id;
+	int pass;
+
+	pi = nova_get_inode_by_ino(sb, NOVA_INODETABLE_INO);
+	num_inodes_per_page = 1 << (blk_type_to_shift[pi->i_blk_type] -
+						NOVA_INODE_BITS);
+	sbi->task_chunks_per_page = DIV_ROUND_UP(num_inodes_per_page,
+						NOVA_CHUNK_INODES);
 
-	ring_id = 0;
+	sbi->recovery_pages = 0;
 	for (cpuid = 0; cpuid < sbi->cpus; cpuid++) {
 		inode_table = nova_get_inode_table(sb, cpuid);
-		if (!inode_table)
-			return -EINVAL;
+		if (!inode_table) {
+			ret = -EINVAL;
+			goto out;
+		}
+
+		for (curr = inode_table->log_head; curr;
+				curr = nova_next_table_page(sb, curr))
+			num_pages++;
+	}
+
+	if (num_pages) {
+		sbi->task_pages = vmalloc(num_pages * sizeof(u64));
+		if (!sbi->task_pages) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	/* Without the summaries every chunk is scanned */
+	if (num_pages && pi->i_blk_type == NOVA_BLOCK_TYPE_2M &&
+			nova_has_rebuild_meta(sb))
+		sbi->task_summaries = vmalloc(num_pages *
+					sizeof(struct nova_table_summary));
 
-		curr = inode_table->log_head;
-		while (curr) {
-			ring = &task_rings[ring_id];
-			if (ring->num >= 512) {
-				nova_err(sb, "%s: ring size too small\n",
-						__func__);
-				return -EINVAL;
+	num_pages = 0;
+	for (cpuid = 0; cpuid < sbi->cpus; cpuid++) {
+		inode_table = nova_get_inode_table(sb, cpuid);
+		block = inode_table->summary_head;
+		spage = NULL;
+		j = 0;
+		for (curr = inode_table->log_head; curr;
+				curr = nova_next_table_page(sb, curr), j++) {
+			/*
+			 * Note: The inode log page is allocated in 2MB
+			 * granularity, but not aligned on 2MB boundary.
+			 */
+			bitmap_set(sbi->global_bm[cpuid]->scan_bm_4K.bitmap,
+					curr >> PAGE_SHIFT, 512);
+			sbi->task_pages[num_pages] = curr;
+
+			if (!sbi->task_summaries) {
+				num_pages++;
+				continue;
 			}
 
-			ring->addr[ring->num] = curr;
-			ring->num++;
+			/* Copy the summaries, the scan may outlive them */
+			if (j % NOVA_SUMMARIES_PER_PAGE == 0) {
+				spage = block ? nova_get_summary_page(sb, block,
+					j / NOVA_SUMMARIES_PER_PAGE) : NULL;
+				if (spage) {
+					set_bm(block >> PAGE_SHIFT,
+						sbi->global_bm[cpuid], BM_4K);
+					block = le64_to_cpu(spage->next_page);
+				} else {
+					block = 0;
+				}
+			}
 
-			ring_id = (ring_id + 1) % sbi->cpus;
+			if (spage)
+				memcpy(&sbi->task_summaries[num_pages],
+					&spage->summary[j %
+						NOVA_SUMMARIES_PER_PAGE],
+					sizeof(struct nova_table_summary));
+			else
+				memset(&sbi->task_summaries[num_pages], 0xff,
+					sizeof(struct nova_table_summary));
+			num_pages++;
+		}
 
-			curr_addr = (unsigned long)nova_get_block(sb, curr);
-			/* Next page resides at the last 8 bytes */
-			curr_addr += 2097152 - 8;
-			curr = *(u64 *)(curr_addr);
+		/* The mount frees the whole chain when it rebuilds it */
+		for (j = DIV_ROUND_UP(j, NOVA_SUMMARIES_PER_PAGE);
+				block && sbi->task_summaries; j++) {
+			spage = nova_get_summary_page(sb, block, j);
+			if (!spage)
+				break;
+			set_bm(block >> PAGE_SHIFT, sbi->global_bm[cpuid],
+					BM_4K);
+			block = le64_to_cpu(spage->next_page);
 		}
 	}
 
-	for (cpuid = 0; cpuid < sbi->cpus; cpuid++)
-		wake_up_process(threads[cpuid]);
+	total = num_pages * sbi->task_chunks_per_page;
+	sbi->recovery_pages = total;
+	for (cpuid = 0; cpuid < sbi->cpus; cpuid++) {
+		ring = &sbi->task_rings[cpuid];
+		for (pass = 0; pass < 2; pass++) {
+			ring->span[pass].next = total * cpuid / sbi->cpus;
+			ring->span[pass].end = total * (cpuid + 1) / sbi->cpus;
+		}
+	}
 
+	/* Recover the root iode before the threads touch global_bm */
 	nova_init_header(sb, &sih, 0);
-	/* Recover the root iode */
-	nova_recover_inode_pages(sb, &sih, &task_rings[0],
-					root_addr, global_bm[1]);
+	nova_recover_inode_pages(sb, &sih, &sbi->task_rings[0],
+				root_addr, sbi->global_bm[1 % sbi->cpus]);
+	sbi->task_rings[0].inodes_used_count++;
+
+out:
+	/* On failure the threads find no work and exit */
+	if (ret)
+		sbi->recovery_abort = 1;
+	for (cpuid = 0; cpuid < sbi->cpus; cpuid++)
+		wake_up_process(sbi->recovery_threads[cpuid]);
 
 	return ret;
 }
@@ -1328,12 +2360,19 @@ int nova_failure_recovery(struct super_block *sb)
 	pi->log_head = pi->log_tail = 0;
 	nova_flush_buffer(&pi->log_head, CACHELINE_SIZE, 0);
 
+	/* Block refcounts are rebuilt from shared write entries */
+	pi = nova_get_inode_by_ino(sb, NOVA_BLOCKREF_INO);
+	pi->log_head = pi->log_tail = 0;
+	nova_flush_buffer(&pi->log_head, CACHELINE_SIZE, 0);
+	nova_destroy_block_refs(sb);
+
 	for (i = 0; i < sbi->cpus; i++) {
 		pair = nova_get_journal_pointers(sb, i);
 		if (!pair)
 			return -EINVAL;
 
-		set_bm(pair->journal_head >> PAGE_SHIFT, global_bm[i], BM_4K);
+		set_bm(pair->journal_head >> PAGE_SHIFT, sbi->global_bm[i],
+					BM_4K);
 	}
 	PERSISTENT_BARRIER();
 
@@ -1342,21 +2381,99 @@ int nova_failure_recovery(struct super_block *sb)
 		return ret;
 
 	ret = nova_failure_recovery_crawl(sb);
+	if (ret) {
+		wait_for_completion(&sbi->recovery_finished);
+		free_resources(sb);
+		return ret;
+	}
 
-	wait_to_finish(sbi->cpus);
+	wait_for_completion(&sbi->recovery_listed);
 
 	for (i = 0; i < sbi->cpus; i++) {
-		ring = &task_rings[i];
+		ring = &sbi->task_rings[i];
 		sbi->s_inodes_used_count += ring->inodes_used_count;
 	}
 
-	free_resources(sb);
-
 	nova_dbg("Failure recovery total recovered %lu\n",
 				sbi->s_inodes_used_count);
 	return ret;
 }
 
+/* Wait for the log scan started by nova_failure_recovery() */
+static void nova_finish_failure_scan(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	int i;
+
+	wait_for_completion(&sbi->recovery_finished);
+
+	if (!sbi->recovery_abort)
+		nova_prune_block_refs(sb);
+
+	for (i = 0; i < sbi->cpus; i++)
+		nova_dbgv("Recovery thread %d stole %lu chunks\n",
+				i, sbi->task_rings[i].stolen);
+
+	free_resources(sb);
+
+	nova_dbg("Failure recovery scanned %lu inodes in %lu chunks\n",
+			atomic_long_read(&sbi->recovery_inodes),
+			atomic_long_read(&sbi->recovery_scanned));
+}
+
+static int nova_bg_recovery_func(void *data)
+{
+	struct super_block *sb = data;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_super_block *super = nova_get_super(sb);
+	unsigned long initsize = le64_to_cpu(super->s_size);
+	int ret = 0;
+
+	nova_finish_failure_scan(sb);
+
+	if (!sbi->recovery_abort)
+		ret = nova_build_blocknode_map(sb, initsize);
+
+	if (!sbi->recovery_abort && ret == 0) {
+		nova_reserve_recovery_pool(sb);
+		sbi->recovery_state = NOVA_RECOVERY_DONE;
+		nova_info("NOVA: background recovery done in %u ms\n",
+			jiffies_to_msecs(jiffies - sbi->recovery_start));
+	} else {
+		sbi->recovery_state = NOVA_RECOVERY_ABORTED;
+		if (ret)
+			nova_err(sb, "%s: building block map failed: %d\n",
+					__func__, ret);
+	}
+
+	free_bm(sb);
+	complete(&sbi->recovery_done);
+	return ret;
+}
+
+/*
+ * Stop a background recovery on unmount. Returns 1 if it did not get to
+ * rebuild the allocator, so that nothing may be saved for the next mount,
+ * which has to run the failure recovery again.
+ */
+int nova_stop_bg_recovery(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+
+	if (sbi->recovery_thread) {
+		sbi->recovery_abort = 1;
+		wait_for_completion(&sbi->recovery_done);
+		sbi->recovery_thread = NULL;
+	}
+
+	if (!sbi->restricted_alloc)
+		return 0;
+
+	nova_discard_restricted_alloc(sb);
+	nova_destroy_inode_trees(sb);
+	return 1;
+}
+
 /*********************** Recovery entrance *************************/
 
 int nova_recovery(struct super_block *sb)
@@ -1366,13 +2483,14 @@ int nova_recovery(struct super_block *sb)
 	unsigned long initsize = le64_to_cpu(super->s_size);
 	bool value = false;
 	int ret = 0;
-	timing_t start, end;
+	u64 clock_start = 0;
+	timing_t start;
 
 	nova_dbgv("%s\n", __func__);
 
 	/* Always check recovery time */
 	if (measure_timing == 0)
-		getrawmonotonic(&start);
+		clock_start = ktime_get_raw_ns();
 
 	NOVA_START_TIMING(recovery_t, start);
 	sbi->num_blocks = ((unsigned long)(initsize) >> PAGE_SHIFT);
@@ -1380,33 +2498,66 @@ int nova_recovery(struct super_block *sb)
 	/* initialize free list info */
 	nova_init_blockmap(sb, 1);
 
+	sbi->recovery_state = NOVA_RECOVERY_NONE;
+	sbi->recovery_abort = 0;
+	atomic_long_set(&sbi->recovery_scanned, 0);
+	atomic_long_set(&sbi->recovery_inodes, 0);
+
 	value = nova_can_skip_full_scan(sb);
 	if (value) {
 		nova_dbg("NOVA: Normal shutdown\n");
-	} else {
-		nova_dbg("NOVA: Failure recovery\n");
-		ret = alloc_bm(sb, initsize);
-		if (ret)
-			goto out;
+		nova_reserve_recovery_pool(sb);
+		goto out;
+	}
 
-		sbi->s_inodes_used_count = 0;
-		ret = nova_failure_recovery(sb);
-		if (ret)
+	nova_dbg("NOVA: Failure recovery\n");
+	sbi->recovery_state = NOVA_RECOVERY_SCANNING;
+	sbi->recovery_start = jiffies;
+
+	/* free_bm() also takes back a partial allocation */
+	ret = alloc_bm(sb, initsize);
+	if (ret)
+		goto out_bm;
+
+	sbi->s_inodes_used_count = 0;
+	ret = nova_failure_recovery(sb);
+	if (ret)
+		goto out_bm;
+
+	/*
+	 * The inode lists are complete. Leave walking the logs and building
+	 * the free lists to a thread, and allocate from the recovery pool
+	 * until then.
+	 */
+	if (bg_recovery && !(sb->s_flags & MS_RDONLY) &&
+			nova_start_restricted_alloc(sb) == 0) {
+		sbi->recovery_thread = kthread_run(nova_bg_recovery_func,
+						sb, "nova_%s_bg", sb->s_id);
+		if (!IS_ERR(sbi->recovery_thread))
 			goto out;
 
-		ret = nova_build_blocknode_map(sb, initsize);
+		sbi->recovery_thread = NULL;
+		nova_discard_restricted_alloc(sb);
 	}
 
-out:
-	NOVA_END_TIMING(recovery_t, start);
-	if (measure_timing == 0) {
-		getrawmonotonic(&end);
-		Timingstats[recovery_t] +=
-			(end.tv_sec - start.tv_sec) * 1000000000 +
-			(end.tv_nsec - start.tv_nsec);
+	nova_finish_failure_scan(sb);
+	ret = nova_build_blocknode_map(sb, initsize);
+	if (ret == 0) {
+		/* The old pool is free space again, reserve a fresh one */
+		nova_release_recovery_pool(sb);
+		nova_reserve_recovery_pool(sb);
+		sbi->recovery_state = NOVA_RECOVERY_DONE;
 	}
 
-	if (!value)
-		free_bm(sb);
+out_bm:
+	free_bm(sb);
+	if (ret)
+		sbi->recovery_state = NOVA_RECOVERY_ABORTED;
+out:
+	NOVA_END_TIMING(sb, recovery_t, start);
+	if (measure_timing == 0)
+		__this_cpu_add(sbi->stats->timing[recovery_t],
+				ktime_get_raw_ns() - clock_start);
+
 	return ret;
 }
@@ -0,0 +1,318 @@
+/*
+ * BRIEF DESCRIPTION
+ *
+ * Persistent index checkpoints.
+ *
+ * Bringing a file inode into the inode cache replays its whole log to
+ * rebuild the radix tree. For files with long logs, the radix tree is saved
+ * to NVMM on evict and after a thorough GC pass, as runs of page offsets
+ * mapped by the same write entry. The checkpoint records the log head and
+ * tail it was taken at, and is only used while the log head is unchanged.
+ * The rebuild then loads the runs and replays the entries after the
+ * recorded tail. GC drops the checkpoint before it frees or moves log
+ * pages.
+ *
+ * Copyright 2015-2016 Regents of the University of California,
+ * UCSD Non-Volatile Systems Lab, Andiry Xu <jix024@cs.ucsd.edu>
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2. This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+
+#include <linux/module.h>
+#include "nova.h"
+
+/* Only checkpoint files with at least this many log pages */
+static unsigned int index_ckpt_pages = 64;
+module_param(index_ckpt_pages, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(index_ckpt_pages,
+	"Log pages of a file to checkpoint its index, 0 to disable");
+
+/* Returns the checkpoint of pi if its header is sane, NULL otherwise */
+static struct nova_index_ckpt *nova_get_index_ckpt(struct super_block *sb,
+	struct nova_inode *pi)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_index_ckpt *ckpt;
+	u64 block = le64_to_cpu(pi->i_index_ckpt);
+	u64 size;
+
+	if (block == 0 || (block & (PAGE_SIZE - 1)) ||
+			block + PAGE_SIZE > sbi->initsize ||
+			!nova_has_rebuild_meta(sb))
+		return NULL;
+
+	ckpt = (struct nova_index_ckpt *)nova_get_block(sb, block);
+	if (le32_to_cpu(ckpt->magic) != NOVA_INDEX_CKPT_MAGIC ||
+			le32_to_cpu(ckpt->version) != NOVA_INDEX_CKPT_VERSION ||
+			ckpt->nova_ino != pi->nova_ino)
+		return NULL;
+
+	size = le64_to_cpu(ckpt->num_blocks) << PAGE_SHIFT;
+	if (block + size > sbi->initsize || sizeof(struct nova_index_ckpt) +
+			le64_to_cpu(ckpt->num_extents) *
+			sizeof(struct nova_index_extent) > size)
+		return NULL;
+
+	return ckpt;
+}
+
+void nova_free_index_ckpt(struct super_block *sb, struct nova_inode *pi)
+{
+	struct nova_index_ckpt *ckpt;
+	struct nova_inode fake_pi;
+	u64 block = le64_to_cpu(pi->i_index_ckpt);
+
+	if (block == 0 || !nova_has_rebuild_meta(sb))
+		return;
+
+	ckpt = nova_get_index_ckpt(sb, pi);
+
+	nova_memunlock_inode(sb, pi);
+	pi->i_index_ckpt = 0;
+	nova_memlock_inode(sb, pi);
+	nova_flush_buffer(&pi->i_index_ckpt, CACHELINE_SIZE, 1);
+
+	if (!ckpt)
+		return;
+
+	fake_pi.nova_ino = pi->nova_ino;
+	fake_pi.i_blk_type = NOVA_BLOCK_TYPE_4K;
+	nova_free_log_blocks(sb, &fake_pi,
+			nova_get_blocknr(sb, block, NOVA_BLOCK_TYPE_4K),
+			le64_to_cpu(ckpt->num_blocks));
+}
+
+/*
+ * Walk the radix tree in page offset order and fill extent with the runs
+ * of pages mapped by the same write entry, if it is not NULL.
+ * Returns the number of runs.
+ */
+static unsigned long nova_index_extents(struct super_block *sb,
+	struct nova_inode_info_header *sih, struct nova_index_extent *extent)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct radix_tree_iter iter;
+	void **slot;
+	void *entry, *run_entry = NULL;
+	unsigned long run_start = 0, run_end = 0;
+	unsigned long count = 0;
+
+	radix_tree_for_each_slot(slot, &sih->tree, &iter, 0) {
+		entry = radix_tree_deref_slot(slot);
+		if (!entry)
+			continue;
+
+		if (entry == run_entry && iter.index == run_end) {
+			run_end++;
+			continue;
+		}
+
+		if (run_entry && extent) {
+			extent->pgoff = cpu_to_le64(run_start);
+			extent->num_pages = cpu_to_le64(run_end - run_start);
+			extent->entry = cpu_to_le64(nova_get_addr_off(sbi,
+							run_entry));
+			extent++;
+		}
+
+		run_entry = entry;
+		run_start = iter.index;
+		run_end = iter.index + 1;
+		count++;
+	}
+
+	if (run_entry && extent) {
+		extent->pgoff = cpu_to_le64(run_start);
+		extent->num_pages = cpu_to_le64(run_end - run_start);
+		extent->entry = cpu_to_le64(nova_get_addr_off(sbi, run_entry));
+	}
+
+	return count;
+}
+
+/*
+ * Save the index of a file inode. Called with the inode quiescent, on
+ * evict or from the log cleaner under i_mutex, so that the radix tree
+ * matches the log up to pi->log_tail.
+ */
+void nova_save_index_ckpt(struct super_block *sb, struct nova_inode *pi,
+	struct nova_inode_info_header *sih)
+{
+	struct nova_index_ckpt *ckpt, *old;
+	struct nova_inode_log_page *curr_page;
+	struct nova_inode fake_pi;
+	unsigned long num_extents, num_blocks, tail_pages = 0;
+	unsigned long blocknr = 0;
+	unsigned long pinned, live;
+	u64 block, old_block, curr_p;
+	size_t size;
+	int allocated;
+
+	if (!pi || index_ckpt_pages == 0 || sih->log_pages < index_ckpt_pages ||
+			!nova_has_rebuild_meta(sb))
+		return;
+
+	if (pi->log_head == 0 || pi->log_tail == 0)
+		return;
+
+	/* Still up to date */
+	old = nova_get_index_ckpt(sb, pi);
+	if (old && old->log_head == pi->log_head &&
+			old->log_tail == pi->log_tail)
+		return;
+
+	num_extents = nova_index_extents(sb, sih, NULL);
+	size = sizeof(struct nova_index_ckpt) +
+			num_extents * sizeof(struct nova_index_extent);
+	num_blocks = DIV_ROUND_UP(size, PAGE_SIZE);
+
+	/* Not worth it unless it is much shorter than the log */
+	if (num_blocks * 2 > sih->log_pages)
+		return;
+
+	fake_pi.nova_ino = pi->nova_ino;
+	fake_pi.i_blk_type = NOVA_BLOCK_TYPE_4K;
+	allocated = nova_new_log_blocks(sb, &fake_pi, &blocknr,
+						num_blocks, 0);
+	if (allocated <= 0)
+		return;
+
+	if (allocated < num_blocks) {
+		nova_free_log_blocks(sb, &fake_pi, blocknr, allocated);
+		return;
+	}
+
+	/* The replay counts the pages from the tail page on */
+	curr_p = BLOCK_OFF(le64_to_cpu(pi->log_tail));
+	curr_page = (struct nova_inode_log_page *)nova_get_block(sb, curr_p);
+	while ((curr_p = curr_page->page_tail.next_page) != 0) {
+		tail_pages++;
+		curr_page = (struct nova_inode_log_page *)
+			nova_get_block(sb, curr_p);
+	}
+
+	block = nova_get_block_off(sb, blocknr, NOVA_BLOCK_TYPE_4K);
+	ckpt = (struct nova_index_ckpt *)nova_get_block(sb, block);
+	nova_index_extents(sb, sih, (struct nova_index_extent *)(ckpt + 1));
+
+	/* Store the live bytes as the rebuild counts them */
+	pinned = nova_log_bytes_pinned(sb, sih);
+	live = sih->live_bytes > pinned ? sih->live_bytes - pinned : 0;
+
+	ckpt->magic = cpu_to_le32(NOVA_INDEX_CKPT_MAGIC);
+	ckpt->version = cpu_to_le32(NOVA_INDEX_CKPT_VERSION);
+	ckpt->nova_ino = pi->nova_ino;
+	ckpt->num_blocks = cpu_to_le64(num_blocks);
+	ckpt->num_extents = cpu_to_le64(num_extents);
+	ckpt->log_head = pi->log_head;
+	ckpt->log_tail = pi->log_tail;
+	ckpt->log_pages = cpu_to_le64(sih->log_pages - tail_pages);
+	ckpt->live_bytes = cpu_to_le64(live);
+	ckpt->dead_bytes = cpu_to_le64(sih->dead_bytes);
+	ckpt->last_setattr = cpu_to_le64(sih->last_setattr);
+	ckpt->last_link_change = cpu_to_le64(sih->last_link_change);
+	nova_flush_buffer(ckpt, size, 1);
+
+	/*
+	 * Switch to the new checkpoint before freeing the old one, so that
+	 * a crash in between never leaves pi pointing at freed blocks.
+	 */
+	old_block = le64_to_cpu(pi->i_index_ckpt);
+	nova_memunlock_inode(sb, pi);
+	pi->i_index_ckpt = cpu_to_le64(block);
+	nova_memlock_inode(sb, pi);
+	nova_flush_buffer(&pi->i_index_ckpt, CACHELINE_SIZE, 1);
+
+	if (old)
+		nova_free_log_blocks(sb, &fake_pi,
+			nova_get_blocknr(sb, old_block, NOVA_BLOCK_TYPE_4K),
+			le64_to_cpu(old->num_blocks));
+
+	NOVA_STATS_ADD(sb, index_ckpt_saved, 1);
+	nova_dbgv("%s: inode %llu, %lu extents in %lu blocks @ 0x%llx\n",
+			__func__, pi->nova_ino, num_extents, num_blocks, block);
+}
+
+/*
+ * Load the index checkpoint of a file inode, if it was taken on the
+ * current log. Adds the log bytes before the checkpoint tail to total and
+ * live, and returns the log position to resume the replay from, or 0 to
+ * replay the whole log.
+ */
+u64 nova_load_index_ckpt(struct super_block *sb, struct nova_inode *pi,
+	struct nova_inode_info_header *sih, unsigned long *total,
+	unsigned long *live)
+{
+	struct nova_index_ckpt *ckpt;
+	struct nova_index_extent *extent;
+	struct nova_file_write_entry *entry;
+	unsigned long num_extents, pgoff, last = 0;
+	unsigned long i, j;
+	int ret;
+
+	ckpt = nova_get_index_ckpt(sb, pi);
+	if (!ckpt || ckpt->log_head != pi->log_head || ckpt->log_tail == 0)
+		return 0;
+
+	num_extents = le64_to_cpu(ckpt->num_extents);
+	extent = (struct nova_index_extent *)(ckpt + 1);
+	for (i = 0; i < num_extents; i++, extent++) {
+		entry = (struct nova_file_write_entry *)nova_get_block(sb,
+					le64_to_cpu(extent->entry));
+		pgoff = le64_to_cpu(extent->pgoff);
+		for (j = 0; j < le64_to_cpu(extent->num_pages); j++) {
+			ret = radix_tree_insert(&sih->tree, pgoff + j, entry);
+			if (ret) {
+				nova_dbg("%s: inode %llu, ERROR %d\n",
+					__func__, pi->nova_ino, ret);
+				goto fail;
+			}
+			last = pgoff + j;
+		}
+	}
+
+	sih->log_pages = le64_to_cpu(ckpt->log_pages);
+	sih->last_setattr = le64_to_cpu(ckpt->last_setattr);
+	sih->last_link_change = le64_to_cpu(ckpt->last_link_change);
+	*live += le64_to_cpu(ckpt->live_bytes);
+	*total += le64_to_cpu(ckpt->live_bytes) +
+			le64_to_cpu(ckpt->dead_bytes);
+
+	NOVA_STATS_ADD(sb, index_ckpt_loaded, 1);
+	return le64_to_cpu(ckpt->log_tail);
+
+fail:
+	/* Fall back to the full replay */
+	if (i || j)
+		nova_delete_file_tree(sb, sih, 0, last, false, false);
+	return 0;
+}
+
+/*
+ * Failure recovery: keep the blocks of a usable checkpoint allocated, and
+ * drop the others.
+ */
+void nova_recover_index_ckpt(struct super_block *sb, struct nova_inode *pi,
+	struct scan_bitmap *bm)
+{
+	struct nova_index_ckpt *ckpt;
+	unsigned long blocknr, i;
+
+	if (pi->i_index_ckpt == 0)
+		return;
+
+	ckpt = nova_get_index_ckpt(sb, pi);
+	if (!ckpt || ckpt->log_head != pi->log_head) {
+		nova_memunlock_inode(sb, pi);
+		pi->i_index_ckpt = 0;
+		nova_memlock_inode(sb, pi);
+		nova_flush_buffer(&pi->i_index_ckpt, CACHELINE_SIZE, 0);
+		return;
+	}
+
+	blocknr = le64_to_cpu(pi->i_index_ckpt) >> PAGE_SHIFT;
+	for (i = 0; i < le64_to_cpu(ckpt->num_blocks); i++)
+		set_bm(blocknr + i, bm, BM_4K);
+}
@@ -18,6 +18,7 @@
 #include <asm/pgtable.h>
 #include <linux/version.h>
 #include "nova.h"
+#include "nova_trace.h"
 
 static ssize_t
 do_dax_mapping_read(struct file *filp, char __user *buf,
@@ -113,7 +114,7 @@ memcpy:
 		else
 			left = __clear_user(buf + copied, nr);
 
-		NOVA_END_TIMING(memcpy_r_nvmm_t, memcpy_time);
+		NOVA_END_TIMING(sb, memcpy_r_nvmm_t, memcpy_time);
 
 		if (left) {
 			nova_dbg("%s ERROR!: bytes %lu, left %lu\n",
@@ -133,7 +134,7 @@ out:
 	if (filp)
 		file_accessed(filp);
 
-	NOVA_STATS_ADD(read_bytes, copied);
+	NOVA_STATS_ADD(sb, read_bytes, copied);
 
 	nova_dbgv("%s returned %zu\n", __func__, copied);
 	return (copied ? copied : error);
@@ -154,7 +155,7 @@ ssize_t nova_dax_file_read(struct file *filp, char __user *buf,
 //	rcu_read_lock();
 	res = do_dax_mapping_read(filp, buf, len, ppos);
 //	rcu_read_unlock();
-	NOVA_END_TIMING(dax_read_t, dax_read_time);
+	NOVA_END_TIMING(file_inode(filp)->i_sb, dax_read_t, dax_read_time);
 	return res;
 }
 
@@ -219,6 +220,7 @@ static void nova_handle_head_tail_blocks(struct super_block *sb,
 					offset, kmem, false);
 		}
 		nova_flush_buffer(kmem, offset, 0);
+		NOVA_WA_ADD(sb, wa_partial, offset);
 	}
 
 	kmem = (void *)((char *)kmem +
@@ -239,9 +241,10 @@ static void nova_handle_head_tail_blocks(struct super_block *sb,
 		}
 		nova_flush_buffer(kmem + eblk_offset,
 					sb->s_blocksize - eblk_offset, 0);
+		NOVA_WA_ADD(sb, wa_partial, sb->s_blocksize - eblk_offset);
 	}
 
-	NOVA_END_TIMING(partial_block_t, partial_time);
+	NOVA_END_TIMING(sb, partial_block_t, partial_time);
 }
 
 int nova_reassign_file_tree(struct super_block *sb,
@@ -250,7 +253,7 @@ int nova_reassign_file_tree(struct super_block *sb,
 {
 	struct nova_file_write_entry *entry_data;
 	u64 curr_p = begin_tail;
-	size_t entry_size = sizeof(struct nova_file_write_entry);
+	size_t entry_size = nova_write_entry_len(sb);
 
 	while (curr_p != pi->log_tail) {
 		if (is_last_entry(curr_p, entry_size))
@@ -285,7 +288,7 @@ static int nova_cleanup_incomplete_write(struct super_block *sb,
 {
 	struct nova_file_write_entry *entry;
 	u64 curr_p = begin_tail;
-	size_t entry_size = sizeof(struct nova_file_write_entry);
+	size_t entry_size = nova_write_entry_len(sb);
 
 	if (blocknr > 0 && allocated > 0)
 		nova_free_data_blocks(sb, pi, blocknr, allocated);
@@ -344,6 +347,7 @@ ssize_t nova_cow_file_write(struct file *filp,
 	size_t bytes;
 	long status = 0;
 	timing_t cow_write_time, memcpy_time;
+	struct nova_persist_ctx persist;
 	unsigned long step = 0;
 	u64 temp_tail = 0, begin_tail = 0;
 	u32 time;
@@ -359,6 +363,7 @@ ssize_t nova_cow_file_write(struct file *filp,
 		return -EACCES;
 
 	NOVA_START_TIMING(cow_write_t, cow_write_time);
+	nova_persist_begin(sb, &persist, PERSIST_WRITE);
 
 	sb_start_write(inode->i_sb);
 	if (need_mutex)
@@ -391,6 +396,7 @@ ssize_t nova_cow_file_write(struct file *filp,
 
 	nova_dbgv("%s: inode %lu, offset %lld, count %lu\n",
 			__func__, inode->i_ino,	pos, count);
+	trace_nova_cow_write_begin(inode, pos, count);
 
 	temp_tail = pi->log_tail;
 	while (num_blocks > 0) {
@@ -427,7 +433,7 @@ ssize_t nova_cow_file_write(struct file *filp,
 		NOVA_START_TIMING(memcpy_w_nvmm_t, memcpy_time);
 		copied = bytes - memcpy_to_pmem_nocache(kmem + offset,
 						buf, bytes);
-		NOVA_END_TIMING(memcpy_w_nvmm_t, memcpy_time);
+		NOVA_END_TIMING(sb, memcpy_w_nvmm_t, memcpy_time);
 
 		entry_data.pgoff = cpu_to_le64(start_blk);
 		entry_data.num_pages = cpu_to_le32(allocated);
@@ -435,6 +441,7 @@ ssize_t nova_cow_file_write(struct file *filp,
 		entry_data.block = cpu_to_le64(nova_get_block_off(sb, blocknr,
 							pi->i_blk_type));
 		entry_data.mtime = cpu_to_le32(time);
+		entry_data.flags = 0;
 		/* Set entry type after set block */
 		nova_set_entry_type((void *)&entry_data, FILE_WRITE);
 
@@ -471,7 +478,7 @@ ssize_t nova_cow_file_write(struct file *filp,
 
 		if (begin_tail == 0)
 			begin_tail = curr_entry;
-		temp_tail = curr_entry + sizeof(struct nova_file_write_entry);
+		temp_tail = curr_entry + nova_write_entry_len(sb);
 	}
 
 	nova_memunlock_inode(sb, pi);
@@ -480,7 +487,7 @@ ssize_t nova_cow_file_write(struct file *filp,
 			(total_blocks << (data_bits - sb->s_blocksize_bits)));
 	nova_memlock_inode(sb, pi);
 
-	nova_update_tail(pi, temp_tail);
+	nova_update_tail(sb, pi, temp_tail);
 
 	/* Free the overlap blocks after the write is committed */
 	ret = nova_reassign_file_tree(sb, pi, sih, begin_tail);
@@ -490,7 +497,7 @@ ssize_t nova_cow_file_write(struct file *filp,
 	inode->i_blocks = le64_to_cpu(pi->i_blocks);
 
 	ret = written;
-	NOVA_STATS_ADD(write_breaks, step);
+	NOVA_STATS_ADD(sb, write_breaks, step);
 	nova_dbgv("blocks: %lu, %llu\n", inode->i_blocks, pi->i_blocks);
 
 	*ppos = pos;
@@ -507,8 +514,11 @@ out:
 	if (need_mutex)
 		mutex_unlock(&inode->i_mutex);
 	sb_end_write(inode->i_sb);
-	NOVA_END_TIMING(cow_write_t, cow_write_time);
-	NOVA_STATS_ADD(cow_write_bytes, written);
+	trace_nova_cow_write_end(inode, ret, step);
+	nova_persist_end(&persist);
+	NOVA_END_TIMING(sb, cow_write_t, cow_write_time);
+	NOVA_STATS_ADD(sb, cow_write_bytes, written);
+	NOVA_WA_ADD(sb, wa_user, written);
 	return ret;
 }
 
@@ -608,6 +618,7 @@ static int nova_dax_get_blocks(struct inode *inode, sector_t iblock,
 	/* Set entry type after set block */
 	nova_set_entry_type((void *)&entry_data, FILE_WRITE);
 	entry_data.mtime = cpu_to_le32(time);
+	entry_data.flags = 0;
 
 	/* Do not extend file size */
 	entry_data.size = cpu_to_le64(inode->i_size);
@@ -625,8 +636,8 @@ static int nova_dax_get_blocks(struct inode *inode, sector_t iblock,
 	le64_add_cpu(&pi->i_blocks,
 			(num_blocks << (data_bits - sb->s_blocksize_bits)));
 
-	temp_tail = curr_entry + sizeof(struct nova_file_write_entry);
-	nova_update_tail(pi, temp_tail);
+	temp_tail = curr_entry + nova_write_entry_len(sb);
+	nova_update_tail(sb, pi, temp_tail);
 
 	ret = nova_reassign_file_tree(sb, pi, sih, curr_entry);
 	if (ret)
@@ -664,7 +675,7 @@ int nova_dax_get_block(struct inode *inode, sector_t iblock,
 		bh->b_size = ret << inode->i_blkbits;
 		ret = 0;
 	}
-	NOVA_END_TIMING(dax_get_block_t, gb_time);
+	NOVA_END_TIMING(inode->i_sb, dax_get_block_t, gb_time);
 	return ret;
 }
 
@@ -790,7 +801,7 @@ ssize_t nova_copy_to_nvmm(struct super_block *sb, struct inode *inode,
 		NOVA_START_TIMING(memcpy_w_wb_t, memcpy_time);
 		copied = nova_flush_mmap_to_nvmm(sb, inode, pi, pos, bytes,
 							kmem);
-		NOVA_END_TIMING(memcpy_w_wb_t, memcpy_time);
+		NOVA_END_TIMING(sb, memcpy_w_wb_t, memcpy_time);
 
 		entry_data.pgoff = cpu_to_le64(start_blk);
 		entry_data.num_pages = cpu_to_le32(allocated);
@@ -799,6 +810,7 @@ ssize_t nova_copy_to_nvmm(struct super_block *sb, struct inode *inode,
 							pi->i_blk_type));
 		/* FIXME: should we use the page cache write time? */
 		entry_data.mtime = cpu_to_le32(time);
+		entry_data.flags = 0;
 		/* Set entry type after set block */
 		nova_set_entry_type((void *)&entry_data, FILE_WRITE);
 
@@ -833,7 +845,7 @@ ssize_t nova_copy_to_nvmm(struct super_block *sb, struct inode *inode,
 
 		if (begin_tail == 0)
 			begin_tail = curr_entry;
-		temp_tail = curr_entry + sizeof(struct nova_file_write_entry);
+		temp_tail = curr_entry + nova_write_entry_len(sb);
 	}
 
 	nova_memunlock_inode(sb, pi);
@@ -853,7 +865,7 @@ out:
 						begin_tail, temp_tail);
 
 	sb_end_write(inode->i_sb);
-	NOVA_END_TIMING(copy_to_nvmm_t, copy_to_nvmm_time);
+	NOVA_END_TIMING(sb, copy_to_nvmm_t, copy_to_nvmm_time);
 	return ret;
 }
 
@@ -1021,24 +1033,56 @@ static int nova_dax_file_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 
 	NOVA_START_TIMING(mmap_fault_t, fault_time);
 	ret = __nova_dax_file_fault(vma, vmf);
-	NOVA_END_TIMING(mmap_fault_t, fault_time);
+	NOVA_END_TIMING(file_inode(vma->vm_file)->i_sb, mmap_fault_t,
+			fault_time);
 	return ret;
 }
 #endif
 
+/*
+ * Shared writable mappings write in place, so a write fault must not map a
+ * block shared with another file. Copy the pages the fault covers and tear
+ * down the mappings of the old copies. Called with i_mutex held, under
+ * mmap_sem; the copy is done here rather than at mmap time because i_mutex
+ * nests outside mmap_sem on the write path.
+ */
+static long nova_dax_unshare_for_write(struct vm_area_struct *vma,
+	unsigned long pgoff, unsigned long num)
+{
+	struct inode *inode = file_inode(vma->vm_file);
+	long ret;
+
+	if (!(vma->vm_flags & VM_SHARED))
+		return 0;
+
+	ret = nova_unshare_file_blocks(inode, pgoff, pgoff + num);
+	if (ret)
+		unmap_mapping_range(inode->i_mapping,
+				(loff_t)pgoff << PAGE_SHIFT,
+				(loff_t)num << PAGE_SHIFT, 0);
+	return ret;
+}
+
 static int nova_dax_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 {
 	struct inode *inode = file_inode(vma->vm_file);
+	long unshared = 0;
 	int ret = 0;
 	timing_t fault_time;
 
 	NOVA_START_TIMING(mmap_fault_t, fault_time);
 
 	mutex_lock(&inode->i_mutex);
-	ret = dax_fault(vma, vmf, nova_dax_get_block, NULL);
+	if (vmf->flags & FAULT_FLAG_WRITE)
+		unshared = nova_dax_unshare_for_write(vma, vmf->pgoff, 1);
+	if (unshared < 0)
+		ret = unshared == -ENOMEM ? VM_FAULT_OOM : VM_FAULT_SIGBUS;
+	else
+		ret = dax_fault(vma, vmf, nova_dax_get_block, NULL);
 	mutex_unlock(&inode->i_mutex);
+	trace_nova_dax_fault(inode, vmf->pgoff, vmf->flags, 0, ret);
 
-	NOVA_END_TIMING(mmap_fault_t, fault_time);
+	NOVA_END_TIMING(inode->i_sb, mmap_fault_t, fault_time);
 	return ret;
 }
 
@@ -1046,16 +1090,28 @@ static int nova_dax_pmd_fault(struct vm_area_struct *vma, unsigned long addr,
 	pmd_t *pmd, unsigned int flags)
 {
 	struct inode *inode = file_inode(vma->vm_file);
+	long unshared = 0;
 	int ret = 0;
 	timing_t fault_time;
 
 	NOVA_START_TIMING(mmap_fault_t, fault_time);
 
 	mutex_lock(&inode->i_mutex);
-	ret = dax_pmd_fault(vma, addr, pmd, flags, nova_dax_get_block, NULL);
+	if (flags & FAULT_FLAG_WRITE)
+		unshared = nova_dax_unshare_for_write(vma,
+				linear_page_index(vma, addr & PMD_MASK),
+				PTRS_PER_PMD);
+	/* Fall back to 4K faults, which report the error */
+	if (unshared < 0)
+		ret = VM_FAULT_FALLBACK;
+	else
+		ret = dax_pmd_fault(vma, addr, pmd, flags,
+					nova_dax_get_block, NULL);
 	mutex_unlock(&inode->i_mutex);
+	trace_nova_dax_fault(inode, linear_page_index(vma, addr & PMD_MASK),
+				flags, 1, ret);
 
-	NOVA_END_TIMING(mmap_fault_t, fault_time);
+	NOVA_END_TIMING(inode->i_sb, mmap_fault_t, fault_time);
 	return ret;
 }
 
@@ -1064,6 +1120,7 @@ static int nova_dax_pfn_mkwrite(struct vm_area_struct *vma,
 {
 	struct inode *inode = file_inode(vma->vm_file);
 	loff_t size;
+	long unshared;
 	int ret = 0;
 	timing_t fault_time;
 
@@ -1071,13 +1128,24 @@ static int nova_dax_pfn_mkwrite(struct vm_area_struct *vma,
 
 	mutex_lock(&inode->i_mutex);
 	size = (i_size_read(inode) + PAGE_SIZE - 1) >> PAGE_SHIFT;
-	if (vmf->pgoff >= size)
+	if (vmf->pgoff >= size) {
 		ret = VM_FAULT_SIGBUS;
+		goto out;
+	}
+
+	unshared = nova_dax_unshare_for_write(vma, vmf->pgoff, 1);
+	if (unshared < 0)
+		ret = unshared == -ENOMEM ? VM_FAULT_OOM : VM_FAULT_SIGBUS;
+	else if (unshared > 0)
+		/* Our read-only pte is gone; refault onto the private copy */
+		ret = VM_FAULT_NOPAGE;
 	else
 		ret = dax_pfn_mkwrite(vma, vmf);
+out:
 	mutex_unlock(&inode->i_mutex);
+	trace_nova_dax_fault(inode, vmf->pgoff, vmf->flags, 0, ret);
 
-	NOVA_END_TIMING(mmap_fault_t, fault_time);
+	NOVA_END_TIMING(inode->i_sb, mmap_fault_t, fault_time);
 	return ret;
 }
 
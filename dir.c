@@ -17,42 +17,289 @@
 
 #include <linux/fs.h>
 #include <linux/pagemap.h>
+#include <linux/jhash.h>
+#include <linux/vmalloc.h>
+#include <linux/compat.h>
 #include "nova.h"
+#include "nova_trace.h"
 
 #define DT2IF(dt) (((dt) << 12) & S_IFMT)
 #define IF2DT(sif) (((sif) & S_IFMT) >> 12)
 
+/*
+ * Directory names are indexed by a DRAM hash table of per-bucket chains,
+ * so names whose hashes collide coexist. The table doubles when it holds
+ * more names than buckets and halves when it is mostly empty. A resize
+ * keeps the old table around and moves a few of its buckets on each
+ * later insert or remove, so no single operation rehashes the directory;
+ * lookups search both tables meanwhile.
+ *
+ * Every name also sits in an rbtree ordered by its readdir cookie, a 63
+ * bit hash of the name. Readdir walks that tree from the cookie in
+ * ctx->pos, so its cost follows the live names, not the log, adding or
+ * removing other names never moves a position, and a position stays
+ * valid across eviction and rebuild of the index. Names whose cookies
+ * collide are ordered by name and listed as a group. Callers limited to
+ * 32 bit offsets see the top 31 bits of the cookie instead, which keep
+ * the same order but collide more often.
+ */
+#define NOVA_DIR_HASH_MIN_BITS	3
+#define NOVA_DIR_HASH_MAX_BITS	24
+/* Old buckets moved per insert or remove during a resize */
+#define NOVA_DIR_REHASH_STEP	16
+#define NOVA_DIR_COOKIE_SEED	0x9e3779b9
+#define NOVA_DIR_END_32BIT	0x7fffffff
+
+static inline u32 nova_dir_hash(const char *name, unsigned long name_len)
+{
+	return jhash(name, name_len, 0);
+}
+
+/* The bucket hash, extended with a second one to make collisions rare */
+static inline u64 nova_dir_cookie(const char *name, unsigned long name_len,
+	u32 hash)
+{
+	u64 cookie = ((u64)hash << 31) |
+			(jhash(name, name_len, NOVA_DIR_COOKIE_SEED) >> 1);
+
+	return max_t(u64, cookie, NOVA_DIR_FIRST_COOKIE);
+}
+
+/* As ext4 does, see is_32bit_api() and hash2pos() there */
+static inline bool nova_dir_32bit_pos(struct file *file)
+{
+	if (file->f_mode & FMODE_32BITHASH)
+		return true;
+	if (file->f_mode & FMODE_64BITHASH)
+		return false;
+#ifdef CONFIG_COMPAT
+	return is_compat_task();
+#else
+	return BITS_PER_LONG == 32;
+#endif
+}
+
+/* The readdir position of a name */
+static inline u64 nova_dir_pos(struct nova_dir_node *node, bool pos32)
+{
+	if (!pos32)
+		return node->cookie;
+
+	return clamp_t(u64, node->cookie >> 32, NOVA_DIR_FIRST_COOKIE,
+			NOVA_DIR_END_32BIT - 1);
+}
+
+static int nova_dir_order_cmp(struct nova_dir_node *a,
+	struct nova_dir_node *b)
+{
+	struct nova_dentry *da = a->direntry, *db = b->direntry;
+	int ret;
+
+	if (a->cookie != b->cookie)
+		return a->cookie < b->cookie ? -1 : 1;
+
+	ret = memcmp(da->name, db->name, min(da->name_len, db->name_len));
+	if (ret)
+		return ret;
+	return (int)da->name_len - (int)db->name_len;
+}
+
+static struct hlist_head *nova_alloc_dir_buckets(unsigned int bits)
+{
+	size_t size = sizeof(struct hlist_head) << bits;
+
+	if (size <= PAGE_SIZE)
+		return kzalloc(size, GFP_NOFS);
+
+	return __vmalloc(size, GFP_NOFS | __GFP_ZERO, PAGE_KERNEL);
+}
+
+/* Move up to steps buckets of the old table to the current one */
+static void nova_dir_rehash_step(struct nova_inode_info_header *sih,
+	unsigned long steps)
+{
+	struct nova_dir_node *node;
+	struct hlist_node *tmp;
+	unsigned long num;
+
+	if (!sih->dir_old_buckets)
+		return;
+
+	num = 1UL << sih->dir_old_bits;
+	while (steps-- && sih->dir_rehash_next < num) {
+		hlist_for_each_entry_safe(node, tmp,
+				&sih->dir_old_buckets[sih->dir_rehash_next],
+				hnode) {
+			hlist_del(&node->hnode);
+			hlist_add_head(&node->hnode, &sih->dir_buckets[
+				node->hash & ((1UL << sih->dir_bits) - 1)]);
+		}
+		sih->dir_rehash_next++;
+	}
+
+	if (sih->dir_rehash_next == num) {
+		kvfree(sih->dir_old_buckets);
+		sih->dir_old_buckets = NULL;
+		sih->dir_old_bits = 0;
+		sih->dir_rehash_next = 0;
+	}
+}
+
+/* Start moving the names to a table of 2^bits buckets */
+static void nova_resize_dir_hash(struct nova_inode_info_header *sih,
+	unsigned int bits)
+{
+	struct hlist_head *buckets;
+
+	buckets = nova_alloc_dir_buckets(bits);
+	if (!buckets)
+		/* Longer chains, still correct */
+		return;
+
+	/* Callers wait for the last resize to finish, but be safe */
+	nova_dir_rehash_step(sih, ULONG_MAX);
+
+	if (sih->dir_buckets) {
+		sih->dir_old_buckets = sih->dir_buckets;
+		sih->dir_old_bits = sih->dir_bits;
+		sih->dir_rehash_next = 0;
+	}
+	sih->dir_buckets = buckets;
+	sih->dir_bits = bits;
+}
+
+static struct nova_dir_node *nova_dir_hash_lookup(
+	struct nova_inode_info_header *sih, const char *name,
+	unsigned long name_len, u32 hash)
+{
+	struct nova_dir_node *node;
+	struct nova_dentry *direntry;
+
+	if (!sih->dir_buckets)
+		return NULL;
+
+	hlist_for_each_entry(node,
+			&sih->dir_buckets[hash & ((1UL << sih->dir_bits) - 1)],
+			hnode) {
+		direntry = node->direntry;
+		if (node->hash == hash && direntry->name_len == name_len &&
+				memcmp(direntry->name, name, name_len) == 0)
+			return node;
+	}
+
+	if (!sih->dir_old_buckets)
+		return NULL;
+
+	hlist_for_each_entry(node, &sih->dir_old_buckets[hash &
+				((1UL << sih->dir_old_bits) - 1)], hnode) {
+		direntry = node->direntry;
+		if (node->hash == hash && direntry->name_len == name_len &&
+				memcmp(direntry->name, name, name_len) == 0)
+			return node;
+	}
+
+	return NULL;
+}
+
+struct nova_dir_node *nova_find_dir_node(struct nova_inode_info_header *sih,
+	const char *name, unsigned long name_len)
+{
+	return nova_dir_hash_lookup(sih, name, name_len,
+					nova_dir_hash(name, name_len));
+}
+
 struct nova_dentry *nova_find_dentry(struct super_block *sb,
 	struct nova_inode *pi, struct inode *inode, const char *name,
 	unsigned long name_len)
 {
 	struct nova_inode_info *si = NOVA_I(inode);
 	struct nova_inode_info_header *sih = &si->header;
-	struct nova_dentry *direntry;
-	unsigned long hash;
+	struct nova_dir_node *node;
+
+	node = nova_find_dir_node(sih, name, name_len);
+
+	return node ? node->direntry : NULL;
+}
 
-	hash = BKDRHash(name, name_len);
-	direntry = radix_tree_lookup(&sih->tree, hash);
+static void nova_insert_dir_order(struct nova_inode_info_header *sih,
+	struct nova_dir_node *node)
+{
+	struct rb_node **temp = &sih->dir_order.rb_node;
+	struct rb_node *parent = NULL;
+	struct nova_dir_node *curr;
+
+	while (*temp) {
+		parent = *temp;
+		curr = container_of(parent, struct nova_dir_node, rnode);
+		if (nova_dir_order_cmp(node, curr) < 0)
+			temp = &(*temp)->rb_left;
+		else
+			temp = &(*temp)->rb_right;
+	}
 
-	return direntry;
+	rb_link_node(&node->rnode, parent, temp);
+	rb_insert_color(&node->rnode, &sih->dir_order);
 }
 
-static int nova_insert_dir_radix_tree(struct super_block *sb,
+/* The first name whose position is at or after pos */
+static struct nova_dir_node *nova_find_dir_cookie(
+	struct nova_inode_info_header *sih, u64 pos, bool pos32)
+{
+	struct rb_node *temp = sih->dir_order.rb_node;
+	struct nova_dir_node *node, *found = NULL;
+
+	while (temp) {
+		node = container_of(temp, struct nova_dir_node, rnode);
+		if (nova_dir_pos(node, pos32) >= pos) {
+			found = node;
+			temp = temp->rb_left;
+		} else {
+			temp = temp->rb_right;
+		}
+	}
+
+	return found;
+}
+
+static int nova_insert_dir_hash(struct super_block *sb,
 	struct nova_inode_info_header *sih, const char *name,
 	int namelen, struct nova_dentry *direntry)
 {
-	unsigned long hash;
-	int ret;
+	struct nova_dir_node *node;
+	u32 hash;
 
-	hash = BKDRHash(name, namelen);
-	nova_dbgv("%s: insert %s hash %lu\n", __func__, name, hash);
+	hash = nova_dir_hash(name, namelen);
+	nova_dbgv("%s: insert %s hash %u\n", __func__, name, hash);
 
-	/* FIXME: hash collision ignored here */
-	ret = radix_tree_insert(&sih->tree, hash, direntry);
-	if (ret)
-		nova_dbg("%s ERROR %d: %s\n", __func__, ret, name);
+	if (nova_dir_hash_lookup(sih, name, namelen, hash)) {
+		nova_dbg("%s ERROR %d: %s\n", __func__, -EEXIST, name);
+		return -EEXIST;
+	}
 
-	return ret;
+	if (!sih->dir_buckets) {
+		nova_resize_dir_hash(sih, NOVA_DIR_HASH_MIN_BITS);
+		if (!sih->dir_buckets)
+			return -ENOMEM;
+	} else if (sih->dir_old_buckets) {
+		nova_dir_rehash_step(sih, NOVA_DIR_REHASH_STEP);
+	} else if (sih->dir_entries >= (1UL << sih->dir_bits) &&
+			sih->dir_bits < NOVA_DIR_HASH_MAX_BITS) {
+		nova_resize_dir_hash(sih, sih->dir_bits + 1);
+	}
+
+	node = nova_alloc_dir_node(sb);
+	if (!node)
+		return -ENOMEM;
+
+	node->hash = hash;
+	node->cookie = nova_dir_cookie(name, namelen, hash);
+	node->direntry = direntry;
+	hlist_add_head(&node->hnode,
+		&sih->dir_buckets[hash & ((1UL << sih->dir_bits) - 1)]);
+	nova_insert_dir_order(sih, node);
+	sih->dir_entries++;
+
+	return 0;
 }
 
 static int nova_check_dentry_match(struct super_block *sb,
@@ -64,19 +311,33 @@ static int nova_check_dentry_match(struct super_block *sb,
 	return strncmp(dentry->name, name, namelen);
 }
 
-static int nova_remove_dir_radix_tree(struct super_block *sb,
+static int nova_remove_dir_hash(struct super_block *sb,
 	struct nova_inode_info_header *sih, const char *name, int namelen,
 	int replay)
 {
-	struct nova_dentry *entry;
-	unsigned long hash;
-
-	hash = BKDRHash(name, namelen);
-	entry = radix_tree_delete(&sih->tree, hash);
+	struct nova_dir_node *node;
+	struct nova_dentry *entry = NULL;
+	u32 hash;
+
+	hash = nova_dir_hash(name, namelen);
+	node = nova_dir_hash_lookup(sih, name, namelen, hash);
+	if (node) {
+		entry = node->direntry;
+		hlist_del(&node->hnode);
+		rb_erase(&node->rnode, &sih->dir_order);
+		nova_free_dir_node(node);
+		sih->dir_entries--;
+
+		if (sih->dir_old_buckets)
+			nova_dir_rehash_step(sih, NOVA_DIR_REHASH_STEP);
+		else if (sih->dir_bits > NOVA_DIR_HASH_MIN_BITS &&
+				sih->dir_entries < (1UL << sih->dir_bits) / 8)
+			nova_resize_dir_hash(sih, sih->dir_bits - 1);
+	}
 
 	if (replay == 0) {
 		if (!entry) {
-			nova_dbg("%s ERROR: %s, length %d, hash %lu\n",
+			nova_dbg("%s ERROR: %s, length %d, hash %u\n",
 					__func__, name, namelen, hash);
 			return -EINVAL;
 		}
@@ -84,7 +345,7 @@ static int nova_remove_dir_radix_tree(struct super_block *sb,
 		if (entry->ino == 0 || entry->invalid ||
 		    nova_check_dentry_match(sb, entry, name, namelen)) {
 			nova_dbg("%s dentry not match: %s, length %d, "
-					"hash %lu\n", __func__, name,
+					"hash %u\n", __func__, name,
 					namelen, hash);
 			nova_dbg("dentry: type %d, inode %llu, name %s, "
 					"namelen %u, rec len %u\n",
@@ -97,6 +358,7 @@ static int nova_remove_dir_radix_tree(struct super_block *sb,
 
 		/* No need to flush */
 		entry->invalid = 1;
+		nova_log_bytes_dead(sb, sih, le16_to_cpu(entry->de_len));
 	}
 
 	return 0;
@@ -105,39 +367,32 @@ static int nova_remove_dir_radix_tree(struct super_block *sb,
 void nova_delete_dir_tree(struct super_block *sb,
 	struct nova_inode_info_header *sih)
 {
-	struct nova_dentry *direntry;
-	unsigned long pos = 0;
-	struct nova_dentry *entries[FREE_BATCH];
+	struct nova_dir_node *node;
+	struct hlist_node *tmp;
 	timing_t delete_time;
-	int nr_entries;
-	int i;
-	void *ret;
+	unsigned long i;
 
 	NOVA_START_TIMING(delete_dir_tree_t, delete_time);
 
-	do {
-		nr_entries = radix_tree_gang_lookup(&sih->tree,
-					(void **)entries, pos, FREE_BATCH);
-		for (i = 0; i < nr_entries; i++) {
-			direntry = entries[i];
-			BUG_ON(!direntry);
-			pos = BKDRHash(direntry->name, direntry->name_len);
-			ret = radix_tree_delete(&sih->tree, pos);
-			if (!ret || ret != direntry) {
-				nova_err(sb, "dentry: type %d, inode %llu, "
-					"name %s, namelen %u, rec len %u\n",
-					direntry->entry_type,
-					le64_to_cpu(direntry->ino),
-					direntry->name, direntry->name_len,
-					le16_to_cpu(direntry->de_len));
-				if (!ret)
-					nova_dbg("ret is NULL\n");
-			}
+	for (i = 0; i < nova_dir_num_buckets(sih); i++) {
+		hlist_for_each_entry_safe(node, tmp, nova_dir_bucket(sih, i),
+						hnode) {
+			hlist_del(&node->hnode);
+			nova_free_dir_node(node);
 		}
-		pos++;
-	} while (nr_entries == FREE_BATCH);
+	}
 
-	NOVA_END_TIMING(delete_dir_tree_t, delete_time);
+	kvfree(sih->dir_buckets);
+	kvfree(sih->dir_old_buckets);
+	sih->dir_buckets = NULL;
+	sih->dir_bits = 0;
+	sih->dir_old_buckets = NULL;
+	sih->dir_old_bits = 0;
+	sih->dir_rehash_next = 0;
+	sih->dir_entries = 0;
+	sih->dir_order = RB_ROOT;
+
+	NOVA_END_TIMING(sb, delete_dir_tree_t, delete_time);
 	return;
 }
 
@@ -199,7 +454,7 @@ static u64 nova_append_dir_inode_entry(struct super_block *sb,
 	*curr_tail = curr_p + de_len;
 
 	dir->i_blocks = pidir->i_blocks;
-	NOVA_END_TIMING(append_dir_entry_t, append_time);
+	NOVA_END_TIMING(sb, append_dir_entry_t, append_time);
 	return curr_p;
 }
 
@@ -231,29 +486,29 @@ int nova_append_dir_init_entries(struct super_block *sb,
 	de_entry->entry_type = DIR_LOG;
 	de_entry->ino = cpu_to_le64(self_ino);
 	de_entry->name_len = 1;
-	de_entry->de_len = cpu_to_le16(NOVA_DIR_LOG_REC_LEN(1));
+	de_entry->de_len = cpu_to_le16(nova_dir_rec_len(sb, 1));
 	de_entry->mtime = CURRENT_TIME_SEC.tv_sec;
 	de_entry->size = sb->s_blocksize;
 	de_entry->links_count = 1;
 	strncpy(de_entry->name, ".\0", 2);
-	nova_flush_buffer(de_entry, NOVA_DIR_LOG_REC_LEN(1), 0);
+	nova_flush_buffer(de_entry, nova_dir_rec_len(sb, 1), 0);
 
-	curr_p = new_block + NOVA_DIR_LOG_REC_LEN(1);
+	curr_p = new_block + nova_dir_rec_len(sb, 1);
 
 	de_entry = (struct nova_dentry *)((char *)de_entry +
 					le16_to_cpu(de_entry->de_len));
 	de_entry->entry_type = DIR_LOG;
 	de_entry->ino = cpu_to_le64(parent_ino);
 	de_entry->name_len = 2;
-	de_entry->de_len = cpu_to_le16(NOVA_DIR_LOG_REC_LEN(2));
+	de_entry->de_len = cpu_to_le16(nova_dir_rec_len(sb, 2));
 	de_entry->mtime = CURRENT_TIME_SEC.tv_sec;
 	de_entry->size = sb->s_blocksize;
 	de_entry->links_count = 2;
 	strncpy(de_entry->name, "..\0", 3);
-	nova_flush_buffer(de_entry, NOVA_DIR_LOG_REC_LEN(2), 0);
+	nova_flush_buffer(de_entry, nova_dir_rec_len(sb, 2), 0);
 
-	curr_p += NOVA_DIR_LOG_REC_LEN(2);
-	nova_update_tail(pi, curr_p);
+	curr_p += nova_dir_rec_len(sb, 2);
+	nova_update_tail(sb, pi, curr_p);
 
 	return 0;
 }
@@ -293,15 +548,15 @@ int nova_add_dentry(struct dentry *dentry, u64 ino, int inc_link,
 	 */
 	dir->i_mtime = dir->i_ctime = CURRENT_TIME_SEC;
 
-	loglen = NOVA_DIR_LOG_REC_LEN(namelen);
+	loglen = nova_dir_rec_len(sb, namelen);
 	curr_entry = nova_append_dir_inode_entry(sb, pidir, dir, ino,
 				dentry,	loglen, tail, inc_link,
 				&curr_tail);
 
 	direntry = (struct nova_dentry *)nova_get_block(sb, curr_entry);
-	ret = nova_insert_dir_radix_tree(sb, sih, name, namelen, direntry);
+	ret = nova_insert_dir_hash(sb, sih, name, namelen, direntry);
 	*new_tail = curr_tail;
-	NOVA_END_TIMING(add_dentry_t, add_dentry_time);
+	NOVA_END_TIMING(sb, add_dentry_t, add_dentry_time);
 	return ret;
 }
 
@@ -330,13 +585,15 @@ int nova_remove_dentry(struct dentry *dentry, int dec_link, u64 tail,
 
 	dir->i_mtime = dir->i_ctime = CURRENT_TIME_SEC;
 
-	loglen = NOVA_DIR_LOG_REC_LEN(entry->len);
+	loglen = nova_dir_rec_len(sb, entry->len);
 	curr_entry = nova_append_dir_inode_entry(sb, pidir, dir, 0,
 				dentry, loglen, tail, dec_link, &curr_tail);
 	*new_tail = curr_tail;
+	/* The removal record itself is dead on arrival */
+	nova_log_bytes_dead(sb, sih, loglen);
 
-	nova_remove_dir_radix_tree(sb, sih, entry->name, entry->len, 0);
-	NOVA_END_TIMING(remove_dentry_t, remove_dentry_time);
+	nova_remove_dir_hash(sb, sih, entry->name, entry->len, 0);
+	NOVA_END_TIMING(sb, remove_dentry_t, remove_dentry_time);
 	return 0;
 }
 
@@ -347,7 +604,7 @@ inline int nova_replay_add_dentry(struct super_block *sb,
 		return -EINVAL;
 
 	nova_dbg_verbose("%s: add %s\n", __func__, entry->name);
-	return nova_insert_dir_radix_tree(sb, sih,
+	return nova_insert_dir_hash(sb, sih,
 			entry->name, entry->name_len, entry);
 }
 
@@ -356,7 +613,7 @@ inline int nova_replay_remove_dentry(struct super_block *sb,
 	struct nova_dentry *entry)
 {
 	nova_dbg_verbose("%s: remove %s\n", __func__, entry->name);
-	nova_remove_dir_radix_tree(sb, sih, entry->name,
+	nova_remove_dir_hash(sb, sih, entry->name,
 					entry->name_len, 1);
 	return 0;
 }
@@ -382,6 +639,11 @@ int nova_rebuild_dir_inode_tree(struct super_block *sb,
 	struct nova_link_change_entry *link_change_entry = NULL;
 	struct nova_inode_log_page *curr_page;
 	u64 ino = pi->nova_ino;
+	size_t attr_len = nova_log_entry_len(sb,
+				sizeof(struct nova_setattr_logentry));
+	size_t link_len = nova_log_entry_len(sb,
+				sizeof(struct nova_link_change_entry));
+	unsigned long total = 0, live = 0;
 	unsigned short de_len;
 	timing_t rebuild_time;
 	void *addr;
@@ -425,7 +687,10 @@ int nova_rebuild_dir_inode_tree(struct super_block *sb,
 				nova_apply_setattr_entry(sb, pi, sih,
 								attr_entry);
 				sih->last_setattr = curr_p;
-				curr_p += sizeof(struct nova_setattr_logentry);
+				total += attr_len;
+				if (attr_entry->attr & ATTR_SIZE)
+					live += attr_len;
+				curr_p += attr_len;
 				continue;
 			case LINK_CHANGE:
 				link_change_entry =
@@ -433,7 +698,8 @@ int nova_rebuild_dir_inode_tree(struct super_block *sb,
 				nova_apply_link_change_entry(pi,
 							link_change_entry);
 				sih->last_link_change = curr_p;
-				curr_p += sizeof(struct nova_link_change_entry);
+				total += link_len;
+				curr_p += link_len;
 				continue;
 			case DIR_LOG:
 				break;
@@ -468,6 +734,9 @@ int nova_rebuild_dir_inode_tree(struct super_block *sb,
 		nova_rebuild_dir_time_and_size(sb, pi, entry);
 
 		de_len = le16_to_cpu(entry->de_len);
+		total += de_len;
+		if (entry->ino > 0 && entry->invalid == 0)
+			live += de_len;
 		curr_p += de_len;
 	}
 
@@ -486,64 +755,58 @@ int nova_rebuild_dir_inode_tree(struct super_block *sb,
 	}
 
 	pi->i_blocks = sih->log_pages;
+	nova_rebuild_log_bytes(sb, sih, total, live);
+	trace_nova_rebuild_inode(sb, ino, 1, sih->log_pages, 0, live, total);
 
 //	nova_print_dir_tree(sb, sih, ino);
-	NOVA_END_TIMING(rebuild_dir_t, rebuild_time);
+	NOVA_END_TIMING(sb, rebuild_dir_t, rebuild_time);
 	return 0;
 }
 
-#if 0
+/*
+ * "." and ".." come from the VFS, so new directories list them before
+ * their init entries reach the hash table on the next rebuild.
+ */
 static int nova_readdir(struct file *file, struct dir_context *ctx)
 {
 	struct inode *inode = file_inode(file);
 	struct super_block *sb = inode->i_sb;
-	struct nova_inode *pidir;
 	struct nova_inode_info *si = NOVA_I(inode);
 	struct nova_inode_info_header *sih = &si->header;
 	struct nova_inode *child_pi;
 	struct nova_dentry *entry;
-	struct nova_dentry *entries[FREE_BATCH];
-	int nr_entries;
+	struct nova_dir_node *node, *next;
+	struct rb_node *temp;
+	bool pos32 = nova_dir_32bit_pos(file);
+	u64 end = pos32 ? NOVA_DIR_END_32BIT : READDIR_END;
 	u64 pi_addr;
-	unsigned long pos = 0;
 	ino_t ino;
-	int i;
-	int ret;
+	int ret = 0;
 	timing_t readdir_time;
 
 	NOVA_START_TIMING(readdir_t, readdir_time);
-	pidir = nova_get_inode(sb, inode);
-	nova_dbgv("%s: ino %llu, size %llu, pos %llu\n",
+	nova_dbgv("%s: ino %llu, size %llu, pos 0x%llx\n",
 			__func__, (u64)inode->i_ino,
-			pidir->i_size, ctx->pos);
+			(u64)inode->i_size, ctx->pos);
 
-	if (!sih) {
-		nova_dbg("%s: inode %lu sih does not exist!\n",
-				__func__, inode->i_ino);
-		ctx->pos = READDIR_END;
-		return 0;
-	}
+	if (ctx->pos == end)
+		goto out;
 
-	pos = ctx->pos;
-	if (pos == READDIR_END)
+	if (!dir_emit_dots(file, ctx))
 		goto out;
 
-	do {
-		nr_entries = radix_tree_gang_lookup(&sih->tree,
-					(void **)entries, pos, FREE_BATCH);
-		for (i = 0; i < nr_entries; i++) {
-			entry = entries[i];
-			pos = BKDRHash(entry->name, entry->name_len);
+	node = nova_find_dir_cookie(sih, ctx->pos, pos32);
+	while (node) {
+		entry = node->direntry;
+		if (!is_dir_init_entry(sb, entry) &&
+				!nova_hidden_dentry(inode, entry)) {
 			ino = __le64_to_cpu(entry->ino);
-			if (ino == 0)
-				continue;
-
 			ret = nova_get_inode_address(sb, ino, &pi_addr, 0);
 			if (ret) {
 				nova_dbg("%s: get child inode %lu address "
 					"failed %d\n", __func__, ino, ret);
-				ctx->pos = READDIR_END;
-				return ret;
+				ctx->pos = end;
+				goto out;
 			}
 
 			child_pi = nova_get_block(sb, pi_addr);
@@ -554,164 +817,37 @@ static int nova_readdir(struct file *file, struct dir_context *ctx)
 			if (!dir_emit(ctx, entry->name, entry->name_len,
 				ino, IF2DT(le16_to_cpu(child_pi->i_mode)))) {
 				nova_dbgv("Here: pos %llu\n", ctx->pos);
-				return 0;
+				goto out;
 			}
-			ctx->pos = pos + 1;
 		}
-		pos++;
-	} while (nr_entries == FREE_BATCH);
 
-out:
-	NOVA_END_TIMING(readdir_t, readdir_time);
-	return 0;
-}
-#endif
-
-static u64 nova_find_next_dentry_addr(struct super_block *sb,
-	struct nova_inode_info_header *sih, u64 pos)
-{
-	struct nova_sb_info *sbi = NOVA_SB(sb);
-	struct nova_file_write_entry *entry = NULL;
-	struct nova_file_write_entry *entries[1];
-	int nr_entries;
-	u64 addr = 0;
-
-	nr_entries = radix_tree_gang_lookup(&sih->tree,
-					(void **)entries, pos, 1);
-	if (nr_entries == 1) {
-		entry = entries[0];
-		addr = nova_get_addr_off(sbi, entry);
+		temp = rb_next(&node->rnode);
+		next = temp ? container_of(temp, struct nova_dir_node,
+						rnode) : NULL;
+		/* Stay on a colliding group until all of it is listed */
+		if (!next || nova_dir_pos(next, pos32) !=
+				nova_dir_pos(node, pos32))
+			ctx->pos = nova_dir_pos(node, pos32) + 1;
+		node = next;
 	}
 
-	return addr;
+	ctx->pos = end;
+out:
+	NOVA_END_TIMING(sb, readdir_t, readdir_time);
+	nova_dbgv("%s return\n", __func__);
+	return ret;
 }
 
-static int nova_readdir(struct file *file, struct dir_context *ctx)
+/* Positions are cookies, not bounded by the maximum file size */
+static loff_t nova_dir_llseek(struct file *file, loff_t offset, int whence)
 {
-	struct inode *inode = file_inode(file);
-	struct super_block *sb = inode->i_sb;
-	struct nova_inode *pidir;
-	struct nova_inode_info *si = NOVA_I(inode);
-	struct nova_inode_info_header *sih = &si->header;
-	struct nova_inode *child_pi;
-	struct nova_inode *prev_child_pi = NULL;
-	struct nova_dentry *entry = NULL;
-	struct nova_dentry *prev_entry = NULL;
-	unsigned short de_len;
-	u64 pi_addr;
-	unsigned long pos = 0;
-	ino_t ino;
-	void *addr;
-	u64 curr_p;
-	u8 type;
-	int ret;
-	timing_t readdir_time;
-
-	NOVA_START_TIMING(readdir_t, readdir_time);
-	pidir = nova_get_inode(sb, inode);
-	nova_dbgv("%s: ino %llu, size %llu, pos 0x%llx\n",
-			__func__, (u64)inode->i_ino,
-			pidir->i_size, ctx->pos);
-
-	if (pidir->log_head == 0) {
-		nova_err(sb, "Dir %lu log is NULL!\n", inode->i_ino);
-		BUG();
-		return -EINVAL;
-	}
+	loff_t end = nova_dir_32bit_pos(file) ? NOVA_DIR_END_32BIT : LLONG_MAX;
 
-	pos = ctx->pos;
-
-	if (pos == 0) {
-		curr_p = pidir->log_head;
-	} else if (pos == READDIR_END) {
-		goto out;
-	} else {
-		curr_p = nova_find_next_dentry_addr(sb, sih, pos);
-		if (curr_p == 0)
-			goto out;
-	}
-
-	while (curr_p != pidir->log_tail) {
-		if (goto_next_page(sb, curr_p)) {
-			curr_p = next_log_page(sb, curr_p);
-		}
-
-		if (curr_p == 0) {
-			nova_err(sb, "Dir %lu log is NULL!\n", inode->i_ino);
-			BUG();
-			return -EINVAL;
-		}
-
-		addr = (void *)nova_get_block(sb, curr_p);
-		type = nova_get_entry_type(addr);
-		switch (type) {
-			case SET_ATTR:
-				curr_p += sizeof(struct nova_setattr_logentry);
-				continue;
-			case LINK_CHANGE:
-				curr_p += sizeof(struct nova_link_change_entry);
-				continue;
-			case DIR_LOG:
-				break;
-			default:
-				nova_dbg("%s: unknown type %d, 0x%llx\n",
-							__func__, type, curr_p);
-			BUG();
-			return -EINVAL;
-		}
-
-		entry = (struct nova_dentry *)nova_get_block(sb, curr_p);
-		nova_dbgv("curr_p: 0x%llx, type %d, ino %llu, "
-			"name %s, namelen %u, rec len %u\n", curr_p,
-			entry->entry_type, le64_to_cpu(entry->ino),
-			entry->name, entry->name_len,
-			le16_to_cpu(entry->de_len));
-
-		de_len = le16_to_cpu(entry->de_len);
-		if (entry->ino > 0 && entry->invalid == 0) {
-			ino = __le64_to_cpu(entry->ino);
-			pos = BKDRHash(entry->name, entry->name_len);
-
-			ret = nova_get_inode_address(sb, ino, &pi_addr, 0);
-			if (ret) {
-				nova_dbg("%s: get child inode %lu address "
-					"failed %d\n", __func__, ino, ret);
-				ctx->pos = READDIR_END;
-				return ret;
-			}
-
-			child_pi = nova_get_block(sb, pi_addr);
-			nova_dbgv("ctx: ino %llu, name %s, "
-				"name_len %u, de_len %u\n",
-				(u64)ino, entry->name, entry->name_len,
-				entry->de_len);
-			if (prev_entry && !dir_emit(ctx, prev_entry->name,
-				prev_entry->name_len, ino,
-				IF2DT(le16_to_cpu(prev_child_pi->i_mode)))) {
-				nova_dbgv("Here: pos %llu\n", ctx->pos);
-				return 0;
-			}
-			prev_entry = entry;
-			prev_child_pi = child_pi;
-		}
-		ctx->pos = pos;
-		curr_p += de_len;
-	}
-
-	if (prev_entry && !dir_emit(ctx, prev_entry->name,
-			prev_entry->name_len, ino,
-			IF2DT(le16_to_cpu(prev_child_pi->i_mode))))
-		return 0;
-
-	ctx->pos = READDIR_END;
-out:
-	NOVA_END_TIMING(readdir_t, readdir_time);
-	nova_dbgv("%s return\n", __func__);
-	return 0;
+	return generic_file_llseek_size(file, offset, whence, end, end);
 }
 
 const struct file_operations nova_dir_operations = {
-	.llseek		= generic_file_llseek,
+	.llseek		= nova_dir_llseek,
 	.read		= generic_read_dir,
 	.iterate	= nova_readdir,
 	.fsync		= noop_fsync,
@@ -216,7 +216,7 @@ int nova_fsync(struct file *file, loff_t start, loff_t end, int datasync)
 	{
 		nova_dbg_verbose("[%s:%d] : (ERR) isize(%llx), start(%llx),"
 			" end(%llx)\n", __func__, __LINE__, isize, start, end);
-		NOVA_END_TIMING(fsync_t, fsync_time);
+		NOVA_END_TIMING(sb, fsync_t, fsync_time);
 		mutex_unlock(&inode->i_mutex);
 		return 0;
 	}
@@ -253,7 +253,7 @@ int nova_fsync(struct file *file, loff_t start, loff_t end, int datasync)
 
 	end_tail = end_temp;
 	if (begin_tail && end_tail && end_tail != pi->log_tail) {
-		nova_update_tail(pi, end_tail);
+		nova_update_tail(sb, pi, end_tail);
 
 		/* Free the overlap blocks after the write is committed */
 		ret = nova_reassign_file_tree(sb, pi, sih, begin_tail);
@@ -264,7 +264,7 @@ int nova_fsync(struct file *file, loff_t start, loff_t end, int datasync)
 	mutex_unlock(&inode->i_mutex);
 
 out:
-	NOVA_END_TIMING(fsync_t, fsync_time);
+	NOVA_END_TIMING(sb, fsync_t, fsync_time);
 
 	return ret;
 }
@@ -303,7 +303,7 @@ int nova_fsync(struct file *file, loff_t start, loff_t end, int datasync)
 	{
 		nova_dbgv("[%s:%d] : (ERR) isize(%llx), start(%llx),"
 			" end(%llx)\n", __func__, __LINE__, isize, start, end);
-		NOVA_END_TIMING(fsync_t, fsync_time);
+		NOVA_END_TIMING(sb, fsync_t, fsync_time);
 		return -ENODATA;
 	}
 
@@ -346,7 +346,7 @@ int nova_fsync(struct file *file, loff_t start, loff_t end, int datasync)
 			nova_err(sb, "%s ERROR: %lu, entry pgoff %llu, num %u, "
 				"blocknr %llu\n", __func__, pgoff, entry->pgoff,
 				entry->num_pages, entry->block >> PAGE_SHIFT);
-			NOVA_END_TIMING(fsync_t, fsync_time);
+			NOVA_END_TIMING(sb, fsync_t, fsync_time);
 			return -EINVAL;
 		}
 
@@ -373,7 +373,7 @@ int nova_fsync(struct file *file, loff_t start, loff_t end, int datasync)
 
 persist:
 	PERSISTENT_BARRIER();
-	NOVA_END_TIMING(fsync_t, fsync_time);
+	NOVA_END_TIMING(sb, fsync_t, fsync_time);
 
 	return ret;
 }
@@ -404,6 +404,10 @@ const struct file_operations nova_dax_file_operations = {
 #ifdef CONFIG_COMPAT
 	.compat_ioctl		= nova_compat_ioctl,
 #endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+	.copy_file_range	= nova_copy_file_range,
+	.clone_file_range	= nova_clone_file_range,
+#endif
 };
 
 const struct inode_operations nova_file_inode_operations = {
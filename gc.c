@@ -0,0 +1,513 @@
+/*
+ * BRIEF DESCRIPTION
+ *
+ * Background log cleaners.
+ *
+ * Extending an inode log used to run fast GC, and possibly thorough GC,
+ * inline under the writer's i_mutex. Now the writer only links the new log
+ * pages and queues the inode on the per-CPU cleaner of the current CPU
+ * once enough entries are dead. The cleaner threads run the GC later.
+ * Inline fast GC is kept as a fallback when the log is very long or free
+ * space is low, and then thorough GC is still left to the cleaners.
+ * Thorough GC is incremental: a cleaner compacts gc_chunk_pages at a time
+ * for at most gc_max_us, then requeues the inode and lets writers in.
+ *
+ * Each inode keeps its live and dead log bytes up to date as entries are
+ * appended and invalidated, and inodes with dead bytes sit on per-sb
+ * candidate lists bucketed by log utilization. Every gc_sched_ms the first
+ * cleaner ranks the oldest candidates of each bucket by cost-benefit: the
+ * dead bytes reclaimed, weighted by the time since the last GC, over the
+ * bytes read and written to copy the live entries out.
+ * While the candidates' logs take more than gc_log_budget_pct of the
+ * device, the best gc_sched_batch of them are queued for GC.
+ *
+ * Copyright 2015-2016 Regents of the University of California,
+ * UCSD Non-Volatile Systems Lab, Andiry Xu <jix024@cs.ucsd.edu>
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2. This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+
+#include <linux/module.h>
+#include <linux/kthread.h>
+#include <linux/slab.h>
+#include "nova.h"
+
+/* Queue an inode once this many of its log bytes are dead */
+static unsigned int gc_dead_bytes = 4096;
+module_param(gc_dead_bytes, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(gc_dead_bytes,
+	"Dead log bytes that queue an inode for background GC");
+
+/* Or once its log is this long and has any dead entry */
+static unsigned int gc_fill_pages = 16;
+module_param(gc_fill_pages, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(gc_fill_pages,
+	"Log pages that queue an inode with dead entries for background GC");
+
+/* Logs this long are cleaned inline */
+static unsigned int gc_inline_pages = 2048;
+module_param(gc_inline_pages, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(gc_inline_pages,
+	"Log pages above which fast GC runs inline on log extension");
+
+/* Clean inline when less than 1/2^shift of the blocks is free */
+static unsigned int gc_low_space_shift = 5;
+module_param(gc_low_space_shift, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(gc_low_space_shift,
+	"Fast GC runs inline below 1/2^shift free space");
+
+/* Thorough GC compacts this many log pages per atomic splice */
+unsigned int gc_chunk_pages = 16;
+module_param(gc_chunk_pages, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(gc_chunk_pages, "Log pages compacted per thorough GC step");
+
+/* and gives up the inode after this long */
+unsigned int gc_max_us = 500;
+module_param(gc_max_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(gc_max_us, "Time cap in us of one thorough GC invocation");
+
+/* Compact logs whose live bytes fill less than this percentage */
+unsigned int gc_thorough_util = 50;
+module_param(gc_thorough_util, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(gc_thorough_util,
+	"Log utilization in percent below which thorough GC runs");
+
+/* The scheduler runs this often */
+static unsigned int gc_sched_ms = 1000;
+module_param(gc_sched_ms, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(gc_sched_ms, "Interval in ms of the log GC scheduler");
+
+/* and keeps the logs with dead bytes under this share of the device */
+static unsigned int gc_log_budget_pct = 10;
+module_param(gc_log_budget_pct, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(gc_log_budget_pct,
+	"Percentage of the device the logs with dead entries may take");
+
+/* by queueing this many victims per pass */
+static unsigned int gc_sched_batch = 8;
+module_param(gc_sched_batch, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(gc_sched_batch,
+	"Inodes the log GC scheduler queues per pass, at most 16");
+
+/* Reserved inodes have no VFS inode, and are always cleaned inline */
+static inline bool nova_vfs_header(struct nova_inode_info_header *sih)
+{
+	return sih->ino == NOVA_ROOT_INO ||
+		sih->ino >= NOVA_NORMAL_INODE_START;
+}
+
+/*
+ * Candidates sit in NOVA_GC_BUCKETS lists by log utilization, emptiest
+ * first, and each list is in the order the inodes joined it, oldest first.
+ * The heads of the lists are thus the best victims, and the scheduler only
+ * has to look at those. -1 means not a candidate.
+ */
+static int nova_gc_bucket(struct nova_inode_info_header *sih)
+{
+	u64 bucket;
+
+	if (sih->dead_bytes == 0)
+		return -1;
+
+	bucket = div64_u64((u64)sih->live_bytes * NOVA_GC_BUCKETS,
+				sih->live_bytes + sih->dead_bytes);
+
+	return min_t(u64, bucket, NOVA_GC_BUCKETS - 1);
+}
+
+/*
+ * Called with i_mutex held, which keeps the bucket and the log pages and
+ * dead bytes accounted to the candidate totals stable. gc_lock is only
+ * taken when the inode changes bucket, or when cleaned is set: the inode
+ * was just cleaned and goes to the back of its bucket.
+ */
+void nova_update_gc_candidate(struct super_block *sb,
+	struct nova_inode_info_header *sih, bool cleaned)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_inode_info *si;
+	unsigned long pages, dead;
+	int bucket;
+
+	if (!nova_vfs_header(sih))
+		return;
+
+	si = container_of(sih, struct nova_inode_info, header);
+	bucket = nova_gc_bucket(sih);
+	pages = bucket < 0 ? 0 : sih->log_pages;
+	dead = sih->dead_bytes;
+	atomic_long_add(pages - si->gc_pages, &sbi->gc_acct_pages);
+	atomic_long_add(dead - si->gc_dead, &sbi->gc_acct_dead);
+	si->gc_pages = pages;
+	si->gc_dead = dead;
+
+	if (bucket == si->gc_bucket && (!cleaned || bucket < 0))
+		return;
+
+	spin_lock(&sbi->gc_lock);
+	if (bucket < 0) {
+		list_del_init(&si->gc_cand);
+		sbi->gc_acct_count--;
+	} else {
+		if (si->gc_bucket < 0) {
+			sbi->gc_acct_count++;
+			si->gc_stamp = jiffies;
+		}
+		if (cleaned)
+			si->gc_stamp = jiffies;
+		list_move_tail(&si->gc_cand, &sbi->gc_buckets[bucket]);
+	}
+	si->gc_bucket = bucket;
+	spin_unlock(&sbi->gc_lock);
+}
+
+/* len bytes of log entries of sih have just been invalidated */
+void nova_log_bytes_dead(struct super_block *sb,
+	struct nova_inode_info_header *sih, unsigned long len)
+{
+	sih->live_bytes -= min(len, sih->live_bytes);
+	sih->dead_bytes += len;
+	nova_update_gc_candidate(sb, sih, false);
+}
+
+bool nova_log_gc_critical(struct super_block *sb,
+	struct nova_inode_info_header *sih)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+
+	if (!sbi->log_cleaners || !nova_vfs_header(sih))
+		return true;
+
+	if (sih->log_pages >= gc_inline_pages)
+		return true;
+
+	return nova_count_free_blocks(sb) <
+			(sbi->num_blocks >> gc_low_space_shift);
+}
+
+/*
+ * Called with i_mutex held, after the log has been extended. Unless force
+ * is set, the inode is queued only past the dead entry thresholds.
+ * Returns true if the inode is on a cleaner queue.
+ */
+bool nova_queue_log_gc(struct super_block *sb,
+	struct nova_inode_info_header *sih, bool force)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_inode_info *si;
+	struct nova_log_cleaner *cleaner;
+
+	if (!sbi->log_cleaners || !nova_vfs_header(sih))
+		return false;
+
+	if (!force && sih->dead_bytes < gc_dead_bytes &&
+			(sih->dead_bytes == 0 ||
+			 sih->log_pages < gc_fill_pages))
+		return false;
+
+	si = container_of(sih, struct nova_inode_info, header);
+	if (!list_empty(&si->gc_list))
+		return true;
+
+	spin_lock(&sbi->gc_lock);
+	if (!sbi->log_cleaners) {
+		spin_unlock(&sbi->gc_lock);
+		return false;
+	}
+
+	if (!list_empty(&si->gc_list)) {
+		spin_unlock(&sbi->gc_lock);
+		return true;
+	}
+
+	cleaner = &sbi->log_cleaners[raw_smp_processor_id() % sbi->cpus];
+	list_add_tail(&si->gc_list, &cleaner->queue);
+	spin_unlock(&sbi->gc_lock);
+
+	NOVA_STATS_ADD(sb, gc_queued, 1);
+	wake_up_interruptible(&cleaner->wait);
+	return true;
+}
+
+/* Called on eviction, before the inode goes away */
+void nova_dequeue_log_gc(struct inode *inode)
+{
+	struct nova_sb_info *sbi = NOVA_SB(inode->i_sb);
+	struct nova_inode_info *si = NOVA_I(inode);
+
+	atomic_long_sub(si->gc_pages, &sbi->gc_acct_pages);
+	atomic_long_sub(si->gc_dead, &sbi->gc_acct_dead);
+	si->gc_pages = 0;
+	si->gc_dead = 0;
+
+	if (list_empty(&si->gc_list) && si->gc_bucket < 0)
+		return;
+
+	spin_lock(&sbi->gc_lock);
+	list_del_init(&si->gc_list);
+	if (si->gc_bucket >= 0) {
+		list_del_init(&si->gc_cand);
+		sbi->gc_acct_count--;
+		si->gc_bucket = -1;
+	}
+	spin_unlock(&sbi->gc_lock);
+}
+
+/*
+ * Take the next inode off the queue. Inodes being evicted fail igrab()
+ * and are simply dropped: their logs are about to be freed.
+ */
+static struct inode *nova_pop_log_gc(struct nova_sb_info *sbi,
+	struct nova_log_cleaner *cleaner)
+{
+	struct nova_inode_info *si;
+	struct inode *inode = NULL;
+
+	spin_lock(&sbi->gc_lock);
+	while (!inode && !list_empty(&cleaner->queue)) {
+		si = list_first_entry(&cleaner->queue, struct nova_inode_info,
+					gc_list);
+		list_del_init(&si->gc_list);
+		inode = igrab(&si->vfs_inode);
+	}
+	spin_unlock(&sbi->gc_lock);
+
+	return inode;
+}
+
+static void nova_clean_inode_log(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct nova_inode_info *si = NOVA_I(inode);
+	struct nova_inode_info_header *sih = &si->header;
+	struct nova_inode *pi;
+	timing_t clean_time;
+
+	if (sb->s_flags & MS_RDONLY)
+		return;
+
+	NOVA_START_TIMING(log_cleaner_t, clean_time);
+	/* Waits for a freeze, e.g. a snapshot, to finish */
+	sb_start_write(sb);
+	mutex_lock(&inode->i_mutex);
+
+	pi = nova_get_inode(sb, inode);
+	/* Unfinished compaction goes to the back of the queue */
+	if (pi && inode->i_nlink && sih->log_pages &&
+			nova_inode_log_gc(sb, pi, sih))
+		nova_queue_log_gc(sb, sih, true);
+	nova_update_gc_candidate(sb, sih, true);
+
+	mutex_unlock(&inode->i_mutex);
+	sb_end_write(sb);
+	NOVA_END_TIMING(sb, log_cleaner_t, clean_time);
+}
+
+/*
+ * LFS style cost-benefit: reclaiming dead bytes means reading the whole
+ * log and writing the live part again. Older garbage is less likely to be
+ * joined by more soon, so it is worth more.
+ */
+static u64 nova_gc_score(struct nova_inode_info *si)
+{
+	struct nova_inode_info_header *sih = &si->header;
+	u64 age = (jiffies - si->gc_stamp) / HZ;
+
+	return div64_u64((u64)sih->dead_bytes * (age + 1),
+			sih->dead_bytes + 2 * (u64)sih->live_bytes + 1);
+}
+
+/* Insert v into top[], sorted by descending score */
+static int nova_gc_rank(struct nova_gc_victim *top, int count, int max,
+	struct nova_gc_victim *v)
+{
+	int i;
+
+	if (count == max && v->score <= top[count - 1].score)
+		return count;
+
+	if (count < max)
+		count++;
+
+	for (i = count - 1; i > 0 && top[i - 1].score < v->score; i--)
+		top[i] = top[i - 1];
+	top[i] = *v;
+
+	return count;
+}
+
+/*
+ * One scheduler pass: rank the oldest candidates of each bucket, publish
+ * the worst offenders, and queue them if the logs are over budget. The
+ * candidate totals are kept up to date as the inodes change, so the pass
+ * costs the same however many candidates there are.
+ */
+static void nova_gc_schedule(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_inode_info *si;
+	struct nova_inode_info_header *sih;
+	struct nova_gc_victim top[NOVA_GC_TOP];
+	struct nova_gc_victim v;
+	struct inode *victims[NOVA_GC_TOP];
+	unsigned long pages;
+	int max = clamp_t(int, gc_sched_batch, 1, NOVA_GC_TOP);
+	int top_count = 0;
+	int nr = 0;
+	int i, b;
+
+	spin_lock(&sbi->gc_lock);
+	for (b = 0; b < NOVA_GC_BUCKETS; b++) {
+		i = 0;
+		list_for_each_entry(si, &sbi->gc_buckets[b], gc_cand) {
+			if (i++ == max)
+				break;
+
+			sih = &si->header;
+			v.ino = sih->ino;
+			v.log_pages = sih->log_pages;
+			v.live_bytes = sih->live_bytes;
+			v.dead_bytes = sih->dead_bytes;
+			v.score = nova_gc_score(si);
+			top_count = nova_gc_rank(top, top_count, max, &v);
+		}
+	}
+
+	pages = atomic_long_read(&sbi->gc_acct_pages);
+	sbi->gc_cand_count = sbi->gc_acct_count;
+	sbi->gc_cand_pages = pages;
+	sbi->gc_dead_total = atomic_long_read(&sbi->gc_acct_dead);
+	sbi->gc_budget_pages = sbi->num_blocks / 100 * gc_log_budget_pct;
+	sbi->gc_over_budget = pages > sbi->gc_budget_pages;
+	sbi->gc_top_count = top_count;
+	memcpy(sbi->gc_top, top, top_count * sizeof(struct nova_gc_victim));
+	spin_unlock(&sbi->gc_lock);
+
+	if (!sbi->gc_over_budget)
+		return;
+
+	for (i = 0; i < top_count; i++) {
+		victims[nr] = ilookup(sb, top[i].ino);
+		if (victims[nr])
+			nr++;
+	}
+
+	for (i = 0; i < nr; i++) {
+		nova_queue_log_gc(sb, &NOVA_I(victims[i])->header, true);
+		iput(victims[i]);
+	}
+}
+
+static int nova_log_cleaner_func(void *data)
+{
+	struct nova_log_cleaner *cleaner = data;
+	struct super_block *sb = cleaner->sb;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	unsigned long next_sched = jiffies;
+	struct inode *inode;
+
+	while (!kthread_should_stop()) {
+		/* The first cleaner also runs the scheduler */
+		if (cleaner->id == 0) {
+			if (time_after_eq(jiffies, next_sched)) {
+				nova_gc_schedule(sb);
+				next_sched = jiffies +
+					msecs_to_jiffies(gc_sched_ms);
+			}
+			wait_event_interruptible_timeout(cleaner->wait,
+				!list_empty(&cleaner->queue) ||
+				kthread_should_stop(),
+				max_t(long, next_sched - jiffies, 1));
+		} else {
+			wait_event_interruptible(cleaner->wait,
+				!list_empty(&cleaner->queue) ||
+				kthread_should_stop());
+		}
+
+		inode = nova_pop_log_gc(sbi, cleaner);
+		if (!inode)
+			continue;
+
+		nova_clean_inode_log(inode);
+		iput(inode);
+		cond_resched();
+	}
+
+	return 0;
+}
+
+int nova_start_log_cleaners(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_log_cleaner *cleaners;
+	struct nova_log_cleaner *cleaner;
+	int i;
+
+	cleaners = kcalloc(sbi->cpus, sizeof(struct nova_log_cleaner),
+				GFP_KERNEL);
+	if (!cleaners)
+		return -ENOMEM;
+
+	for (i = 0; i < sbi->cpus; i++) {
+		cleaner = &cleaners[i];
+		cleaner->sb = sb;
+		cleaner->id = i;
+		INIT_LIST_HEAD(&cleaner->queue);
+		init_waitqueue_head(&cleaner->wait);
+		cleaner->task = kthread_create(nova_log_cleaner_func,
+					cleaner, "nova_gc%d", i);
+		if (IS_ERR(cleaner->task)) {
+			nova_err(sb, "%s: create cleaner %d failed %ld\n",
+				__func__, i, PTR_ERR(cleaner->task));
+			cleaner->task = NULL;
+			sbi->log_cleaners = cleaners;
+			nova_stop_log_cleaners(sb);
+			return -ENOMEM;
+		}
+		/* A volume may have more CPUs than this machine has online */
+		if (i < nr_cpu_ids && cpu_online(i))
+			kthread_bind(cleaner->task, i);
+	}
+
+	for (i = 0; i < sbi->cpus; i++)
+		wake_up_process(cleaners[i].task);
+
+	sbi->log_cleaners = cleaners;
+	return 0;
+}
+
+/*
+ * Must run before the VFS evicts the inodes at unmount: a cleaner
+ * holds a reference to the inode it works on.
+ */
+void nova_stop_log_cleaners(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_log_cleaner *cleaners = sbi->log_cleaners;
+	struct nova_inode_info *si;
+	int i;
+
+	if (!cleaners)
+		return;
+
+	for (i = 0; i < sbi->cpus; i++) {
+		if (cleaners[i].task)
+			kthread_stop(cleaners[i].task);
+	}
+
+	/* From now on logs are cleaned inline */
+	spin_lock(&sbi->gc_lock);
+	sbi->log_cleaners = NULL;
+	for (i = 0; i < sbi->cpus; i++) {
+		while (!list_empty(&cleaners[i].queue)) {
+			si = list_first_entry(&cleaners[i].queue,
+					struct nova_inode_info, gc_list);
+			list_del_init(&si->gc_list);
+		}
+	}
+	spin_unlock(&sbi->gc_lock);
+
+	kfree(cleaners);
+}
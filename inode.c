@@ -24,6 +24,7 @@
 #include <linux/types.h>
 #include <linux/ratelimit.h>
 #include "nova.h"
+#include "nova_trace.h"
 
 unsigned int blk_type_to_shift[NOVA_BLOCK_TYPE_MAX] = {12, 21, 30};
 uint32_t blk_type_to_size[NOVA_BLOCK_TYPE_MAX] = {0x1000, 0x200000, 0x40000000};
@@ -104,23 +105,447 @@ int nova_init_inode_table(struct super_block *sb)
 	return 0;
 }
 
+/*
+ * Each CPU's inode table is a chain of 2M superpages linked through their
+ * last 8 bytes. A DRAM index of the chain, filled on first use and
+ * extended as the table grows, turns an inode lookup into an array
+ * access. Readers go through RCU; growth happens under table_index_mutex.
+ */
+#define NOVA_TABLE_INDEX_MIN	16
+
+static struct nova_table_index *nova_grow_table_index(
+	struct inode_map *inode_map, struct nova_table_index *old)
+{
+	struct nova_table_index *index;
+	unsigned long cap;
+
+	cap = old ? old->cap * 2 : NOVA_TABLE_INDEX_MIN;
+	index = kmalloc(sizeof(struct nova_table_index) + cap * sizeof(u64),
+				GFP_NOFS);
+	if (!index)
+		return NULL;
+
+	index->cap = cap;
+	index->num = 0;
+	if (old) {
+		memcpy(index->pages, old->pages, old->num * sizeof(u64));
+		index->num = old->num;
+	}
+
+	rcu_assign_pointer(inode_map->table_index, index);
+	if (old)
+		kfree_rcu(old, rcu);
+
+	return index;
+}
+
+/* Index superpages up to superpage_count, extending the chain if allowed */
+static int nova_extend_table_index(struct super_block *sb,
+	struct inode_map *inode_map, int cpuid, unsigned int superpage_count,
+	int extendable, u64 *page)
+{
+	struct nova_inode *pi;
+	struct nova_table_index *index;
+	struct inode_table *inode_table;
+	unsigned long blocknr;
+	unsigned long curr_addr;
+	int allocated;
+	u64 curr;
+
+	pi = nova_get_inode_by_ino(sb, NOVA_INODETABLE_INO);
+	inode_table = nova_get_inode_table(sb, cpuid);
+	index = rcu_dereference_protected(inode_map->table_index,
+			lockdep_is_held(&inode_map->table_index_mutex));
+
+	while (!index || index->num <= superpage_count) {
+		if (!index || index->num == index->cap) {
+			index = nova_grow_table_index(inode_map, index);
+			if (!index)
+				return -ENOMEM;
+		}
+
+		if (index->num == 0) {
+			curr = inode_table->log_head;
+			if (curr == 0)
+				return -EINVAL;
+		} else {
+			curr_addr = (unsigned long)nova_get_block(sb,
+					index->pages[index->num - 1]);
+			/* Next page pointer in the last 8 bytes */
+			curr_addr += 2097152 - 8;
+			curr = *(u64 *)(curr_addr);
+
+			if (curr == 0) {
+				if (extendable == 0)
+					return -EINVAL;
+
+				allocated = nova_new_log_blocks(sb, pi,
+							&blocknr, 1, 1);
+
+				if (allocated != 1)
+					return allocated;
+
+				curr = nova_get_block_off(sb, blocknr,
+							NOVA_BLOCK_TYPE_2M);
+				*(u64 *)(curr_addr) = curr;
+				nova_flush_buffer((void *)curr_addr,
+							NOVA_INODE_SIZE, 1);
+			}
+		}
+
+		index->pages[index->num] = curr;
+		/* Publish the offset before the count that covers it */
+		smp_wmb();
+		index->num++;
+	}
+
+	*page = index->pages[superpage_count];
+	return 0;
+}
+
+void nova_free_inode_table_index(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct inode_map *inode_map;
+	int i;
+
+	for (i = 0; i < sbi->cpus; i++) {
+		inode_map = &sbi->inode_maps[i];
+		kfree(rcu_dereference_protected(inode_map->table_index, 1));
+		RCU_INIT_POINTER(inode_map->table_index, NULL);
+	}
+}
+
+/* Returns the summary page at block if it is sane, NULL otherwise */
+struct nova_summary_page *nova_get_summary_page(struct super_block *sb,
+	u64 block, unsigned int index)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_summary_page *page;
+
+	if (block == 0 || (block & (PAGE_SIZE - 1)) ||
+			block + PAGE_SIZE > sbi->initsize)
+		return NULL;
+
+	page = (struct nova_summary_page *)nova_get_block(sb, block);
+	if (le32_to_cpu(page->magic) != NOVA_SUMMARY_MAGIC ||
+			le32_to_cpu(page->index) != index)
+		return NULL;
+
+	return page;
+}
+
+static int nova_add_summary_page(struct inode_map *inode_map, u64 block)
+{
+	unsigned int cap;
+	u64 *pages;
+
+	if (inode_map->summary_num == inode_map->summary_cap) {
+		cap = inode_map->summary_cap ? inode_map->summary_cap * 2 : 4;
+		pages = krealloc(inode_map->summary_pages, cap * sizeof(u64),
+					GFP_NOFS);
+		if (!pages)
+			return -ENOMEM;
+		inode_map->summary_pages = pages;
+		inode_map->summary_cap = cap;
+	}
+
+	inode_map->summary_pages[inode_map->summary_num++] = block;
+	return 0;
+}
+
+/* A zeroed summary page, not fenced yet. Returns 0 on failure */
+static u64 nova_new_summary_page(struct super_block *sb, unsigned int index)
+{
+	struct nova_summary_page *page;
+	struct nova_inode fake_pi;
+	unsigned long blocknr = 0;
+	u64 block;
+	int allocated;
+
+	fake_pi.nova_ino = NOVA_INODETABLE_INO;
+	fake_pi.i_blk_type = NOVA_BLOCK_TYPE_4K;
+	allocated = nova_new_log_blocks(sb, &fake_pi, &blocknr, 1, 1);
+	if (allocated != 1 || blocknr == 0)
+		return 0;
+
+	block = nova_get_block_off(sb, blocknr, NOVA_BLOCK_TYPE_4K);
+	page = (struct nova_summary_page *)nova_get_block(sb, block);
+	page->magic = cpu_to_le32(NOVA_SUMMARY_MAGIC);
+	page->index = cpu_to_le32(index);
+	nova_flush_buffer(&page->magic, CACHELINE_SIZE, 0);
+	return block;
+}
+
+static void nova_free_summary_page(struct super_block *sb, u64 block)
+{
+	struct nova_inode fake_pi;
+
+	fake_pi.nova_ino = NOVA_INODETABLE_INO;
+	fake_pi.i_blk_type = NOVA_BLOCK_TYPE_4K;
+	nova_free_log_blocks(sb, &fake_pi,
+		nova_get_blocknr(sb, block, NOVA_BLOCK_TYPE_4K), 1);
+}
+
+/* Free the summary pages in DRAM, from the first one on */
+static void nova_free_summary_pages(struct super_block *sb,
+	struct inode_map *inode_map, unsigned int first)
+{
+	unsigned int i;
+
+	for (i = first; i < inode_map->summary_num; i++)
+		nova_free_summary_page(sb, inode_map->summary_pages[i]);
+	inode_map->summary_num = first;
+}
+
+/* Go without a summary: recovery scans this table in full again */
+static void nova_drop_table_summary(struct super_block *sb, int cpuid)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct inode_map *inode_map = &sbi->inode_maps[cpuid];
+	struct inode_table *inode_table = nova_get_inode_table(sb, cpuid);
+
+	if (inode_table->summary_head) {
+		inode_table->summary_head = 0;
+		nova_flush_buffer(inode_table, CACHELINE_SIZE, 1);
+		nova_info("Inode table %d goes without occupancy summary\n",
+				cpuid);
+	}
+
+	nova_free_summary_pages(sb, inode_map, 0);
+}
+
+/*
+ * Set the summary bit of the chunk holding internal_ino. Flushed, but the
+ * caller fences before the inode can be made valid.
+ */
+static int nova_mark_table_chunk(struct super_block *sb, int cpuid,
+	unsigned long internal_ino, unsigned int num_inodes_bits)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct inode_map *inode_map = &sbi->inode_maps[cpuid];
+	struct nova_summary_page *page, *prev;
+	unsigned long superpage, chunk;
+	unsigned int index;
+	__le64 *word;
+	u64 block;
+
+	superpage = internal_ino >> num_inodes_bits;
+	chunk = (internal_ino & ((1UL << num_inodes_bits) - 1)) /
+					NOVA_CHUNK_INODES;
+	index = superpage / NOVA_SUMMARIES_PER_PAGE;
+
+	/* No summary to keep up to date */
+	if (inode_map->summary_num == 0)
+		return 0;
+
+	while (inode_map->summary_num <= index) {
+		block = nova_new_summary_page(sb, inode_map->summary_num);
+		if (block == 0)
+			return -ENOSPC;
+
+		if (nova_add_summary_page(inode_map, block)) {
+			nova_free_summary_page(sb, block);
+			return -ENOMEM;
+		}
+
+		/* Page contents before the link */
+		PERSISTENT_BARRIER();
+		prev = (struct nova_summary_page *)nova_get_block(sb,
+			inode_map->summary_pages[inode_map->summary_num - 2]);
+		prev->next_page = cpu_to_le64(block);
+		nova_flush_buffer(&prev->next_page, sizeof(u64), 0);
+	}
+
+	page = (struct nova_summary_page *)nova_get_block(sb,
+					inode_map->summary_pages[index]);
+	word = &page->summary[superpage % NOVA_SUMMARIES_PER_PAGE].bits[
+					chunk / 64];
+	if (!(le64_to_cpu(*word) & (1ULL << (chunk % 64)))) {
+		*word |= cpu_to_le64(1ULL << (chunk % 64));
+		nova_flush_buffer(word, sizeof(u64), 0);
+	}
+
+	return 0;
+}
+
+/*
+ * Write a new summary of a table from its inuse list, then switch to it.
+ * Called with inode_table_mutex held, the old pages are in DRAM.
+ */
+static int nova_build_table_summary(struct super_block *sb, int cpuid,
+	unsigned int num_inodes_bits)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct inode_map *inode_map = &sbi->inode_maps[cpuid];
+	struct inode_table *inode_table = nova_get_inode_table(sb, cpuid);
+	struct nova_summary_page *page;
+	struct nova_range_node *range;
+	struct rb_node *temp;
+	unsigned long num_superpages = 0, last = 0;
+	unsigned long ino, superpage, chunk;
+	unsigned int old_num = inode_map->summary_num;
+	unsigned int num, i;
+	__le64 *bits;
+	u64 curr, block;
+
+	for (curr = inode_table->log_head; curr;
+			curr = *(u64 *)((char *)nova_get_block(sb, curr) +
+						2097152 - 8))
+		num_superpages++;
+
+	temp = rb_last(&inode_map->inode_inuse_tree);
+	if (temp) {
+		range = container_of(temp, struct nova_range_node, node);
+		last = (range->range_high >> num_inodes_bits) + 1;
+	}
+	num_superpages = max(num_superpages, last);
+	num = DIV_ROUND_UP(num_superpages, NOVA_SUMMARIES_PER_PAGE);
+	if (num == 0)
+		num = 1;
+
+	/* New pages go after the old ones in DRAM until the switch */
+	for (i = 0; i < num; i++) {
+		block = nova_new_summary_page(sb, i);
+		if (block == 0 || nova_add_summary_page(inode_map, block)) {
+			if (block)
+				nova_free_summary_page(sb, block);
+			nova_free_summary_pages(sb, inode_map, old_num);
+			return -ENOSPC;
+		}
+		if (i) {
+			page = (struct nova_summary_page *)nova_get_block(sb,
+				inode_map->summary_pages[old_num + i - 1]);
+			page->next_page = cpu_to_le64(block);
+		}
+	}
+
+	for (temp = rb_first(&inode_map->inode_inuse_tree); temp;
+			temp = rb_next(temp)) {
+		range = container_of(temp, struct nova_range_node, node);
+		for (ino = range->range_low; ino <= range->range_high;
+				ino += NOVA_CHUNK_INODES) {
+			superpage = ino >> num_inodes_bits;
+			chunk = (ino & ((1UL << num_inodes_bits) - 1)) /
+						NOVA_CHUNK_INODES;
+			page = (struct nova_summary_page *)nova_get_block(sb,
+				inode_map->summary_pages[old_num +
+				superpage / NOVA_SUMMARIES_PER_PAGE]);
+			bits = page->summary[superpage %
+					NOVA_SUMMARIES_PER_PAGE].bits;
+			bits[chunk / 64] |= cpu_to_le64(1ULL << (chunk % 64));
+			/* The next chunk of the range starts aligned */
+			ino &= ~((unsigned long)NOVA_CHUNK_INODES - 1);
+		}
+	}
+
+	for (i = 0; i < num; i++)
+		nova_flush_buffer(nova_get_block(sb,
+			inode_map->summary_pages[old_num + i]), PAGE_SIZE, 0);
+	PERSISTENT_BARRIER();
+
+	inode_table->summary_head = inode_map->summary_pages[old_num];
+	nova_flush_buffer(inode_table, CACHELINE_SIZE, 1);
+
+	/* Retire the old pages, keep the new ones first */
+	for (i = 0; i < old_num; i++)
+		nova_free_summary_page(sb, inode_map->summary_pages[i]);
+	memmove(inode_map->summary_pages,
+		inode_map->summary_pages + old_num, num * sizeof(u64));
+	inode_map->summary_num = num;
+	return 0;
+}
+
+/* Load the summary chain of a table into DRAM, 0 if it is whole */
+static int nova_load_table_summary(struct super_block *sb, int cpuid)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct inode_map *inode_map = &sbi->inode_maps[cpuid];
+	struct inode_table *inode_table = nova_get_inode_table(sb, cpuid);
+	struct nova_summary_page *page;
+	unsigned int index = 0;
+	u64 block;
+
+	block = inode_table->summary_head;
+	while (block) {
+		page = nova_get_summary_page(sb, block, index);
+		if (!page)
+			return -EINVAL;
+		if (nova_add_summary_page(inode_map, block))
+			return -ENOMEM;
+		block = le64_to_cpu(page->next_page);
+		index++;
+	}
+
+	return index ? 0 : -ENOENT;
+}
+
+/*
+ * Load the occupancy summaries when the volume goes writable, at mount or
+ * on a remount read-write. Write them from the inuse lists if they are
+ * missing, or stale after a failure recovery. A table left without a
+ * summary in DRAM must not have one on media either, or recovery would
+ * skip the chunks of the inodes created since.
+ */
+void nova_init_table_summaries(struct super_block *sb, int rebuild)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct inode_map *inode_map;
+	struct nova_inode *pi;
+	unsigned int num_inodes_bits;
+	int i;
+
+	pi = nova_get_inode_by_ino(sb, NOVA_INODETABLE_INO);
+	if (pi->i_blk_type != NOVA_BLOCK_TYPE_2M || !nova_has_rebuild_meta(sb))
+		return;
+
+	num_inodes_bits = blk_type_to_shift[pi->i_blk_type] - NOVA_INODE_BITS;
+	for (i = 0; i < sbi->cpus; i++) {
+		inode_map = &sbi->inode_maps[i];
+		mutex_lock(&inode_map->inode_table_mutex);
+		if (inode_map->summary_num) {
+			/* Kept up to date since an earlier read-write mount */
+		} else if (sbi->recovery_state == NOVA_RECOVERY_ABORTED) {
+			/* The inuse lists are incomplete */
+			nova_drop_table_summary(sb, i);
+		} else if (nova_load_table_summary(sb, i) || rebuild) {
+			if (nova_build_table_summary(sb, i, num_inodes_bits))
+				nova_drop_table_summary(sb, i);
+		}
+		mutex_unlock(&inode_map->inode_table_mutex);
+	}
+}
+
+void nova_free_table_summaries(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct inode_map *inode_map;
+	int i;
+
+	for (i = 0; i < sbi->cpus; i++) {
+		inode_map = &sbi->inode_maps[i];
+		kfree(inode_map->summary_pages);
+		inode_map->summary_pages = NULL;
+		inode_map->summary_num = 0;
+		inode_map->summary_cap = 0;
+	}
+}
+
 int nova_get_inode_address(struct super_block *sb, u64 ino,
 	u64 *pi_addr, int extendable)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
 	struct nova_inode *pi;
-	struct inode_table *inode_table;
+	struct nova_table_index *index;
+	struct inode_map *inode_map;
 	unsigned int data_bits;
 	unsigned int num_inodes_bits;
-	u64 curr;
+	u64 curr = 0;
 	unsigned int superpage_count;
 	u64 internal_ino;
 	int cpuid;
-	unsigned int index;
-	unsigned int i = 0;
-	unsigned long blocknr;
-	unsigned long curr_addr;
-	int allocated;
+	unsigned int index_in_page;
+	int ret;
 
 	pi = nova_get_inode_by_ino(sb, NOVA_INODETABLE_INO);
 	data_bits = blk_type_to_shift[pi->i_blk_type];
@@ -128,43 +553,29 @@ int nova_get_inode_address(struct super_block *sb, u64 ino,
 
 	cpuid = ino % sbi->cpus;
 	internal_ino = ino / sbi->cpus;
+	inode_map = &sbi->inode_maps[cpuid];
 
-	inode_table = nova_get_inode_table(sb, cpuid);
 	superpage_count = internal_ino >> num_inodes_bits;
-	index = internal_ino & ((1 << num_inodes_bits) - 1);
-
-	curr = inode_table->log_head;
-	if (curr == 0)
-		return -EINVAL;
-
-	for (i = 0; i < superpage_count; i++) {
-		if (curr == 0)
-			return -EINVAL;
-
-		curr_addr = (unsigned long)nova_get_block(sb, curr);
-		/* Next page pointer in the last 8 bytes of the superpage */
-		curr_addr += 2097152 - 8;
-		curr = *(u64 *)(curr_addr);
-
-		if (curr == 0) {
-			if (extendable == 0)
-				return -EINVAL;
-
-			allocated = nova_new_log_blocks(sb, pi, &blocknr,
-							1, 1);
-
-			if (allocated != 1)
-				return allocated;
-
-			curr = nova_get_block_off(sb, blocknr,
-						NOVA_BLOCK_TYPE_2M);
-			*(u64 *)(curr_addr) = curr;
-			nova_flush_buffer((void *)curr_addr,
-						NOVA_INODE_SIZE, 1);
-		}
+	index_in_page = internal_ino & ((1 << num_inodes_bits) - 1);
+
+	rcu_read_lock();
+	index = rcu_dereference(inode_map->table_index);
+	if (index && superpage_count < READ_ONCE(index->num)) {
+		smp_rmb();
+		curr = index->pages[superpage_count];
+	}
+	rcu_read_unlock();
+
+	if (curr == 0) {
+		mutex_lock(&inode_map->table_index_mutex);
+		ret = nova_extend_table_index(sb, inode_map, cpuid,
+					superpage_count, extendable, &curr);
+		mutex_unlock(&inode_map->table_index_mutex);
+		if (ret)
+			return ret;
 	}
 
-	*pi_addr = curr + index * NOVA_INODE_SIZE;
+	*pi_addr = curr + index_in_page * NOVA_INODE_SIZE;
 
 	return 0;
 }
@@ -188,6 +599,8 @@ static inline int nova_free_contiguous_data_blocks(struct super_block *sb,
 	}
 
 	entry->invalid_pages += num_pages;
+	if (entry->invalid_pages == entry->num_pages)
+		nova_log_bytes_dead(sb, sih, nova_write_entry_len(sb));
 	nvmm = get_nvmm(sb, sih, entry, pgoff);
 
 	if (*start_blocknr == 0) {
@@ -198,7 +611,7 @@ static inline int nova_free_contiguous_data_blocks(struct super_block *sb,
 			(*num_free) += num_pages;
 		} else {
 			/* A new start */
-			nova_free_data_blocks(sb, pi, *start_blocknr,
+			nova_put_data_blocks(sb, pi, *start_blocknr,
 						*num_free);
 			freed = *num_free;
 			*start_blocknr = nvmm;
@@ -308,6 +721,7 @@ static int nova_zero_cache_tree(struct super_block *sb,
 		if (block) {
 			addr = nova_get_block(sb, block);
 			memset(addr, 0, PAGE_SIZE);
+			NOVA_WA_ADD(sb, wa_zero, PAGE_SIZE);
 		}
 	}
 
@@ -360,11 +774,11 @@ int nova_delete_file_tree(struct super_block *sb,
 	}
 
 	if (free_blocknr) {
-		nova_free_data_blocks(sb, pi, free_blocknr, num_free);
+		nova_put_data_blocks(sb, pi, free_blocknr, num_free);
 		freed += num_free;
 	}
 
-	NOVA_END_TIMING(delete_file_tree_t, delete_time);
+	NOVA_END_TIMING(sb, delete_file_tree_t, delete_time);
 	nova_dbgv("Inode %llu: delete file tree from pgoff %lu to %lu, "
 			"%d blocks freed\n",
 			pi->nova_ino, start_blocknr, last_blocknr, freed);
@@ -521,7 +935,11 @@ int nova_assign_write_entry(struct super_block *sb,
 			old_nvmm = get_nvmm(sb, sih, old_entry, curr_pgoff);
 			if (free) {
 				old_entry->invalid_pages++;
-				nova_free_data_blocks(sb, pi, old_nvmm, 1);
+				if (old_entry->invalid_pages ==
+						old_entry->num_pages)
+					nova_log_bytes_dead(sb, sih,
+						nova_write_entry_len(sb));
+				nova_put_data_blocks(sb, pi, old_nvmm, 1);
 				pi->i_blocks--;
 			}
 			radix_tree_replace_slot(pentry, entry);
@@ -535,7 +953,7 @@ int nova_assign_write_entry(struct super_block *sb,
 	}
 
 out:
-	NOVA_END_TIMING(assign_t, assign_time);
+	NOVA_END_TIMING(sb, assign_t, assign_time);
 
 	return ret;
 }
@@ -602,7 +1020,8 @@ bad_inode:
 	return ret;
 }
 
-static void nova_get_inode_flags(struct inode *inode, struct nova_inode *pi)
+/* On-media form of the inode flags, as stored in pi->i_flags */
+unsigned int nova_persistent_flags(struct inode *inode, struct nova_inode *pi)
 {
 	unsigned int flags = inode->i_flags;
 	unsigned int nova_flags = le32_to_cpu(pi->i_flags);
@@ -620,7 +1039,12 @@ static void nova_get_inode_flags(struct inode *inode, struct nova_inode *pi)
 	if (flags & S_DIRSYNC)
 		nova_flags |= FS_DIRSYNC_FL;
 
-	pi->i_flags = cpu_to_le32(nova_flags);
+	return nova_flags;
+}
+
+static void nova_get_inode_flags(struct inode *inode, struct nova_inode *pi)
+{
+	pi->i_flags = cpu_to_le32(nova_persistent_flags(inode, pi));
 }
 
 static void nova_update_inode(struct inode *inode, struct nova_inode *pi)
@@ -816,7 +1240,7 @@ static int nova_free_inode(struct inode *inode,
 
 	err = nova_free_inuse_inode(sb, pi->nova_ino);
 
-	NOVA_END_TIMING(free_inode_t, free_time);
+	NOVA_END_TIMING(sb, free_inode_t, free_time);
 	return err;
 }
 
@@ -954,15 +1378,187 @@ void nova_evict_inode(struct inode *inode)
 		inode->i_size = 0;
 	}
 out:
-	if (destroy == 0)
+	if (destroy == 0) {
+		if (S_ISREG(sih->i_mode) && !(sb->s_flags & MS_RDONLY))
+			nova_save_index_ckpt(sb, pi, sih);
 		nova_free_dram_resource(sb, sih);
+	}
 
 	/* TODO: Since we don't use page-cache, do we really need the following
 	 * call? */
 	truncate_inode_pages(&inode->i_data, 0);
 
+	/* Freeing the blocks above may have made it a GC candidate */
+	nova_dequeue_log_gc(inode);
 	clear_inode(inode);
-	NOVA_END_TIMING(evict_inode_t, evict_time);
+	NOVA_END_TIMING(sb, evict_inode_t, evict_time);
+}
+
+/*
+ * New inode numbers come from the inode map of the running CPU. Each map
+ * keeps a small cache of numbers reserved in its inuse tree, with their
+ * inode addresses already resolved, so most creates only take the cache
+ * spinlock. Refills take inode_table_mutex once per NOVA_INO_BATCH
+ * numbers, and when a refill gets past half of a table superpage the
+ * next superpage is linked from a workqueue.
+ */
+static void nova_grow_inode_table(struct work_struct *work)
+{
+	struct inode_map *inode_map = container_of(work, struct inode_map,
+							grow_work);
+	struct super_block *sb = inode_map->sb;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_inode *pi;
+	unsigned int num_inodes_bits;
+	u64 internal_ino;
+	u64 pi_addr;
+
+	pi = nova_get_inode_by_ino(sb, NOVA_INODETABLE_INO);
+	num_inodes_bits = blk_type_to_shift[pi->i_blk_type] - NOVA_INODE_BITS;
+	internal_ino = (u64)READ_ONCE(inode_map->grow_superpage) <<
+				num_inodes_bits;
+
+	nova_get_inode_address(sb, internal_ino * sbi->cpus +
+				inode_map->cpuid, &pi_addr, 1);
+}
+
+void nova_init_ino_caches(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct inode_map *inode_map;
+	int i;
+
+	for (i = 0; i < sbi->cpus; i++) {
+		inode_map = &sbi->inode_maps[i];
+		spin_lock_init(&inode_map->ino_cache_lock);
+		inode_map->ino_head = 0;
+		inode_map->ino_count = 0;
+		inode_map->sb = sb;
+		inode_map->cpuid = i;
+		INIT_WORK(&inode_map->grow_work, nova_grow_inode_table);
+	}
+}
+
+void nova_drain_ino_caches(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct inode_map *inode_map;
+	int i;
+
+	for (i = 0; i < sbi->cpus; i++) {
+		inode_map = &sbi->inode_maps[i];
+		cancel_work_sync(&inode_map->grow_work);
+
+		while (inode_map->ino_count) {
+			nova_free_inuse_inode(sb,
+				inode_map->cached_ino[inode_map->ino_head]);
+			inode_map->ino_head++;
+			inode_map->ino_count--;
+		}
+	}
+}
+
+static bool nova_get_cached_ino(struct inode_map *inode_map,
+	unsigned long *ino, u64 *pi_addr)
+{
+	bool found = false;
+
+	spin_lock(&inode_map->ino_cache_lock);
+	if (inode_map->ino_count) {
+		*ino = inode_map->cached_ino[inode_map->ino_head];
+		*pi_addr = inode_map->cached_addr[inode_map->ino_head];
+		inode_map->ino_head++;
+		inode_map->ino_count--;
+		found = true;
+	}
+	spin_unlock(&inode_map->ino_cache_lock);
+
+	return found;
+}
+
+static int nova_refill_ino_cache(struct super_block *sb, int cpuid)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct inode_map *inode_map = &sbi->inode_maps[cpuid];
+	struct nova_inode *pi;
+	unsigned long inos[NOVA_INO_BATCH];
+	u64 addrs[NOVA_INO_BATCH];
+	unsigned long free_ino = 0;
+	unsigned long orphan = 0;
+	unsigned int num_inodes_bits;
+	unsigned long internal_ino;
+	unsigned long half;
+	int count = 0;
+	int ret = 0;
+	int i;
+
+	mutex_lock(&inode_map->inode_table_mutex);
+
+	/* Another CPU sharing this map may have refilled it */
+	if (READ_ONCE(inode_map->ino_count))
+		goto out;
+
+	while (count < NOVA_INO_BATCH) {
+		ret = nova_alloc_unused_inode(sb, cpuid, &free_ino);
+		if (ret) {
+			nova_dbg("%s: alloc inode number failed %d\n",
+					__func__, ret);
+			break;
+		}
+
+		ret = nova_get_inode_address(sb, free_ino, &addrs[count], 1);
+		if (ret) {
+			nova_dbg("%s: get inode address failed %d\n",
+					__func__, ret);
+			orphan = free_ino;
+			break;
+		}
+
+		inos[count++] = free_ino;
+	}
+
+	pi = nova_get_inode_by_ino(sb, NOVA_INODETABLE_INO);
+	num_inodes_bits = blk_type_to_shift[pi->i_blk_type] - NOVA_INODE_BITS;
+
+	/* Summary bits are durable before any of these inodes is valid */
+	if (count) {
+		for (i = 0; i < count; i++) {
+			if (nova_mark_table_chunk(sb, cpuid,
+					inos[i] / sbi->cpus, num_inodes_bits)) {
+				nova_drop_table_summary(sb, cpuid);
+				break;
+			}
+		}
+		PERSISTENT_BARRIER();
+	}
+
+	spin_lock(&inode_map->ino_cache_lock);
+	for (i = 0; i < count; i++) {
+		inode_map->cached_ino[i] = inos[i];
+		inode_map->cached_addr[i] = addrs[i];
+	}
+	inode_map->ino_head = 0;
+	inode_map->ino_count = count;
+	spin_unlock(&inode_map->ino_cache_lock);
+
+	if (count) {
+		internal_ino = inos[count - 1] / sbi->cpus;
+		half = 1UL << (num_inodes_bits - 1);
+		if (internal_ino & half) {
+			WRITE_ONCE(inode_map->grow_superpage,
+				(internal_ino >> num_inodes_bits) + 1);
+			schedule_work(&inode_map->grow_work);
+		}
+	}
+
+out:
+	mutex_unlock(&inode_map->inode_table_mutex);
+
+	/* A number was reserved but has no inode slot */
+	if (orphan)
+		nova_free_inuse_inode(sb, orphan);
+
+	return count ? 0 : ret;
 }
 
 /* Returns 0 on failure */
@@ -971,37 +1567,26 @@ u64 nova_new_nova_inode(struct super_block *sb, u64 *pi_addr)
 	struct nova_sb_info *sbi = NOVA_SB(sb);
 	struct inode_map *inode_map;
 	unsigned long free_ino = 0;
-	int map_id;
+	int cpuid;
 	u64 ino = 0;
 	int ret;
 	timing_t new_inode_time;
 
 	NOVA_START_TIMING(new_nova_inode_t, new_inode_time);
-	map_id = sbi->map_id;
-	sbi->map_id = (sbi->map_id + 1) % sbi->cpus;
-
-	inode_map = &sbi->inode_maps[map_id];
-
-	mutex_lock(&inode_map->inode_table_mutex);
-	ret = nova_alloc_unused_inode(sb, map_id, &free_ino);
-	if (ret) {
-		nova_dbg("%s: alloc inode number failed %d\n", __func__, ret);
-		mutex_unlock(&inode_map->inode_table_mutex);
-		return 0;
-	}
+	cpuid = nova_get_cpuid(sb);
+	inode_map = &sbi->inode_maps[cpuid];
 
-	ret = nova_get_inode_address(sb, free_ino, pi_addr, 1);
-	if (ret) {
-		nova_dbg("%s: get inode address failed %d\n", __func__, ret);
-		mutex_unlock(&inode_map->inode_table_mutex);
-		return 0;
+	while (!nova_get_cached_ino(inode_map, &free_ino, pi_addr)) {
+		ret = nova_refill_ino_cache(sb, cpuid);
+		if (ret) {
+			NOVA_END_TIMING(sb, new_nova_inode_t, new_inode_time);
+			return 0;
+		}
 	}
 
-	mutex_unlock(&inode_map->inode_table_mutex);
-
 	ino = free_ino;
 
-	NOVA_END_TIMING(new_nova_inode_t, new_inode_time);
+	NOVA_END_TIMING(sb, new_nova_inode_t, new_inode_time);
 	return ino;
 }
 
@@ -1082,6 +1667,7 @@ struct inode *nova_new_vfs_inode(enum nova_new_inode_type type,
 	pi->i_flags = nova_mask_flags(mode, diri->i_flags);
 	pi->log_head = 0;
 	pi->log_tail = 0;
+	pi->i_index_ckpt = 0;
 	pi->nova_ino = ino;
 	nova_memlock_inode(sb, pi);
 
@@ -1102,13 +1688,13 @@ struct inode *nova_new_vfs_inode(enum nova_new_inode_type type,
 	}
 
 	nova_flush_buffer(&pi, NOVA_INODE_SIZE, 0);
-	NOVA_END_TIMING(new_vfs_inode_t, new_inode_time);
+	NOVA_END_TIMING(sb, new_vfs_inode_t, new_inode_time);
 	return inode;
 fail1:
 	make_bad_inode(inode);
 	iput(inode);
 fail2:
-	NOVA_END_TIMING(new_vfs_inode_t, new_inode_time);
+	NOVA_END_TIMING(sb, new_vfs_inode_t, new_inode_time);
 	return ERR_PTR(errval);
 }
 
@@ -1167,6 +1753,7 @@ static void nova_clear_last_page_tail(struct super_block *sb,
 	nvmm_addr = (char *)nova_get_block(sb, nvmm);
 	memset(nvmm_addr + offset, 0, length);
 	nova_flush_buffer(nvmm_addr + offset, length, 0);
+	NOVA_WA_ADD(sb, wa_zero, length);
 
 	/* Clear mmap page */
 	if (sih->mmap_pages && pgoff <= sih->high_dirty &&
@@ -1176,6 +1763,7 @@ static void nova_clear_last_page_tail(struct super_block *sb,
 		if (nvmm) {
 			nvmm_addr = nova_get_block(sb, nvmm);
 			memset(nvmm_addr + offset, 0, length);
+			NOVA_WA_ADD(sb, wa_zero, length);
 		}
 	}
 }
@@ -1295,6 +1883,48 @@ out:
 	/* Do not flush now */
 }
 
+static bool nova_setattr_is_size(struct super_block *sb, u64 curr_p)
+{
+	struct nova_setattr_logentry *entry;
+
+	entry = (struct nova_setattr_logentry *)nova_get_block(sb, curr_p);
+	return entry->attr & ATTR_SIZE;
+}
+
+/*
+ * Bytes of the last setattr and link change entries, which stay live
+ * because the inode attributes are rebuilt from them.
+ */
+unsigned long nova_log_bytes_pinned(struct super_block *sb,
+	struct nova_inode_info_header *sih)
+{
+	unsigned long pinned = 0;
+
+	if (sih->last_setattr && !nova_setattr_is_size(sb, sih->last_setattr))
+		pinned += nova_log_entry_len(sb,
+				sizeof(struct nova_setattr_logentry));
+	if (sih->last_link_change)
+		pinned += nova_log_entry_len(sb,
+				sizeof(struct nova_link_change_entry));
+
+	return pinned;
+}
+
+/*
+ * Called at the end of a log rebuild with the bytes of all entries, and
+ * of the valid write entries, dentries and size changes among them.
+ */
+void nova_rebuild_log_bytes(struct super_block *sb,
+	struct nova_inode_info_header *sih, unsigned long total,
+	unsigned long live)
+{
+	live += nova_log_bytes_pinned(sb, sih);
+
+	sih->live_bytes = min(live, total);
+	sih->dead_bytes = total - sih->live_bytes;
+	nova_update_gc_candidate(sb, sih, false);
+}
+
 /* Returns new tail after append */
 static u64 nova_append_setattr_entry(struct super_block *sb,
 	struct nova_inode *pi, struct inode *inode, struct iattr *attr,
@@ -1305,7 +1935,8 @@ static u64 nova_append_setattr_entry(struct super_block *sb,
 	struct nova_setattr_logentry *entry;
 	u64 curr_p, new_tail = 0;
 	int extended = 0;
-	size_t size = sizeof(struct nova_setattr_logentry);
+	size_t size = nova_log_entry_len(sb,
+				sizeof(struct nova_setattr_logentry));
 	timing_t append_time;
 
 	NOVA_START_TIMING(append_setattr_t, append_time);
@@ -1320,12 +1951,33 @@ static u64 nova_append_setattr_entry(struct super_block *sb,
 	/* inode is already updated with attr */
 	nova_update_setattr_entry(inode, entry, attr);
 	new_tail = curr_p + size;
+	/* Size changes stay valid, see curr_log_entry_invalid() */
+	if (sih->last_setattr && !nova_setattr_is_size(sb, sih->last_setattr))
+		nova_log_bytes_dead(sb, sih, size);
 	sih->last_setattr = curr_p;
 
-	NOVA_END_TIMING(append_setattr_t, append_time);
+	NOVA_END_TIMING(sb, append_setattr_t, append_time);
 	return new_tail;
 }
 
+/*
+ * Log a size change that no write entry records, e.g. a clone that only
+ * covered holes. Called with i_mutex held.
+ */
+void nova_log_size_change(struct inode *inode, loff_t new_size)
+{
+	struct super_block *sb = inode->i_sb;
+	struct nova_inode *pi = nova_get_inode(sb, inode);
+	struct iattr attr;
+	u64 new_tail;
+
+	attr.ia_valid = ATTR_SIZE;
+	attr.ia_size = new_size;
+
+	new_tail = nova_append_setattr_entry(sb, pi, inode, &attr, 0);
+	nova_update_tail(sb, pi, new_tail);
+}
+
 int nova_notify_change(struct dentry *dentry, struct iattr *attr)
 {
 	struct inode *inode = dentry->d_inode;
@@ -1339,6 +1991,9 @@ int nova_notify_change(struct dentry *dentry, struct iattr *attr)
 	u64 new_tail;
 	timing_t setattr_time;
 
+	if (nova_snapshot_sealed(dentry))
+		return -EPERM;
+
 	NOVA_START_TIMING(setattr_t, setattr_time);
 	if (!pi)
 		return -EACCES;
@@ -1364,7 +2019,7 @@ int nova_notify_change(struct dentry *dentry, struct iattr *attr)
 	/* We are holding i_mutex so OK to append the log */
 	new_tail = nova_append_setattr_entry(sb, pi, inode, attr, 0);
 
-	nova_update_tail(pi, new_tail);
+	nova_update_tail(sb, pi, new_tail);
 
 	/* Only after log entry is committed, we can truncate size */
 	if ((ia_valid & ATTR_SIZE) && (attr->ia_size != oldsize ||
@@ -1375,7 +2030,7 @@ int nova_notify_change(struct dentry *dentry, struct iattr *attr)
 		nova_setsize(inode, oldsize, attr->ia_size);
 	}
 
-	NOVA_END_TIMING(setattr_t, setattr_time);
+	NOVA_END_TIMING(sb, setattr_t, setattr_time);
 	return ret;
 }
 
@@ -1443,7 +2098,7 @@ static ssize_t nova_direct_IO(struct kiocb *iocb,
 			"but offset = %lld\n", end, offset);
 	ret = written;
 err:
-	NOVA_END_TIMING(direct_IO_t, dio_time);
+	NOVA_END_TIMING(file_inode(filp)->i_sb, direct_IO_t, dio_time);
 	return ret;
 }
 #endif
@@ -1461,7 +2116,7 @@ static ssize_t nova_direct_IO(struct kiocb *iocb, struct iov_iter *iter,
 
 	ret = dax_do_io(iocb, inode, iter, offset, nova_dax_get_block,
 				NULL, DIO_LOCKING);
-	NOVA_END_TIMING(direct_IO_t, dio_time);
+	NOVA_END_TIMING(inode->i_sb, direct_IO_t, dio_time);
 	return ret;
 }
 
@@ -1579,18 +2234,20 @@ static bool curr_log_entry_invalid(struct super_block *sb,
 			setattr_entry = (struct nova_setattr_logentry *)addr;
 			if (setattr_entry->attr & ATTR_SIZE)
 				ret = false;
-			*length = sizeof(struct nova_setattr_logentry);
+			*length = nova_log_entry_len(sb,
+					sizeof(struct nova_setattr_logentry));
 			break;
 		case LINK_CHANGE:
 			if (sih->last_link_change == curr_p)
 				ret = false;
-			*length = sizeof(struct nova_link_change_entry);
+			*length = nova_log_entry_len(sb,
+					sizeof(struct nova_link_change_entry));
 			break;
 		case FILE_WRITE:
 			entry = (struct nova_file_write_entry *)addr;
 			if (entry->num_pages != entry->invalid_pages)
 				ret = false;
-			*length = sizeof(struct nova_file_write_entry);
+			*length = nova_write_entry_len(sb);
 			break;
 		case DIR_LOG:
 			dentry = (struct nova_dentry *)addr;
@@ -1613,9 +2270,10 @@ static bool curr_log_entry_invalid(struct super_block *sb,
 	return ret;
 }
 
+/* Also returns the bytes of the invalid entries in the page in *dead */
 static bool curr_page_invalid(struct super_block *sb,
 	struct nova_inode *pi, struct nova_inode_info_header *sih,
-	u64 page_head)
+	u64 page_head, unsigned long *dead)
 {
 	u64 curr_p = page_head;
 	bool ret = true;
@@ -1631,15 +2289,16 @@ static bool curr_page_invalid(struct super_block *sb,
 		}
 
 		length = 0;
-		if (!curr_log_entry_invalid(sb, pi, sih, curr_p, &length)) {
-			sih->valid_bytes += length;
+		if (!curr_log_entry_invalid(sb, pi, sih, curr_p, &length))
 			ret = false;
-		}
+		else if (nova_get_entry_type(nova_get_block(sb, curr_p)) !=
+				NEXT_PAGE)
+			*dead += length;
 
 		curr_p += length;
 	}
 
-	NOVA_END_TIMING(check_invalid_t, check_time);
+	NOVA_END_TIMING(sb, check_invalid_t, check_time);
 	return ret;
 }
 
@@ -1698,22 +2357,15 @@ static int nova_gc_assign_dentry(struct super_block *sb,
 	struct nova_inode_info_header *sih, struct nova_dentry *old_dentry,
 	struct nova_dentry *new_dentry)
 {
-	struct nova_dentry *temp;
-	void **pentry;
-	unsigned long hash;
+	struct nova_dir_node *node;
 	int ret = 0;
 
-	hash = BKDRHash(old_dentry->name, old_dentry->name_len);
-	nova_dbgv("%s: assign %s hash %lu\n", __func__,
-			old_dentry->name, hash);
+	nova_dbgv("%s: assign %s\n", __func__, old_dentry->name);
 
-	/* FIXME: hash collision ignored here */
-	pentry = radix_tree_lookup_slot(&sih->tree, hash);
-	if (pentry) {
-		temp = radix_tree_deref_slot(pentry);
-		if (temp == old_dentry)
-			radix_tree_replace_slot(pentry, new_dentry);
-	}
+	node = nova_find_dir_node(sih, old_dentry->name,
+					old_dentry->name_len);
+	if (node && node->direntry == old_dentry)
+		node->direntry = new_dentry;
 
 	return ret;
 }
@@ -1761,131 +2413,243 @@ static int nova_gc_assign_new_entry(struct super_block *sb,
 	return ret;
 }
 
-/* Copy alive log entries to the new log and atomically replace the old log */
-static int nova_inode_log_thorough_gc(struct super_block *sb,
+/*
+ * Pages needed to pack the live entries of [first, end) into a new log.
+ * The bytes of the dead entries are returned in *dead.
+ */
+static unsigned long nova_count_live_log_pages(struct super_block *sb,
 	struct nova_inode *pi, struct nova_inode_info_header *sih,
-	unsigned long blocks, unsigned long checked_pages)
+	u64 first, u64 end, unsigned long *dead)
 {
-	struct nova_inode_log_page *curr_page = NULL;
+	u64 page = first, curr_p;
+	unsigned long pages = 0;
+	size_t used = LAST_ENTRY;
 	size_t length;
-	u64 ino = pi->nova_ino;
-	u64 curr_p, new_curr;
-	u64 old_curr_p;
-	u64 tail_block;
-	u64 old_head;
-	u64 new_head = 0;
-	u64 next;
-	int allocated;
-	int extended = 0;
-	int ret;
-	timing_t gc_time;
 
-	NOVA_START_TIMING(thorough_gc_t, gc_time);
+	*dead = 0;
+	while (page != end) {
+		curr_p = page;
+		while (curr_p < page + LAST_ENTRY) {
+			length = 0;
+			if (!curr_log_entry_invalid(sb, pi, sih, curr_p,
+							&length)) {
+				if (used + length > LAST_ENTRY) {
+					pages++;
+					used = 0;
+				}
+				used += length;
+			} else if (nova_get_entry_type(nova_get_block(sb,
+						curr_p)) != NEXT_PAGE) {
+				*dead += length;
+			}
+			curr_p += length;
+		}
+		page = next_log_page(sb, page);
+	}
 
-	curr_p = pi->log_head;
-	old_curr_p = curr_p;
-	old_head = pi->log_head;
-	nova_dbg_verbose("Log head 0x%llx, tail 0x%llx\n",
-				curr_p, pi->log_tail);
-	if (curr_p == 0 && pi->log_tail == 0)
-		goto out;
+	return pages;
+}
 
-	if (curr_p >> PAGE_SHIFT == pi->log_tail >> PAGE_SHIFT)
-		goto out;
+/*
+ * Compact one chunk of up to gc_chunk_pages log pages, the ones after
+ * prev_page, or from the log head if prev_page is 0. The live entries are
+ * copied to new pages, which are linked to the rest of the log and then
+ * spliced in with a single 8-byte pointer update; the old pages are freed
+ * afterwards. The tail page is never touched.
+ * Returns 1 and the last page of the chunk in *last, 0 if the tail page
+ * is reached, or an error.
+ */
+static int nova_compact_log_chunk(struct super_block *sb,
+	struct nova_inode *pi, struct nova_inode_info_header *sih,
+	u64 prev_page, u64 *last)
+{
+	struct nova_inode_log_page *curr_page;
+	u64 first, end, last_old = 0;
+	u64 page, curr_p, new_curr = 0;
+	u64 new_head = 0;
+	u64 next;
+	unsigned long pages = 0, new_pages;
+	unsigned long dead;
+	size_t length;
+	int allocated;
+	int extended;
 
-	allocated = nova_allocate_inode_log_pages(sb, pi, blocks,
-					&new_head);
-	if (allocated != blocks) {
-		nova_err(sb, "%s: ERROR: no inode log page "
-					"available\n", __func__);
-		goto out;
+	first = prev_page ? next_log_page(sb, prev_page) : pi->log_head;
+	end = first;
+	while (pages < gc_chunk_pages && end &&
+			end >> PAGE_SHIFT != pi->log_tail >> PAGE_SHIFT) {
+		last_old = end;
+		end = next_log_page(sb, end);
+		pages++;
 	}
 
-	new_curr = new_head;
-	while (curr_p != pi->log_tail) {
-		old_curr_p = curr_p;
-		if (goto_next_page(sb, curr_p))
-			curr_p = next_log_page(sb, curr_p);
+	if (pages == 0)
+		return 0;
 
-		if (curr_p >> PAGE_SHIFT == pi->log_tail >> PAGE_SHIFT) {
-			/* Don't recycle tail page */
-			break;
-		}
+	new_pages = nova_count_live_log_pages(sb, pi, sih, first, end, &dead);
+	*last = last_old;
+	if (new_pages >= pages)
+		return 1;
 
-		if (curr_p == 0) {
-			nova_err(sb, "File inode %llu log is NULL!\n", ino);
-			BUG();
+	if (new_pages) {
+		allocated = nova_allocate_inode_log_pages(sb, pi, new_pages,
+							&new_head);
+		if (allocated != new_pages) {
+			nova_err(sb, "%s: ERROR: no inode log page "
+					"available\n", __func__);
+			if (allocated > 0)
+				nova_free_contiguous_log_blocks(sb, pi,
+								new_head);
+			return -ENOSPC;
 		}
 
-		length = 0;
-		ret = curr_log_entry_invalid(sb, pi, sih, curr_p, &length);
-		if (!ret) {
-			extended = 0;
-			new_curr = nova_get_append_head(sb, pi, NULL,
+		new_curr = new_head;
+		for (page = first; page != end;
+				page = next_log_page(sb, page)) {
+			curr_p = page;
+			while (curr_p < page + LAST_ENTRY) {
+				length = 0;
+				if (curr_log_entry_invalid(sb, pi, sih, curr_p,
+								&length)) {
+					curr_p += length;
+					continue;
+				}
+
+				extended = 0;
+				new_curr = nova_get_append_head(sb, pi, NULL,
 						new_curr, length, &extended);
-			if (extended)
-				blocks++;
-			/* Copy entry to the new log */
-			memcpy_to_pmem_nocache(nova_get_block(sb, new_curr),
-				nova_get_block(sb, curr_p), length);
-			nova_gc_assign_new_entry(sb, pi, sih, curr_p, new_curr);
-			new_curr += length;
+				if (extended)
+					new_pages++;
+				/* Copy entry to the new log */
+				memcpy_to_pmem_nocache(
+					nova_get_block(sb, new_curr),
+					nova_get_block(sb, curr_p), length);
+				NOVA_WA_ADD(sb, wa_gc, length);
+				nova_gc_assign_new_entry(sb, pi, sih, curr_p,
+								new_curr);
+				new_curr += length;
+				curr_p += length;
+			}
 		}
 
-		curr_p += length;
+		/* Step 1: Link the new pages to the rest of the log */
+		curr_page = (struct nova_inode_log_page *)nova_get_block(sb,
+							BLOCK_OFF(new_curr));
+		nova_set_next_page_flag(sb, new_curr);
+		nova_set_next_page_address(sb, curr_page, end, 0);
+		nova_flush_buffer(curr_page, PAGE_SIZE, 0);
+		*last = BLOCK_OFF(new_curr);
+	} else {
+		new_head = end;
+		*last = prev_page;
 	}
 
-	/* Step 1: Link new log to the tail block */
-	tail_block = BLOCK_OFF(pi->log_tail);
-	curr_page = (struct nova_inode_log_page *)nova_get_block(sb,
-							BLOCK_OFF(new_curr));
-	next = curr_page->page_tail.next_page;
-	if (next)
-		nova_free_contiguous_log_blocks(sb, pi, next);
-	nova_set_next_page_flag(sb, new_curr);
-	nova_set_next_page_address(sb, curr_page, tail_block, 0);
-	nova_flush_buffer(curr_page, PAGE_SIZE, 0);
-
-	/* Step 2: Atomically switch to the new log */
-	pi->log_head = new_head;
-	nova_flush_buffer(pi, sizeof(struct nova_inode), 1);
-
-	/* Step 3: Unlink the old log */
-	curr_page = (struct nova_inode_log_page *)nova_get_block(sb,
-							BLOCK_OFF(old_curr_p));
+	/* Step 2: Atomically splice them in */
+	if (prev_page) {
+		curr_page = (struct nova_inode_log_page *)nova_get_block(sb,
+							prev_page);
+		nova_set_next_page_address(sb, curr_page, new_head, 1);
+	} else {
+		pi->log_head = new_head;
+		nova_flush_buffer(&pi->log_head, CACHELINE_SIZE, 1);
+	}
+
+	/* Step 3: Unlink and free the old pages */
+	curr_page = (struct nova_inode_log_page *)nova_get_block(sb, last_old);
 	next = curr_page->page_tail.next_page;
-	if (next != tail_block) {
-		nova_err(sb, "Old log error: old curr_p 0x%lx, next 0x%lx ",
-			"curr_p 0x%lx, tail block 0x%lx\n", old_curr_p,
-			next, curr_p, tail_block);
+	if (next != end) {
+		nova_err(sb, "Old log error: last 0x%llx, next 0x%llx, "
+			"end 0x%llx\n", last_old, next, end);
 		BUG();
 	}
 	nova_set_next_page_address(sb, curr_page, 0, 1);
+	nova_free_contiguous_log_blocks(sb, pi, first);
+
+	sih->log_pages = sih->log_pages + new_pages - pages;
+	sih->dead_bytes -= min(dead, sih->dead_bytes);
+	NOVA_STATS_ADD(sb, thorough_gc_pages, pages - new_pages);
+	NOVA_STATS_ADD(sb, thorough_checked_pages, pages);
+	trace_nova_thorough_gc(sb, sih->ino, pages, new_pages,
+				sih->log_pages);
+	nova_update_gc_candidate(sb, sih, false);
+	return 1;
+}
+
+/*
+ * Incremental thorough GC: compact the log chunk by chunk, from where the
+ * last call stopped, until the tail page or until gc_max_us is spent.
+ * Returns 1 if there is more to do.
+ */
+static int nova_inode_log_thorough_gc(struct super_block *sb,
+	struct nova_inode *pi, struct nova_inode_info_header *sih)
+{
+	u64 start = ktime_get_ns();
+	u64 prev_page = sih->gc_resume_page;
+	int ret;
+	timing_t gc_time;
+	struct nova_persist_ctx persist;
+
+	NOVA_START_TIMING(thorough_gc_t, gc_time);
+	nova_persist_begin(sb, &persist, PERSIST_GC);
+
+	if (pi->log_head == 0 || pi->log_head >> PAGE_SHIFT ==
+				pi->log_tail >> PAGE_SHIFT) {
+		ret = 0;
+		goto out;
+	}
+
+	/* Compaction moves the entries the checkpoint points to */
+	nova_free_index_ckpt(sb, pi);
 
-	/* Step 4: Free the old log */
-	nova_free_contiguous_log_blocks(sb, pi, old_head);
+	do {
+		ret = nova_compact_log_chunk(sb, pi, sih, prev_page,
+						&prev_page);
+	} while (ret > 0 && ktime_get_ns() - start <
+			(u64)gc_max_us * NSEC_PER_USEC);
 
-	sih->log_pages = sih->log_pages + blocks - checked_pages;
-	NOVA_STATS_ADD(thorough_gc_pages, checked_pages - blocks);
-	NOVA_STATS_ADD(thorough_checked_pages, checked_pages);
 out:
-	NOVA_END_TIMING(thorough_gc_t, gc_time);
-	return 0;
+	if (ret > 0) {
+		sih->gc_resume_page = prev_page;
+	} else {
+		sih->gc_resume_page = 0;
+		sih->thorough_gc_pending = 0;
+	}
+
+	nova_persist_end(&persist);
+	NOVA_END_TIMING(sb, thorough_gc_t, gc_time);
+	return ret > 0;
 }
 
+/*
+ * Compact the log when its live bytes fill less than gc_thorough_util
+ * percent of it. When the logs are over their space budget, any log with
+ * a couple of pages worth of dead bytes is compacted.
+ */
 static int need_thorough_gc(struct super_block *sb,
-	struct nova_inode_info_header *sih, unsigned long blocks,
-	unsigned long checked_pages)
+	struct nova_inode_info_header *sih)
 {
-	if (blocks && blocks * 2 < checked_pages)
+	unsigned long log_bytes = sih->log_pages * LAST_ENTRY;
+
+	if (sih->log_pages < 2 || sih->live_bytes == 0)
+		return 0;
+
+	if (sih->live_bytes * 100 < log_bytes * gc_thorough_util)
+		return 1;
+
+	if (NOVA_SB(sb)->gc_over_budget && sih->dead_bytes >= 2 * LAST_ENTRY)
 		return 1;
 
 	return 0;
 }
 
+/*
+ * Free the log pages without live entries. If new_block is set, also link
+ * the new_block pages after curr_tail. Thorough GC is left to the log
+ * cleaners when called inline.
+ */
 static int nova_inode_log_fast_gc(struct super_block *sb,
 	struct nova_inode *pi, struct nova_inode_info_header *sih,
-	u64 curr_tail, u64 new_block, int num_pages)
+	u64 curr_tail, u64 new_block, int num_pages, bool inline_gc)
 {
 	u64 curr, next, possible_head = 0;
 	int found_head = 0;
@@ -1893,14 +2657,15 @@ static int nova_inode_log_fast_gc(struct super_block *sb,
 	struct nova_inode_log_page *curr_page = NULL;
 	int first_need_free = 0;
 	unsigned short btype = pi->i_blk_type;
-	unsigned long blocks;
 	unsigned long checked_pages = 0;
+	unsigned long dead, freed_dead = 0;
 	int freed_pages = 0;
 	timing_t gc_time;
+	struct nova_persist_ctx persist;
 
 	NOVA_START_TIMING(fast_gc_t, gc_time);
+	nova_persist_begin(sb, &persist, PERSIST_GC);
 	curr = pi->log_head;
-	sih->valid_bytes = 0;
 
 	nova_dbg_verbose("%s: log head 0x%llx, tail 0x%llx\n",
 				__func__, curr, curr_tail);
@@ -1916,7 +2681,8 @@ static int nova_inode_log_fast_gc(struct super_block *sb,
 					nova_get_block(sb, curr);
 		next = curr_page->page_tail.next_page;
 		nova_dbg_verbose("curr 0x%llx, next 0x%llx\n", curr, next);
-		if (curr_page_invalid(sb, pi, sih, curr)) {
+		dead = 0;
+		if (curr_page_invalid(sb, pi, sih, curr, &dead)) {
 			nova_dbg_verbose("curr page %p invalid\n", curr_page);
 			if (curr == pi->log_head) {
 				/* Free first page later */
@@ -1928,8 +2694,9 @@ static int nova_inode_log_fast_gc(struct super_block *sb,
 				free_curr_page(sb, pi, curr_page, last_page,
 						curr);
 			}
-			NOVA_STATS_ADD(fast_gc_pages, 1);
+			NOVA_STATS_ADD(sb, fast_gc_pages, 1);
 			freed_pages++;
+			freed_dead += dead;
 		} else {
 			if (found_head == 0) {
 				possible_head = cpu_to_le64(curr);
@@ -1944,12 +2711,20 @@ static int nova_inode_log_fast_gc(struct super_block *sb,
 			break;
 	}
 
-	NOVA_STATS_ADD(fast_checked_pages, checked_pages);
-	checked_pages -= freed_pages;
+	NOVA_STATS_ADD(sb, fast_checked_pages, checked_pages);
+	/* The thorough GC resume point and the index checkpoint may be gone */
+	if (freed_pages) {
+		sih->gc_resume_page = 0;
+		nova_free_index_ckpt(sb, pi);
+	}
+	sih->dead_bytes -= min(freed_dead, sih->dead_bytes);
 
-	curr = BLOCK_OFF(curr_tail);
-	curr_page = (struct nova_inode_log_page *)nova_get_block(sb, curr);
-	nova_set_next_page_address(sb, curr_page, new_block, 1);
+	if (new_block) {
+		curr = BLOCK_OFF(curr_tail);
+		curr_page = (struct nova_inode_log_page *)
+					nova_get_block(sb, curr);
+		nova_set_next_page_address(sb, curr_page, new_block, 1);
+	}
 
 	curr = pi->log_head;
 
@@ -1969,25 +2744,55 @@ static int nova_inode_log_fast_gc(struct super_block *sb,
 				nova_get_blocknr(sb, curr, btype), 1);
 	}
 
-	blocks = sih->valid_bytes / LAST_ENTRY;
-	if (sih->valid_bytes % LAST_ENTRY)
-		blocks++;
-
-	NOVA_END_TIMING(fast_gc_t, gc_time);
+	trace_nova_fast_gc(sb, sih->ino, checked_pages, freed_pages,
+				sih->log_pages);
+	nova_update_gc_candidate(sb, sih, false);
+	nova_persist_end(&persist);
+	NOVA_END_TIMING(sb, fast_gc_t, gc_time);
 
-	if (need_thorough_gc(sb, sih, blocks, checked_pages)) {
-		nova_dbgv("Thorough GC for inode %lu: checked pages %lu, "
-				"valid pages %lu\n", sih->ino,
-				checked_pages, blocks);
-		nova_inode_log_thorough_gc(sb, pi, sih, blocks, checked_pages);
+	if (need_thorough_gc(sb, sih)) {
+		nova_dbgv("Thorough GC for inode %lu: log pages %lu, "
+				"live bytes %lu, dead bytes %lu\n", sih->ino,
+				sih->log_pages, sih->live_bytes,
+				sih->dead_bytes);
+		sih->thorough_gc_pending = 1;
 	}
 
+	/* Copying the live entries is the cleaners' job */
+	if (inline_gc && sih->thorough_gc_pending &&
+			!nova_queue_log_gc(sb, sih, true))
+		nova_inode_log_thorough_gc(sb, pi, sih);
+
+	return 0;
+}
+
+/*
+ * Log cleaner entry point. Called with i_mutex held. Resumes a pending
+ * thorough GC without another fast GC pass.
+ * Returns 1 if the thorough GC ran out of time and should be resumed.
+ */
+int nova_inode_log_gc(struct super_block *sb, struct nova_inode *pi,
+	struct nova_inode_info_header *sih)
+{
+	if (!sih->thorough_gc_pending)
+		nova_inode_log_fast_gc(sb, pi, sih, 0, 0, 0, false);
+
+	if (!sih->thorough_gc_pending)
+		return 0;
+
+	if (nova_inode_log_thorough_gc(sb, pi, sih))
+		return 1;
+
+	/* Checkpoint the index of the compacted log */
+	if (S_ISREG(sih->i_mode))
+		nova_save_index_ckpt(sb, pi, sih);
 	return 0;
 }
 
 static u64 nova_extend_inode_log(struct super_block *sb, struct nova_inode *pi,
 	struct nova_inode_info_header *sih, u64 curr_p)
 {
+	struct nova_inode_log_page *curr_page;
 	u64 new_block;
 	int allocated;
 	unsigned long num_pages;
@@ -2024,8 +2829,19 @@ static u64 nova_extend_inode_log(struct super_block *sb, struct nova_inode *pi,
 			return 0;
 		}
 
-		nova_inode_log_fast_gc(sb, pi, sih, curr_p,
-						new_block, allocated);
+		if (nova_log_gc_critical(sb, sih)) {
+			NOVA_STATS_ADD(sb, gc_inline, 1);
+			nova_inode_log_fast_gc(sb, pi, sih, curr_p,
+						new_block, allocated, true);
+		} else {
+			curr_page = (struct nova_inode_log_page *)
+					nova_get_block(sb, BLOCK_OFF(curr_p));
+			nova_set_next_page_address(sb, curr_page,
+						new_block, 1);
+			sih->log_pages += allocated;
+			pi->i_blocks += allocated;
+			nova_queue_log_gc(sb, sih, false);
+		}
 
 //		nova_dbg("After append log pages:\n");
 //		nova_print_inode_log_page(sb, inode);
@@ -2096,6 +2912,12 @@ u64 nova_get_append_head(struct super_block *sb, struct nova_inode *pi,
 		curr_p = next_log_page(sb, curr_p);
 	}
 
+	/* A new entry is live until superseded; GC copies are not new */
+	if (sih) {
+		sih->live_bytes += size;
+		NOVA_WA_ADD(sb, wa_log, size);
+	}
+
 	return  curr_p;
 }
 
@@ -2113,7 +2935,7 @@ u64 nova_append_file_write_entry(struct super_block *sb, struct nova_inode *pi,
 	struct nova_file_write_entry *entry;
 	u64 curr_p;
 	int extended = 0;
-	size_t size = sizeof(struct nova_file_write_entry);
+	size_t size = nova_write_entry_len(sb);
 	timing_t append_time;
 
 	NOVA_START_TIMING(append_file_entry_t, append_time);
@@ -2130,8 +2952,11 @@ u64 nova_append_file_write_entry(struct super_block *sb, struct nova_inode *pi,
 			curr_p, entry->pgoff, entry->num_pages,
 			entry->block >> PAGE_SHIFT, entry->size);
 	/* entry->invalid is set to 0 */
+	trace_nova_append_file_write_entry(inode, curr_p,
+			le64_to_cpu(data->pgoff), le32_to_cpu(data->num_pages),
+			le64_to_cpu(data->block), le64_to_cpu(data->size));
 
-	NOVA_END_TIMING(append_file_entry_t, append_time);
+	NOVA_END_TIMING(sb, append_file_entry_t, append_time);
 	return curr_p;
 }
 
@@ -2147,6 +2972,7 @@ void nova_free_inode_log(struct super_block *sb, struct nova_inode *pi)
 	NOVA_START_TIMING(free_inode_log_t, free_time);
 
 	curr_block = pi->log_head;
+	nova_free_index_ckpt(sb, pi);
 
 	/* The inode is invalid now, no need to call PCOMMIT */
 	pi->log_head = pi->log_tail = 0;
@@ -2154,7 +2980,7 @@ void nova_free_inode_log(struct super_block *sb, struct nova_inode *pi)
 
 	freed = nova_free_contiguous_log_blocks(sb, pi, curr_block);
 
-	NOVA_END_TIMING(free_inode_log_t, free_time);
+	NOVA_END_TIMING(sb, free_inode_log_t, free_time);
 }
 
 static inline void nova_rebuild_file_time_and_size(struct super_block *sb,
@@ -2178,9 +3004,16 @@ int nova_rebuild_file_inode_tree(struct super_block *sb,
 	struct nova_inode_log_page *curr_page;
 	unsigned int data_bits = blk_type_to_shift[pi->i_blk_type];
 	u64 ino = pi->nova_ino;
+	size_t attr_len = nova_log_entry_len(sb,
+				sizeof(struct nova_setattr_logentry));
+	size_t link_len = nova_log_entry_len(sb,
+				sizeof(struct nova_link_change_entry));
+	size_t entry_len = nova_write_entry_len(sb);
+	unsigned long total = 0, live = 0;
 	timing_t rebuild_time;
 	void *addr;
 	u64 curr_p;
+	u64 ckpt_tail;
 	u64 next;
 	u8 type;
 
@@ -2197,6 +3030,11 @@ int nova_rebuild_file_inode_tree(struct super_block *sb,
 
 	sih->log_pages = 1;
 
+	/* Only replay the entries after the index checkpoint, if any */
+	ckpt_tail = nova_load_index_ckpt(sb, pi, sih, &total, &live);
+	if (ckpt_tail)
+		curr_p = ckpt_tail;
+
 	while (curr_p != pi->log_tail) {
 		if (goto_next_page(sb, curr_p)) {
 			sih->log_pages++;
@@ -2217,7 +3055,10 @@ int nova_rebuild_file_inode_tree(struct super_block *sb,
 				nova_apply_setattr_entry(sb, pi, sih,
 								attr_entry);
 				sih->last_setattr = curr_p;
-				curr_p += sizeof(struct nova_setattr_logentry);
+				total += attr_len;
+				if (attr_entry->attr & ATTR_SIZE)
+					live += attr_len;
+				curr_p += attr_len;
 				continue;
 			case LINK_CHANGE:
 				link_change_entry =
@@ -2225,7 +3066,8 @@ int nova_rebuild_file_inode_tree(struct super_block *sb,
 				nova_apply_link_change_entry(pi,
 							link_change_entry);
 				sih->last_link_change = curr_p;
-				curr_p += sizeof(struct nova_link_change_entry);
+				total += link_len;
+				curr_p += link_len;
 				continue;
 			case FILE_WRITE:
 				break;
@@ -2233,7 +3075,7 @@ int nova_rebuild_file_inode_tree(struct super_block *sb,
 				nova_err(sb, "unknown type %d, 0x%llx\n",
 							type, curr_p);
 				NOVA_ASSERT(0);
-				curr_p += sizeof(struct nova_file_write_entry);
+				curr_p += entry_len;
 				continue;
 		}
 
@@ -2244,12 +3086,14 @@ int nova_rebuild_file_inode_tree(struct super_block *sb,
 			 * Don't double free them, just re-assign the pointers.
 			 */
 			nova_assign_write_entry(sb, pi, sih, entry, false);
+			live += entry_len;
 		}
+		total += entry_len;
 
 		nova_rebuild_file_time_and_size(sb, pi, entry);
 		/* Update sih->i_size for setattr apply operations */
 		sih->i_size = le64_to_cpu(pi->i_size);
-		curr_p += sizeof(struct nova_file_write_entry);
+		curr_p += entry_len;
 	}
 
 	sih->i_size = le64_to_cpu(pi->i_size);
@@ -2267,9 +3111,12 @@ int nova_rebuild_file_inode_tree(struct super_block *sb,
 	}
 
 	pi->i_blocks = sih->log_pages + (sih->i_size >> data_bits);
+	nova_rebuild_log_bytes(sb, sih, total, live);
+	trace_nova_rebuild_inode(sb, ino, 0, sih->log_pages, ckpt_tail != 0,
+				live, total);
 
 //	nova_print_inode_log_page(sb, inode);
-	NOVA_END_TIMING(rebuild_file_t, rebuild_time);
+	NOVA_END_TIMING(sb, rebuild_file_t, rebuild_time);
 	return 0;
 }
 
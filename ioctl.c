@@ -18,6 +18,9 @@
 #include <linux/sched.h>
 #include <linux/compat.h>
 #include <linux/mount.h>
+#include <linux/uaccess.h>
+#include <linux/slab.h>
+#include <linux/string.h>
 #include "nova.h"
 
 long nova_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
@@ -50,6 +53,12 @@ long nova_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 			goto flags_out;
 		}
 
+		/* Snapshots stay immutable */
+		if (nova_in_snapshot(filp->f_path.dentry)) {
+			ret = -EPERM;
+			goto flags_out;
+		}
+
 		if (get_user(flags, (int __user *)arg)) {
 			ret = -EFAULT;
 			goto flags_out;
@@ -79,7 +88,7 @@ long nova_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		ret = nova_append_link_change_entry(sb, pi, inode, 0,
 							&new_tail);
 		if (!ret)
-			nova_update_tail(pi, new_tail);
+			nova_update_tail(sb, pi, new_tail);
 		nova_memlock_inode(sb, pi);
 		mutex_unlock(&inode->i_mutex);
 flags_out:
@@ -107,19 +116,29 @@ flags_out:
 		ret = nova_append_link_change_entry(sb, pi, inode, 0,
 							&new_tail);
 		if (!ret)
-			nova_update_tail(pi, new_tail);
+			nova_update_tail(sb, pi, new_tail);
 		nova_memlock_inode(sb, pi);
 		mutex_unlock(&inode->i_mutex);
 setversion_out:
 		mnt_drop_write_file(filp);
 		return ret;
 	}
+	case FICLONE:
+		return nova_ioctl_clone(filp, arg, 0, 0, 0);
+	case FICLONERANGE: {
+		struct file_clone_range args;
+
+		if (copy_from_user(&args, (void __user *)arg, sizeof(args)))
+			return -EFAULT;
+		return nova_ioctl_clone(filp, args.src_fd, args.src_offset,
+					args.src_length, args.dest_offset);
+	}
 	case NOVA_PRINT_TIMING: {
 		nova_print_timing_stats(sb);
 		return 0;
 	}
 	case NOVA_CLEAR_STATS: {
-		nova_clear_stats();
+		nova_clear_stats(sb);
 		return 0;
 	}
 	case NOVA_PRINT_LOG: {
@@ -134,6 +153,29 @@ setversion_out:
 		nova_print_free_lists(sb);
 		return 0;
 	}
+	case NOVA_CREATE_SNAPSHOT:
+	case NOVA_DELETE_SNAPSHOT: {
+		char *name;
+
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+
+		/* No mnt_want_write_file(): it would block the freeze */
+		if (IS_RDONLY(inode) || __mnt_is_readonly(filp->f_path.mnt))
+			return -EROFS;
+
+		name = strndup_user((const char __user *)arg,
+					NOVA_NAME_LEN + 1);
+		if (IS_ERR(name))
+			return PTR_ERR(name);
+
+		if (cmd == NOVA_CREATE_SNAPSHOT)
+			ret = nova_create_snapshot(sb, name);
+		else
+			ret = nova_delete_snapshot(sb, name);
+		kfree(name);
+		return ret;
+	}
 	default:
 		return -ENOTTY;
 	}
@@ -155,6 +197,11 @@ long nova_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case FS_IOC32_SETVERSION:
 		cmd = FS_IOC_SETVERSION;
 		break;
+	case FICLONE:
+	case FICLONERANGE:
+	case NOVA_CREATE_SNAPSHOT:
+	case NOVA_DELETE_SNAPSHOT:
+		break;
 	default:
 		return -ENOIOCTLCMD;
 	}
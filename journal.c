@@ -33,18 +33,27 @@
 #include <linux/sched.h>
 #include "nova.h"
 #include "journal.h"
+#include "nova_trace.h"
 
 /**************************** Lite journal ******************************/
 
-static u64 next_lite_journal(u64 curr_p)
+/* Move curr_p bytes forward in the ring of its journal page */
+static inline u64 lite_journal_add(u64 curr_p, size_t bytes)
 {
-	size_t size = sizeof(struct nova_lite_journal_entry);
+	return (curr_p & PAGE_MASK) +
+		(((curr_p & (PAGE_SIZE - 1)) + bytes) & (PAGE_SIZE - 1));
+}
 
-	/* One page holds 64 entries with cacheline size */
-	if ((curr_p & (PAGE_SIZE - 1)) + size >= PAGE_SIZE)
-		return (curr_p & PAGE_MASK);
+/* Units in use between head and tail */
+static inline unsigned int lite_journal_used(u64 head, u64 tail)
+{
+	return ((tail - head) & (PAGE_SIZE - 1)) / NOVA_JOURNAL_UNIT;
+}
 
-	return curr_p + size;
+/* Bytes of a record of words */
+static inline size_t lite_record_len(unsigned int words)
+{
+	return (words + 1) * NOVA_JOURNAL_UNIT;
 }
 
 static void nova_recover_lite_journal_entry(struct super_block *sb,
@@ -72,97 +81,297 @@ static void nova_recover_lite_journal_entry(struct super_block *sb,
 	nova_flush_buffer((void *)nova_get_block(sb, addr), CACHELINE_SIZE, 0);
 }
 
-void nova_print_lite_transaction(struct nova_lite_journal_entry *entry)
+void nova_print_lite_transaction(struct nova_lite_transaction *trans)
 {
 	int i;
 
-	for (i = 0; i < 4; i++)
-		nova_dbg_verbose("Entry %d: addr 0x%llx, value 0x%llx\n",
-				i, entry->addrs[i], entry->values[i]);
+	for (i = 0; i < trans->words; i++)
+		nova_dbg_verbose("Word %d: addr 0x%llx, value 0x%llx\n",
+				i, trans->entries[i].addr,
+				trans->entries[i].value);
+}
+
+void nova_init_lite_transaction(struct nova_lite_transaction *trans)
+{
+	memset(trans, 0, sizeof(struct nova_lite_transaction));
+	trans->entries = trans->inline_entries;
+	trans->max_words = NOVA_TRANS_INLINE_WORDS;
+}
+
+static void nova_grow_lite_transaction(struct nova_lite_transaction *trans)
+{
+	struct nova_lite_journal_word *entries;
+	int max_words = min_t(int, trans->max_words * 2,
+				NOVA_TRANS_MAX_WORDS);
+
+	/* Journaled updates cannot back out half way */
+	entries = kmalloc_array(max_words, NOVA_JOURNAL_UNIT,
+				GFP_NOFS | __GFP_NOFAIL);
+	memcpy(entries, trans->entries, trans->words * NOVA_JOURNAL_UNIT);
+	if (trans->entries != trans->inline_entries)
+		kfree(trans->entries);
+	trans->entries = entries;
+	trans->max_words = max_words;
+}
+
+/* Log the current value of the size bytes at addr */
+void nova_lite_transaction_add(struct super_block *sb,
+	struct nova_lite_transaction *trans, void *addr, int size)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_lite_journal_word *entry;
+	u64 value;
+
+	BUG_ON(trans->words >= NOVA_TRANS_MAX_WORDS);
+	if (trans->words == trans->max_words)
+		nova_grow_lite_transaction(trans);
+
+	switch (size) {
+		case 1:
+			value = *(u8 *)addr;
+			break;
+		case 2:
+			value = *(u16 *)addr;
+			break;
+		case 4:
+			value = *(u32 *)addr;
+			break;
+		case 8:
+			value = *(u64 *)addr;
+			break;
+		default:
+			BUG();
+	}
+
+	entry = &trans->entries[trans->words];
+	entry->addr = (u64)nova_get_addr_off(sbi, addr);
+	entry->addr |= (u64)size << 56;
+	entry->value = value;
+	trans->words++;
 }
 
-u64 nova_create_lite_transaction(struct super_block *sb,
-	struct nova_lite_journal_entry *dram_entry1,
-	struct nova_lite_journal_entry *dram_entry2,
-	int entries, int cpu)
+/* Copy len bytes to the journal ring from curr_p, returns the new end */
+static u64 nova_write_lite_journal(struct super_block *sb, u64 curr_p,
+	const void *src, size_t len)
 {
+	size_t room, bytes;
+
+	while (len) {
+		room = PAGE_SIZE - (curr_p & (PAGE_SIZE - 1));
+		bytes = min(len, room);
+		memcpy_to_pmem_nocache(nova_get_block(sb, curr_p), src, bytes);
+		curr_p = lite_journal_add(curr_p, bytes);
+		src += bytes;
+		len -= bytes;
+	}
+
+	return curr_p;
+}
+
+/*
+ * Write the transaction to the journal of the current CPU. The journal lock
+ * is only held while the record is written; the caller updates the logged
+ * fields in place and then commits.
+ */
+void nova_create_lite_transaction(struct super_block *sb,
+	struct nova_lite_transaction *trans)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_lite_journal *journal;
+	struct nova_lite_journal_header header;
 	struct ptr_pair *pair;
-	struct nova_lite_journal_entry *entry;
-	size_t size = sizeof(struct nova_lite_journal_entry);
-	u64 new_tail, temp;;
+	unsigned int units = trans->words + 1;
+	u64 temp;
+	struct nova_persist_ctx persist;
 
-	pair = nova_get_journal_pointers(sb, cpu);
-	if (!pair || pair->journal_head == 0 ||
-			pair->journal_head != pair->journal_tail)
+	trans->cpu = raw_smp_processor_id() % sbi->cpus;
+	journal = &sbi->journals[trans->cpu];
+	pair = nova_get_journal_pointers(sb, trans->cpu);
+	if (!pair || pair->journal_head == 0 || trans->words == 0)
 		BUG();
 
-	temp = pair->journal_head;
-	entry = (struct nova_lite_journal_entry *)nova_get_block(sb,
-							temp);
-
-//	nova_print_lite_transaction(dram_entry1);
-	memcpy_to_pmem_nocache(entry, dram_entry1, size);
-
-	if (entries == 2) {
-		temp = next_lite_journal(temp);
-		entry = (struct nova_lite_journal_entry *)nova_get_block(sb,
-							temp);
-//		nova_print_lite_transaction(dram_entry2);
-		memcpy_to_pmem_nocache(entry, dram_entry2, size);
+	header.magic = NOVA_JOURNAL_MAGIC;
+	header.words = trans->words;
+	header.committed = 0;
+
+	nova_persist_begin(sb, &persist, PERSIST_JOURNAL);
+again:
+	spin_lock(&journal->lock);
+	if (lite_journal_used(pair->journal_head, pair->journal_tail) +
+			units >= NOVA_JOURNAL_UNITS) {
+		/* Full of transactions in flight, wait for some to commit */
+		spin_unlock(&journal->lock);
+		NOVA_STATS_ADD(sb, journal_full, 1);
+		cond_resched();
+		goto again;
 	}
 
-	new_tail = next_lite_journal(temp);
-	pair->journal_tail = new_tail;
+	trans->start = pair->journal_tail;
+	temp = nova_write_lite_journal(sb, trans->start, &header,
+					NOVA_JOURNAL_UNIT);
+	temp = nova_write_lite_journal(sb, temp, trans->entries,
+					trans->words * NOVA_JOURNAL_UNIT);
+	PERSISTENT_BARRIER();
+	NOVA_WA_ADD(sb, wa_journal, lite_record_len(trans->words));
+
+	pair->journal_tail = temp;
 	nova_flush_buffer(&pair->journal_head, CACHELINE_SIZE, 1);
+	spin_unlock(&journal->lock);
+	trace_nova_lite_journal_create(sb, trans->cpu, trans->start,
+					trans->words);
+	nova_persist_end(&persist);
+}
 
-	return new_tail;
+/* Move the head past the committed records at the head. Lock held. */
+static void nova_advance_lite_journal(struct super_block *sb,
+	struct ptr_pair *pair)
+{
+	struct nova_lite_journal_header *header;
+	u64 head = pair->journal_head;
+
+	while (head != pair->journal_tail) {
+		header = (struct nova_lite_journal_header *)
+				nova_get_block(sb, head);
+		if (!header->committed)
+			break;
+		head = lite_journal_add(head, lite_record_len(header->words));
+	}
+
+	if (head != pair->journal_head) {
+		pair->journal_head = head;
+		nova_flush_buffer(&pair->journal_head, CACHELINE_SIZE, 1);
+	}
 }
 
-void nova_commit_lite_transaction(struct super_block *sb, u64 tail, int cpu)
+void nova_commit_lite_transaction(struct super_block *sb,
+	struct nova_lite_transaction *trans)
 {
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_lite_journal *journal = &sbi->journals[trans->cpu];
+	struct nova_lite_journal_header *header;
 	struct ptr_pair *pair;
+	int out_of_order = 0;
+	struct nova_persist_ctx persist;
 
-	pair = nova_get_journal_pointers(sb, cpu);
-	if (!pair || pair->journal_tail != tail)
+	pair = nova_get_journal_pointers(sb, trans->cpu);
+	if (!pair)
 		BUG();
 
-	pair->journal_head = tail;
-	nova_flush_buffer(&pair->journal_head, CACHELINE_SIZE, 1);
+	nova_persist_resume(sb, &persist, PERSIST_JOURNAL);
+	/*
+	 * The in place updates are durable before the record is marked
+	 * committed, and the mark is one 8-byte store, so recovery either
+	 * undoes the whole transaction or none of it.
+	 */
+	PERSISTENT_BARRIER();
+	header = (struct nova_lite_journal_header *)
+			nova_get_block(sb, trans->start);
+	header->committed = 1;
+	nova_flush_buffer(&header->committed, sizeof(header->committed), 1);
+
+	spin_lock(&journal->lock);
+	if (pair->journal_head != trans->start) {
+		/* An older transaction is still in flight */
+		NOVA_STATS_ADD(sb, journal_ooo_commits, 1);
+		out_of_order = 1;
+	}
+	nova_advance_lite_journal(sb, pair);
+	spin_unlock(&journal->lock);
+	trace_nova_lite_journal_commit(sb, trans->cpu, trans->start,
+					trans->words, out_of_order);
+	nova_persist_end(&persist);
+
+	if (trans->entries != trans->inline_entries)
+		kfree(trans->entries);
+	trans->entries = trans->inline_entries;
 }
 
-static void nova_undo_lite_journal_entry(struct super_block *sb,
-	struct nova_lite_journal_entry *entry)
+/* Units of the journal of cpu taken by transactions in flight */
+unsigned int nova_lite_journal_in_flight(struct super_block *sb, int cpu)
 {
-	int i;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_lite_journal *journal = &sbi->journals[cpu];
+	struct ptr_pair *pair;
+	unsigned int used;
+
+	pair = nova_get_journal_pointers(sb, cpu);
+	if (!pair)
+		return 0;
+
+	spin_lock(&journal->lock);
+	used = lite_journal_used(pair->journal_head, pair->journal_tail);
+	spin_unlock(&journal->lock);
+
+	return used;
+}
+
+/* Restore the words of a record, last logged first */
+static void nova_undo_lite_journal_record(struct super_block *sb,
+	u64 start, unsigned int words)
+{
+	struct nova_lite_journal_word *entry;
+	u64 temp;
 	u8 type;
+	int i;
 
-	for (i = 0; i < 4; i++) {
-		type = entry->addrs[i] >> 56;
-		if (entry->addrs[i] && type) {
-			nova_dbg("%s: recover entry %d\n", __func__, i);
-			nova_recover_lite_journal_entry(sb, entry->addrs[i],
-					entry->values[i], type);
+	for (i = words - 1; i >= 0; i--) {
+		temp = lite_journal_add(start, (i + 1) * NOVA_JOURNAL_UNIT);
+		entry = (struct nova_lite_journal_word *)nova_get_block(sb,
+								temp);
+		type = entry->addr >> 56;
+		if (entry->addr && type) {
+			nova_dbg("%s: recover word %d\n", __func__, i);
+			nova_recover_lite_journal_entry(sb,
+				entry->addr & ((1ULL << 56) - 1),
+				entry->value, type);
 		}
 	}
 }
 
+/* Undo all uncommitted records, newest first */
 static int nova_recover_lite_journal(struct super_block *sb,
-	struct ptr_pair *pair, int recover)
+	struct ptr_pair *pair)
 {
-	struct nova_lite_journal_entry *entry;
+	struct nova_lite_journal_header *header;
+	unsigned int used, units;
+	u64 *starts;
 	u64 temp;
+	int count = 0;
+	int i;
+
+	starts = kcalloc(NOVA_JOURNAL_UNITS, sizeof(u64), GFP_KERNEL);
+	if (!starts)
+		return -ENOMEM;
+
+	used = lite_journal_used(pair->journal_head, pair->journal_tail);
+	temp = pair->journal_head;
+	while (temp != pair->journal_tail) {
+		header = (struct nova_lite_journal_header *)
+				nova_get_block(sb, temp);
+		units = header->words + 1;
+		if (header->magic != NOVA_JOURNAL_MAGIC ||
+				header->words == 0 || units > used) {
+			nova_err(sb, "%s: bad journal record at 0x%llx\n",
+					__func__, temp);
+			kfree(starts);
+			return -EINVAL;
+		}
 
-	entry = (struct nova_lite_journal_entry *)nova_get_block(sb,
-							pair->journal_head);
-	nova_undo_lite_journal_entry(sb, entry);
+		starts[count++] = temp;
+		used -= units;
+		temp = lite_journal_add(temp, lite_record_len(header->words));
+	}
 
-	if (recover == 2) {
-		temp = next_lite_journal(pair->journal_head);
-		entry = (struct nova_lite_journal_entry *)nova_get_block(sb,
-							temp);
-		nova_undo_lite_journal_entry(sb, entry);
+	for (i = count - 1; i >= 0; i--) {
+		header = (struct nova_lite_journal_header *)
+				nova_get_block(sb, starts[i]);
+		if (!header->committed)
+			nova_undo_lite_journal_record(sb, starts[i],
+							header->words);
 	}
+	kfree(starts);
 
+	PERSISTENT_BARRIER();
 	pair->journal_tail = pair->journal_head;
 	nova_flush_buffer(&pair->journal_head, CACHELINE_SIZE, 1);
 
@@ -173,40 +382,36 @@ int nova_lite_journal_soft_init(struct super_block *sb)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
 	struct ptr_pair *pair;
+	int ret;
 	int i;
-	u64 temp;
 
-	sbi->journal_locks = kzalloc(sbi->cpus * sizeof(spinlock_t),
+	sbi->journals = kcalloc(sbi->cpus, sizeof(struct nova_lite_journal),
 					GFP_KERNEL);
-	if (!sbi->journal_locks)
+	if (!sbi->journals)
 		return -ENOMEM;
 
 	for (i = 0; i < sbi->cpus; i++)
-		spin_lock_init(&sbi->journal_locks[i]);
+		spin_lock_init(&sbi->journals[i].lock);
 
 	for (i = 0; i < sbi->cpus; i++) {
 		pair = nova_get_journal_pointers(sb, i);
 		if (pair->journal_head == pair->journal_tail)
 			continue;
 
-		/* We only allow up to two uncommited entries */
-		temp = next_lite_journal(pair->journal_head);
-		if (pair->journal_tail == temp) {
-			nova_recover_lite_journal(sb, pair, 1);
-			continue;
-		}
-
-		temp = next_lite_journal(temp);
-		if (pair->journal_tail == temp) {
-			nova_recover_lite_journal(sb, pair, 2);
-			continue;
-		}
-
-		/* We are in trouble if we get here*/
-		nova_err(sb, "%s: lite journal %d error: head 0x%llx, "
+		/* Both ends must be units of the same journal page */
+		if ((pair->journal_head & PAGE_MASK) !=
+				(pair->journal_tail & PAGE_MASK) ||
+		    (pair->journal_head | pair->journal_tail) &
+				(NOVA_JOURNAL_UNIT - 1)) {
+			nova_err(sb, "%s: lite journal %d error: head 0x%llx, "
 				"tail 0x%llx\n", __func__, i,
 				pair->journal_head, pair->journal_tail);
-		return -EINVAL;
+			return -EINVAL;
+		}
+
+		ret = nova_recover_lite_journal(sb, pair);
+		if (ret)
+			return ret;
 	}
 
 	return 0;
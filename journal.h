@@ -23,18 +23,57 @@
 #define __NOVA_JOURNAL_H__
 #include <linux/slab.h>
 
-/* Lite journal */
-struct nova_lite_journal_entry {
-	/* The highest byte of addr is type */
-	u64 addrs[4];
-	u64 values[4];
+/*
+ * Lite journal. Each CPU has a journal page, used as a ring of 16 byte
+ * units. A transaction is one record: a header unit, then one unit per
+ * logged word. Several transactions may be in flight at once and they can
+ * commit in any order: a commit sets the committed flag of its header with
+ * a single 8-byte store, and the head only moves past committed records.
+ * Recovery undoes the records between head and tail that are not committed.
+ */
+struct nova_lite_journal_header {
+	u32 magic;
+	u32 words;		/* Logged words that follow */
+	u64 committed;
+};
+
+/* The highest byte of addr is the size of the word */
+struct nova_lite_journal_word {
+	u64 addr;
+	u64 value;
+};
+
+#define	NOVA_JOURNAL_MAGIC	0x4E4A524E
+#define	NOVA_JOURNAL_UNIT	sizeof(struct nova_lite_journal_word)
+#define	NOVA_JOURNAL_UNITS	(PAGE_SIZE / NOVA_JOURNAL_UNIT)
+
+/* Words kept in the transaction itself; more are allocated */
+#define	NOVA_TRANS_INLINE_WORDS	8
+/* Leave room in the ring for other transactions */
+#define	NOVA_TRANS_MAX_WORDS	(NOVA_JOURNAL_UNITS / 2)
+
+struct nova_lite_transaction {
+	int cpu;
+	int words;
+	int max_words;
+	u64 start;		/* Header of the record, set on creation */
+	struct nova_lite_journal_word *entries;
+	struct nova_lite_journal_word inline_entries[NOVA_TRANS_INLINE_WORDS];
+};
+
+/* DRAM state of a per-CPU journal */
+struct nova_lite_journal {
+	spinlock_t lock;	/* Moving the head and the tail */
 };
 
 int nova_lite_journal_soft_init(struct super_block *sb);
 int nova_lite_journal_hard_init(struct super_block *sb);
-u64 nova_create_lite_transaction(struct super_block *sb,
-	struct nova_lite_journal_entry *dram_entry1,
-	struct nova_lite_journal_entry *dram_entry2,
-	int entries, int cpu);
-void nova_commit_lite_transaction(struct super_block *sb, u64 tail, int cpu);
+void nova_init_lite_transaction(struct nova_lite_transaction *trans);
+void nova_lite_transaction_add(struct super_block *sb,
+	struct nova_lite_transaction *trans, void *addr, int size);
+void nova_create_lite_transaction(struct super_block *sb,
+	struct nova_lite_transaction *trans);
+void nova_commit_lite_transaction(struct super_block *sb,
+	struct nova_lite_transaction *trans);
+unsigned int nova_lite_journal_in_flight(struct super_block *sb, int cpu);
 #endif    /* __NOVA_JOURNAL_H__ */
@@ -62,34 +62,23 @@ static struct dentry *nova_lookup(struct inode *dir, struct dentry *dentry,
 		}
 	}
 
-	NOVA_END_TIMING(lookup_t, lookup_time);
+	NOVA_END_TIMING(dir->i_sb, lookup_t, lookup_time);
 	return d_splice_alias(inode, dentry);
 }
 
 static void nova_lite_transaction_for_new_inode(struct super_block *sb,
 	struct nova_inode *pi, struct nova_inode *pidir, u64 pidir_tail)
 {
-	struct nova_sb_info *sbi = NOVA_SB(sb);
-	struct nova_lite_journal_entry entry;
-	int cpu;
-	u64 journal_tail;
+	struct nova_lite_transaction trans;
 	timing_t trans_time;
 
 	NOVA_START_TIMING(create_trans_t, trans_time);
 
 	/* Commit a lite transaction */
-	memset(&entry, 0, sizeof(struct nova_lite_journal_entry));
-	entry.addrs[0] = (u64)nova_get_addr_off(sbi, &pidir->log_tail);
-	entry.addrs[0] |= (u64)8 << 56;
-	entry.values[0] = pidir->log_tail;
-
-	entry.addrs[1] = (u64)nova_get_addr_off(sbi, &pi->valid);
-	entry.addrs[1] |= (u64)1 << 56;
-	entry.values[1] = pi->valid;
-
-	cpu = smp_processor_id();
-	spin_lock(&sbi->journal_locks[cpu]);
-	journal_tail = nova_create_lite_transaction(sb, &entry, NULL, 1, cpu);
+	nova_init_lite_transaction(&trans);
+	nova_lite_transaction_add(sb, &trans, &pidir->log_tail, 8);
+	nova_lite_transaction_add(sb, &trans, &pi->valid, 1);
+	nova_create_lite_transaction(sb, &trans);
 
 	pidir->log_tail = pidir_tail;
 	nova_flush_buffer(&pidir->log_tail, CACHELINE_SIZE, 0);
@@ -97,9 +86,8 @@ static void nova_lite_transaction_for_new_inode(struct super_block *sb,
 	nova_flush_buffer(&pi->valid, CACHELINE_SIZE, 0);
 	PERSISTENT_BARRIER();
 
-	nova_commit_lite_transaction(sb, journal_tail, cpu);
-	spin_unlock(&sbi->journal_locks[cpu]);
-	NOVA_END_TIMING(create_trans_t, trans_time);
+	nova_commit_lite_transaction(sb, &trans);
+	NOVA_END_TIMING(sb, create_trans_t, trans_time);
 }
 
 /* Returns new tail after append */
@@ -122,8 +110,13 @@ static int nova_create(struct inode *dir, struct dentry *dentry, umode_t mode,
 	u64 tail = 0;
 	u64 ino;
 	timing_t create_time;
+	struct nova_persist_ctx persist;
+
+	if (nova_snapshot_sealed(dentry))
+		return -EPERM;
 
 	NOVA_START_TIMING(create_t, create_time);
+	nova_persist_begin(sb, &persist, PERSIST_CREATE);
 
 	pidir = nova_get_inode(sb, dir);
 	if (!pidir)
@@ -149,11 +142,13 @@ static int nova_create(struct inode *dir, struct dentry *dentry, umode_t mode,
 
 	pi = nova_get_block(sb, pi_addr);
 	nova_lite_transaction_for_new_inode(sb, pi, pidir, tail);
-	NOVA_END_TIMING(create_t, create_time);
+	nova_persist_end(&persist);
+	NOVA_END_TIMING(sb, create_t, create_time);
 	return err;
 out_err:
 	nova_err(sb, "%s return %d\n", __func__, err);
-	NOVA_END_TIMING(create_t, create_time);
+	nova_persist_end(&persist);
+	NOVA_END_TIMING(sb, create_t, create_time);
 	return err;
 }
 
@@ -168,8 +163,13 @@ static int nova_mknod(struct inode *dir, struct dentry *dentry, umode_t mode,
 	u64 tail = 0;
 	u64 ino;
 	timing_t mknod_time;
+	struct nova_persist_ctx persist;
+
+	if (nova_snapshot_sealed(dentry))
+		return -EPERM;
 
 	NOVA_START_TIMING(mknod_t, mknod_time);
+	nova_persist_begin(sb, &persist, PERSIST_CREATE);
 
 	pidir = nova_get_inode(sb, dir);
 	if (!pidir)
@@ -195,11 +195,13 @@ static int nova_mknod(struct inode *dir, struct dentry *dentry, umode_t mode,
 
 	pi = nova_get_block(sb, pi_addr);
 	nova_lite_transaction_for_new_inode(sb, pi, pidir, tail);
-	NOVA_END_TIMING(mknod_t, mknod_time);
+	nova_persist_end(&persist);
+	NOVA_END_TIMING(sb, mknod_t, mknod_time);
 	return err;
 out_err:
 	nova_err(sb, "%s return %d\n", __func__, err);
-	NOVA_END_TIMING(mknod_t, mknod_time);
+	nova_persist_end(&persist);
+	NOVA_END_TIMING(sb, mknod_t, mknod_time);
 	return err;
 }
 
@@ -218,8 +220,13 @@ static int nova_symlink(struct inode *dir, struct dentry *dentry,
 	u64 tail = 0;
 	u64 ino;
 	timing_t symlink_time;
+	struct nova_persist_ctx persist;
+
+	if (nova_snapshot_sealed(dentry))
+		return -EPERM;
 
 	NOVA_START_TIMING(symlink_t, symlink_time);
+	nova_persist_begin(sb, &persist, PERSIST_CREATE);
 	if (len + 1 > sb->s_blocksize)
 		goto out;
 
@@ -269,7 +276,8 @@ static int nova_symlink(struct inode *dir, struct dentry *dentry,
 
 	nova_lite_transaction_for_new_inode(sb, pi, pidir, tail);
 out:
-	NOVA_END_TIMING(symlink_t, symlink_time);
+	nova_persist_end(&persist);
+	NOVA_END_TIMING(sb, symlink_t, symlink_time);
 	return err;
 
 out_fail2:
@@ -283,33 +291,18 @@ static void nova_lite_transaction_for_time_and_link(struct super_block *sb,
 	struct nova_inode *pi, struct nova_inode *pidir, u64 pi_tail,
 	u64 pidir_tail, int invalidate)
 {
-	struct nova_sb_info *sbi = NOVA_SB(sb);
-	struct nova_lite_journal_entry entry;
-	u64 journal_tail;
-	int cpu;
+	struct nova_lite_transaction trans;
 	timing_t trans_time;
 
 	NOVA_START_TIMING(link_trans_t, trans_time);
 
 	/* Commit a lite transaction */
-	memset(&entry, 0, sizeof(struct nova_lite_journal_entry));
-	entry.addrs[0] = (u64)nova_get_addr_off(sbi, &pi->log_tail);
-	entry.addrs[0] |= (u64)8 << 56;
-	entry.values[0] = pi->log_tail;
-
-	entry.addrs[1] = (u64)nova_get_addr_off(sbi, &pidir->log_tail);
-	entry.addrs[1] |= (u64)8 << 56;
-	entry.values[1] = pidir->log_tail;
-
-	if (invalidate) {
-		entry.addrs[2] = (u64)nova_get_addr_off(sbi, &pi->valid);
-		entry.addrs[2] |= (u64)1 << 56;
-		entry.values[2] = pi->valid;
-	}
-
-	cpu = smp_processor_id();
-	spin_lock(&sbi->journal_locks[cpu]);
-	journal_tail = nova_create_lite_transaction(sb, &entry, NULL, 1, cpu);
+	nova_init_lite_transaction(&trans);
+	nova_lite_transaction_add(sb, &trans, &pi->log_tail, 8);
+	nova_lite_transaction_add(sb, &trans, &pidir->log_tail, 8);
+	if (invalidate)
+		nova_lite_transaction_add(sb, &trans, &pi->valid, 1);
+	nova_create_lite_transaction(sb, &trans);
 
 	pi->log_tail = pi_tail;
 	nova_flush_buffer(&pi->log_tail, CACHELINE_SIZE, 0);
@@ -321,9 +314,8 @@ static void nova_lite_transaction_for_time_and_link(struct super_block *sb,
 	}
 	PERSISTENT_BARRIER();
 
-	nova_commit_lite_transaction(sb, journal_tail, cpu);
-	spin_unlock(&sbi->journal_locks[cpu]);
-	NOVA_END_TIMING(link_trans_t, trans_time);
+	nova_commit_lite_transaction(sb, &trans);
+	NOVA_END_TIMING(sb, link_trans_t, trans_time);
 }
 
 /* Returns new tail after append */
@@ -335,7 +327,8 @@ int nova_append_link_change_entry(struct super_block *sb,
 	struct nova_link_change_entry *entry;
 	u64 curr_p;
 	int extended = 0;
-	size_t size = sizeof(struct nova_link_change_entry);
+	size_t size = nova_log_entry_len(sb,
+				sizeof(struct nova_link_change_entry));
 	timing_t append_time;
 
 	NOVA_START_TIMING(append_link_change_t, append_time);
@@ -350,13 +343,15 @@ int nova_append_link_change_entry(struct super_block *sb,
 	entry->entry_type = LINK_CHANGE;
 	entry->links = cpu_to_le16(inode->i_nlink);
 	entry->ctime = cpu_to_le32(inode->i_ctime.tv_sec);
-	entry->flags = cpu_to_le32(inode->i_flags);
+	entry->flags = cpu_to_le32(nova_persistent_flags(inode, pi));
 	entry->generation = cpu_to_le32(inode->i_generation);
-	nova_flush_buffer(entry, size, 0);
+	nova_flush_buffer(entry, sizeof(struct nova_link_change_entry), 0);
 	*new_tail = curr_p + size;
+	if (sih->last_link_change)
+		nova_log_bytes_dead(sb, sih, size);
 	sih->last_link_change = curr_p;
 
-	NOVA_END_TIMING(append_link_change_t, append_time);
+	NOVA_END_TIMING(sb, append_link_change_t, append_time);
 	return 0;
 }
 
@@ -384,8 +379,13 @@ static int nova_link(struct dentry *dest_dentry, struct inode *dir,
 	u64 pidir_tail = 0, pi_tail = 0;
 	int err = -ENOMEM;
 	timing_t link_time;
+	struct nova_persist_ctx persist;
+
+	if (nova_snapshot_sealed(dentry))
+		return -EPERM;
 
 	NOVA_START_TIMING(link_t, link_time);
+	nova_persist_begin(sb, &persist, PERSIST_CREATE);
 	if (inode->i_nlink >= NOVA_LINK_MAX) {
 		err = -EMLINK;
 		goto out;
@@ -423,7 +423,8 @@ static int nova_link(struct dentry *dest_dentry, struct inode *dir,
 						pi_tail, pidir_tail, 0);
 
 out:
-	NOVA_END_TIMING(link_t, link_time);
+	nova_persist_end(&persist);
+	NOVA_END_TIMING(sb, link_t, link_time);
 	return err;
 }
 
@@ -437,8 +438,13 @@ static int nova_unlink(struct inode *dir, struct dentry *dentry)
 	u64 pidir_tail = 0, pi_tail = 0;
 	int invalidate = 0;
 	timing_t unlink_time;
+	struct nova_persist_ctx persist;
+
+	if (nova_snapshot_sealed(dentry))
+		return -EPERM;
 
 	NOVA_START_TIMING(unlink_t, unlink_time);
+	nova_persist_begin(sb, &persist, PERSIST_UNLINK);
 
 	pidir = nova_get_inode(sb, dir);
 	if (!pidir)
@@ -467,11 +473,13 @@ static int nova_unlink(struct inode *dir, struct dentry *dentry)
 	nova_lite_transaction_for_time_and_link(sb, pi, pidir,
 					pi_tail, pidir_tail, invalidate);
 
-	NOVA_END_TIMING(unlink_t, unlink_time);
+	nova_persist_end(&persist);
+	NOVA_END_TIMING(sb, unlink_t, unlink_time);
 	return 0;
 out:
 	nova_err(sb, "%s return %d\n", __func__, retval);
-	NOVA_END_TIMING(unlink_t, unlink_time);
+	nova_persist_end(&persist);
+	NOVA_END_TIMING(sb, unlink_t, unlink_time);
 	return retval;
 }
 
@@ -487,8 +495,13 @@ static int nova_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 	u64 ino;
 	int err = -EMLINK;
 	timing_t mkdir_time;
+	struct nova_persist_ctx persist;
+
+	if (nova_snapshot_sealed(dentry))
+		return -EPERM;
 
 	NOVA_START_TIMING(mkdir_t, mkdir_time);
+	nova_persist_begin(sb, &persist, PERSIST_CREATE);
 	if (dir->i_nlink >= NOVA_LINK_MAX)
 		goto out;
 
@@ -529,7 +542,8 @@ static int nova_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 
 	nova_lite_transaction_for_new_inode(sb, pi, pidir, tail);
 out:
-	NOVA_END_TIMING(mkdir_t, mkdir_time);
+	nova_persist_end(&persist);
+	NOVA_END_TIMING(sb, mkdir_t, mkdir_time);
 	return err;
 
 out_err:
@@ -546,21 +560,15 @@ static int nova_empty_dir(struct inode *inode)
 	struct super_block *sb;
 	struct nova_inode_info *si = NOVA_I(inode);
 	struct nova_inode_info_header *sih = &si->header;
-	struct nova_dentry *entry;
-	unsigned long pos = 0;
-	struct nova_dentry *entries[4];
-	int nr_entries;
-	int i;
+	struct nova_dir_node *node;
+	unsigned long bkt;
 
 	sb = inode->i_sb;
-	nr_entries = radix_tree_gang_lookup(&sih->tree,
-					(void **)entries, pos, 4);
-	if (nr_entries > 2)
+	if (sih->dir_entries > 2)
 		return 0;
 
-	for (i = 0; i < nr_entries; i++) {
-		entry = entries[i];
-		if (!is_dir_init_entry(sb, entry))
+	nova_dir_for_each_node(sih, bkt, node) {
+		if (!is_dir_init_entry(sb, node->direntry))
 			return 0;
 	}
 
@@ -578,6 +586,10 @@ static int nova_rmdir(struct inode *dir, struct dentry *dentry)
 	struct nova_inode_info_header *sih = &si->header;
 	int err = -ENOTEMPTY;
 	timing_t rmdir_time;
+	struct nova_persist_ctx persist;
+
+	if (nova_snapshot_sealed(dentry))
+		return -EPERM;
 
 	NOVA_START_TIMING(rmdir_t, rmdir_time);
 	if (!inode)
@@ -601,6 +613,7 @@ static int nova_rmdir(struct inode *dir, struct dentry *dentry)
 		nova_dbg("empty directory %lu has nlink!=2 (%d), dir %lu",
 				inode->i_ino, inode->i_nlink, dir->i_ino);
 
+	nova_persist_begin(sb, &persist, PERSIST_UNLINK);
 	err = nova_remove_dentry(dentry, -1, 0, &pidir_tail);
 	if (err)
 		goto end_rmdir;
@@ -621,12 +634,14 @@ static int nova_rmdir(struct inode *dir, struct dentry *dentry)
 	nova_lite_transaction_for_time_and_link(sb, pi, pidir,
 						pi_tail, pidir_tail, 1);
 
-	NOVA_END_TIMING(rmdir_t, rmdir_time);
+	nova_persist_end(&persist);
+	NOVA_END_TIMING(sb, rmdir_t, rmdir_time);
 	return err;
 
 end_rmdir:
 	nova_err(sb, "%s return %d\n", __func__, err);
-	NOVA_END_TIMING(rmdir_t, rmdir_time);
+	nova_persist_end(&persist);
+	NOVA_END_TIMING(sb, rmdir_t, rmdir_time);
 	return err;
 }
 
@@ -637,19 +652,15 @@ static int nova_rename(struct inode *old_dir,
 	struct inode *old_inode = old_dentry->d_inode;
 	struct inode *new_inode = new_dentry->d_inode;
 	struct super_block *sb = old_inode->i_sb;
-	struct nova_sb_info *sbi = NOVA_SB(sb);
 	struct nova_inode *old_pi = NULL, *new_pi = NULL;
 	struct nova_inode *new_pidir = NULL, *old_pidir = NULL;
-	struct nova_lite_journal_entry entry, entry1;
+	struct nova_lite_transaction trans;
 	struct nova_dentry *father_entry = NULL;
 	char *head_addr = NULL;
 	u64 old_tail = 0, new_tail = 0, new_pi_tail = 0, old_pi_tail = 0;
 	int err = -ENOENT;
 	int inc_link = 0, dec_link = 0;
-	int entries = 0;
-	int cpu;
 	int change_parent = 0;
-	u64 journal_tail;
 	timing_t rename_time;
 
 	nova_dbgv("%s: rename %s to %s,\n", __func__,
@@ -658,6 +669,10 @@ static int nova_rename(struct inode *old_dir,
 			__func__, S_ISDIR(old_inode->i_mode) ? "dir" : "normal",
 			old_inode->i_ino, old_dir->i_ino, new_dir->i_ino,
 			new_inode ? new_inode->i_ino : 0);
+	if (nova_snapshot_sealed(old_dentry) ||
+			nova_snapshot_sealed(new_dentry))
+		return -EPERM;
+
 	NOVA_START_TIMING(rename_t, rename_time);
 
 	if (new_inode) {
@@ -694,7 +709,7 @@ static int nova_rename(struct inode *old_dir,
 		change_parent = 1;
 		head_addr = (char *)nova_get_block(sb, old_pi->log_head);
 		father_entry = (struct nova_dentry *)(head_addr +
-					NOVA_DIR_LOG_REC_LEN(1));
+					nova_dir_rec_len(sb, 1));
 		if (le64_to_cpu(father_entry->ino) != old_dir->i_ino)
 			nova_err(sb, "%s: dir %lu parent should be %lu, "
 				"but actually %lu\n", __func__,
@@ -745,53 +760,25 @@ static int nova_rename(struct inode *old_dir,
 			goto out;
 	}
 
-	entries = 1;
-	memset(&entry, 0, sizeof(struct nova_lite_journal_entry));
-
-	entry.addrs[0] = (u64)nova_get_addr_off(sbi, &old_pi->log_tail);
-	entry.addrs[0] |= (u64)8 << 56;
-	entry.values[0] = old_pi->log_tail;
-
-	entry.addrs[1] = (u64)nova_get_addr_off(sbi, &old_pidir->log_tail);
-	entry.addrs[1] |= (u64)8 << 56;
-	entry.values[1] = old_pidir->log_tail;
+	nova_init_lite_transaction(&trans);
+	nova_lite_transaction_add(sb, &trans, &old_pi->log_tail, 8);
+	nova_lite_transaction_add(sb, &trans, &old_pidir->log_tail, 8);
 
 	if (old_dir != new_dir) {
-		entry.addrs[2] = (u64)nova_get_addr_off(sbi,
-						&new_pidir->log_tail);
-		entry.addrs[2] |= (u64)8 << 56;
-		entry.values[2] = new_pidir->log_tail;
-
-		if (change_parent && father_entry) {
-			entry.addrs[3] = (u64)nova_get_addr_off(sbi,
-						&father_entry->ino);
-			entry.addrs[3] |= (u64)8 << 56;
-			entry.values[3] = father_entry->ino;
-		}
+		nova_lite_transaction_add(sb, &trans, &new_pidir->log_tail, 8);
+		if (change_parent && father_entry)
+			nova_lite_transaction_add(sb, &trans,
+						&father_entry->ino, 8);
 	}
 
 	if (new_inode) {
-		entries++;
-		memset(&entry1, 0, sizeof(struct nova_lite_journal_entry));
-
-		entry1.addrs[0] = (u64)nova_get_addr_off(sbi,
-						&new_pi->log_tail);
-		entry1.addrs[0] |= (u64)8 << 56;
-		entry1.values[0] = new_pi->log_tail;
-
-		if (!new_inode->i_nlink) {
-			entry1.addrs[1] = (u64)nova_get_addr_off(sbi,
-							&new_pi->valid);
-			entry1.addrs[1] |= (u64)1 << 56;
-			entry1.values[1] = new_pi->valid;
-		}
-
+		nova_lite_transaction_add(sb, &trans, &new_pi->log_tail, 8);
+		if (!new_inode->i_nlink)
+			nova_lite_transaction_add(sb, &trans,
+						&new_pi->valid, 1);
 	}
 
-	cpu = smp_processor_id();
-	spin_lock(&sbi->journal_locks[cpu]);
-	journal_tail = nova_create_lite_transaction(sb, &entry, &entry1,
-							entries, cpu);
+	nova_create_lite_transaction(sb, &trans);
 
 	old_pi->log_tail = old_pi_tail;
 	nova_flush_buffer(&old_pi->log_tail, CACHELINE_SIZE, 0);
@@ -819,14 +806,13 @@ static int nova_rename(struct inode *old_dir,
 
 	PERSISTENT_BARRIER();
 
-	nova_commit_lite_transaction(sb, journal_tail, cpu);
-	spin_unlock(&sbi->journal_locks[cpu]);
+	nova_commit_lite_transaction(sb, &trans);
 
-	NOVA_END_TIMING(rename_t, rename_time);
+	NOVA_END_TIMING(sb, rename_t, rename_time);
 	return 0;
 out:
 	nova_err(sb, "%s return %d\n", __func__, err);
-	NOVA_END_TIMING(rename_t, rename_time);
+	NOVA_END_TIMING(sb, rename_t, rename_time);
 	return err;
 }
 
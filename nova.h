@@ -35,6 +35,8 @@
 #include <linux/radix-tree.h>
 #include <linux/version.h>
 #include <linux/kthread.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
 #include <linux/buffer_head.h>
 #include <linux/uio.h>
 #include <asm/tlbflush.h>
@@ -127,9 +129,30 @@ extern unsigned int nova_dbgmask;
 #define	NOVA_PRINT_LOG_BLOCKNODE	0xBCD00014
 #define	NOVA_PRINT_LOG_PAGES		0xBCD00015
 #define	NOVA_PRINT_FREE_LISTS		0xBCD00018
+#define	NOVA_CREATE_SNAPSHOT		0xBCD00019
+#define	NOVA_DELETE_SNAPSHOT		0xBCD0001A
+
+/* Snapshots live under this directory of the root, hidden from readdir */
+#define	NOVA_SNAPSHOT_DIR		".snapshots"
+#define	NOVA_SNAPSHOT_DIR_LEN		10
+
+/* Clone ioctls, handled by the VFS from 4.5 on */
+#ifndef FICLONE
+struct file_clone_range {
+	__s64 src_fd;
+	__u64 src_offset;
+	__u64 src_length;
+	__u64 dest_offset;
+};
+
+#define	FICLONE		_IOW(0x94, 9, int)
+#define	FICLONERANGE	_IOW(0x94, 13, struct file_clone_range)
+#endif
 
 
 #define	READDIR_END			(ULONG_MAX)
+/* Readdir positions 0 and 1 are "." and ".." */
+#define	NOVA_DIR_FIRST_COOKIE		2
 #define	INVALID_CPU			(-1)
 #define	SHARED_CPU			(65536)
 #define FREE_BATCH			(16)
@@ -173,10 +196,13 @@ struct nova_file_write_entry {
 	__le32	invalid_pages;
 	/* For both ctime and mtime */
 	__le32	mtime;
-	__le32	padding;
+	__le32	flags;
 	__le64	size;
 } __attribute((__packed__));
 
+/* Write entry flags */
+#define	NOVA_WRITE_SHARED	0x1	/* Blocks may be shared (reflink) */
+
 struct nova_inode_page_tail {
 	__le64	padding1;
 	__le64	padding2;
@@ -250,23 +276,12 @@ enum alloc_type {
 #define	IS_MAP_WRITE(p)	((p) & (MMAP_WRITE_BIT))
 #define	MMAP_ADDR(p)	((p) & (PAGE_MASK))
 
-static inline void nova_update_tail(struct nova_inode *pi, u64 new_tail)
-{
-	timing_t update_time;
-
-	NOVA_START_TIMING(update_tail_t, update_time);
-
-	PERSISTENT_BARRIER();
-	pi->log_tail = new_tail;
-	nova_flush_buffer(&pi->log_tail, CACHELINE_SIZE, 1);
-
-	NOVA_END_TIMING(update_tail_t, update_time);
-}
-
 /* symlink.c */
 int nova_block_symlink(struct super_block *sb, struct nova_inode *pi,
 	struct inode *inode, u64 log_block,
 	unsigned long name_blocknr, const char *symname, int len);
+const char *nova_get_symlink_target(struct super_block *sb,
+	struct nova_inode *pi);
 
 /* Inline functions start here */
 
@@ -300,14 +315,71 @@ struct nova_range_node_lowhigh {
 
 #define	RANGENODE_PER_PAGE	254
 
+/*
+ * Allocator state saved by lists on umount: the log starts with a header
+ * and one nova_save_list per free list or inode list, and each list then
+ * begins on a page of its own. The header magic sits where an older log
+ * keeps range_low and is above its range_high, so the two formats cannot
+ * be confused.
+ */
+#define	NOVA_SAVE_MAGIC		0x4e4f56414c495354ULL	/* "NOVALIST" */
+
+struct nova_save_header {
+	__le64 magic;
+	__le64 num_lists;
+};
+
+struct nova_save_list {
+	__le64 head;		/* First entry, 0 if the list is empty */
+	__le64 num_entries;
+};
+
+/* Shared block range saved in the block reference log on umount */
+struct nova_block_ref_entry {
+	__le64 range_low;
+	__le64 range_high;
+	__le64 refcount;
+	__le64 padding;
+};
+
+#define	BLOCKREF_PER_PAGE	127
+
+/* A range of data blocks referenced by refcount write entries */
+struct nova_block_ref_node {
+	struct rb_node node;
+	unsigned long range_low;
+	unsigned long range_high;
+	unsigned long refcount;
+};
+
 struct nova_range_node {
 	struct rb_node node;
 	unsigned long range_low;
 	unsigned long range_high;
 };
 
+/*
+ * A name in a directory hash table, chained per bucket. It is also on
+ * the directory's readdir order, keyed by a cookie derived from the name
+ * alone, so it is the same whenever the index is rebuilt.
+ */
+struct nova_dir_node {
+	struct hlist_node hnode;
+	struct rb_node rnode;
+	u64 cookie;
+	u32 hash;
+	struct nova_dentry *direntry;
+};
+
 struct nova_inode_info_header {
-	struct radix_tree_root tree;	/* Dir name entry tree root */
+	struct radix_tree_root tree;	/* File write entry tree root */
+	struct hlist_head *dir_buckets;	/* Dir name hash table */
+	unsigned int dir_bits;		/* log2 of the number of buckets */
+	struct hlist_head *dir_old_buckets;	/* Table being resized from */
+	unsigned int dir_old_bits;
+	unsigned long dir_rehash_next;	/* First old bucket not moved yet */
+	unsigned long dir_entries;	/* Names in the hash table */
+	struct rb_root dir_order;	/* Names by readdir cookie */
 	struct radix_tree_root cache_tree;	/* Mmap cache tree root */
 	unsigned short i_mode;		/* Dir or file? */
 	unsigned long log_pages;	/* Num of log pages */
@@ -317,16 +389,74 @@ struct nova_inode_info_header {
 	unsigned long mmap_pages;	/* Num of mmap pages */
 	unsigned long low_dirty;	/* Mmap dirty low range */
 	unsigned long high_dirty;	/* Mmap dirty high range */
-	unsigned long valid_bytes;	/* For thorough GC */
+	unsigned long live_bytes;	/* Log bytes in valid entries */
+	unsigned long dead_bytes;	/* Log bytes in invalid entries */
+	int thorough_gc_pending;	/* Thorough GC started, not finished */
+	u64 gc_resume_page;		/* Where thorough GC resumes, 0: head */
 	u64 last_setattr;		/* Last setattr entry */
 	u64 last_link_change;		/* Last link change entry */
 };
 
+/* The buckets of the hash table, then those of the table resized from */
+static inline unsigned long nova_dir_num_buckets(
+	struct nova_inode_info_header *sih)
+{
+	unsigned long num = 0;
+
+	if (sih->dir_buckets)
+		num += 1UL << sih->dir_bits;
+	if (sih->dir_old_buckets)
+		num += 1UL << sih->dir_old_bits;
+	return num;
+}
+
+static inline struct hlist_head *nova_dir_bucket(
+	struct nova_inode_info_header *sih, unsigned long bkt)
+{
+	if (bkt < (1UL << sih->dir_bits))
+		return &sih->dir_buckets[bkt];
+	return &sih->dir_old_buckets[bkt - (1UL << sih->dir_bits)];
+}
+
+/* Visit every name in a directory, in no particular order */
+#define nova_dir_for_each_node(sih, bkt, node)				\
+	for ((bkt) = 0; (bkt) < nova_dir_num_buckets(sih); (bkt)++)	\
+		hlist_for_each_entry(node, nova_dir_bucket(sih, bkt), hnode)
+
 struct nova_inode_info {
 	struct nova_inode_info_header header;
+	struct list_head gc_list;	/* On a log cleaner queue */
+	struct list_head gc_cand;	/* On a GC candidate bucket */
+	int gc_bucket;			/* Which one, -1: not a candidate */
+	unsigned long gc_stamp;		/* Jiffies of last GC or first dead */
+	unsigned long gc_pages;		/* Accounted to the candidate totals */
+	unsigned long gc_dead;
 	struct inode vfs_inode;
 };
 
+/* Per-CPU background log cleaner */
+struct nova_log_cleaner {
+	struct super_block *sb;
+	struct task_struct *task;
+	struct list_head queue;		/* Inodes waiting for log GC */
+	wait_queue_head_t wait;
+	int id;
+};
+
+/* GC candidates are bucketed by log utilization */
+#define	NOVA_GC_BUCKETS	8
+
+/* One worst offender, as ranked by the last GC scheduler pass */
+#define	NOVA_GC_TOP	16
+
+struct nova_gc_victim {
+	unsigned long ino;
+	unsigned long log_pages;
+	unsigned long live_bytes;
+	unsigned long dead_bytes;
+	u64 score;
+};
+
 enum bm_type {
 	BM_4K = 0,
 	BM_2M,
@@ -368,10 +498,32 @@ struct free_list {
 
 /*
  * The first block contains super blocks and reserved inodes;
- * The second block contains pointers to journal pages.
- * The third block contains pointers to inode tables.
+ * The following blocks contain pointers to journal pages, then the same
+ * number of blocks contain pointers to inode tables. Each CPU takes a
+ * cacheline, so volumes with up to 64 CPUs reserve three blocks.
  */
-#define	RESERVED_BLOCKS	3
+#define	NOVA_CPUS_PER_PTR_BLOCK	(NOVA_DEF_BLOCK_SIZE_4K / CACHELINE_SIZE)
+
+static inline unsigned long nova_ptr_blocks(int cpus)
+{
+	return DIV_ROUND_UP(cpus, NOVA_CPUS_PER_PTR_BLOCK);
+}
+
+static inline unsigned long nova_reserved_blocks(int cpus)
+{
+	return 1 + 2 * nova_ptr_blocks(cpus);
+}
+
+/* DRAM copy of one inode table chain: superpage offsets in chain order */
+struct nova_table_index {
+	struct rcu_head rcu;
+	unsigned long num;		/* Superpages indexed */
+	unsigned long cap;
+	u64 pages[];
+};
+
+/* Inode numbers a CPU reserves from its map at a time */
+#define	NOVA_INO_BATCH	16
 
 struct inode_map {
 	struct mutex inode_table_mutex;
@@ -380,6 +532,26 @@ struct inode_map {
 	struct nova_range_node *first_inode_range;
 	int allocated;
 	int freed;
+	struct mutex table_index_mutex;	/* Serializes index growth */
+	struct nova_table_index __rcu *table_index;
+
+	/* Reserved free inode numbers and their addresses */
+	spinlock_t	ino_cache_lock;
+	int		ino_head;
+	int		ino_count;
+	unsigned long	cached_ino[NOVA_INO_BATCH];
+	u64		cached_addr[NOVA_INO_BATCH];
+
+	/* Links the next inode table superpage ahead of need */
+	struct super_block *sb;
+	int		cpuid;
+	unsigned int	grow_superpage;
+	struct work_struct grow_work;
+
+	/* Occupancy summary pages, under inode_table_mutex */
+	u64		*summary_pages;
+	unsigned int	summary_num;
+	unsigned int	summary_cap;
 };
 
 /*
@@ -415,33 +587,114 @@ struct nova_sb_info {
 	kgid_t		gid;    /* Mount gid for root directory */
 	umode_t		mode;   /* Mount mode for root directory */
 	atomic_t	next_generation;
+	unsigned long	log_align;	/* Log entry alignment, 1 or 64 */
 	/* inode tracking */
 	unsigned long	s_inodes_used_count;
 	unsigned long	reserved_blocks;
 
 	struct mutex 	s_lock;	/* protects the SB's buffer-head */
 
+	/* Per-CPU structures on media, fixed when the volume is created */
 	int cpus;
 	struct proc_dir_entry *s_proc;
 
 	/* ZEROED page for cache page initialized */
 	void *zeroed_page;
 
-	/* Per-CPU journal lock */
-	spinlock_t *journal_locks;
+	/* Per-CPU lite journals */
+	struct nova_lite_journal *journals;
 
 	/* Per-CPU inode map */
 	struct inode_map	*inode_maps;
 
-	/* Decide new inode map id */
-	unsigned long map_id;
-
 	/* Per-CPU free block list */
 	struct free_list *free_lists;
 
 	/* Shared free block list */
 	unsigned long per_list_blocks;
 	struct free_list shared_free_list;
+
+	/* Reference counts of shared (reflinked) data blocks */
+	struct mutex block_ref_mutex;
+	struct rb_root block_ref_tree;
+	unsigned long num_block_ref_nodes;
+	unsigned long num_shared_blocks;
+
+	/* Serializes snapshot creation and deletion */
+	struct mutex snapshot_mutex;
+	struct task_struct *snapshot_task;	/* The task doing either */
+
+	/*
+	 * Log cleaners, one per CPU; gc_lock protects their queues, the GC
+	 * candidate buckets and count, and the scheduler results below.
+	 */
+	struct nova_log_cleaner *log_cleaners;
+	spinlock_t gc_lock;
+	/* Inodes with dead log bytes */
+	struct list_head gc_buckets[NOVA_GC_BUCKETS];
+	unsigned long gc_acct_count;
+	atomic_long_t gc_acct_pages;	/* Log pages of the candidates */
+	atomic_long_t gc_acct_dead;	/* Dead log bytes of the candidates */
+	unsigned long gc_cand_count;
+	unsigned long gc_cand_pages;	/* Log pages of the candidates */
+	unsigned long gc_dead_total;	/* Dead log bytes of the candidates */
+	unsigned long gc_budget_pages;
+	int gc_over_budget;
+	int gc_top_count;
+	struct nova_gc_victim gc_top[NOVA_GC_TOP];
+
+	/*
+	 * Background failure recovery. Until the scan is done, blocks are
+	 * handed out from the recovery pool and frees are deferred, both
+	 * under pool_lock.
+	 */
+	spinlock_t pool_lock;
+	int restricted_alloc;
+	unsigned long pool_start;	/* First block handed out this mount */
+	unsigned long pool_next;
+	unsigned long pool_end;
+	unsigned long pool_mark;	/* s_pool_next on media */
+	struct list_head deferred_frees;
+	unsigned long deferred_blocks;
+	unsigned long leaked_blocks;	/* Deferred frees given up on */
+
+	int recovery_state;
+	int recovery_abort;
+	struct task_struct *recovery_thread;
+	struct completion recovery_done;
+	unsigned long recovery_start;	/* jiffies */
+	unsigned long recovery_pages;	/* Inode table chunks to scan */
+	atomic_long_t recovery_scanned;	/* Chunks scanned */
+	atomic_long_t recovery_inodes;	/* Inodes scanned */
+
+	/* Failure recovery threads and their work, see bbuild.c */
+	struct scan_bitmap **global_bm;	/* Per-CPU used block maps */
+	struct task_ring *task_rings;
+	struct task_struct **recovery_threads;
+	u64 *task_pages;		/* Inode table superpages */
+	struct nova_table_summary *task_summaries;
+	unsigned long task_chunks_per_page;
+	atomic_t threads_listing;
+	atomic_t threads_running;
+	struct completion recovery_listed;
+	struct completion recovery_finished;
+
+	/* Timing, I/O and persistence counters, and latency histograms */
+	struct nova_stats __percpu *stats;
+	struct nova_latency_hist __percpu *latency_hist;
+
+	/* Write amplification counters, and their totals at window start */
+	struct nova_wa_stats __percpu *wa_stats;
+	spinlock_t wa_lock;
+	struct nova_wa_stats wa_window;
+	unsigned long wa_window_start;	/* jiffies */
+};
+
+enum nova_recovery_state {
+	NOVA_RECOVERY_NONE = 0,		/* Clean mount */
+	NOVA_RECOVERY_SCANNING,
+	NOVA_RECOVERY_DONE,
+	NOVA_RECOVERY_ABORTED,
 };
 
 static inline struct nova_sb_info *NOVA_SB(struct super_block *sb)
@@ -454,6 +707,40 @@ static inline struct nova_inode_info *NOVA_I(struct inode *inode)
 	return container_of(inode, struct nova_inode_info, vfs_inode);
 }
 
+static inline void nova_update_tail(struct super_block *sb,
+	struct nova_inode *pi, u64 new_tail)
+{
+	timing_t update_time;
+
+	NOVA_START_TIMING(update_tail_t, update_time);
+
+	PERSISTENT_BARRIER();
+	pi->log_tail = new_tail;
+	nova_flush_buffer(&pi->log_tail, CACHELINE_SIZE, 1);
+
+	NOVA_END_TIMING(sb, update_tail_t, update_time);
+}
+
+/*
+ * Log space taken by an entry of size bytes: log format v2 pads entries
+ * to whole cachelines. Only the entry itself is written and flushed.
+ */
+static inline size_t nova_log_entry_len(struct super_block *sb, size_t size)
+{
+	return ALIGN(size, NOVA_SB(sb)->log_align);
+}
+
+static inline size_t nova_write_entry_len(struct super_block *sb)
+{
+	return nova_log_entry_len(sb, sizeof(struct nova_file_write_entry));
+}
+
+static inline unsigned short nova_dir_rec_len(struct super_block *sb,
+	int name_len)
+{
+	return nova_log_entry_len(sb, NOVA_DIR_LOG_REC_LEN(name_len));
+}
+
 /* If this is part of a read-modify-write of the super block,
  * nova_memunlock_super() before calling! */
 static inline struct nova_super_block *nova_get_super(struct super_block *sb)
@@ -463,6 +750,13 @@ static inline struct nova_super_block *nova_get_super(struct super_block *sb)
 	return (struct nova_super_block *)sbi->virt_addr;
 }
 
+/* Does the volume keep the fast rebuild metadata? */
+static inline int nova_has_rebuild_meta(struct super_block *sb)
+{
+	return le32_to_cpu(nova_get_super(sb)->s_features) &
+		NOVA_FEATURE_REBUILD;
+}
+
 static inline struct nova_super_block *nova_get_redund_super(struct super_block *sb)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
@@ -505,6 +799,14 @@ struct free_list *nova_get_free_list(struct super_block *sb, int cpu)
 		return &sbi->shared_free_list;
 }
 
+/* Map the running CPU onto the per-CPU structures of the volume */
+static inline int nova_get_cpuid(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+
+	return raw_smp_processor_id() % sbi->cpus;
+}
+
 struct ptr_pair {
 	__le64 journal_head;
 	__le64 journal_tail;
@@ -524,6 +826,32 @@ struct ptr_pair *nova_get_journal_pointers(struct super_block *sb, int cpu)
 
 struct inode_table {
 	__le64 log_head;
+	__le64 summary_head;	/* Occupancy summary chain, 0 if none */
+};
+
+/*
+ * Occupancy summary of a 2M inode table superpage, one bit per 4K chunk
+ * of inodes. A bit is set and flushed before any inode of its chunk is
+ * made valid, so failure recovery skips chunks whose bit is clear. Bits
+ * are only cleared by rebuilding the summary from the inuse lists.
+ */
+#define NOVA_TABLE_CHUNKS	512
+#define NOVA_CHUNK_INODES	(PAGE_SIZE >> NOVA_INODE_BITS)
+
+struct nova_table_summary {
+	__le64 bits[NOVA_TABLE_CHUNKS / 64];
+};
+
+#define NOVA_SUMMARY_MAGIC	0x4e4f5653	/* "NOVS" */
+#define NOVA_SUMMARIES_PER_PAGE	63
+
+/* Summaries of one CPU's superpages in table order, in a chain of pages */
+struct nova_summary_page {
+	struct nova_table_summary summary[NOVA_SUMMARIES_PER_PAGE];
+	__le32 magic;
+	__le32 index;		/* Position in the chain */
+	__le64 next_page;
+	__le64 padding[6];
 };
 
 static inline
@@ -535,21 +863,8 @@ struct inode_table *nova_get_inode_table(struct super_block *sb, int cpu)
 		return NULL;
 
 	return (struct inode_table *)((char *)nova_get_block(sb,
-		NOVA_DEF_BLOCK_SIZE_4K * 2) + cpu * CACHELINE_SIZE);
-}
-
-// BKDR String Hash Function
-static inline unsigned long BKDRHash(const char *str, int length)
-{
-	unsigned int seed = 131; // 31 131 1313 13131 131313 etc..
-	unsigned long hash = 0;
-	int i;
-
-	for (i = 0; i < length; i++) {
-		hash = hash * seed + (*str++);
-	}
-
-	return hash;
+		NOVA_DEF_BLOCK_SIZE_4K * (1 + nova_ptr_blocks(sbi->cpus))) +
+		cpu * CACHELINE_SIZE);
 }
 
 /* uses CPU instructions to atomically write up to 8 bytes */
@@ -593,6 +908,7 @@ static inline int memcpy_to_pmem_nocache(void *dst, const void *src,
 	int ret;
 
 	ret = __copy_from_user_inatomic_nocache(dst, src, size);
+	nova_persist_add(persist_nt_bytes, size - ret);
 
 	return ret;
 }
@@ -603,6 +919,7 @@ static inline void memset_nt(void *dest, uint32_t dword, size_t length)
 	uint64_t dummy1, dummy2;
 	uint64_t qword = ((uint64_t)dword << 32) | dword;
 
+	nova_persist_add(persist_nt_bytes, length);
 	asm volatile ("movl %%edx,%%ecx\n"
 		"andl $63,%%edx\n"
 		"shrl $6,%%ecx\n"
@@ -854,6 +1171,37 @@ static inline int is_dir_init_entry(struct super_block *sb,
 	return 0;
 }
 
+static inline int nova_hidden_dentry(struct inode *dir,
+	struct nova_dentry *entry)
+{
+	return dir->i_ino == NOVA_ROOT_INO &&
+		entry->name_len == NOVA_SNAPSHOT_DIR_LEN &&
+		strncmp(entry->name, NOVA_SNAPSHOT_DIR,
+			NOVA_SNAPSHOT_DIR_LEN) == 0;
+}
+
+/* Is this /.snapshots? */
+static inline int nova_snapshot_dir_dentry(struct dentry *dentry)
+{
+	return dentry->d_parent == dentry->d_sb->s_root &&
+		dentry->d_name.len == NOVA_SNAPSHOT_DIR_LEN &&
+		strncmp(dentry->d_name.name, NOVA_SNAPSHOT_DIR,
+			NOVA_SNAPSHOT_DIR_LEN) == 0;
+}
+
+/*
+ * Only the snapshot code may add, remove or rename /.snapshots and the
+ * snapshots in it. Everything below those is immutable.
+ */
+static inline int nova_snapshot_sealed(struct dentry *dentry)
+{
+	if (NOVA_SB(dentry->d_sb)->snapshot_task == current)
+		return 0;
+
+	return nova_snapshot_dir_dentry(dentry) ||
+		nova_snapshot_dir_dentry(dentry->d_parent);
+}
+
 #include "wprotect.h"
 
 /* Function Prototypes */
@@ -865,6 +1213,8 @@ void nova_delete_free_lists(struct super_block *sb);
 inline struct nova_range_node *nova_alloc_blocknode(struct super_block *sb);
 inline struct nova_range_node *nova_alloc_inode_node(struct super_block *sb);
 inline void nova_free_range_node(struct nova_range_node *node);
+struct nova_dir_node *nova_alloc_dir_node(struct super_block *sb);
+void nova_free_dir_node(struct nova_dir_node *node);
 inline void nova_free_blocknode(struct super_block *sb,
 	struct nova_range_node *bnode);
 inline void nova_free_inode_node(struct super_block *sb,
@@ -872,6 +1222,12 @@ inline void nova_free_inode_node(struct super_block *sb,
 extern void nova_init_blockmap(struct super_block *sb, int recovery);
 extern int nova_free_data_blocks(struct super_block *sb, struct nova_inode *pi,
 	unsigned long blocknr, int num);
+int nova_start_restricted_alloc(struct super_block *sb);
+void nova_end_restricted_alloc(struct super_block *sb,
+	unsigned long *bitmap);
+void nova_discard_restricted_alloc(struct super_block *sb);
+void nova_release_recovery_pool(struct super_block *sb);
+void nova_reserve_recovery_pool(struct super_block *sb);
 extern int nova_free_log_blocks(struct super_block *sb, struct nova_inode *pi,
 	unsigned long blocknr, int num);
 extern int nova_new_data_blocks(struct super_block *sb, struct nova_inode *pi,
@@ -880,6 +1236,7 @@ extern int nova_new_data_blocks(struct super_block *sb, struct nova_inode *pi,
 extern int nova_new_log_blocks(struct super_block *sb, struct nova_inode *pi,
 	unsigned long *blocknr, unsigned int num, int zero);
 extern unsigned long nova_count_free_blocks(struct super_block *sb);
+extern unsigned long nova_count_pool_blocks(struct super_block *sb);
 inline int nova_search_inodetree(struct nova_sb_info *sbi,
 	unsigned long ino, struct nova_range_node **ret_node);
 inline int nova_insert_blocktree(struct nova_sb_info *sbi,
@@ -897,10 +1254,22 @@ inline void set_bm(unsigned long bit, struct scan_bitmap *bm,
 int nova_rebuild_inode(struct super_block *sb, struct nova_inode_info *si,
 	u64 pi_addr);
 void nova_save_blocknode_mappings_to_log(struct super_block *sb);
-void nova_save_inode_list_to_log(struct super_block *sb);
+int nova_save_inode_list_to_log(struct super_block *sb);
+int nova_save_block_refs_to_log(struct super_block *sb);
 void nova_init_header(struct super_block *sb,
 	struct nova_inode_info_header *sih, u16 i_mode);
 int nova_recovery(struct super_block *sb);
+int nova_stop_bg_recovery(struct super_block *sb);
+
+/* ckpt.c */
+u64 nova_load_index_ckpt(struct super_block *sb, struct nova_inode *pi,
+	struct nova_inode_info_header *sih, unsigned long *total,
+	unsigned long *live);
+void nova_save_index_ckpt(struct super_block *sb, struct nova_inode *pi,
+	struct nova_inode_info_header *sih);
+void nova_free_index_ckpt(struct super_block *sb, struct nova_inode *pi);
+void nova_recover_index_ckpt(struct super_block *sb, struct nova_inode *pi,
+	struct scan_bitmap *bm);
 
 /*
  * Inodes and files operations
@@ -930,6 +1299,8 @@ void nova_print_dir_tree(struct super_block *sb,
 	struct nova_inode_info_header *sih, unsigned long ino);
 void nova_delete_dir_tree(struct super_block *sb,
 	struct nova_inode_info_header *sih);
+struct nova_dir_node *nova_find_dir_node(struct nova_inode_info_header *sih,
+	const char *name, unsigned long name_len);
 struct nova_dentry *nova_find_dentry(struct super_block *sb,
 	struct nova_inode *pi, struct inode *inode, const char *name,
 	unsigned long name_len);
@@ -942,12 +1313,35 @@ extern const struct inode_operations nova_file_inode_operations;
 extern const struct file_operations nova_dax_file_operations;
 int nova_fsync(struct file *file, loff_t start, loff_t end, int datasync);
 
+/* gc.c */
+extern unsigned int gc_chunk_pages;
+extern unsigned int gc_max_us;
+extern unsigned int gc_thorough_util;
+void nova_log_bytes_dead(struct super_block *sb,
+	struct nova_inode_info_header *sih, unsigned long len);
+void nova_update_gc_candidate(struct super_block *sb,
+	struct nova_inode_info_header *sih, bool cleaned);
+bool nova_log_gc_critical(struct super_block *sb,
+	struct nova_inode_info_header *sih);
+bool nova_queue_log_gc(struct super_block *sb,
+	struct nova_inode_info_header *sih, bool force);
+void nova_dequeue_log_gc(struct inode *inode);
+int nova_start_log_cleaners(struct super_block *sb);
+void nova_stop_log_cleaners(struct super_block *sb);
+
 /* inode.c */
 extern const struct address_space_operations nova_aops_dax;
 int nova_init_inode_inuse_list(struct super_block *sb);
 extern int nova_init_inode_table(struct super_block *sb);
 unsigned long nova_get_last_blocknr(struct super_block *sb,
 	struct nova_inode_info_header *sih);
+void nova_free_inode_table_index(struct super_block *sb);
+struct nova_summary_page *nova_get_summary_page(struct super_block *sb,
+	u64 block, unsigned int index);
+void nova_init_table_summaries(struct super_block *sb, int rebuild);
+void nova_free_table_summaries(struct super_block *sb);
+void nova_init_ino_caches(struct super_block *sb);
+void nova_drain_ino_caches(struct super_block *sb);
 int nova_get_inode_address(struct super_block *sb, u64 ino,
 	u64 *pi_addr, int extendable);
 int nova_set_blocksize_hint(struct super_block *sb, struct inode *inode,
@@ -959,10 +1353,15 @@ extern void nova_evict_inode(struct inode *inode);
 extern int nova_write_inode(struct inode *inode, struct writeback_control *wbc);
 extern void nova_dirty_inode(struct inode *inode, int flags);
 extern int nova_notify_change(struct dentry *dentry, struct iattr *attr);
+extern void nova_log_size_change(struct inode *inode, loff_t new_size);
+int nova_inode_log_gc(struct super_block *sb, struct nova_inode *pi,
+	struct nova_inode_info_header *sih);
 int nova_getattr(struct vfsmount *mnt, struct dentry *dentry,
 		struct kstat *stat);
 extern void nova_set_inode_flags(struct inode *inode, struct nova_inode *pi,
 	unsigned int flags);
+extern unsigned int nova_persistent_flags(struct inode *inode,
+	struct nova_inode *pi);
 extern unsigned long nova_find_region(struct inode *inode, loff_t *offset,
 		int hole);
 void nova_apply_setattr_entry(struct super_block *sb, struct nova_inode *pi,
@@ -980,6 +1379,11 @@ u64 nova_get_append_head(struct super_block *sb, struct nova_inode *pi,
 	int *extended);
 u64 nova_append_file_write_entry(struct super_block *sb, struct nova_inode *pi,
 	struct inode *inode, struct nova_file_write_entry *data, u64 tail);
+unsigned long nova_log_bytes_pinned(struct super_block *sb,
+	struct nova_inode_info_header *sih);
+void nova_rebuild_log_bytes(struct super_block *sb,
+	struct nova_inode_info_header *sih, unsigned long total,
+	unsigned long live);
 int nova_rebuild_file_inode_tree(struct super_block *sb,
 	struct nova_inode *pi, u64 pi_addr,
 	struct nova_inode_info_header *sih);
@@ -1009,6 +1413,33 @@ int nova_append_link_change_entry(struct super_block *sb,
 void nova_apply_link_change_entry(struct nova_inode *pi,
 	struct nova_link_change_entry *entry);
 
+/* reflink.c */
+int nova_share_data_blocks(struct super_block *sb, unsigned long blocknr,
+	unsigned long num);
+int nova_recover_block_refs(struct super_block *sb, unsigned long blocknr,
+	unsigned long num);
+int nova_put_data_blocks(struct super_block *sb, struct nova_inode *pi,
+	unsigned long blocknr, unsigned long num);
+bool nova_data_block_shared(struct super_block *sb, unsigned long blocknr);
+void nova_prune_block_refs(struct super_block *sb);
+void nova_destroy_block_refs(struct super_block *sb);
+int nova_insert_block_ref_range(struct super_block *sb, unsigned long low,
+	unsigned long high, unsigned long refcount);
+int nova_clone_file_range(struct file *file_in, loff_t pos_in,
+	struct file *file_out, loff_t pos_out, u64 len);
+int nova_clone_inode_data(struct inode *src, struct inode *dst);
+ssize_t nova_copy_file_range(struct file *file_in, loff_t pos_in,
+	struct file *file_out, loff_t pos_out, size_t len, unsigned int flags);
+long nova_unshare_file_blocks(struct inode *inode, unsigned long start,
+	unsigned long end);
+long nova_ioctl_clone(struct file *dst_file, unsigned long srcfd,
+	u64 off, u64 olen, u64 destoff);
+
+/* snapshot.c */
+int nova_create_snapshot(struct super_block *sb, const char *name);
+int nova_delete_snapshot(struct super_block *sb, const char *name);
+bool nova_in_snapshot(struct dentry *dentry);
+
 /* super.c */
 extern struct super_block *nova_read_super(struct super_block *sb, void *data,
 	int silent);
@@ -1026,12 +1457,21 @@ extern const struct inode_operations nova_symlink_inode_operations;
 extern const char *proc_dirname;
 extern struct proc_dir_entry *nova_proc_root;
 void nova_sysfs_init(struct super_block *sb);
+void nova_sysfs_init_stats(struct super_block *sb);
 void nova_sysfs_exit(struct super_block *sb);
 
 /* nova_stats.c */
-void nova_get_timing_stats(void);
+void nova_get_stats(struct super_block *sb, struct nova_stats *stats);
 void nova_print_timing_stats(struct super_block *sb);
-void nova_clear_stats(void);
+void nova_clear_stats(struct super_block *sb);
+void nova_init_timing(void);
+u64 nova_get_latency_hist(struct super_block *sb, int name, u64 *buckets,
+	u64 *max);
+u64 nova_hist_percentile(u64 *buckets, u64 count, u64 max,
+	unsigned int permyriad);
+void nova_get_persist_stats(struct super_block *sb, int op, u64 *stats);
+void nova_get_wa_stats(struct super_block *sb, struct nova_wa_stats *stats);
+void nova_start_wa_window(struct super_block *sb);
 void nova_print_inode_log(struct super_block *sb, struct inode *inode);
 void nova_print_inode_log_pages(struct super_block *sb, struct inode *inode);
 void nova_print_free_lists(struct super_block *sb);
@@ -22,6 +22,8 @@
 
 #include <linux/types.h>
 #include <linux/magic.h>
+#include <linux/percpu.h>
+#include <linux/list_bl.h>
 
 #define	NOVA_SUPER_MAGIC	0x4E4F5641	/* NOVA */
 
@@ -43,6 +45,8 @@
 #define NOVA_MOUNT_HUGEIOREMAP 0x000100        /* Huge mappings with ioremap */
 #define NOVA_MOUNT_FORMAT      0x000200        /* was FS formatted on mount? */
 #define NOVA_MOUNT_MOUNTING    0x000400        /* FS currently being mounted */
+#define NOVA_MOUNT_LOGV2       0x000800        /* Format with log format v2 */
+#define NOVA_MOUNT_REBUILD     0x001000        /* Keep fast rebuild metadata */
 
 /*
  * Maximal count of links to a file
@@ -111,9 +115,40 @@ struct nova_inode {
 		__le32 rdev;	/* major/minor # */
 	} dev;			/* device inode */
 
+	__le64	i_index_ckpt;	/* Index checkpoint block, see ckpt.c */
+
 	/* Leave 8 bytes for inode table tail pointer */
 } __attribute((__packed__));
 
+#define NOVA_INDEX_CKPT_MAGIC	0x4e4f5649	/* "NOVI" */
+#define NOVA_INDEX_CKPT_VERSION	1
+
+/*
+ * Header of a file inode index checkpoint. The extents follow it in the
+ * same run of blocks.
+ */
+struct nova_index_ckpt {
+	__le32	magic;
+	__le32	version;
+	__le64	nova_ino;
+	__le64	num_blocks;	/* Blocks taken by the checkpoint */
+	__le64	num_extents;
+	__le64	log_head;	/* Log head and tail when it was taken */
+	__le64	log_tail;
+	__le64	log_pages;	/* Log pages up to the tail page */
+	__le64	live_bytes;	/* Live and dead log bytes before log_tail */
+	__le64	dead_bytes;
+	__le64	last_setattr;
+	__le64	last_link_change;
+} __attribute((__packed__));
+
+/* Pages [pgoff, pgoff + num_pages) are mapped by the write entry */
+struct nova_index_extent {
+	__le64	pgoff;
+	__le64	num_pages;
+	__le64	entry;
+} __attribute((__packed__));
+
 
 #define NOVA_SB_SIZE 512       /* must be power of two */
 
@@ -133,9 +168,9 @@ struct nova_super_block {
 	/* static fields. they never change after file system creation.
 	 * checksum only validates up to s_start_dynamic field below */
 	__le16		s_sum;              /* checksum of this sb */
-	__le16		s_padding16;
+	__le16		s_cpus;             /* per-CPU structures on media */
 	__le32		s_magic;            /* magic signature */
-	__le32		s_padding32;
+	__le32		s_features;         /* on-media format features */
 	__le32		s_blocksize;        /* blocksize in bytes */
 	__le64		s_size;             /* total size of fs in bytes */
 	char		s_volume_name[16];  /* volume name */
@@ -149,8 +184,31 @@ struct nova_super_block {
 	__le32		s_wtime;            /* write time */
 	/* fields for fast mount support. Always keep them together */
 	__le64		s_num_free_blocks;
+
+	/*
+	 * Recovery pool: blocks [s_pool_start, s_pool_end) are kept out of
+	 * the free lists, and those from s_pool_next on have never been
+	 * handed out, so they are known free after a crash.
+	 */
+	__le64		s_pool_start;
+	__le64		s_pool_next;
+	__le64		s_pool_end;
 } __attribute((__packed__));
 
+/*
+ * Log format v2: every log entry starts on a cacheline and is padded to
+ * whole cachelines, so appending an entry flushes a single line.
+ */
+#define NOVA_FEATURE_LOG_V2	0x00000001
+/*
+ * Fast rebuild metadata: the recovery pool (s_pool_*), the inode table
+ * summaries (summary_head) and the index checkpoints (i_index_ckpt).
+ * Kernels without it would leave them stale, so it is incompatible, and
+ * only set when asked for with the rebuild mount option.
+ */
+#define NOVA_FEATURE_REBUILD	0x00000002
+#define NOVA_FEATURE_ALL	(NOVA_FEATURE_LOG_V2 | NOVA_FEATURE_REBUILD)
+
 #define NOVA_SB_STATIC_SIZE(ps) ((u64)&ps->s_start_dynamic - (u64)ps)
 
 /* the above fast mount fields take total 32 bytes in the super block */
@@ -163,6 +221,7 @@ struct nova_super_block {
 #define NOVA_INODELIST_INO	(4)
 #define NOVA_LITEJOURNAL_INO	(5)
 #define NOVA_INODELIST1_INO	(6)
+#define NOVA_BLOCKREF_INO	(7)	/* Shared block refcounts */
 
 #define	NOVA_ROOT_INO_START	(NOVA_SB_SIZE * 2)
 
@@ -201,6 +260,63 @@ extern int support_pcommit;
 #define _mm_pcommit()\
 	asm volatile(".byte 0x66, 0x0f, 0xae, 0xf8")
 
+/*
+ * Persistence cost accounting: cachelines flushed, fences and bytes
+ * stored non-temporally, per mount and operation class. Both belong to
+ * the task: nova_persist_begin() enters them with a context on the
+ * caller's stack, which the flush and fence hooks find in a table hashed
+ * by task, so the costs follow the task across sleeps and migrations.
+ * Costs outside these operations are not counted. The lookup is not
+ * free, so costs are only counted while measure_timing is on.
+ */
+enum persist_op {
+	PERSIST_WRITE = 0,
+	PERSIST_CREATE,
+	PERSIST_UNLINK,
+	PERSIST_GC,
+	PERSIST_JOURNAL,
+
+	/* Sentinel */
+	PERSIST_OP_NUM,
+};
+
+enum persist_stat {
+	persist_ops,
+	persist_flush_lines,
+	persist_fences,
+	persist_nt_bytes,
+
+	/* Sentinel */
+	PERSIST_STAT_NUM,
+};
+
+struct nova_stats;
+
+struct nova_persist_ctx {
+	struct hlist_bl_node node;
+	struct task_struct *task;	/* NULL if not entered */
+	struct nova_persist_ctx *outer;	/* Context of the task we nest in */
+	struct nova_stats __percpu *stats;	/* Of the mount operated on */
+	struct nova_stats __percpu *prev_stats;
+	int op;
+	int prev;			/* Class of outer to go back to */
+};
+
+extern int measure_timing;
+
+void nova_persist_account(int stat, u64 value);
+void nova_persist_begin(struct super_block *sb, struct nova_persist_ctx *ctx,
+	int op);
+void nova_persist_resume(struct super_block *sb,
+	struct nova_persist_ctx *ctx, int op);
+void nova_persist_end(struct nova_persist_ctx *ctx);
+
+static inline void nova_persist_add(int stat, u64 value)
+{
+	if (measure_timing)
+		nova_persist_account(stat, value);
+}
+
 /* Provides ordering from all previous clflush too */
 static inline void PERSISTENT_MARK(void)
 {
@@ -210,6 +326,7 @@ static inline void PERSISTENT_MARK(void)
 static inline void PERSISTENT_BARRIER(void)
 {
 	asm volatile ("sfence\n" : : );
+	nova_persist_add(persist_fences, 1);
 	if (support_pcommit) {
 		/* Do nothing */
 	}
@@ -219,6 +336,8 @@ static inline void nova_flush_buffer(void *buf, uint32_t len, bool fence)
 {
 	uint32_t i;
 	len = len + ((unsigned long)(buf) & (CACHELINE_SIZE - 1));
+	nova_persist_add(persist_flush_lines,
+			(len + CACHELINE_SIZE - 1) / CACHELINE_SIZE);
 	if (support_clwb) {
 		for (i = 0; i < len; i += CACHELINE_SIZE)
 			_mm_clwb(buf + i);
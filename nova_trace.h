@@ -0,0 +1,343 @@
+/*
+ * BRIEF DESCRIPTION
+ *
+ * Tracepoints on the write, allocation, GC, journal, fault and rebuild
+ * paths. They cost next to nothing until enabled through ftrace or perf.
+ *
+ * Copyright 2015-2016 Regents of the University of California,
+ * UCSD Non-Volatile Systems Lab, Andiry Xu <jix024@cs.ucsd.edu>
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2. This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM nova
+
+#if !defined(_TRACE_NOVA_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_NOVA_H
+
+#include <linux/tracepoint.h>
+#include <linux/fs.h>
+
+TRACE_EVENT(nova_cow_write_begin,
+	TP_PROTO(struct inode *inode, loff_t pos, size_t count),
+
+	TP_ARGS(inode, pos, count),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	ino)
+		__field(loff_t,		pos)
+		__field(size_t,		count)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= inode->i_sb->s_dev;
+		__entry->ino	= inode->i_ino;
+		__entry->pos	= pos;
+		__entry->count	= count;
+	),
+
+	TP_printk("dev %d,%d ino %lu pos %lld count %zu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->pos, __entry->count)
+);
+
+TRACE_EVENT(nova_cow_write_end,
+	TP_PROTO(struct inode *inode, ssize_t ret, unsigned long breaks),
+
+	TP_ARGS(inode, ret, breaks),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	ino)
+		__field(ssize_t,	ret)
+		__field(unsigned long,	breaks)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= inode->i_sb->s_dev;
+		__entry->ino	= inode->i_ino;
+		__entry->ret	= ret;
+		__entry->breaks	= breaks;
+	),
+
+	TP_printk("dev %d,%d ino %lu ret %zd breaks %lu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->ret, __entry->breaks)
+);
+
+TRACE_EVENT(nova_append_file_write_entry,
+	TP_PROTO(struct inode *inode, u64 curr_p, u64 pgoff, u32 num_pages,
+		 u64 block, u64 size),
+
+	TP_ARGS(inode, curr_p, pgoff, num_pages, block, size),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	ino)
+		__field(u64,		curr_p)
+		__field(u64,		pgoff)
+		__field(u32,		num_pages)
+		__field(u64,		block)
+		__field(u64,		size)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= inode->i_sb->s_dev;
+		__entry->ino		= inode->i_ino;
+		__entry->curr_p		= curr_p;
+		__entry->pgoff		= pgoff;
+		__entry->num_pages	= num_pages;
+		__entry->block		= block;
+		__entry->size		= size;
+	),
+
+	TP_printk("dev %d,%d ino %lu entry 0x%llx pgoff %llu pages %u "
+		  "block 0x%llx size %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->curr_p, __entry->pgoff, __entry->num_pages,
+		  __entry->block, __entry->size)
+);
+
+TRACE_EVENT(nova_new_blocks,
+	TP_PROTO(struct super_block *sb, unsigned long blocknr,
+		 unsigned long num_blocks, unsigned long allocated,
+		 unsigned short btype, int atype, int zero),
+
+	TP_ARGS(sb, blocknr, num_blocks, allocated, btype, atype, zero),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	blocknr)
+		__field(unsigned long,	num_blocks)
+		__field(unsigned long,	allocated)
+		__field(unsigned short,	btype)
+		__field(int,		atype)
+		__field(int,		zero)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= sb->s_dev;
+		__entry->blocknr	= blocknr;
+		__entry->num_blocks	= num_blocks;
+		__entry->allocated	= allocated;
+		__entry->btype		= btype;
+		__entry->atype		= atype;
+		__entry->zero		= zero;
+	),
+
+	TP_printk("dev %d,%d block %lu wanted %lu got %lu btype %u %s%s",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->blocknr,
+		  __entry->num_blocks, __entry->allocated, __entry->btype,
+		  __entry->atype == 1 ? "log" : "data",
+		  __entry->zero ? " zeroed" : "")
+);
+
+TRACE_EVENT(nova_free_blocks,
+	TP_PROTO(struct super_block *sb, unsigned long blocknr,
+		 unsigned long num_blocks, int log_page),
+
+	TP_ARGS(sb, blocknr, num_blocks, log_page),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	blocknr)
+		__field(unsigned long,	num_blocks)
+		__field(int,		log_page)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= sb->s_dev;
+		__entry->blocknr	= blocknr;
+		__entry->num_blocks	= num_blocks;
+		__entry->log_page	= log_page;
+	),
+
+	TP_printk("dev %d,%d block %lu count %lu %s",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->blocknr,
+		  __entry->num_blocks, __entry->log_page ? "log" : "data")
+);
+
+TRACE_EVENT(nova_fast_gc,
+	TP_PROTO(struct super_block *sb, unsigned long ino,
+		 unsigned long checked, unsigned long freed,
+		 unsigned long log_pages),
+
+	TP_ARGS(sb, ino, checked, freed, log_pages),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	ino)
+		__field(unsigned long,	checked)
+		__field(unsigned long,	freed)
+		__field(unsigned long,	log_pages)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= sb->s_dev;
+		__entry->ino		= ino;
+		__entry->checked	= checked;
+		__entry->freed		= freed;
+		__entry->log_pages	= log_pages;
+	),
+
+	TP_printk("dev %d,%d ino %lu checked %lu freed %lu log pages %lu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->checked, __entry->freed, __entry->log_pages)
+);
+
+TRACE_EVENT(nova_thorough_gc,
+	TP_PROTO(struct super_block *sb, unsigned long ino,
+		 unsigned long pages, unsigned long new_pages,
+		 unsigned long log_pages),
+
+	TP_ARGS(sb, ino, pages, new_pages, log_pages),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	ino)
+		__field(unsigned long,	pages)
+		__field(unsigned long,	new_pages)
+		__field(unsigned long,	log_pages)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= sb->s_dev;
+		__entry->ino		= ino;
+		__entry->pages		= pages;
+		__entry->new_pages	= new_pages;
+		__entry->log_pages	= log_pages;
+	),
+
+	TP_printk("dev %d,%d ino %lu compacted %lu pages into %lu "
+		  "log pages %lu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->pages, __entry->new_pages, __entry->log_pages)
+);
+
+TRACE_EVENT(nova_lite_journal_create,
+	TP_PROTO(struct super_block *sb, int cpu, u64 start, int words),
+
+	TP_ARGS(sb, cpu, start, words),
+
+	TP_STRUCT__entry(
+		__field(dev_t,	dev)
+		__field(int,	cpu)
+		__field(u64,	start)
+		__field(int,	words)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= sb->s_dev;
+		__entry->cpu	= cpu;
+		__entry->start	= start;
+		__entry->words	= words;
+	),
+
+	TP_printk("dev %d,%d journal %d start 0x%llx words %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->cpu,
+		  __entry->start, __entry->words)
+);
+
+TRACE_EVENT(nova_lite_journal_commit,
+	TP_PROTO(struct super_block *sb, int cpu, u64 start, int words,
+		 int out_of_order),
+
+	TP_ARGS(sb, cpu, start, words, out_of_order),
+
+	TP_STRUCT__entry(
+		__field(dev_t,	dev)
+		__field(int,	cpu)
+		__field(u64,	start)
+		__field(int,	words)
+		__field(int,	out_of_order)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= sb->s_dev;
+		__entry->cpu		= cpu;
+		__entry->start		= start;
+		__entry->words		= words;
+		__entry->out_of_order	= out_of_order;
+	),
+
+	TP_printk("dev %d,%d journal %d start 0x%llx words %d%s",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->cpu,
+		  __entry->start, __entry->words,
+		  __entry->out_of_order ? " out of order" : "")
+);
+
+TRACE_EVENT(nova_dax_fault,
+	TP_PROTO(struct inode *inode, unsigned long pgoff, unsigned int flags,
+		 int pmd, int ret),
+
+	TP_ARGS(inode, pgoff, flags, pmd, ret),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	ino)
+		__field(unsigned long,	pgoff)
+		__field(unsigned int,	flags)
+		__field(int,		pmd)
+		__field(int,		ret)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= inode->i_sb->s_dev;
+		__entry->ino	= inode->i_ino;
+		__entry->pgoff	= pgoff;
+		__entry->flags	= flags;
+		__entry->pmd	= pmd;
+		__entry->ret	= ret;
+	),
+
+	TP_printk("dev %d,%d ino %lu pgoff %lu flags 0x%x%s ret 0x%x",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->pgoff, __entry->flags, __entry->pmd ? " pmd" : "",
+		  __entry->ret)
+);
+
+TRACE_EVENT(nova_rebuild_inode,
+	TP_PROTO(struct super_block *sb, u64 ino, int dir,
+		 unsigned long log_pages, int from_ckpt, unsigned long live,
+		 unsigned long total),
+
+	TP_ARGS(sb, ino, dir, log_pages, from_ckpt, live, total),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(u64,		ino)
+		__field(int,		dir)
+		__field(unsigned long,	log_pages)
+		__field(int,		from_ckpt)
+		__field(unsigned long,	live)
+		__field(unsigned long,	total)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= sb->s_dev;
+		__entry->ino		= ino;
+		__entry->dir		= dir;
+		__entry->log_pages	= log_pages;
+		__entry->from_ckpt	= from_ckpt;
+		__entry->live		= live;
+		__entry->total		= total;
+	),
+
+	TP_printk("dev %d,%d %s %llu log pages %lu live %lu of %lu bytes%s",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->dir ? "dir" : "file", __entry->ino,
+		  __entry->log_pages, __entry->live, __entry->total,
+		  __entry->from_ckpt ? " from checkpoint" : "")
+);
+
+#endif /* _TRACE_NOVA_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE nova_trace
+#include <trace/define_trace.h>
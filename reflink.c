@@ -0,0 +1,961 @@
+/*
+ * BRIEF DESCRIPTION
+ *
+ * Data block sharing (reflink) for NOVA.
+ *
+ * Blocks are owned by a single write entry unless they appear in the
+ * block reference tree. A block in the tree is referenced by
+ * refcount write entries, all of them flagged NOVA_WRITE_SHARED, which
+ * lets failure recovery rebuild the counts by scanning the logs.
+ *
+ * Copyright 2015-2016 Regents of the University of California,
+ * UCSD Non-Volatile Systems Lab, Andiry Xu <jix024@cs.ucsd.edu>
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2. This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/file.h>
+#include <linux/mount.h>
+#include "nova.h"
+
+/************************ Block reference tree **************************/
+
+static inline struct nova_block_ref_node *nova_alloc_block_ref_node(void)
+{
+	return kmalloc(sizeof(struct nova_block_ref_node), GFP_NOFS);
+}
+
+static inline void nova_free_block_ref_node(struct nova_block_ref_node *node)
+{
+	kfree(node);
+}
+
+/* Return the lowest node whose range ends at or after blocknr */
+static struct nova_block_ref_node *nova_find_block_ref_node(
+	struct nova_sb_info *sbi, unsigned long blocknr)
+{
+	struct nova_block_ref_node *curr, *ret = NULL;
+	struct rb_node *temp = sbi->block_ref_tree.rb_node;
+
+	while (temp) {
+		curr = container_of(temp, struct nova_block_ref_node, node);
+		if (curr->range_high >= blocknr) {
+			ret = curr;
+			if (curr->range_low <= blocknr)
+				break;
+			temp = temp->rb_left;
+		} else {
+			temp = temp->rb_right;
+		}
+	}
+
+	return ret;
+}
+
+static int nova_insert_block_ref_node(struct nova_sb_info *sbi,
+	struct nova_block_ref_node *new_node)
+{
+	struct nova_block_ref_node *curr;
+	struct rb_node **temp, *parent = NULL;
+
+	temp = &(sbi->block_ref_tree.rb_node);
+	while (*temp) {
+		curr = container_of(*temp, struct nova_block_ref_node, node);
+		parent = *temp;
+
+		if (new_node->range_high < curr->range_low) {
+			temp = &((*temp)->rb_left);
+		} else if (new_node->range_low > curr->range_high) {
+			temp = &((*temp)->rb_right);
+		} else {
+			nova_dbg("%s: range %lu - %lu overlaps %lu - %lu\n",
+				__func__, new_node->range_low,
+				new_node->range_high, curr->range_low,
+				curr->range_high);
+			return -EINVAL;
+		}
+	}
+
+	rb_link_node(&new_node->node, parent, temp);
+	rb_insert_color(&new_node->node, &sbi->block_ref_tree);
+	sbi->num_block_ref_nodes++;
+
+	return 0;
+}
+
+static void nova_erase_block_ref_node(struct nova_sb_info *sbi,
+	struct nova_block_ref_node *node)
+{
+	rb_erase(&node->node, &sbi->block_ref_tree);
+	sbi->num_block_ref_nodes--;
+	sbi->num_shared_blocks -= node->range_high - node->range_low + 1;
+	nova_free_block_ref_node(node);
+}
+
+static int nova_new_block_ref_node(struct nova_sb_info *sbi,
+	unsigned long low, unsigned long high, unsigned long refcount)
+{
+	struct nova_block_ref_node *node;
+	int ret;
+
+	node = nova_alloc_block_ref_node();
+	if (!node)
+		return -ENOMEM;
+
+	node->range_low = low;
+	node->range_high = high;
+	node->refcount = refcount;
+	ret = nova_insert_block_ref_node(sbi, node);
+	if (ret) {
+		nova_free_block_ref_node(node);
+		return ret;
+	}
+
+	sbi->num_shared_blocks += high - low + 1;
+	return 0;
+}
+
+/* Split node at blocknr; the returned node covers [blocknr, range_high] */
+static struct nova_block_ref_node *nova_split_block_ref_node(
+	struct nova_sb_info *sbi, struct nova_block_ref_node *node,
+	unsigned long blocknr)
+{
+	struct nova_block_ref_node *new_node;
+	unsigned long high = node->range_high;
+
+	new_node = nova_alloc_block_ref_node();
+	if (!new_node)
+		return NULL;
+
+	node->range_high = blocknr - 1;
+	new_node->range_low = blocknr;
+	new_node->range_high = high;
+	new_node->refcount = node->refcount;
+	if (nova_insert_block_ref_node(sbi, new_node)) {
+		node->range_high = high;
+		nova_free_block_ref_node(new_node);
+		return NULL;
+	}
+
+	return new_node;
+}
+
+/*
+ * Isolate the part of the tree covering [blocknr, end].
+ * Returns the node starting at blocknr, or NULL if blocknr is not shared;
+ * *next is set to the first block after the returned range or hole.
+ */
+static int nova_isolate_block_ref_range(struct nova_sb_info *sbi,
+	unsigned long blocknr, unsigned long end,
+	struct nova_block_ref_node **ret_node, unsigned long *next)
+{
+	struct nova_block_ref_node *node;
+
+	*ret_node = NULL;
+	node = nova_find_block_ref_node(sbi, blocknr);
+	if (!node || node->range_low > end) {
+		*next = end + 1;
+		return 0;
+	}
+
+	if (node->range_low > blocknr) {
+		*next = node->range_low;
+		return 0;
+	}
+
+	if (node->range_low < blocknr) {
+		node = nova_split_block_ref_node(sbi, node, blocknr);
+		if (!node)
+			return -ENOMEM;
+	}
+
+	if (node->range_high > end) {
+		if (!nova_split_block_ref_node(sbi, node, end + 1))
+			return -ENOMEM;
+	}
+
+	*ret_node = node;
+	*next = node->range_high + 1;
+	return 0;
+}
+
+/*
+ * Undo nova_inc_block_refs() for [blocknr, end]. The range was isolated
+ * by the increments, so no node has to be split here.
+ */
+static void nova_undo_block_refs(struct nova_sb_info *sbi,
+	unsigned long blocknr, unsigned long end, unsigned long init_count)
+{
+	struct nova_block_ref_node *node;
+	unsigned long curr = blocknr;
+	unsigned long next;
+
+	while (curr <= end) {
+		if (nova_isolate_block_ref_range(sbi, curr, end,
+							&node, &next))
+			break;
+
+		if (node) {
+			node->refcount--;
+			if (node->refcount < init_count)
+				nova_erase_block_ref_node(sbi, node);
+		}
+		curr = next;
+	}
+}
+
+/*
+ * Add one reference to each block in [blocknr, blocknr + num).
+ * Blocks not in the tree start at init_count. On failure no reference
+ * is taken.
+ */
+static int nova_inc_block_refs(struct super_block *sb,
+	unsigned long blocknr, unsigned long num, unsigned long init_count)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_block_ref_node *node;
+	unsigned long curr = blocknr;
+	unsigned long end = blocknr + num - 1;
+	unsigned long next;
+	int ret = 0;
+
+	if (num == 0)
+		return 0;
+
+	mutex_lock(&sbi->block_ref_mutex);
+	while (curr <= end) {
+		ret = nova_isolate_block_ref_range(sbi, curr, end,
+							&node, &next);
+		if (ret)
+			break;
+
+		if (node) {
+			node->refcount++;
+		} else {
+			ret = nova_new_block_ref_node(sbi, curr, next - 1,
+							init_count);
+			if (ret)
+				break;
+		}
+		curr = next;
+	}
+
+	if (ret && curr > blocknr)
+		nova_undo_block_refs(sbi, blocknr, curr - 1, init_count);
+	mutex_unlock(&sbi->block_ref_mutex);
+
+	if (ret)
+		nova_err(sb, "%s: failed to share blocks %lu - %lu: %d\n",
+				__func__, blocknr, end, ret);
+	return ret;
+}
+
+int nova_share_data_blocks(struct super_block *sb, unsigned long blocknr,
+	unsigned long num)
+{
+	return nova_inc_block_refs(sb, blocknr, num, 2);
+}
+
+/* Called by failure recovery for each live block of a shared write entry */
+int nova_recover_block_refs(struct super_block *sb, unsigned long blocknr,
+	unsigned long num)
+{
+	return nova_inc_block_refs(sb, blocknr, num, 1);
+}
+
+/*
+ * Drop one reference to each block in [blocknr, blocknr + num) and free
+ * the blocks nobody else references. Replaces nova_free_data_blocks()
+ * for file data.
+ */
+int nova_put_data_blocks(struct super_block *sb, struct nova_inode *pi,
+	unsigned long blocknr, unsigned long num)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_block_ref_node *node;
+	unsigned long curr = blocknr;
+	unsigned long end = blocknr + num - 1;
+	unsigned long next;
+	int freed = 0;
+	int ret = 0;
+
+	if (num == 0)
+		return 0;
+
+	/*
+	 * While failure recovery is still counting references, the free is
+	 * deferred and sorted out once the counts are complete.
+	 */
+	if (sbi->num_shared_blocks == 0 || READ_ONCE(sbi->restricted_alloc)) {
+		nova_free_data_blocks(sb, pi, blocknr, num);
+		return num;
+	}
+
+	mutex_lock(&sbi->block_ref_mutex);
+	while (curr <= end) {
+		ret = nova_isolate_block_ref_range(sbi, curr, end,
+							&node, &next);
+		if (ret) {
+			/* Leak rather than free a block that may be shared */
+			nova_err(sb, "%s: failed to release blocks %lu - %lu\n",
+					__func__, curr, end);
+			break;
+		}
+
+		if (node) {
+			node->refcount--;
+			if (node->refcount <= 1)
+				nova_erase_block_ref_node(sbi, node);
+		} else {
+			nova_free_data_blocks(sb, pi, curr, next - curr);
+			freed += next - curr;
+		}
+		curr = next;
+	}
+	mutex_unlock(&sbi->block_ref_mutex);
+
+	return freed;
+}
+
+bool nova_data_block_shared(struct super_block *sb, unsigned long blocknr)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_block_ref_node *node;
+	bool ret;
+
+	/* Reference counts are incomplete until recovery is done */
+	if (READ_ONCE(sbi->restricted_alloc))
+		return true;
+
+	if (sbi->num_shared_blocks == 0)
+		return false;
+
+	mutex_lock(&sbi->block_ref_mutex);
+	node = nova_find_block_ref_node(sbi, blocknr);
+	ret = node && node->range_low <= blocknr;
+	mutex_unlock(&sbi->block_ref_mutex);
+
+	return ret;
+}
+
+/*
+ * After failure recovery: drop blocks with a single reference and merge
+ * adjacent ranges with equal counts.
+ */
+void nova_prune_block_refs(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_block_ref_node *curr, *prev = NULL;
+	struct rb_node *temp;
+
+	mutex_lock(&sbi->block_ref_mutex);
+	temp = rb_first(&sbi->block_ref_tree);
+	while (temp) {
+		curr = container_of(temp, struct nova_block_ref_node, node);
+		temp = rb_next(temp);
+
+		if (curr->refcount <= 1) {
+			nova_erase_block_ref_node(sbi, curr);
+			continue;
+		}
+
+		if (prev && prev->range_high + 1 == curr->range_low &&
+				prev->refcount == curr->refcount) {
+			prev->range_high = curr->range_high;
+			rb_erase(&curr->node, &sbi->block_ref_tree);
+			sbi->num_block_ref_nodes--;
+			nova_free_block_ref_node(curr);
+			continue;
+		}
+		prev = curr;
+	}
+	mutex_unlock(&sbi->block_ref_mutex);
+
+	nova_dbg("%s: %lu shared blocks in %lu ranges\n", __func__,
+			sbi->num_shared_blocks, sbi->num_block_ref_nodes);
+}
+
+void nova_destroy_block_refs(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_block_ref_node *curr;
+	struct rb_node *temp;
+
+	mutex_lock(&sbi->block_ref_mutex);
+	temp = rb_first(&sbi->block_ref_tree);
+	while (temp) {
+		curr = container_of(temp, struct nova_block_ref_node, node);
+		temp = rb_next(temp);
+		nova_erase_block_ref_node(sbi, curr);
+	}
+	mutex_unlock(&sbi->block_ref_mutex);
+}
+
+/* Used by the clean mount path to reload the saved tree */
+int nova_insert_block_ref_range(struct super_block *sb, unsigned long low,
+	unsigned long high, unsigned long refcount)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	int ret;
+
+	mutex_lock(&sbi->block_ref_mutex);
+	ret = nova_new_block_ref_node(sbi, low, high, refcount);
+	mutex_unlock(&sbi->block_ref_mutex);
+
+	return ret;
+}
+
+/**************************** Clone files ******************************/
+
+/* Flag an existing write entry in place before its blocks get shared */
+static void nova_set_write_entry_shared(struct nova_file_write_entry *entry)
+{
+	if (entry->flags & cpu_to_le32(NOVA_WRITE_SHARED))
+		return;
+
+	entry->flags |= cpu_to_le32(NOVA_WRITE_SHARED);
+	nova_flush_buffer(&entry->flags, sizeof(entry->flags), 0);
+}
+
+static void nova_init_clone_entry(struct super_block *sb,
+	struct nova_inode *pi, struct nova_file_write_entry *entry,
+	unsigned long pgoff, unsigned long blocknr, unsigned int num,
+	u64 size, u32 time, u32 flags)
+{
+	entry->pgoff = cpu_to_le64(pgoff);
+	entry->num_pages = cpu_to_le32(num);
+	entry->invalid_pages = 0;
+	entry->block = cpu_to_le64(nova_get_block_off(sb, blocknr,
+							pi->i_blk_type));
+	entry->mtime = cpu_to_le32(time);
+	entry->flags = cpu_to_le32(flags);
+	/* Set entry type after set block */
+	nova_set_entry_type((void *)entry, FILE_WRITE);
+	entry->size = cpu_to_le64(size);
+}
+
+/* Drop the references taken by uncommitted entries in [begin, end) */
+static void nova_cleanup_incomplete_clone(struct super_block *sb,
+	struct nova_inode *pi, u64 begin_tail, u64 end_tail)
+{
+	struct nova_file_write_entry *entry;
+	size_t entry_size = nova_write_entry_len(sb);
+	u64 curr_p = begin_tail;
+
+	if (begin_tail == 0 || end_tail == 0)
+		return;
+
+	while (curr_p != end_tail) {
+		if (is_last_entry(curr_p, entry_size))
+			curr_p = next_log_page(sb, curr_p);
+
+		if (curr_p == 0)
+			return;
+
+		entry = (struct nova_file_write_entry *)
+					nova_get_block(sb, curr_p);
+		if (nova_get_entry_type(entry) == FILE_WRITE)
+			nova_put_data_blocks(sb, pi, entry->block >> PAGE_SHIFT,
+						entry->num_pages);
+		curr_p += entry_size;
+	}
+}
+
+/* Does dst have data in [pgoff, pgoff + num)? */
+static bool nova_range_has_data(struct super_block *sb,
+	struct nova_inode_info_header *sih, unsigned long pgoff,
+	unsigned long num)
+{
+	struct nova_file_write_entry *entry;
+
+	if (radix_tree_lookup(&sih->tree, pgoff))
+		return true;
+
+	entry = nova_find_next_entry(sb, sih, pgoff);
+	return entry && entry->pgoff < pgoff + num;
+}
+
+/*
+ * Make [dst_pgoff, dst_pgoff + num_pages) of dst share the blocks of
+ * [src_pgoff, src_pgoff + num_pages) of src. Holes in src become zeroed
+ * blocks in dst only where dst has data to hide. Both inodes are locked.
+ */
+static int nova_clone_pages(struct super_block *sb, struct inode *src,
+	unsigned long src_pgoff, struct inode *dst, unsigned long dst_pgoff,
+	unsigned long num_pages, u64 new_size)
+{
+	struct nova_inode_info *src_si = NOVA_I(src);
+	struct nova_inode_info *dst_si = NOVA_I(dst);
+	struct nova_inode_info_header *src_sih = &src_si->header;
+	struct nova_inode_info_header *dst_sih = &dst_si->header;
+	struct nova_inode *pi = nova_get_inode(sb, dst);
+	struct nova_file_write_entry *entry;
+	struct nova_file_write_entry entry_data;
+	unsigned long done = 0;
+	unsigned long nvmm, num, blocknr = 0;
+	unsigned long total_blocks = 0;
+	unsigned int data_bits;
+	u64 temp_tail, begin_tail = 0;
+	u64 curr_entry;
+	u32 time;
+	u32 flags;
+	int ret = 0;
+
+	time = CURRENT_TIME_SEC.tv_sec;
+	temp_tail = pi->log_tail;
+
+	while (done < num_pages) {
+		unsigned long pgoff = src_pgoff + done;
+
+		entry = nova_get_write_entry(sb, src_si, pgoff);
+		if (entry) {
+			/* Extend over the pages still mapped by this entry */
+			num = 1;
+			while (done + num < num_pages && num < UINT_MAX &&
+					radix_tree_lookup(&src_sih->tree,
+						pgoff + num) == entry)
+				num++;
+
+			nvmm = get_nvmm(sb, src_sih, entry, pgoff);
+			nova_set_write_entry_shared(entry);
+			ret = nova_share_data_blocks(sb, nvmm, num);
+			if (ret)
+				goto out;
+
+			flags = NOVA_WRITE_SHARED;
+		} else {
+			entry = nova_find_next_entry(sb, src_sih, pgoff);
+			num = num_pages - done;
+			if (entry && entry->pgoff - pgoff < num)
+				num = entry->pgoff - pgoff;
+
+			if (!nova_range_has_data(sb, dst_sih,
+						dst_pgoff + done, num)) {
+				done += num;
+				continue;
+			}
+
+			ret = nova_new_data_blocks(sb, pi, &blocknr, num,
+						dst_pgoff + done, 1, 1);
+			if (ret <= 0) {
+				ret = ret ? ret : -ENOSPC;
+				goto out;
+			}
+
+			num = ret;
+			nvmm = blocknr;
+			flags = 0;
+		}
+
+		nova_init_clone_entry(sb, pi, &entry_data, dst_pgoff + done,
+					nvmm, num, new_size, time, flags);
+
+		curr_entry = nova_append_file_write_entry(sb, pi, dst,
+						&entry_data, temp_tail);
+		if (curr_entry == 0) {
+			nova_dbg("%s: append inode entry failed\n", __func__);
+			nova_put_data_blocks(sb, pi, nvmm, num);
+			ret = -ENOSPC;
+			goto out;
+		}
+
+		if (begin_tail == 0)
+			begin_tail = curr_entry;
+		temp_tail = curr_entry + nova_write_entry_len(sb);
+		total_blocks += num;
+		done += num;
+	}
+
+	ret = 0;
+	if (begin_tail == 0) {
+		/* Only holes were cloned, but the size may still grow */
+		if (new_size > i_size_read(dst))
+			nova_log_size_change(dst, new_size);
+		return 0;
+	}
+
+	nova_memunlock_inode(sb, pi);
+	data_bits = blk_type_to_shift[pi->i_blk_type];
+	le64_add_cpu(&pi->i_blocks,
+			(total_blocks << (data_bits - sb->s_blocksize_bits)));
+	nova_memlock_inode(sb, pi);
+
+	nova_update_tail(sb, pi, temp_tail);
+
+	/* Drop the references of the replaced blocks after commit */
+	ret = nova_reassign_file_tree(sb, pi, dst_sih, begin_tail);
+	dst->i_blocks = le64_to_cpu(pi->i_blocks);
+	return ret;
+
+out:
+	nova_cleanup_incomplete_clone(sb, pi, begin_tail, temp_tail);
+	return ret;
+}
+
+/*
+ * Share len bytes of src at pos_in with dst at pos_out.
+ * Offsets must be block aligned; len must be too unless the range ends at
+ * EOF of src and covers the end of dst. len == 0 clones up to EOF.
+ */
+int nova_clone_file_range(struct file *file_in, loff_t pos_in,
+	struct file *file_out, loff_t pos_out, u64 len)
+{
+	struct inode *src = file_inode(file_in);
+	struct inode *dst = file_inode(file_out);
+	struct super_block *sb = dst->i_sb;
+	struct nova_inode_info *dst_si = NOVA_I(dst);
+	struct nova_inode_info_header *dst_sih = &dst_si->header;
+	unsigned long blocksize = sb->s_blocksize;
+	unsigned long num_pages;
+	loff_t src_size;
+	u64 new_size;
+	int ret;
+	timing_t clone_time;
+
+	if (src->i_sb != dst->i_sb)
+		return -EXDEV;
+
+	if (!S_ISREG(src->i_mode) || !S_ISREG(dst->i_mode))
+		return -EINVAL;
+
+	if (pos_in < 0 || pos_out < 0 || (loff_t)len < 0 ||
+			(loff_t)(pos_in + len) < pos_in ||
+			(loff_t)(pos_out + len) < pos_out)
+		return -EINVAL;
+
+	/* Sharing needs the reference counts failure recovery rebuilds */
+	if (READ_ONCE(NOVA_SB(sb)->restricted_alloc))
+		return -EBUSY;
+
+	NOVA_START_TIMING(clone_file_t, clone_time);
+
+	sb_start_write(sb);
+	lock_two_nondirectories(src, dst);
+
+	if (IS_APPEND(dst) || IS_IMMUTABLE(dst)) {
+		ret = -EPERM;
+		goto out;
+	}
+
+	/* mmap is in place, so a shared page must not be writable through it */
+	if (mapping_mapped(dst->i_mapping) ||
+			mapping_writably_mapped(src->i_mapping)) {
+		ret = -EACCES;
+		goto out;
+	}
+
+	src_size = i_size_read(src);
+	if (pos_in >= src_size) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (len == 0 || pos_in + len > src_size)
+		len = src_size - pos_in;
+
+	ret = -EINVAL;
+	if ((pos_in | pos_out) & (blocksize - 1))
+		goto out;
+
+	if (len & (blocksize - 1)) {
+		if (pos_in + len != src_size ||
+				pos_out + len < i_size_read(dst))
+			goto out;
+	}
+
+	if (src == dst && pos_out + len > pos_in && pos_in + len > pos_out)
+		goto out;
+
+	if (pos_out + len > sb->s_maxbytes) {
+		ret = -EFBIG;
+		goto out;
+	}
+
+	ret = file_remove_privs(file_out);
+	if (ret)
+		goto out;
+
+	num_pages = (len + blocksize - 1) >> sb->s_blocksize_bits;
+	new_size = max_t(u64, i_size_read(dst), pos_out + len);
+
+	nova_dbgv("%s: inode %lu @ %lld -> inode %lu @ %lld, %llu bytes\n",
+			__func__, src->i_ino, pos_in, dst->i_ino, pos_out, len);
+
+	ret = nova_clone_pages(sb, src, pos_in >> sb->s_blocksize_bits,
+				dst, pos_out >> sb->s_blocksize_bits,
+				num_pages, new_size);
+	if (ret)
+		goto out;
+
+	dst->i_ctime = dst->i_mtime = CURRENT_TIME_SEC;
+	if (new_size > i_size_read(dst)) {
+		i_size_write(dst, new_size);
+		dst_sih->i_size = new_size;
+	}
+
+	NOVA_STATS_ADD(sb, clone_bytes, len);
+
+out:
+	unlock_two_nondirectories(src, dst);
+	sb_end_write(sb);
+	NOVA_END_TIMING(sb, clone_file_t, clone_time);
+	return ret;
+}
+
+/*
+ * Make the empty regular file dst share all data of src. Used for
+ * snapshot copies, which are taken with the filesystem frozen, so no
+ * sb_start_write() here. Both inodes are locked.
+ */
+int nova_clone_inode_data(struct inode *src, struct inode *dst)
+{
+	struct super_block *sb = dst->i_sb;
+	struct nova_inode_info *dst_si = NOVA_I(dst);
+	struct nova_inode_info_header *dst_sih = &dst_si->header;
+	unsigned long num_pages;
+	loff_t src_size;
+	int ret;
+
+	if (mapping_writably_mapped(src->i_mapping) ||
+			READ_ONCE(NOVA_SB(sb)->restricted_alloc))
+		return -EBUSY;
+
+	src_size = i_size_read(src);
+	if (src_size == 0)
+		return 0;
+
+	num_pages = (src_size + sb->s_blocksize - 1) >> sb->s_blocksize_bits;
+	ret = nova_clone_pages(sb, src, 0, dst, 0, num_pages, src_size);
+	if (ret)
+		return ret;
+
+	i_size_write(dst, src_size);
+	dst_sih->i_size = src_size;
+	NOVA_STATS_ADD(sb, clone_bytes, src_size);
+	return 0;
+}
+
+/*
+ * copy_file_range() shares the block aligned part of the range and lets
+ * the VFS fall back to a data copy for anything else.
+ */
+ssize_t nova_copy_file_range(struct file *file_in, loff_t pos_in,
+	struct file *file_out, loff_t pos_out, size_t len, unsigned int flags)
+{
+	struct super_block *sb = file_inode(file_out)->i_sb;
+	loff_t src_size = i_size_read(file_inode(file_in));
+	size_t count = len;
+	int ret;
+
+	if (file_inode(file_in)->i_sb != sb)
+		return -EXDEV;
+
+	if ((pos_in | pos_out) & (sb->s_blocksize - 1))
+		return -EOPNOTSUPP;
+
+	if (pos_in >= src_size)
+		return 0;
+
+	if (pos_in + count > src_size)
+		count = src_size - pos_in;
+
+	/* An unaligned tail can only be shared if it becomes the new EOF */
+	if (pos_in + count != src_size ||
+			pos_out + count < i_size_read(file_inode(file_out)))
+		count &= ~((size_t)sb->s_blocksize - 1);
+
+	if (count == 0)
+		return -EOPNOTSUPP;
+
+	ret = nova_clone_file_range(file_in, pos_in, file_out, pos_out, count);
+
+	return ret ? ret : count;
+}
+
+/*
+ * Give the file private copies of its shared blocks in [start, end). Used
+ * on write faults through shared mappings, since DAX mmap writes blocks in
+ * place. Returns the number of blocks copied. Called with i_mutex held.
+ */
+long nova_unshare_file_blocks(struct inode *inode, unsigned long start,
+	unsigned long end)
+{
+	struct super_block *sb = inode->i_sb;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_inode_info *si = NOVA_I(inode);
+	struct nova_inode_info_header *sih = &si->header;
+	struct nova_inode *pi = nova_get_inode(sb, inode);
+	struct nova_file_write_entry *entry;
+	struct nova_file_write_entry entry_data;
+	unsigned long pgoff = start;
+	unsigned long nvmm, blocknr, num, i;
+	unsigned long total_blocks = 0;
+	unsigned int data_bits;
+	u64 temp_tail, begin_tail = 0;
+	u64 curr_entry;
+	void *src_addr, *dst_addr;
+	u32 time;
+	int allocated;
+	int ret = 0;
+
+	if (sbi->num_shared_blocks == 0 && !READ_ONCE(sbi->restricted_alloc))
+		return 0;
+
+	time = CURRENT_TIME_SEC.tv_sec;
+	temp_tail = pi->log_tail;
+
+	while (pgoff < end) {
+		entry = radix_tree_lookup(&sih->tree, pgoff);
+		if (!entry) {
+			/* We are finding a hole. Jump to the next entry. */
+			entry = nova_find_next_entry(sb, sih, pgoff);
+			if (!entry)
+				break;
+			pgoff++;
+			pgoff = pgoff > entry->pgoff ? pgoff : entry->pgoff;
+			continue;
+		}
+
+		if (!(entry->flags & cpu_to_le32(NOVA_WRITE_SHARED)) ||
+				!nova_data_block_shared(sb,
+					get_nvmm(sb, sih, entry, pgoff))) {
+			pgoff++;
+			continue;
+		}
+
+		/* Copy the run of shared pages this entry still maps */
+		num = 1;
+		while (pgoff + num < end &&
+				radix_tree_lookup(&sih->tree,
+						pgoff + num) == entry &&
+				nova_data_block_shared(sb,
+					get_nvmm(sb, sih, entry, pgoff + num)))
+			num++;
+
+		allocated = nova_new_data_blocks(sb, pi, &blocknr, num,
+						pgoff, 0, 1);
+		if (allocated <= 0) {
+			ret = allocated ? allocated : -ENOSPC;
+			goto out;
+		}
+
+		nvmm = get_nvmm(sb, sih, entry, pgoff);
+		for (i = 0; i < allocated; i++) {
+			src_addr = nova_get_block(sb, (nvmm + i) << PAGE_SHIFT);
+			dst_addr = nova_get_block(sb,
+					(blocknr + i) << PAGE_SHIFT);
+			memcpy(dst_addr, src_addr, PAGE_SIZE);
+			nova_flush_buffer(dst_addr, PAGE_SIZE, 0);
+		}
+
+		nova_init_clone_entry(sb, pi, &entry_data, pgoff, blocknr,
+					allocated, inode->i_size, time, 0);
+
+		curr_entry = nova_append_file_write_entry(sb, pi, inode,
+						&entry_data, temp_tail);
+		if (curr_entry == 0) {
+			nova_free_data_blocks(sb, pi, blocknr, allocated);
+			ret = -ENOSPC;
+			goto out;
+		}
+
+		if (begin_tail == 0)
+			begin_tail = curr_entry;
+		temp_tail = curr_entry + nova_write_entry_len(sb);
+		total_blocks += allocated;
+		pgoff += allocated;
+	}
+
+out:
+	if (begin_tail == 0)
+		return ret;
+
+	/* Commit what was copied even on failure; it is all valid data */
+	nova_memunlock_inode(sb, pi);
+	data_bits = blk_type_to_shift[pi->i_blk_type];
+	le64_add_cpu(&pi->i_blocks,
+			(total_blocks << (data_bits - sb->s_blocksize_bits)));
+	nova_memlock_inode(sb, pi);
+
+	nova_update_tail(sb, pi, temp_tail);
+	nova_reassign_file_tree(sb, pi, sih, begin_tail);
+	inode->i_blocks = le64_to_cpu(pi->i_blocks);
+
+	nova_dbgv("%s: inode %lu, unshared %lu blocks\n", __func__,
+			inode->i_ino, total_blocks);
+	return ret ? ret : total_blocks;
+}
+
+/*
+ * What rw_verify_area() checks for each side of the clone; it is not
+ * exported to modules.
+ */
+static int nova_clone_verify_area(struct file *file, loff_t pos, u64 len,
+	bool write)
+{
+	struct inode *inode = file_inode(file);
+
+	if (pos < 0 || (loff_t)len < 0 || (loff_t)(pos + len) < pos)
+		return -EINVAL;
+
+	if (likely(!inode->i_flctx || !mandatory_lock(inode)))
+		return 0;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+	return locks_mandatory_area(inode, file, pos,
+			len ? pos + len - 1 : OFFSET_MAX,
+			write ? F_WRLCK : F_RDLCK);
+#else
+	return locks_mandatory_area(write ? FLOCK_VERIFY_WRITE :
+			FLOCK_VERIFY_READ, inode, file, pos, len);
+#endif
+}
+
+/* FICLONE and FICLONERANGE for kernels without ->clone_file_range */
+long nova_ioctl_clone(struct file *dst_file, unsigned long srcfd,
+	u64 off, u64 olen, u64 destoff)
+{
+	struct fd src_file;
+	int ret;
+
+	ret = mnt_want_write_file(dst_file);
+	if (ret)
+		return ret;
+
+	src_file = fdget(srcfd);
+	if (!src_file.file) {
+		ret = -EBADF;
+		goto out_drop_write;
+	}
+
+	ret = -EXDEV;
+	if (src_file.file->f_path.mnt != dst_file->f_path.mnt)
+		goto out_fput;
+
+	ret = -EBADF;
+	if (!(src_file.file->f_mode & FMODE_READ) ||
+			!(dst_file->f_mode & FMODE_WRITE) ||
+			(dst_file->f_flags & O_APPEND))
+		goto out_fput;
+
+	ret = nova_clone_verify_area(src_file.file, off, olen, false);
+	if (ret)
+		goto out_fput;
+
+	ret = nova_clone_verify_area(dst_file, destoff, olen, true);
+	if (ret)
+		goto out_fput;
+
+	ret = nova_clone_file_range(src_file.file, off, dst_file,
+					destoff, olen);
+
+out_fput:
+	fdput(src_file);
+out_drop_write:
+	mnt_drop_write_file(dst_file);
+	return ret;
+}
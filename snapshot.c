@@ -0,0 +1,571 @@
+/*
+ * BRIEF DESCRIPTION
+ *
+ * Read-only snapshots.
+ *
+ * A snapshot is a copy of the namespace under /.snapshots/<name>.
+ * Regular files share their data blocks with the live files through the
+ * block refcounts (see reflink.c), so only metadata is copied. Blocks
+ * referenced by a snapshot are therefore never freed by the write path or
+ * by truncation of the live file; log GC only moves log entries. Deleting
+ * a snapshot drops its references and reclaims the blocks no one else
+ * uses. The copies are immutable, /.snapshots and the snapshot roots in
+ * it can only be changed by the snapshot code, and the filesystem is
+ * frozen while a snapshot is created or deleted.
+ *
+ * Copyright 2015-2016 Regents of the University of California,
+ * UCSD Non-Volatile Systems Lab, Andiry Xu <jix024@cs.ucsd.edu>
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2. This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+
+#include <linux/fs.h>
+#include <linux/namei.h>
+#include <linux/slab.h>
+#include <linux/cred.h>
+#include <linux/capability.h>
+#include "nova.h"
+
+struct nova_snapshot_work {
+	struct list_head list;
+	struct inode *src;
+	struct dentry *dst;
+};
+
+struct nova_snapshot_ctx {
+	struct super_block *sb;
+	struct list_head dirs;		/* Directories left to copy */
+	struct list_head links;		/* Hard linked files, sealed last */
+	struct radix_tree_root link_tree;	/* Source ino -> link work */
+};
+
+/*
+ * The copy creates device nodes in directories of any mode, and sets
+ * owners, modes, times and flags the caller may not own. The ioctl only
+ * requires CAP_SYS_ADMIN, so grant the rest for the copy and the removal,
+ * like overlayfs does for its copy up. Prepared before the freeze.
+ */
+static struct cred *nova_snapshot_creds(void)
+{
+	struct cred *cred = prepare_creds();
+
+	if (!cred)
+		return NULL;
+
+	cap_raise(cred->cap_effective, CAP_DAC_OVERRIDE);
+	cap_raise(cred->cap_effective, CAP_DAC_READ_SEARCH);
+	cap_raise(cred->cap_effective, CAP_FOWNER);
+	cap_raise(cred->cap_effective, CAP_FSETID);
+	cap_raise(cred->cap_effective, CAP_CHOWN);
+	cap_raise(cred->cap_effective, CAP_MKNOD);
+	cap_raise(cred->cap_effective, CAP_LINUX_IMMUTABLE);
+	return cred;
+}
+
+static bool nova_valid_snapshot_name(const char *name)
+{
+	size_t len = strlen(name);
+
+	if (len == 0 || len > NOVA_NAME_LEN || strchr(name, '/'))
+		return false;
+
+	return strcmp(name, ".") && strcmp(name, "..");
+}
+
+/* Is dentry /.snapshots or below it? */
+bool nova_in_snapshot(struct dentry *dentry)
+{
+	bool ret = false;
+
+	rcu_read_lock();
+	while (!IS_ROOT(dentry)) {
+		if (nova_snapshot_dir_dentry(dentry)) {
+			ret = true;
+			break;
+		}
+		dentry = READ_ONCE(dentry->d_parent);
+	}
+	rcu_read_unlock();
+
+	return ret;
+}
+
+static int nova_snapshot_set_flags(struct inode *inode, unsigned int flags)
+{
+	struct super_block *sb = inode->i_sb;
+	struct nova_inode *pi = nova_get_inode(sb, inode);
+	u64 new_tail = 0;
+	int ret;
+
+	mutex_lock(&inode->i_mutex);
+	inode->i_ctime = CURRENT_TIME_SEC;
+	nova_set_inode_flags(inode, pi, flags);
+
+	nova_memunlock_inode(sb, pi);
+	ret = nova_append_link_change_entry(sb, pi, inode, 0, &new_tail);
+	if (!ret)
+		nova_update_tail(sb, pi, new_tail);
+	nova_memlock_inode(sb, pi);
+	mutex_unlock(&inode->i_mutex);
+
+	return ret;
+}
+
+static int nova_snapshot_unseal(struct inode *inode)
+{
+	struct nova_inode *pi = nova_get_inode(inode->i_sb, inode);
+	unsigned int flags = nova_persistent_flags(inode, pi);
+
+	if (!(flags & (FS_IMMUTABLE_FL | FS_APPEND_FL)))
+		return 0;
+
+	return nova_snapshot_set_flags(inode,
+				flags & ~(FS_IMMUTABLE_FL | FS_APPEND_FL));
+}
+
+/* Copy the attributes of src to dst and make dst immutable */
+static int nova_snapshot_seal(struct inode *src, struct dentry *dst)
+{
+	struct inode *inode = dst->d_inode;
+	struct nova_inode *src_pi = nova_get_inode(src->i_sb, src);
+	struct iattr attr;
+	int ret;
+
+	attr.ia_valid = ATTR_UID | ATTR_GID | ATTR_ATIME | ATTR_MTIME |
+			ATTR_ATIME_SET | ATTR_MTIME_SET;
+	if (!S_ISLNK(src->i_mode))
+		attr.ia_valid |= ATTR_MODE;
+	attr.ia_mode = src->i_mode;
+	attr.ia_uid = src->i_uid;
+	attr.ia_gid = src->i_gid;
+	attr.ia_atime = src->i_atime;
+	attr.ia_mtime = src->i_mtime;
+
+	mutex_lock(&inode->i_mutex);
+	ret = nova_notify_change(dst, &attr);
+	mutex_unlock(&inode->i_mutex);
+	if (ret)
+		return ret;
+
+	return nova_snapshot_set_flags(inode,
+			nova_persistent_flags(src, src_pi) | FS_IMMUTABLE_FL);
+}
+
+static int nova_snapshot_create_inode(struct inode *src, struct inode *dir,
+	struct dentry *dentry)
+{
+	struct super_block *sb = src->i_sb;
+
+	switch (src->i_mode & S_IFMT) {
+	case S_IFDIR:
+		return vfs_mkdir(dir, dentry, src->i_mode);
+	case S_IFREG:
+		return vfs_create(dir, dentry, src->i_mode, true);
+	case S_IFLNK:
+		return vfs_symlink(dir, dentry, nova_get_symlink_target(sb,
+						nova_get_inode(sb, src)));
+	default:
+		return vfs_mknod(dir, dentry, src->i_mode, src->i_rdev);
+	}
+}
+
+/*
+ * Directories are sealed after their entries are created, and hard linked
+ * files after all their links are. Takes over the references.
+ */
+static int nova_snapshot_defer(struct nova_snapshot_ctx *ctx,
+	struct inode *src, struct dentry *dst)
+{
+	struct nova_snapshot_work *work;
+	int ret;
+
+	work = kmalloc(sizeof(struct nova_snapshot_work), GFP_KERNEL);
+	if (!work)
+		return -ENOMEM;
+
+	work->src = src;
+	work->dst = dst;
+
+	if (S_ISDIR(src->i_mode)) {
+		list_add(&work->list, &ctx->dirs);
+		return 0;
+	}
+
+	ret = radix_tree_insert(&ctx->link_tree, src->i_ino, work);
+	if (ret) {
+		kfree(work);
+		return ret;
+	}
+
+	list_add_tail(&work->list, &ctx->links);
+	return 0;
+}
+
+static int nova_snapshot_copy_entry(struct nova_snapshot_ctx *ctx,
+	struct dentry *parent, struct nova_dentry *entry)
+{
+	struct super_block *sb = ctx->sb;
+	struct inode *dir = parent->d_inode;
+	struct nova_snapshot_work *link = NULL;
+	struct inode *src;
+	struct dentry *dentry;
+	int ret;
+
+	src = nova_iget(sb, le64_to_cpu(entry->ino));
+	if (IS_ERR(src))
+		return PTR_ERR(src);
+
+	if (!S_ISDIR(src->i_mode) && src->i_nlink > 1)
+		link = radix_tree_lookup(&ctx->link_tree, src->i_ino);
+
+	mutex_lock_nested(&dir->i_mutex, I_MUTEX_PARENT);
+	dentry = lookup_one_len(entry->name, parent, entry->name_len);
+	if (IS_ERR(dentry)) {
+		mutex_unlock(&dir->i_mutex);
+		ret = PTR_ERR(dentry);
+		goto out;
+	}
+
+	if (link)
+		ret = vfs_link(link->dst, dir, dentry, NULL);
+	else
+		ret = nova_snapshot_create_inode(src, dir, dentry);
+	mutex_unlock(&dir->i_mutex);
+	if (ret || link)
+		goto out_dput;
+
+	if (S_ISREG(src->i_mode)) {
+		lock_two_nondirectories(src, dentry->d_inode);
+		ret = nova_clone_inode_data(src, dentry->d_inode);
+		unlock_two_nondirectories(src, dentry->d_inode);
+		if (ret)
+			goto out_dput;
+	}
+
+	if (S_ISDIR(src->i_mode) || src->i_nlink > 1) {
+		ret = nova_snapshot_defer(ctx, src, dentry);
+		if (ret == 0)
+			return 0;
+		goto out_dput;
+	}
+
+	ret = nova_snapshot_seal(src, dentry);
+
+out_dput:
+	dput(dentry);
+out:
+	iput(src);
+	return ret;
+}
+
+/* The source tree is stable: the filesystem is frozen */
+static int nova_snapshot_copy_dir(struct nova_snapshot_ctx *ctx,
+	struct inode *src, struct dentry *dst)
+{
+	struct super_block *sb = ctx->sb;
+	struct nova_inode_info *si = NOVA_I(src);
+	struct nova_inode_info_header *sih = &si->header;
+	struct nova_dir_node *node;
+	struct nova_dentry *entry;
+	unsigned long bkt;
+	int ret;
+
+	nova_dir_for_each_node(sih, bkt, node) {
+		entry = node->direntry;
+		if (is_dir_init_entry(sb, entry) ||
+				nova_hidden_dentry(src, entry))
+			continue;
+
+		ret = nova_snapshot_copy_entry(ctx, dst, entry);
+		if (ret)
+			return ret;
+	}
+
+	return nova_snapshot_seal(src, dst);
+}
+
+static void nova_snapshot_put_work(struct nova_snapshot_work *work)
+{
+	list_del(&work->list);
+	if (work->src)
+		iput(work->src);
+	dput(work->dst);
+	kfree(work);
+}
+
+static struct dentry *nova_get_snapshot_dir(struct super_block *sb,
+	bool create)
+{
+	struct dentry *root = sb->s_root;
+	struct inode *dir = root->d_inode;
+	struct dentry *dentry;
+	int ret;
+
+	mutex_lock_nested(&dir->i_mutex, I_MUTEX_PARENT);
+	dentry = lookup_one_len(NOVA_SNAPSHOT_DIR, root,
+					NOVA_SNAPSHOT_DIR_LEN);
+	if (!IS_ERR(dentry) && d_really_is_negative(dentry)) {
+		ret = create ? vfs_mkdir(dir, dentry, S_IRWXU | S_IRGRP |
+					S_IXGRP | S_IROTH | S_IXOTH) : -ENOENT;
+		if (ret) {
+			dput(dentry);
+			dentry = ERR_PTR(ret);
+		}
+	}
+	mutex_unlock(&dir->i_mutex);
+
+	return dentry;
+}
+
+static struct nova_dentry *nova_first_child(struct inode *dir)
+{
+	struct super_block *sb = dir->i_sb;
+	struct nova_inode_info *si = NOVA_I(dir);
+	struct nova_inode_info_header *sih = &si->header;
+	struct nova_dir_node *node;
+	unsigned long bkt;
+
+	nova_dir_for_each_node(sih, bkt, node) {
+		if (!is_dir_init_entry(sb, node->direntry))
+			return node->direntry;
+	}
+
+	return NULL;
+}
+
+/* Depth first removal of a snapshot tree, with an explicit stack */
+static int nova_remove_snapshot_tree(struct dentry *top)
+{
+	struct nova_snapshot_work *work;
+	struct nova_dentry *entry;
+	struct dentry *dentry, *child, *parent;
+	struct inode *dir;
+	LIST_HEAD(stack);
+	int ret;
+
+	ret = nova_snapshot_unseal(top->d_inode);
+	if (ret)
+		return ret;
+
+	work = kzalloc(sizeof(struct nova_snapshot_work), GFP_KERNEL);
+	if (!work)
+		return -ENOMEM;
+	work->dst = dget(top);
+	list_add(&work->list, &stack);
+
+	while (!list_empty(&stack)) {
+		work = list_first_entry(&stack, struct nova_snapshot_work,
+					list);
+		dentry = work->dst;
+		dir = dentry->d_inode;
+
+		entry = nova_first_child(dir);
+		if (!entry) {
+			parent = dget_parent(dentry);
+			mutex_lock_nested(&parent->d_inode->i_mutex,
+						I_MUTEX_PARENT);
+			ret = vfs_rmdir(parent->d_inode, dentry);
+			mutex_unlock(&parent->d_inode->i_mutex);
+			dput(parent);
+			nova_snapshot_put_work(work);
+			if (ret)
+				break;
+			continue;
+		}
+
+		mutex_lock_nested(&dir->i_mutex, I_MUTEX_PARENT);
+		child = lookup_one_len(entry->name, dentry, entry->name_len);
+		mutex_unlock(&dir->i_mutex);
+		if (IS_ERR(child)) {
+			ret = PTR_ERR(child);
+			break;
+		}
+
+		ret = nova_snapshot_unseal(child->d_inode);
+		if (ret) {
+			dput(child);
+			break;
+		}
+
+		if (d_is_dir(child)) {
+			work = kzalloc(sizeof(struct nova_snapshot_work),
+					GFP_KERNEL);
+			if (!work) {
+				dput(child);
+				ret = -ENOMEM;
+				break;
+			}
+			work->dst = child;
+			list_add(&work->list, &stack);
+			continue;
+		}
+
+		mutex_lock_nested(&dir->i_mutex, I_MUTEX_PARENT);
+		ret = vfs_unlink(dir, child, NULL);
+		mutex_unlock(&dir->i_mutex);
+		dput(child);
+		if (ret)
+			break;
+	}
+
+	while (!list_empty(&stack)) {
+		work = list_first_entry(&stack, struct nova_snapshot_work,
+					list);
+		nova_snapshot_put_work(work);
+	}
+
+	return ret;
+}
+
+int nova_create_snapshot(struct super_block *sb, const char *name)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_snapshot_ctx ctx;
+	struct nova_snapshot_work *work;
+	struct inode *root = sb->s_root->d_inode;
+	struct dentry *snapdir, *dentry;
+	const struct cred *old_cred;
+	struct cred *cred;
+	int ret;
+	timing_t snapshot_time;
+
+	if (!nova_valid_snapshot_name(name))
+		return -EINVAL;
+
+	cred = nova_snapshot_creds();
+	if (!cred)
+		return -ENOMEM;
+
+	NOVA_START_TIMING(create_snapshot_t, snapshot_time);
+	mutex_lock(&sbi->snapshot_mutex);
+	ret = freeze_super(sb);
+	if (ret)
+		goto out;
+	sbi->snapshot_task = current;
+	old_cred = override_creds(cred);
+
+	snapdir = nova_get_snapshot_dir(sb, true);
+	if (IS_ERR(snapdir)) {
+		ret = PTR_ERR(snapdir);
+		goto out_thaw;
+	}
+
+	mutex_lock_nested(&snapdir->d_inode->i_mutex, I_MUTEX_PARENT);
+	dentry = lookup_one_len(name, snapdir, strlen(name));
+	if (IS_ERR(dentry))
+		ret = PTR_ERR(dentry);
+	else if (d_really_is_positive(dentry))
+		ret = -EEXIST;
+	else
+		ret = vfs_mkdir(snapdir->d_inode, dentry, root->i_mode);
+	mutex_unlock(&snapdir->d_inode->i_mutex);
+	if (ret)
+		goto out_dput;
+
+	ctx.sb = sb;
+	INIT_LIST_HEAD(&ctx.dirs);
+	INIT_LIST_HEAD(&ctx.links);
+	INIT_RADIX_TREE(&ctx.link_tree, GFP_KERNEL);
+
+	ret = nova_snapshot_defer(&ctx, igrab(root), dget(dentry));
+	if (ret) {
+		iput(root);
+		dput(dentry);
+	}
+
+	while (!list_empty(&ctx.dirs)) {
+		work = list_first_entry(&ctx.dirs, struct nova_snapshot_work,
+					list);
+		if (ret == 0)
+			ret = nova_snapshot_copy_dir(&ctx, work->src,
+						work->dst);
+		nova_snapshot_put_work(work);
+	}
+
+	while (!list_empty(&ctx.links)) {
+		work = list_first_entry(&ctx.links, struct nova_snapshot_work,
+					list);
+		if (ret == 0)
+			ret = nova_snapshot_seal(work->src, work->dst);
+		radix_tree_delete(&ctx.link_tree, work->src->i_ino);
+		nova_snapshot_put_work(work);
+	}
+
+	if (ret) {
+		nova_dbg("%s: snapshot %s failed %d\n", __func__, name, ret);
+		nova_remove_snapshot_tree(dentry);
+	}
+
+out_dput:
+	if (!IS_ERR(dentry))
+		dput(dentry);
+	dput(snapdir);
+out_thaw:
+	revert_creds(old_cred);
+	sbi->snapshot_task = NULL;
+	thaw_super(sb);
+out:
+	mutex_unlock(&sbi->snapshot_mutex);
+	put_cred(cred);
+	NOVA_END_TIMING(sb, create_snapshot_t, snapshot_time);
+	return ret;
+}
+
+int nova_delete_snapshot(struct super_block *sb, const char *name)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct dentry *snapdir, *dentry;
+	const struct cred *old_cred;
+	struct cred *cred;
+	int ret;
+	timing_t snapshot_time;
+
+	if (!nova_valid_snapshot_name(name))
+		return -EINVAL;
+
+	cred = nova_snapshot_creds();
+	if (!cred)
+		return -ENOMEM;
+
+	NOVA_START_TIMING(delete_snapshot_t, snapshot_time);
+	mutex_lock(&sbi->snapshot_mutex);
+	ret = freeze_super(sb);
+	if (ret)
+		goto out;
+	sbi->snapshot_task = current;
+	old_cred = override_creds(cred);
+
+	snapdir = nova_get_snapshot_dir(sb, false);
+	if (IS_ERR(snapdir)) {
+		ret = PTR_ERR(snapdir);
+		goto out_thaw;
+	}
+
+	mutex_lock_nested(&snapdir->d_inode->i_mutex, I_MUTEX_PARENT);
+	dentry = lookup_one_len(name, snapdir, strlen(name));
+	mutex_unlock(&snapdir->d_inode->i_mutex);
+	if (IS_ERR(dentry)) {
+		ret = PTR_ERR(dentry);
+		goto out_dput;
+	}
+
+	if (d_really_is_negative(dentry))
+		ret = -ENOENT;
+	else
+		ret = nova_remove_snapshot_tree(dentry);
+	dput(dentry);
+
+out_dput:
+	dput(snapdir);
+out_thaw:
+	revert_creds(old_cred);
+	sbi->snapshot_task = NULL;
+	thaw_super(sb);
+out:
+	mutex_unlock(&sbi->snapshot_mutex);
+	put_cred(cred);
+	NOVA_END_TIMING(sb, delete_snapshot_t, snapshot_time);
+	return ret;
+}
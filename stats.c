@@ -18,6 +18,8 @@
  * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <linux/delay.h>
+#include <linux/hash.h>
 #include "nova.h"
 
 const char *Timingstring[TIMING_NUM] = 
@@ -46,6 +48,7 @@ const char *Timingstring[TIMING_NUM] =
 	"cow_write",
 	"copy_to_nvmm",
 	"dax_get_block",
+	"clone_file",
 
 	"memcpy_read_nvmm",
 	"memcpy_write_nvmm",
@@ -68,6 +71,10 @@ const char *Timingstring[TIMING_NUM] =
 	"log_fast_gc",
 	"log_thorough_gc",
 	"check_invalid_log",
+	"log_cleaner",
+
+	"create_snapshot",
+	"delete_snapshot",
 
 	"find_cache_page",
 	"assign_blocks",
@@ -86,169 +93,380 @@ const char *Timingstring[TIMING_NUM] =
 	"rebuild_file",
 };
 
-u64 Timingstats[TIMING_NUM];
-DEFINE_PER_CPU(u64[TIMING_NUM], Timingstats_percpu);
-u64 Countstats[TIMING_NUM];
-DEFINE_PER_CPU(u64[TIMING_NUM], Countstats_percpu);
-u64 IOstats[STATS_NUM];
-DEFINE_PER_CPU(u64[STATS_NUM], IOstats_percpu);
+const char *Persiststring[PERSIST_OP_NUM] =
+{
+	"write",
+	"create",
+	"unlink",
+	"gc",
+	"journal",
+};
 
-static void nova_print_alloc_stats(struct super_block *sb)
+const char *IOstring[STATS_NUM] =
 {
-	struct nova_sb_info *sbi = NOVA_SB(sb);
-	struct free_list *free_list;
-	unsigned long alloc_log_count = 0;
-	unsigned long alloc_log_pages = 0;
-	unsigned long alloc_data_count = 0;
-	unsigned long alloc_data_pages = 0;
-	unsigned long free_log_count = 0;
-	unsigned long freed_log_pages = 0;
-	unsigned long free_data_count = 0;
-	unsigned long freed_data_pages = 0;
+	"alloc_steps",
+	"write_breaks",
+	"read_bytes",
+	"cow_write_bytes",
+	"clone_bytes",
+	"fast_checked_pages",
+	"thorough_checked_pages",
+	"fast_gc_pages",
+	"thorough_gc_pages",
+	"gc_queued",
+	"gc_inline",
+	"journal_full",
+	"journal_ooo_commits",
+	"index_ckpt_saved",
+	"index_ckpt_loaded",
+};
+
+const char *WAstring[WA_NUM] =
+{
+	"user",
+	"partial",
+	"log",
+	"gc",
+	"zero",
+	"journal",
+};
+
+DEFINE_PER_CPU(u32[TIMING_NUM], Samplecount_percpu);
+u32 nova_cycles_mult;
+
+/* Persistence contexts of the tasks inside an operation */
+#define NOVA_PERSIST_HASH_BITS	8
+static struct hlist_bl_head nova_persist_tasks[1 << NOVA_PERSIST_HASH_BITS];
+
+static inline struct hlist_bl_head *nova_persist_bucket(
+	struct task_struct *task)
+{
+	return &nova_persist_tasks[hash_ptr(task, NOVA_PERSIST_HASH_BITS)];
+}
+
+/* The outermost context of task. Called with its bucket locked. */
+static struct nova_persist_ctx *nova_persist_find(struct hlist_bl_head *head,
+	struct task_struct *task)
+{
+	struct nova_persist_ctx *ctx;
+	struct hlist_bl_node *pos;
+
+	hlist_bl_for_each_entry(ctx, pos, head, node) {
+		if (ctx->task == task)
+			return ctx;
+	}
+
+	return NULL;
+}
+
+/*
+ * Charges value to the mount and class the current task is in. Costs
+ * outside any operation have no mount to go to and are not counted.
+ */
+void nova_persist_account(int stat, u64 value)
+{
+	struct hlist_bl_head *head = nova_persist_bucket(current);
+	struct nova_persist_ctx *ctx;
+
+	hlist_bl_lock(head);
+	ctx = nova_persist_find(head, current);
+	if (ctx)
+		this_cpu_add(ctx->stats->persist[ctx->op][stat], value);
+	hlist_bl_unlock(head);
+}
+
+static void nova_persist_enter(struct super_block *sb,
+	struct nova_persist_ctx *ctx, int op)
+{
+	struct hlist_bl_head *head = nova_persist_bucket(current);
+	struct nova_persist_ctx *outer;
+
+	ctx->task = current;
+	ctx->stats = NOVA_SB(sb)->stats;
+	ctx->op = op;
+	hlist_bl_lock(head);
+	outer = nova_persist_find(head, current);
+	ctx->outer = outer;
+	if (outer) {
+		/* Only the outermost context is in the table */
+		ctx->prev_stats = outer->stats;
+		ctx->prev = outer->op;
+		outer->stats = ctx->stats;
+		outer->op = op;
+	} else {
+		hlist_bl_add_head(&ctx->node, head);
+	}
+	hlist_bl_unlock(head);
+}
+
+/*
+ * Enters class op of sb for the current task and counts one operation of
+ * it. Every call must be paired with nova_persist_end() before ctx goes
+ * out of scope.
+ */
+void nova_persist_begin(struct super_block *sb, struct nova_persist_ctx *ctx,
+	int op)
+{
+	ctx->task = NULL;
+	if (!measure_timing)
+		return;
+
+	nova_persist_enter(sb, ctx, op);
+	this_cpu_inc(NOVA_SB(sb)->stats->persist[op][persist_ops]);
+}
+
+/* Go on with an operation already counted by nova_persist_begin() */
+void nova_persist_resume(struct super_block *sb,
+	struct nova_persist_ctx *ctx, int op)
+{
+	ctx->task = NULL;
+	if (measure_timing)
+		nova_persist_enter(sb, ctx, op);
+}
+
+void nova_persist_end(struct nova_persist_ctx *ctx)
+{
+	struct hlist_bl_head *head;
+
+	if (!ctx->task)
+		return;
+
+	head = nova_persist_bucket(ctx->task);
+	hlist_bl_lock(head);
+	if (ctx->outer) {
+		ctx->outer->stats = ctx->prev_stats;
+		ctx->outer->op = ctx->prev;
+	} else {
+		hlist_bl_del(&ctx->node);
+	}
+	hlist_bl_unlock(head);
+}
+
+/* ns per cycle << NOVA_CYCLES_SHIFT, from the raw clock over 10 ms */
+static int nova_calibrate_cycles(void)
+{
+	u64 ns, cycles;
+	cycles_t c0, c1;
+
+	ns = ktime_get_raw_ns();
+	c0 = get_cycles();
+	mdelay(10);
+	c1 = get_cycles();
+	ns = ktime_get_raw_ns() - ns;
+
+	/* Architectures without a cycle counter read 0 */
+	if (c1 <= c0)
+		return -EINVAL;
+
+	cycles = c1 - c0;
+	nova_cycles_mult = div64_u64(ns << NOVA_CYCLES_SHIFT, cycles);
+	nova_info("NOVA: cycle counter at %llu kHz\n",
+			div64_u64(cycles * 1000000, ns));
+	return 0;
+}
+
+#define NOVA_TIMING_BENCH_LOOPS	10000
+
+/* Average cost in ns of one timed section with the given backend */
+static u64 nova_bench_timing(int mode)
+{
+	int saved_mode = measure_timing;
+	unsigned int saved_sample = timing_sample;
+	timing_t bench_time;
+	u64 ns;
 	int i;
 
-	printk("=========== NOVA allocation stats ===========\n");
-	printk("Alloc %llu, alloc steps %llu, average %llu\n",
-		Countstats[new_data_blocks_t], IOstats[alloc_steps],
-		Countstats[new_data_blocks_t] ?
-			IOstats[alloc_steps] / Countstats[new_data_blocks_t] : 0);
-	printk("Free %llu\n", Countstats[free_data_t]);
-	printk("Fast GC %llu, check pages %llu, free pages %llu, average %llu\n",
-		Countstats[fast_gc_t], IOstats[fast_checked_pages],
-		IOstats[fast_gc_pages], Countstats[fast_gc_t] ?
-			IOstats[fast_gc_pages] / Countstats[fast_gc_t] : 0);
-	printk("Thorough GC %llu, checked pages %llu, free pages %llu, "
-		"average %llu\n", Countstats[thorough_gc_t],
-		IOstats[thorough_checked_pages], IOstats[thorough_gc_pages],
-		Countstats[thorough_gc_t] ?
-			IOstats[thorough_gc_pages] / Countstats[thorough_gc_t] : 0);
+	measure_timing = mode;
+	timing_sample = 1;
+	ns = ktime_get_raw_ns();
+	for (i = 0; i < NOVA_TIMING_BENCH_LOOPS; i++) {
+		NOVA_START_TIMING(init_t, bench_time);
+		nova_timing_delta(bench_time);
+	}
+	ns = ktime_get_raw_ns() - ns;
+	measure_timing = saved_mode;
+	timing_sample = saved_sample;
 
-	for (i = 0; i < sbi->cpus; i++) {
-		free_list = nova_get_free_list(sb, i);
+	return div_u64(ns, NOVA_TIMING_BENCH_LOOPS);
+}
 
-		alloc_log_count += free_list->alloc_log_count;
-		alloc_log_pages += free_list->alloc_log_pages;
-		alloc_data_count += free_list->alloc_data_count;
-		alloc_data_pages += free_list->alloc_data_pages;
-		free_log_count += free_list->free_log_count;
-		freed_log_pages += free_list->freed_log_pages;
-		free_data_count += free_list->free_data_count;
-		freed_data_pages += free_list->freed_data_pages;
+/*
+ * Calibrate the cycle counter and report what timing costs per section
+ * with each backend. Runs at module load, before any mount.
+ */
+void nova_init_timing(void)
+{
+	bool has_cycles = nova_calibrate_cycles() == 0;
+	u64 clock_ns, cycles_ns = 0;
+
+	if (!has_cycles && measure_timing == NOVA_TIMING_CYCLES) {
+		nova_info("NOVA: no cycle counter, timing with the clock\n");
+		measure_timing = NOVA_TIMING_CLOCK;
 	}
 
-	printk("alloc log count %lu, allocated log pages %lu, "
-		"alloc data count %lu, allocated data pages %lu, "
-		"free log count %lu, freed log pages %lu, "
-		"free data count %lu, freed data pages %lu\n",
-		alloc_log_count, alloc_log_pages,
-		alloc_data_count, alloc_data_pages,
-		free_log_count, freed_log_pages,
-		free_data_count, freed_data_pages);
+	clock_ns = nova_bench_timing(NOVA_TIMING_CLOCK);
+	if (has_cycles)
+		cycles_ns = nova_bench_timing(NOVA_TIMING_CYCLES);
+
+	nova_info("NOVA: timing costs %llu ns per section with the clock, "
+		"%llu ns with the cycle counter%s, sampling 1 in %u\n",
+		clock_ns, cycles_ns, has_cycles ? "" : " (none)",
+		max(timing_sample, 1U));
 }
 
-static void nova_print_IO_stats(struct super_block *sb)
-{
-	printk("=========== NOVA I/O stats ===========\n");
-	printk("Read %llu, bytes %llu, average %llu\n",
-		Countstats[dax_read_t], IOstats[read_bytes],
-		Countstats[dax_read_t] ?
-			IOstats[read_bytes] / Countstats[dax_read_t] : 0);
-	printk("COW write %llu, bytes %llu, average %llu, "
-		"write breaks %llu, average %llu\n",
-		Countstats[cow_write_t], IOstats[cow_write_bytes],
-		Countstats[cow_write_t] ?
-			IOstats[cow_write_bytes] / Countstats[cow_write_t] : 0,
-		IOstats[write_breaks], Countstats[cow_write_t] ?
-			IOstats[write_breaks] / Countstats[cow_write_t] : 0);
+/* Merge the histogram of a timing category. Returns the sample count. */
+u64 nova_get_latency_hist(struct super_block *sb, int name, u64 *buckets,
+	u64 *max)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_latency_hist *hist;
+	u64 count = 0;
+	int cpu;
+	int i;
+
+	memset(buckets, 0, NOVA_HIST_BUCKETS * sizeof(u64));
+	*max = 0;
+	for_each_possible_cpu(cpu) {
+		hist = per_cpu_ptr(sbi->latency_hist, cpu);
+		for (i = 0; i < NOVA_HIST_BUCKETS; i++)
+			buckets[i] += hist->buckets[name][i];
+		if (hist->max[name] > *max)
+			*max = hist->max[name];
+	}
+
+	for (i = 0; i < NOVA_HIST_BUCKETS; i++)
+		count += buckets[i];
+
+	return count;
 }
 
-void nova_get_timing_stats(void)
+/*
+ * Upper bound in ns of the permyriad-th (1/10000) percentile of a merged
+ * histogram with count samples, capped at the largest latency seen.
+ */
+u64 nova_hist_percentile(u64 *buckets, u64 count, u64 max,
+	unsigned int permyriad)
+{
+	u64 target = div_u64(count * permyriad + 9999, 10000);
+	u64 seen = 0;
+	int i;
+
+	for (i = 0; i < NOVA_HIST_BUCKETS - 1; i++) {
+		seen += buckets[i];
+		if (seen >= target)
+			return min_t(u64, i ? (1ULL << i) - 1 : 0, max);
+	}
+
+	return max;
+}
+
+/* Sums the timing and I/O counters of sb over all CPUs */
+void nova_get_stats(struct super_block *sb, struct nova_stats *stats)
 {
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_stats *cpu_stats;
 	int i;
 	int cpu;
 
-	for (i = 0; i < TIMING_NUM; i++) {
-		Timingstats[i] = 0;
-		Countstats[i] = 0;
-		for_each_possible_cpu(cpu) {
-			Timingstats[i] += per_cpu(Timingstats_percpu[i], cpu);
-			Countstats[i] += per_cpu(Countstats_percpu[i], cpu);
+	memset(stats, 0, sizeof(struct nova_stats));
+	for_each_possible_cpu(cpu) {
+		cpu_stats = per_cpu_ptr(sbi->stats, cpu);
+		for (i = 0; i < TIMING_NUM; i++) {
+			stats->timing[i] += cpu_stats->timing[i];
+			stats->count[i] += cpu_stats->count[i];
 		}
+		for (i = 0; i < STATS_NUM; i++)
+			stats->io[i] += cpu_stats->io[i];
 	}
 }
 
-void nova_get_IO_stats(void)
+/* Sums the persistence costs of op on sb over all CPUs into stats */
+void nova_get_persist_stats(struct super_block *sb, int op, u64 *stats)
 {
+	struct nova_sb_info *sbi = NOVA_SB(sb);
 	int i;
 	int cpu;
 
-	for (i = 0; i < STATS_NUM; i++) {
-		IOstats[i] = 0;
+	for (i = 0; i < PERSIST_STAT_NUM; i++) {
+		stats[i] = 0;
 		for_each_possible_cpu(cpu)
-			IOstats[i] += per_cpu(IOstats_percpu[i], cpu);
+			stats[i] += per_cpu_ptr(sbi->stats,
+						cpu)->persist[op][i];
 	}
 }
 
+/* Sums the write amplification counters of sb over all CPUs */
+void nova_get_wa_stats(struct super_block *sb, struct nova_wa_stats *stats)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	int i;
+	int cpu;
+
+	for (i = 0; i < WA_NUM; i++) {
+		stats->bytes[i] = 0;
+		for_each_possible_cpu(cpu)
+			stats->bytes[i] +=
+				per_cpu_ptr(sbi->wa_stats, cpu)->bytes[i];
+	}
+}
+
+/* Start a new measurement window from the current totals */
+void nova_start_wa_window(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_wa_stats stats;
+
+	nova_get_wa_stats(sb, &stats);
+	spin_lock(&sbi->wa_lock);
+	sbi->wa_window = stats;
+	sbi->wa_window_start = jiffies;
+	spin_unlock(&sbi->wa_lock);
+}
+
 void nova_print_timing_stats(struct super_block *sb)
 {
+	struct nova_stats *stats;
 	int i;
 
-	nova_get_timing_stats();
-	nova_get_IO_stats();
+	stats = kmalloc(sizeof(struct nova_stats), GFP_KERNEL);
+	if (!stats)
+		return;
+
+	nova_get_stats(sb, stats);
 
 	printk("======== NOVA kernel timing stats ========\n");
 	for (i = 0; i < TIMING_NUM; i++) {
-		if (measure_timing || Timingstats[i]) {
+		if (measure_timing || stats->timing[i]) {
 			printk("%s: count %llu, timing %llu, average %llu\n",
 				Timingstring[i],
-				Countstats[i],
-				Timingstats[i],
-				Countstats[i] ?
-				Timingstats[i] / Countstats[i] : 0);
+				stats->count[i],
+				stats->timing[i],
+				stats->count[i] ?
+				stats->timing[i] / stats->count[i] : 0);
 		} else {
 			printk("%s: count %llu\n",
 				Timingstring[i],
-				Countstats[i]);
+				stats->count[i]);
 		}
 	}
 
-	nova_print_alloc_stats(sb);
-	nova_print_IO_stats(sb);
-}
-
-static void nova_clear_timing_stats(void)
-{
-	int i;
-	int cpu;
-
-	for (i = 0; i < TIMING_NUM; i++) {
-		Countstats[i] = 0;
-		Timingstats[i] = 0;
-		for_each_possible_cpu(cpu) {
-			per_cpu(Timingstats_percpu[i], cpu) = 0;
-			per_cpu(Countstats_percpu[i], cpu) = 0;
-		}
-	}
+	kfree(stats);
 }
 
-static void nova_clear_IO_stats(void)
+/* Clears the counters and latency histograms of sb */
+void nova_clear_stats(struct super_block *sb)
 {
-	int i;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
 	int cpu;
 
-	for (i = 0; i < STATS_NUM; i++) {
-		IOstats[i] = 0;
-		for_each_possible_cpu(cpu)
-			per_cpu(IOstats_percpu[i], cpu) = 0;
+	for_each_possible_cpu(cpu) {
+		memset(per_cpu_ptr(sbi->stats, cpu), 0,
+			sizeof(struct nova_stats));
+		memset(per_cpu_ptr(sbi->latency_hist, cpu), 0,
+			sizeof(struct nova_latency_hist));
 	}
 }
 
-void nova_clear_stats(void)
-{
-	nova_clear_timing_stats();
-	nova_clear_IO_stats();
-}
-
 static inline void nova_print_file_write_entry(struct super_block *sb,
 	u64 curr, struct nova_file_write_entry *entry)
 {
@@ -295,15 +513,17 @@ static u64 nova_print_log_entry(struct super_block *sb, u64 curr)
 	switch (type) {
 		case SET_ATTR:
 			nova_print_set_attr_entry(sb, curr, addr);
-			curr += sizeof(struct nova_setattr_logentry);
+			curr += nova_log_entry_len(sb,
+					sizeof(struct nova_setattr_logentry));
 			break;
 		case LINK_CHANGE:
 			nova_print_link_change_entry(sb, curr, addr);
-			curr += sizeof(struct nova_link_change_entry);
+			curr += nova_log_entry_len(sb,
+					sizeof(struct nova_link_change_entry));
 			break;
 		case FILE_WRITE:
 			nova_print_file_write_entry(sb, curr, addr);
-			curr += sizeof(struct nova_file_write_entry);
+			curr += nova_write_entry_len(sb);
 			break;
 		case DIR_LOG:
 			size = nova_print_dentry(sb, curr, addr);
@@ -311,7 +531,7 @@ static u64 nova_print_log_entry(struct super_block *sb, u64 curr)
 			if (size == 0) {
 				nova_dbg("%s: dentry with size 0 @ 0x%llx\n",
 						__func__, curr);
-				curr += sizeof(struct nova_file_write_entry);
+				curr += nova_write_entry_len(sb);
 				NOVA_ASSERT(0);
 			}
 			break;
@@ -323,7 +543,7 @@ static u64 nova_print_log_entry(struct super_block *sb, u64 curr)
 		default:
 			nova_dbg("%s: unknown type %d, 0x%llx\n",
 						__func__, type, curr);
-			curr += sizeof(struct nova_file_write_entry);
+			curr += nova_write_entry_len(sb);
 			NOVA_ASSERT(0);
 			break;
 	}
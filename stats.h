@@ -47,6 +47,7 @@ enum timing_category {
 	cow_write_t,
 	copy_to_nvmm_t,
 	dax_get_block_t,
+	clone_file_t,
 
 	/* Memory operations */
 	memcpy_r_nvmm_t,
@@ -73,6 +74,11 @@ enum timing_category {
 	fast_gc_t,
 	thorough_gc_t,
 	check_invalid_t,
+	log_cleaner_t,
+
+	/* Snapshots */
+	create_snapshot_t,
+	delete_snapshot_t,
 
 	/* Others */
 	find_cache_t,
@@ -100,40 +106,174 @@ enum stats_category {
 	write_breaks,
 	read_bytes,
 	cow_write_bytes,
+	clone_bytes,
 	fast_checked_pages,
 	thorough_checked_pages,
 	fast_gc_pages,
 	thorough_gc_pages,
+	gc_queued,
+	gc_inline,
+	journal_full,
+	journal_ooo_commits,
+	index_ckpt_saved,
+	index_ckpt_loaded,
 
 	/* Sentinel */
 	STATS_NUM,
 };
 
+/*
+ * Write amplification: bytes stored to NVMM per mount, per CPU and per
+ * source. wa_user is the file data written by users, the others are what
+ * NOVA writes on top of it.
+ */
+enum wa_source {
+	wa_user,
+	wa_partial,	/* Head and tail of partially written blocks */
+	wa_log,		/* New log entries */
+	wa_gc,		/* Log entries copied by thorough GC */
+	wa_zero,	/* Zeroed blocks and truncated tails */
+	wa_journal,	/* Lite journal entries */
+
+	/* Sentinel */
+	WA_NUM,
+};
+
+struct nova_wa_stats {
+	u64 bytes[WA_NUM];
+};
+
+#define NOVA_WA_ADD(sb, source, value) \
+	{this_cpu_add(NOVA_SB(sb)->wa_stats->bytes[source], value);}
+
+/* Timing, I/O and persistence counters of a mount, per CPU, merged on read */
+struct nova_stats {
+	u64 timing[TIMING_NUM];
+	u64 count[TIMING_NUM];
+	u64 io[STATS_NUM];
+	u64 persist[PERSIST_OP_NUM][PERSIST_STAT_NUM];
+};
+
 extern const char *Timingstring[TIMING_NUM];
-extern u64 Timingstats[TIMING_NUM];
-DECLARE_PER_CPU(u64[TIMING_NUM], Timingstats_percpu);
-extern u64 Countstats[TIMING_NUM];
-DECLARE_PER_CPU(u64[TIMING_NUM], Countstats_percpu);
-extern u64 IOstats[STATS_NUM];
-DECLARE_PER_CPU(u64[STATS_NUM], IOstats_percpu);
+extern const char *IOstring[STATS_NUM];
+extern const char *WAstring[WA_NUM];
+extern const char *Persiststring[PERSIST_OP_NUM];
+
+/*
+ * Per-CPU latency histograms of the timed sections of one mount, merged
+ * on read. A latency of ns nanoseconds goes to bucket fls64(ns), which
+ * holds [2^(b-1), 2^b); the last bucket takes everything longer.
+ */
+#define NOVA_HIST_BUCKETS	40
+
+struct nova_latency_hist {
+	u64 buckets[TIMING_NUM][NOVA_HIST_BUCKETS];
+	u64 max[TIMING_NUM];
+};
+
+static inline void nova_hist_add(struct nova_latency_hist __percpu *hist,
+	int name, u64 ns)
+{
+	int bucket = min_t(int, fls64(ns), NOVA_HIST_BUCKETS - 1);
+
+	__this_cpu_inc(hist->buckets[name][bucket]);
+	if (ns > __this_cpu_read(hist->max[name]))
+		__this_cpu_write(hist->max[name], ns);
+}
 
-typedef struct timespec timing_t;
+/*
+ * Timing backends, picked by measure_timing at module load: the raw
+ * monotonic clock, or the CPU cycle counter, which is much cheaper to
+ * read and is converted to ns with a factor calibrated at load. With
+ * timing_sample N > 1 only one in N sections of each category is timed
+ * per CPU, and its time counts N times in the totals. The cycle counters
+ * of different CPUs need not agree, so a section that ends on another
+ * CPU than it started on is not timed.
+ */
+enum nova_timing_mode {
+	NOVA_TIMING_OFF = 0,
+	NOVA_TIMING_CLOCK,
+	NOVA_TIMING_CYCLES,
+};
+
+#define NOVA_CYCLES_SHIFT	20
+
+extern int measure_timing;
+extern unsigned int timing_sample;
+extern u32 nova_cycles_mult;
+DECLARE_PER_CPU(u32[TIMING_NUM], Samplecount_percpu);
+
+/* A timestamp of the current backend, and the CPU it was read on */
+typedef struct {
+	u64 stamp;	/* 0 if the section is not timed */
+	int cpu;
+} timing_t;
+
+static inline timing_t nova_timing_now(void)
+{
+	timing_t now;
+
+	if (measure_timing == NOVA_TIMING_CYCLES) {
+		preempt_disable();
+		now.stamp = get_cycles();
+		now.cpu = smp_processor_id();
+		preempt_enable();
+	} else {
+		now.stamp = ktime_get_raw_ns();
+		now.cpu = 0;
+	}
+	return now;
+}
+
+static inline timing_t nova_timing_start(int name)
+{
+	timing_t none = {0, 0};
+
+	if (!measure_timing || (timing_sample > 1 &&
+			__this_cpu_inc_return(Samplecount_percpu[name]) %
+							timing_sample))
+		return none;
+
+	return nova_timing_now();
+}
+
+/* ns since start, or -1 if the section moved to another cycle counter */
+static inline s64 nova_timing_delta(timing_t start)
+{
+	timing_t now = nova_timing_now();
+
+	if (measure_timing == NOVA_TIMING_CYCLES) {
+		if (now.cpu != start.cpu)
+			return -1;
+		return mul_u64_u32_shr(now.stamp - start.stamp,
+					nova_cycles_mult, NOVA_CYCLES_SHIFT);
+	}
+	return now.stamp - start.stamp;
+}
+
+static inline void nova_timing_end(struct nova_stats __percpu *stats,
+	struct nova_latency_hist __percpu *hist, int name, timing_t start)
+{
+	s64 delta = nova_timing_delta(start);
+
+	if (delta < 0)
+		return;
+
+	__this_cpu_add(stats->timing[name], delta * max(timing_sample, 1U));
+	nova_hist_add(hist, name, delta);
+}
 
 #define NOVA_START_TIMING(name, start) \
-	{if (measure_timing) getrawmonotonic(&start);}
-
-#define NOVA_END_TIMING(name, start) \
-	{if (measure_timing) { \
-		timing_t end; \
-		getrawmonotonic(&end); \
-		__this_cpu_add(Timingstats_percpu[name], \
-			(end.tv_sec - start.tv_sec) * 1000000000 + \
-			(end.tv_nsec - start.tv_nsec)); \
-	} \
-	__this_cpu_add(Countstats_percpu[name], 1); \
+	{start = nova_timing_start(name);}
+
+#define NOVA_END_TIMING(sb, name, start) \
+	{if (measure_timing && start.stamp) \
+		nova_timing_end(NOVA_SB(sb)->stats, \
+				NOVA_SB(sb)->latency_hist, name, start); \
+	__this_cpu_add(NOVA_SB(sb)->stats->count[name], 1); \
 	}
 
-#define NOVA_STATS_ADD(name, value) \
-	{__this_cpu_add(IOstats_percpu[name], value);}
+#define NOVA_STATS_ADD(sb, name, value) \
+	{__this_cpu_add(NOVA_SB(sb)->stats->io[name], value);}
 
 
@@ -38,17 +38,27 @@
 #include <linux/list.h>
 #include "nova.h"
 
+#define CREATE_TRACE_POINTS
+#include "nova_trace.h"
+
 int measure_timing = 0;
 int support_clwb = 0;
 int support_pcommit = 0;
 
 module_param(measure_timing, int, S_IRUGO);
-MODULE_PARM_DESC(measure_timing, "Timing measurement");
+MODULE_PARM_DESC(measure_timing,
+	"Timing measurement: 0 off, 1 clock, 2 cycle counter");
+
+/* Time one in timing_sample sections of each category */
+unsigned int timing_sample = 1;
+module_param(timing_sample, uint, S_IRUGO);
+MODULE_PARM_DESC(timing_sample, "Time 1 in N sections of each category");
 
 static struct super_operations nova_sops;
 static const struct export_operations nova_export_ops;
 static struct kmem_cache *nova_inode_cachep;
 static struct kmem_cache *nova_range_node_cachep;
+static struct kmem_cache *nova_dir_node_cachep;
 
 /* FIXME: should the following variable be one per NOVA instance? */
 unsigned int nova_dbgmask = 0;
@@ -147,7 +157,7 @@ enum {
 	Opt_bpi, Opt_init, Opt_mode, Opt_uid,
 	Opt_gid, Opt_blocksize, Opt_wprotect,
 	Opt_err_cont, Opt_err_panic, Opt_err_ro,
-	Opt_dbgmask, Opt_err
+	Opt_dbgmask, Opt_logv2, Opt_rebuild, Opt_err
 };
 
 static const match_table_t tokens = {
@@ -161,6 +171,8 @@ static const match_table_t tokens = {
 	{ Opt_err_panic,     "errors=panic"	  },
 	{ Opt_err_ro,	     "errors=remount-ro"  },
 	{ Opt_dbgmask,	     "dbgmask=%u"	  },
+	{ Opt_logv2,	     "logv2"		  },
+	{ Opt_rebuild,	     "rebuild"		  },
 	{ Opt_err,	     NULL		  },
 };
 
@@ -237,6 +249,14 @@ static int nova_parse_options(char *options, struct nova_sb_info *sbi,
 				goto bad_val;
 			nova_dbgmask = option;
 			break;
+		case Opt_logv2:
+			if (remount)
+				goto bad_opt;
+			set_opt(sbi->s_mount_opt, LOGV2);
+			break;
+		case Opt_rebuild:
+			set_opt(sbi->s_mount_opt, REBUILD);
+			break;
 		default: {
 			goto bad_opt;
 		}
@@ -329,6 +349,14 @@ static struct nova_inode *nova_init(struct super_block *sb,
 	super->s_size = cpu_to_le64(size);
 	super->s_blocksize = cpu_to_le32(blocksize);
 	super->s_magic = cpu_to_le32(NOVA_SUPER_MAGIC);
+	super->s_cpus = cpu_to_le16(sbi->cpus);
+	super->s_features = 0;
+	if (test_opt(sb, REBUILD))
+		super->s_features |= cpu_to_le32(NOVA_FEATURE_REBUILD);
+	if (test_opt(sb, LOGV2)) {
+		super->s_features |= cpu_to_le32(NOVA_FEATURE_LOG_V2);
+		sbi->log_align = CACHELINE_SIZE;
+	}
 
 	nova_init_blockmap(sb, 0);
 
@@ -381,9 +409,11 @@ static struct nova_inode *nova_init(struct super_block *sb,
 	nova_append_dir_init_entries(sb, root_i, NOVA_ROOT_INO,
 					NOVA_ROOT_INO);
 
+	nova_reserve_recovery_pool(sb);
+
 	PERSISTENT_MARK();
 	PERSISTENT_BARRIER();
-	NOVA_END_TIMING(new_init_t, init_time);
+	NOVA_END_TIMING(sb, new_init_t, init_time);
 	return root_i;
 }
 
@@ -391,9 +421,49 @@ static inline void set_default_opts(struct nova_sb_info *sbi)
 {
 	set_opt(sbi->s_mount_opt, HUGEIOREMAP);
 	set_opt(sbi->s_mount_opt, ERRORS_CONT);
-	sbi->reserved_blocks = RESERVED_BLOCKS;
 	sbi->cpus = num_online_cpus();
-	sbi->map_id = 0;
+	sbi->reserved_blocks = nova_reserved_blocks(sbi->cpus);
+	sbi->log_align = 1;
+}
+
+/*
+ * Per-CPU journals, inode tables and inode numbers are laid out for the
+ * CPU count the volume was created with, whatever runs it now. Volumes
+ * created before s_cpus was recorded have one journal per CPU in the
+ * single journal pointer block.
+ */
+static int nova_get_volume_cpus(struct super_block *sb,
+	struct nova_super_block *super)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct ptr_pair *pair;
+	char *ptr_block;
+	int cpus;
+
+	cpus = le16_to_cpu(super->s_cpus);
+	if (cpus == 0) {
+		ptr_block = nova_get_block(sb, NOVA_DEF_BLOCK_SIZE_4K);
+		while (cpus < NOVA_CPUS_PER_PTR_BLOCK) {
+			pair = (struct ptr_pair *)(ptr_block +
+						cpus * CACHELINE_SIZE);
+			if (pair->journal_head == 0)
+				break;
+			cpus++;
+		}
+	}
+
+	if (cpus == 0) {
+		printk(KERN_ERR "nova: no per-CPU journals found\n");
+		return -EINVAL;
+	}
+
+	if (cpus != num_online_cpus())
+		nova_info("volume created with %d cpus, %d cpus online\n",
+				cpus, num_online_cpus());
+
+	sbi->cpus = cpus;
+	sbi->reserved_blocks = nova_reserved_blocks(cpus);
+	return 0;
 }
 
 static void nova_root_check(struct super_block *sb, struct nova_inode *root_pi)
@@ -461,6 +531,30 @@ out:
 	return 0;
 }
 
+/*
+ * With the rebuild option, mark an existing volume before the rebuild
+ * metadata is first written to it, so kernels that would leave it stale
+ * refuse the volume.
+ */
+static void nova_set_rebuild_feature(struct super_block *sb)
+{
+	struct nova_super_block *super = nova_get_super(sb);
+	u32 features = le32_to_cpu(super->s_features);
+
+	if (!test_opt(sb, REBUILD) || (features & NOVA_FEATURE_REBUILD))
+		return;
+
+	nova_memunlock_range(sb, super, NOVA_SB_SIZE*2);
+	super->s_features = cpu_to_le32(features | NOVA_FEATURE_REBUILD);
+	nova_sync_super(super);
+	nova_memlock_range(sb, super, NOVA_SB_SIZE*2);
+
+	nova_flush_buffer(super, NOVA_SB_SIZE, false);
+	nova_flush_buffer((char *)super + NOVA_SB_SIZE, sizeof(*super), true);
+	nova_info("Volume upgraded for fast rebuild, older kernels will "
+			"refuse it\n");
+}
+
 static int nova_fill_super(struct super_block *sb, void *data, int silent)
 {
 	struct nova_super_block *super;
@@ -479,6 +573,13 @@ static int nova_fill_super(struct super_block *sb, void *data, int silent)
 	BUILD_BUG_ON(sizeof(struct nova_super_block) > NOVA_SB_SIZE);
 	BUILD_BUG_ON(sizeof(struct nova_inode) > NOVA_INODE_SIZE);
 	BUILD_BUG_ON(sizeof(struct nova_inode_log_page) != PAGE_SIZE);
+	BUILD_BUG_ON(sizeof(struct nova_summary_page) != PAGE_SIZE);
+	BUILD_BUG_ON(sizeof(struct inode_table) > CACHELINE_SIZE);
+	/* A journal record header takes one unit */
+	BUILD_BUG_ON(sizeof(struct nova_lite_journal_header) !=
+			NOVA_JOURNAL_UNIT);
+	/* The per-CPU structure count is a 16-bit superblock field */
+	BUILD_BUG_ON(NR_CPUS > USHRT_MAX);
 
 	sbi = kzalloc(sizeof(struct nova_sb_info), GFP_KERNEL);
 	if (!sbi)
@@ -486,15 +587,17 @@ static int nova_fill_super(struct super_block *sb, void *data, int silent)
 	sb->s_fs_info = sbi;
 	sbi->sb = sb;
 
-	set_default_opts(sbi);
-
-	/* Currently the log page supports 64 journal pointer pairs */
-	if (sbi->cpus > 64) {
-		nova_err(sb, "NOVA needs more log pointer pages "
-				"to support more than 64 cpus.\n");
-		goto out;
+	sbi->stats = alloc_percpu(struct nova_stats);
+	sbi->latency_hist = alloc_percpu(struct nova_latency_hist);
+	if (!sbi->stats || !sbi->latency_hist) {
+		free_percpu(sbi->latency_hist);
+		free_percpu(sbi->stats);
+		kfree(sbi);
+		return -ENOMEM;
 	}
 
+	set_default_opts(sbi);
+
 	if (nova_get_block_info(sb, sbi))
 		goto out;
 
@@ -511,23 +614,30 @@ static int nova_fill_super(struct super_block *sb, void *data, int silent)
 	clear_opt(sbi->s_mount_opt, PROTECT);
 	set_opt(sbi->s_mount_opt, HUGEIOREMAP);
 
-	sbi->inode_maps = kzalloc(sbi->cpus * sizeof(struct inode_map),
-					GFP_KERNEL);
-	if (!sbi->inode_maps) {
+	/* Before the proc files that read them */
+	spin_lock_init(&sbi->gc_lock);
+	for (i = 0; i < NOVA_GC_BUCKETS; i++)
+		INIT_LIST_HEAD(&sbi->gc_buckets[i]);
+	spin_lock_init(&sbi->pool_lock);
+	INIT_LIST_HEAD(&sbi->deferred_frees);
+	init_completion(&sbi->recovery_done);
+
+	sbi->wa_stats = alloc_percpu(struct nova_wa_stats);
+	if (!sbi->wa_stats) {
 		retval = -ENOMEM;
 		goto out;
 	}
+	spin_lock_init(&sbi->wa_lock);
+	sbi->wa_window_start = jiffies;
 
 	nova_sysfs_init(sb);
 
-	for (i = 0; i < sbi->cpus; i++) {
-		inode_map = &sbi->inode_maps[i];
-		mutex_init(&inode_map->inode_table_mutex);
-		inode_map->inode_inuse_tree = RB_ROOT;
-	}
-
 	mutex_init(&sbi->s_lock);
 
+	mutex_init(&sbi->block_ref_mutex);
+	sbi->block_ref_tree = RB_ROOT;
+	mutex_init(&sbi->snapshot_mutex);
+
 	sbi->zeroed_page = kzalloc(PAGE_SIZE, GFP_KERNEL);
 	if (!sbi->zeroed_page) {
 		retval = -ENOMEM;
@@ -539,6 +649,47 @@ static int nova_fill_super(struct super_block *sb, void *data, int silent)
 
 	set_opt(sbi->s_mount_opt, MOUNTING);
 
+	super = nova_get_super(sb);
+
+	if ((sbi->s_mount_opt & NOVA_MOUNT_FORMAT) == 0) {
+		nova_dbg_verbose("checking physical address 0x%016llx "
+				"for nova image\n", (u64)sbi->phys_addr);
+
+		if (nova_check_integrity(sb, super) == 0) {
+			nova_dbg("Memory contains invalid nova %x:%x\n",
+				le32_to_cpu(super->s_magic), NOVA_SUPER_MAGIC);
+			goto out;
+		}
+
+		if (le32_to_cpu(super->s_features) & ~NOVA_FEATURE_ALL) {
+			printk(KERN_ERR "Unsupported nova features 0x%x\n",
+					le32_to_cpu(super->s_features));
+			goto out;
+		}
+
+		if (le32_to_cpu(super->s_features) & NOVA_FEATURE_LOG_V2)
+			sbi->log_align = CACHELINE_SIZE;
+
+		if (nova_get_volume_cpus(sb, super))
+			goto out;
+	}
+
+	sbi->inode_maps = kzalloc(sbi->cpus * sizeof(struct inode_map),
+					GFP_KERNEL);
+	if (!sbi->inode_maps) {
+		retval = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < sbi->cpus; i++) {
+		inode_map = &sbi->inode_maps[i];
+		mutex_init(&inode_map->inode_table_mutex);
+		mutex_init(&inode_map->table_index_mutex);
+		inode_map->inode_inuse_tree = RB_ROOT;
+	}
+
+	nova_init_ino_caches(sb);
+
 	if (nova_alloc_block_free_lists(sb)) {
 		retval = -ENOMEM;
 		goto out;
@@ -549,21 +700,9 @@ static int nova_fill_super(struct super_block *sb, void *data, int silent)
 		root_pi = nova_init(sb, sbi->initsize);
 		if (IS_ERR(root_pi))
 			goto out;
-		super = nova_get_super(sb);
 		goto setup_sb;
 	}
 
-	nova_dbg_verbose("checking physical address 0x%016llx for nova image\n",
-		  (u64)sbi->phys_addr);
-
-	super = nova_get_super(sb);
-
-	if (nova_check_integrity(sb, super) == 0) {
-		nova_dbg("Memory contains invalid nova %x:%x\n",
-				le32_to_cpu(super->s_magic), NOVA_SUPER_MAGIC);
-		goto out;
-	}
-
 	if (nova_lite_journal_soft_init(sb)) {
 		retval = -EINVAL;
 		printk(KERN_ERR "Lite journal initialization failed\n");
@@ -591,11 +730,22 @@ setup_sb:
 	sb->s_xattr = NULL;
 	sb->s_flags |= MS_NOSEC;
 
+	if (!(sb->s_flags & MS_RDONLY))
+		nova_set_rebuild_feature(sb);
+
 	/* If the FS was not formatted on this mount, scan the meta-data after
 	 * truncate list has been processed */
 	if ((sbi->s_mount_opt & NOVA_MOUNT_FORMAT) == 0)
 		nova_recovery(sb);
 
+	/*
+	 * A failure recovery leaves the summaries with stale bits. Read-only
+	 * mounts load them when remounted read-write.
+	 */
+	if (!(sb->s_flags & MS_RDONLY))
+		nova_init_table_summaries(sb,
+			sbi->recovery_state != NOVA_RECOVERY_NONE);
+
 	root_i = nova_iget(sb, NOVA_ROOT_INO);
 	if (IS_ERR(root_i)) {
 		retval = PTR_ERR(root_i);
@@ -625,31 +775,49 @@ setup_sb:
 	}
 
 	clear_opt(sbi->s_mount_opt, MOUNTING);
+	nova_sysfs_init_stats(sb);
+
+	/* Without cleaners, logs are cleaned inline as before */
+	if (nova_start_log_cleaners(sb))
+		nova_info("Log cleaner threads not started\n");
+
 	retval = 0;
 
-	NOVA_END_TIMING(mount_t, mount_time);
+	NOVA_END_TIMING(sb, mount_t, mount_time);
 	return retval;
 out:
+	if (sbi->recovery_thread)
+		nova_stop_bg_recovery(sb);
+
 	if (sbi->zeroed_page) {
 		kfree(sbi->zeroed_page);
 		sbi->zeroed_page = NULL;
 	}
 
+	if (sbi->wa_stats) {
+		free_percpu(sbi->wa_stats);
+		sbi->wa_stats = NULL;
+	}
+
 	if (sbi->free_lists) {
 		kfree(sbi->free_lists);
 		sbi->free_lists = NULL;
 	}
 
-	if (sbi->journal_locks) {
-		kfree(sbi->journal_locks);
-		sbi->journal_locks = NULL;
+	if (sbi->journals) {
+		kfree(sbi->journals);
+		sbi->journals = NULL;
 	}
 
 	if (sbi->inode_maps) {
+		nova_free_inode_table_index(sb);
+		nova_free_table_summaries(sb);
 		kfree(sbi->inode_maps);
 		sbi->inode_maps = NULL;
 	}
 
+	free_percpu(sbi->latency_hist);
+	free_percpu(sbi->stats);
 	kfree(sbi);
 	return retval;
 }
@@ -663,7 +831,9 @@ int nova_statfs(struct dentry *d, struct kstatfs *buf)
 	buf->f_bsize = sb->s_blocksize;
 
 	buf->f_blocks = sbi->num_blocks;
-	buf->f_bfree = buf->f_bavail = nova_count_free_blocks(sb);
+	/* The recovery pool only tides writes over until the scan is done */
+	buf->f_bfree = buf->f_bavail = nova_count_free_blocks(sb) -
+					nova_count_pool_blocks(sb);
 	buf->f_files = LONG_MAX;
 	buf->f_ffree = LONG_MAX - sbi->s_inodes_used_count;
 	buf->f_namelen = NOVA_NAME_LEN;
@@ -698,6 +868,10 @@ static int nova_show_options(struct seq_file *seq, struct dentry *root)
 	/* memory protection disabled by default */
 	if (test_opt(root->d_sb, PROTECT))
 		seq_puts(seq, ",wprotect");
+	if (sbi->log_align > 1)
+		seq_puts(seq, ",logv2");
+	if (nova_has_rebuild_meta(root->d_sb))
+		seq_puts(seq, ",rebuild");
 	if (test_opt(root->d_sb, DAX))
 		seq_puts(seq, ",dax");
 
@@ -737,6 +911,13 @@ int nova_remount(struct super_block *sb, int *mntflags, char *data)
 		nova_flush_buffer(&ps->s_mtime, 8, false);
 		PERSISTENT_MARK();
 		PERSISTENT_BARRIER();
+
+		/* New inodes must set their chunk bits from now on */
+		if (sb->s_flags & MS_RDONLY) {
+			nova_set_rebuild_feature(sb);
+			nova_init_table_summaries(sb,
+				sbi->recovery_state != NOVA_RECOVERY_NONE);
+		}
 	}
 
 	mutex_unlock(&sbi->s_lock);
@@ -759,18 +940,32 @@ static void nova_put_super(struct super_block *sb)
 	/* It's unmount time, so unmap the nova memory */
 //	nova_print_free_lists(sb);
 	if (sbi->virt_addr) {
-		nova_save_inode_list_to_log(sb);
-		/* Save everything before blocknode mapping! */
-		nova_save_blocknode_mappings_to_log(sb);
+		/* Reserved inode numbers go back before the list is saved */
+		nova_drain_ino_caches(sb);
+		/*
+		 * Free lists cut short by the unmount are not saved, nor are
+		 * they when the inode lists or block refs could not be: the
+		 * next mount runs the failure recovery again.
+		 */
+		if (!nova_stop_bg_recovery(sb) &&
+				nova_save_inode_list_to_log(sb) == 0 &&
+				nova_save_block_refs_to_log(sb) == 0) {
+			/* Save everything before blocknode mapping! */
+			nova_save_blocknode_mappings_to_log(sb);
+		}
 		sbi->virt_addr = NULL;
 	}
 
 	nova_delete_free_lists(sb);
+	nova_destroy_block_refs(sb);
 
 	kfree(sbi->zeroed_page);
+	free_percpu(sbi->wa_stats);
+	free_percpu(sbi->latency_hist);
+	free_percpu(sbi->stats);
 	nova_dbgmask = 0;
 	kfree(sbi->free_lists);
-	kfree(sbi->journal_locks);
+	kfree(sbi->journals);
 
 	for (i = 0; i < sbi->cpus; i++) {
 		inode_map = &sbi->inode_maps[i];
@@ -778,6 +973,8 @@ static void nova_put_super(struct super_block *sb)
 			i, inode_map->allocated, inode_map->freed);
 	}
 
+	nova_free_inode_table_index(sb);
+	nova_free_table_summaries(sb);
 	kfree(sbi->inode_maps);
 
 	nova_sysfs_exit(sb);
@@ -822,6 +1019,16 @@ inline struct nova_range_node *nova_alloc_inode_node(struct super_block *sb)
 	return nova_alloc_range_node(sb);
 }
 
+struct nova_dir_node *nova_alloc_dir_node(struct super_block *sb)
+{
+	return kmem_cache_alloc(nova_dir_node_cachep, GFP_NOFS);
+}
+
+void nova_free_dir_node(struct nova_dir_node *node)
+{
+	kmem_cache_free(nova_dir_node_cachep, node);
+}
+
 static struct inode *nova_alloc_inode(struct super_block *sb)
 {
 	struct nova_inode_info *vi;
@@ -831,6 +1038,11 @@ static struct inode *nova_alloc_inode(struct super_block *sb)
 		return NULL;
 
 	vi->vfs_inode.i_version = 1;
+	INIT_LIST_HEAD(&vi->gc_list);
+	INIT_LIST_HEAD(&vi->gc_cand);
+	vi->gc_bucket = -1;
+	vi->gc_pages = 0;
+	vi->gc_dead = 0;
 
 	return &vi->vfs_inode;
 }
@@ -869,6 +1081,16 @@ static int __init init_rangenode_cache(void)
 	return 0;
 }
 
+static int __init init_dirnode_cache(void)
+{
+	nova_dir_node_cachep = kmem_cache_create("nova_dir_node_cache",
+					sizeof(struct nova_dir_node),
+					0, (SLAB_RECLAIM_ACCOUNT |
+					SLAB_MEM_SPREAD), NULL);
+	if (nova_dir_node_cachep == NULL)
+		return -ENOMEM;
+	return 0;
+}
 
 static int __init init_inodecache(void)
 {
@@ -896,6 +1118,11 @@ static void destroy_rangenode_cache(void)
 	kmem_cache_destroy(nova_range_node_cachep);
 }
 
+static void destroy_dirnode_cache(void)
+{
+	kmem_cache_destroy(nova_dir_node_cachep);
+}
+
 /*
  * the super block writes are all done "on the fly", so the
  * super block is never in a "dirty" state, so there's no need
@@ -919,11 +1146,20 @@ static struct dentry *nova_mount(struct file_system_type *fs_type,
 	return mount_bdev(fs_type, flags, dev_name, data, nova_fill_super);
 }
 
+static void nova_kill_sb(struct super_block *sb)
+{
+	/* Cleaners pin inodes, stop them before the VFS evicts */
+	if (sb->s_root)
+		nova_stop_log_cleaners(sb);
+
+	kill_block_super(sb);
+}
+
 static struct file_system_type nova_fs_type = {
 	.owner		= THIS_MODULE,
 	.name		= "NOVA",
 	.mount		= nova_mount,
-	.kill_sb	= kill_block_super,
+	.kill_sb	= nova_kill_sb,
 };
 
 static struct inode *nova_nfs_get_inode(struct super_block *sb,
@@ -975,9 +1211,7 @@ static const struct export_operations nova_export_ops = {
 static int __init init_nova_fs(void)
 {
 	int rc = 0;
-	timing_t init_time;
 
-	NOVA_START_TIMING(init_t, init_time);
 	nova_dbg("%s: %d cpus online\n", __func__, num_online_cpus());
 	if (arch_has_pcommit())
 		support_pcommit = 1;
@@ -989,6 +1223,8 @@ static int __init init_nova_fs(void)
 			support_pcommit ? "YES" : "NO",
 			support_clwb ? "YES" : "NO");
 
+	nova_init_timing();
+
 	nova_proc_root = proc_mkdir(proc_dirname, NULL);
 
 	nova_dbgv("Data structure size: inode %lu, log_page %lu, "
@@ -1003,23 +1239,30 @@ static int __init init_nova_fs(void)
 
 	rc = init_rangenode_cache();
 	if (rc)
-		return rc;
+		goto out0;
 
-	rc = init_inodecache();
+	rc = init_dirnode_cache();
 	if (rc)
 		goto out1;
 
-	rc = register_filesystem(&nova_fs_type);
+	rc = init_inodecache();
 	if (rc)
 		goto out2;
 
-	NOVA_END_TIMING(init_t, init_time);
+	rc = register_filesystem(&nova_fs_type);
+	if (rc)
+		goto out3;
+
 	return 0;
 
-out2:
+out3:
 	destroy_inodecache();
+out2:
+	destroy_dirnode_cache();
 out1:
 	destroy_rangenode_cache();
+out0:
+	remove_proc_entry(proc_dirname, NULL);
 	return rc;
 }
 
@@ -1028,6 +1271,7 @@ static void __exit exit_nova_fs(void)
 	unregister_filesystem(&nova_fs_type);
 	remove_proc_entry(proc_dirname, NULL);
 	destroy_inodecache();
+	destroy_dirnode_cache();
 	destroy_rangenode_cache();
 }
 
@@ -60,39 +60,40 @@ int nova_block_symlink(struct super_block *sb, struct nova_inode *pi,
 	nova_flush_buffer(entry, CACHELINE_SIZE, 0);
 
 	sih->log_pages = 1;
+	sih->live_bytes = nova_write_entry_len(sb);
 	pi->log_head = block;
-	nova_update_tail(pi, block + sizeof(struct nova_file_write_entry));
+	nova_update_tail(sb, pi, block + nova_write_entry_len(sb));
 
 	return 0;
 }
 
-static int nova_readlink(struct dentry *dentry, char __user *buffer, int buflen)
+/* The target lives in the block of the first write entry */
+const char *nova_get_symlink_target(struct super_block *sb,
+	struct nova_inode *pi)
 {
 	struct nova_file_write_entry *entry;
-	struct inode *inode = dentry->d_inode;
-	struct super_block *sb = inode->i_sb;
-	struct nova_inode *pi = nova_get_inode(sb, inode);
-	char *blockp;
 
 	entry = (struct nova_file_write_entry *)nova_get_block(sb,
 							pi->log_head);
-	blockp = (char *)nova_get_block(sb, BLOCK_OFF(entry->block));
+	return (char *)nova_get_block(sb, BLOCK_OFF(entry->block));
+}
 
-	return readlink_copy(buffer, buflen, blockp);
+static int nova_readlink(struct dentry *dentry, char __user *buffer, int buflen)
+{
+	struct inode *inode = dentry->d_inode;
+	struct super_block *sb = inode->i_sb;
+	struct nova_inode *pi = nova_get_inode(sb, inode);
+
+	return readlink_copy(buffer, buflen,
+				nova_get_symlink_target(sb, pi));
 }
 
 static const char *nova_get_link(struct dentry *dentry, struct inode *inode, void **cookie)
 {
-	struct nova_file_write_entry *entry;
 	struct super_block *sb = inode->i_sb;
 	struct nova_inode *pi = nova_get_inode(sb, inode);
-	char *blockp;
-
-	entry = (struct nova_file_write_entry *)nova_get_block(sb,
-							pi->log_head);
-	blockp = (char *)nova_get_block(sb, BLOCK_OFF(entry->block));
 
-	return blockp;
+	return nova_get_symlink_target(sb, pi);
 }
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)
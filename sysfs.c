@@ -25,27 +25,34 @@ struct proc_dir_entry *nova_proc_root;
 
 static int nova_seq_timing_show(struct seq_file *seq, void *v)
 {
+	struct super_block *sb = seq->private;
+	struct nova_stats *stats;
 	int i;
 
-	nova_get_timing_stats();
+	stats = kmalloc(sizeof(struct nova_stats), GFP_KERNEL);
+	if (!stats)
+		return -ENOMEM;
+
+	nova_get_stats(sb, stats);
 
 	seq_printf(seq, "======== NOVA kernel timing stats ========\n");
 	for (i = 0; i < TIMING_NUM; i++) {
-		if (measure_timing || Timingstats[i]) {
+		if (measure_timing || stats->timing[i]) {
 			seq_printf(seq, "%s: count %llu, timing %llu, "
 				"average %llu\n",
 				Timingstring[i],
-				Countstats[i],
-				Timingstats[i],
-				Countstats[i] ?
-				Timingstats[i] / Countstats[i] : 0);
+				stats->count[i],
+				stats->timing[i],
+				stats->count[i] ?
+				stats->timing[i] / stats->count[i] : 0);
 		} else {
 			seq_printf(seq, "%s: count %llu\n",
 				Timingstring[i],
-				Countstats[i]);
+				stats->count[i]);
 		}
 	}
 
+	kfree(stats);
 	return 0;
 }
 
@@ -57,7 +64,7 @@ static int nova_seq_timing_open(struct inode *inode, struct file *file)
 ssize_t nova_seq_clear_stats(struct file *filp, const char __user *buf,
 	size_t len, loff_t *ppos)
 {
-	nova_clear_stats();
+	nova_clear_stats(PDE_DATA(file_inode(filp)));
 	return len;
 }
 
@@ -70,6 +77,552 @@ static const struct file_operations nova_seq_timing_fops = {
 	.release	= single_release,
 };
 
+static int nova_seq_latency_show(struct seq_file *seq, void *v)
+{
+	struct super_block *sb = seq->private;
+	u64 buckets[NOVA_HIST_BUCKETS];
+	u64 count, max;
+	int i;
+
+	seq_printf(seq, "======== NOVA latency percentiles (ns) ========\n");
+	if (!measure_timing)
+		seq_printf(seq, "measure_timing is off\n");
+
+	for (i = 0; i < TIMING_NUM; i++) {
+		count = nova_get_latency_hist(sb, i, buckets, &max);
+		if (count == 0)
+			continue;
+
+		seq_printf(seq, "%s: count %llu, p50 %llu, p99 %llu, "
+			"p99.9 %llu, max %llu\n", Timingstring[i], count,
+			nova_hist_percentile(buckets, count, max, 5000),
+			nova_hist_percentile(buckets, count, max, 9900),
+			nova_hist_percentile(buckets, count, max, 9990),
+			max);
+	}
+
+	return 0;
+}
+
+static int nova_seq_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nova_seq_latency_show, PDE_DATA(inode));
+}
+
+static const struct file_operations nova_seq_latency_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nova_seq_latency_open,
+	.read		= seq_read,
+	.write		= nova_seq_clear_stats,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int nova_seq_persist_show(struct seq_file *seq, void *v)
+{
+	struct super_block *sb = seq->private;
+	u64 stats[PERSIST_STAT_NUM];
+	u64 ops;
+	int i;
+
+	seq_printf(seq, "======== NOVA persistence costs ========\n");
+	if (!measure_timing)
+		seq_printf(seq, "measure_timing is off\n");
+
+	for (i = 0; i < PERSIST_OP_NUM; i++) {
+		nova_get_persist_stats(sb, i, stats);
+		ops = stats[persist_ops];
+		seq_printf(seq, "%s: ops %llu, flush lines %llu, fences %llu, "
+			"nt bytes %llu", Persiststring[i], ops,
+			stats[persist_flush_lines], stats[persist_fences],
+			stats[persist_nt_bytes]);
+		if (ops)
+			seq_printf(seq, ", per op %llu/%llu/%llu",
+				stats[persist_flush_lines] / ops,
+				stats[persist_fences] / ops,
+				stats[persist_nt_bytes] / ops);
+		seq_printf(seq, "\n");
+	}
+
+	return 0;
+}
+
+static int nova_seq_persist_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nova_seq_persist_show, PDE_DATA(inode));
+}
+
+static const struct file_operations nova_seq_persist_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nova_seq_persist_open,
+	.read		= seq_read,
+	.write		= nova_seq_clear_stats,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void nova_seq_wa_print(struct seq_file *seq, const char *scope,
+	struct nova_wa_stats *stats)
+{
+	u64 total = 0, ratio;
+	int i;
+
+	seq_printf(seq, "%s:", scope);
+	for (i = 0; i < WA_NUM; i++) {
+		seq_printf(seq, " %s %llu,", WAstring[i], stats->bytes[i]);
+		total += stats->bytes[i];
+	}
+
+	/* NVMM bytes per user byte, in hundredths */
+	ratio = stats->bytes[wa_user] ?
+			div64_u64(total * 100, stats->bytes[wa_user]) : 0;
+	seq_printf(seq, " nvmm %llu, amplification %llu.%02llu\n",
+			total, ratio / 100, ratio % 100);
+}
+
+static int nova_seq_wa_show(struct seq_file *seq, void *v)
+{
+	struct super_block *sb = seq->private;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_wa_stats stats, window;
+	unsigned long start;
+	char scope[32];
+	int i;
+
+	nova_get_wa_stats(sb, &stats);
+	spin_lock(&sbi->wa_lock);
+	window = sbi->wa_window;
+	start = sbi->wa_window_start;
+	spin_unlock(&sbi->wa_lock);
+
+	seq_printf(seq, "======== NOVA write amplification (bytes) ========\n");
+	nova_seq_wa_print(seq, "mount", &stats);
+
+	for (i = 0; i < WA_NUM; i++)
+		window.bytes[i] = stats.bytes[i] - window.bytes[i];
+	snprintf(scope, sizeof(scope), "window %us",
+			jiffies_to_msecs(jiffies - start) / 1000);
+	nova_seq_wa_print(seq, scope, &window);
+
+	return 0;
+}
+
+static int nova_seq_wa_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nova_seq_wa_show, PDE_DATA(inode));
+}
+
+/* Any write starts a new window */
+static ssize_t nova_seq_wa_window(struct file *filp, const char __user *buf,
+	size_t len, loff_t *ppos)
+{
+	nova_start_wa_window(PDE_DATA(file_inode(filp)));
+	return len;
+}
+
+static const struct file_operations nova_seq_wa_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nova_seq_wa_open,
+	.read		= seq_read,
+	.write		= nova_seq_wa_window,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int nova_seq_gc_show(struct seq_file *seq, void *v)
+{
+	struct super_block *sb = seq->private;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_gc_victim top[NOVA_GC_TOP];
+	unsigned long count, pages, dead, budget;
+	int over, top_count;
+	int i;
+
+	spin_lock(&sbi->gc_lock);
+	count = sbi->gc_cand_count;
+	pages = sbi->gc_cand_pages;
+	dead = sbi->gc_dead_total;
+	budget = sbi->gc_budget_pages;
+	over = sbi->gc_over_budget;
+	top_count = sbi->gc_top_count;
+	memcpy(top, sbi->gc_top, top_count * sizeof(struct nova_gc_victim));
+	spin_unlock(&sbi->gc_lock);
+
+	seq_printf(seq, "========== NOVA log GC stats ==========\n");
+	seq_printf(seq, "Candidates %lu, log pages %lu, dead bytes %lu\n",
+			count, pages, dead);
+	seq_printf(seq, "Budget %lu pages, %s\n", budget,
+			over ? "over budget" : "within budget");
+	seq_printf(seq, "Worst offenders:\n");
+	for (i = 0; i < top_count; i++) {
+		seq_printf(seq, "inode %lu: log pages %lu, live bytes %lu, "
+				"dead bytes %lu, score %llu\n",
+				top[i].ino, top[i].log_pages,
+				top[i].live_bytes, top[i].dead_bytes,
+				top[i].score);
+	}
+
+	return 0;
+}
+
+static int nova_seq_gc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nova_seq_gc_show, PDE_DATA(inode));
+}
+
+static const struct file_operations nova_seq_gc_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nova_seq_gc_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static const char * const nova_recovery_states[] = {
+	[NOVA_RECOVERY_NONE]		= "none",
+	[NOVA_RECOVERY_SCANNING]	= "scanning",
+	[NOVA_RECOVERY_DONE]		= "done",
+	[NOVA_RECOVERY_ABORTED]		= "aborted",
+};
+
+static int nova_seq_recovery_show(struct seq_file *seq, void *v)
+{
+	struct super_block *sb = seq->private;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	unsigned long pool_left, deferred, leaked;
+	int state = READ_ONCE(sbi->recovery_state);
+	int restricted;
+
+	spin_lock(&sbi->pool_lock);
+	restricted = sbi->restricted_alloc;
+	pool_left = sbi->pool_end - sbi->pool_next;
+	deferred = sbi->deferred_blocks;
+	leaked = sbi->leaked_blocks;
+	spin_unlock(&sbi->pool_lock);
+
+	seq_printf(seq, "========== NOVA failure recovery ==========\n");
+	seq_printf(seq, "State %s\n", nova_recovery_states[state]);
+	if (state == NOVA_RECOVERY_NONE)
+		return 0;
+
+	seq_printf(seq, "Inode table chunks scanned %ld / %lu, inodes %ld\n",
+			atomic_long_read(&sbi->recovery_scanned),
+			sbi->recovery_pages,
+			atomic_long_read(&sbi->recovery_inodes));
+	if (state == NOVA_RECOVERY_SCANNING)
+		seq_printf(seq, "Elapsed %u ms\n",
+			jiffies_to_msecs(jiffies - sbi->recovery_start));
+	seq_printf(seq, "Restricted allocation %s, pool blocks left %lu\n",
+			restricted ? "on" : "off", restricted ? pool_left : 0);
+	seq_printf(seq, "Deferred frees %lu blocks, leaked %lu blocks\n",
+			deferred, leaked);
+
+	return 0;
+}
+
+static int nova_seq_recovery_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nova_seq_recovery_show, PDE_DATA(inode));
+}
+
+static const struct file_operations nova_seq_recovery_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nova_seq_recovery_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * Machine-readable stats under stats/, one key=value pair per line.
+ * Counters only grow until cleared through timing_stats.
+ */
+static int nova_kv_timing_show(struct seq_file *seq, void *v)
+{
+	struct super_block *sb = seq->private;
+	struct nova_stats *stats;
+	int i;
+
+	stats = kmalloc(sizeof(struct nova_stats), GFP_KERNEL);
+	if (!stats)
+		return -ENOMEM;
+
+	nova_get_stats(sb, stats);
+	seq_printf(seq, "measure_timing=%d\n", measure_timing);
+	seq_printf(seq, "timing_sample=%u\n", max(timing_sample, 1U));
+	for (i = 0; i < TIMING_NUM; i++) {
+		seq_printf(seq, "%s_count=%llu\n", Timingstring[i],
+				stats->count[i]);
+		seq_printf(seq, "%s_ns=%llu\n", Timingstring[i],
+				stats->timing[i]);
+	}
+
+	kfree(stats);
+	return 0;
+}
+
+static int nova_kv_io_show(struct seq_file *seq, void *v)
+{
+	struct super_block *sb = seq->private;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_stats *stats;
+	int i;
+
+	stats = kmalloc(sizeof(struct nova_stats), GFP_KERNEL);
+	if (!stats)
+		return -ENOMEM;
+
+	nova_get_stats(sb, stats);
+	seq_printf(seq, "read_count=%llu\n", stats->count[dax_read_t]);
+	seq_printf(seq, "cow_write_count=%llu\n", stats->count[cow_write_t]);
+	seq_printf(seq, "clone_count=%llu\n", stats->count[clone_file_t]);
+	seq_printf(seq, "shared_blocks=%lu\n", sbi->num_shared_blocks);
+	for (i = 0; i < STATS_NUM; i++)
+		seq_printf(seq, "%s=%llu\n", IOstring[i], stats->io[i]);
+
+	kfree(stats);
+	return 0;
+}
+
+static void nova_kv_free_list(struct seq_file *seq, const char *prefix,
+	struct free_list *free_list)
+{
+	seq_printf(seq, "%sfree_blocks=%lu\n", prefix,
+			free_list->num_free_blocks);
+	seq_printf(seq, "%sblocknodes=%lu\n", prefix,
+			free_list->num_blocknode);
+	seq_printf(seq, "%salloc_log_count=%lu\n", prefix,
+			free_list->alloc_log_count);
+	seq_printf(seq, "%salloc_log_pages=%lu\n", prefix,
+			free_list->alloc_log_pages);
+	seq_printf(seq, "%salloc_data_count=%lu\n", prefix,
+			free_list->alloc_data_count);
+	seq_printf(seq, "%salloc_data_pages=%lu\n", prefix,
+			free_list->alloc_data_pages);
+	seq_printf(seq, "%sfree_log_count=%lu\n", prefix,
+			free_list->free_log_count);
+	seq_printf(seq, "%sfreed_log_pages=%lu\n", prefix,
+			free_list->freed_log_pages);
+	seq_printf(seq, "%sfree_data_count=%lu\n", prefix,
+			free_list->free_data_count);
+	seq_printf(seq, "%sfreed_data_pages=%lu\n", prefix,
+			free_list->freed_data_pages);
+}
+
+static int nova_kv_alloc_show(struct seq_file *seq, void *v)
+{
+	struct super_block *sb = seq->private;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct free_list *free_list;
+	struct free_list total;
+	char prefix[16];
+	int i;
+
+	memset(&total, 0, sizeof(struct free_list));
+	for (i = 0; i < sbi->cpus; i++) {
+		free_list = nova_get_free_list(sb, i);
+		snprintf(prefix, sizeof(prefix), "cpu%d_", i);
+		nova_kv_free_list(seq, prefix, free_list);
+
+		total.num_free_blocks += free_list->num_free_blocks;
+		total.num_blocknode += free_list->num_blocknode;
+		total.alloc_log_count += free_list->alloc_log_count;
+		total.alloc_log_pages += free_list->alloc_log_pages;
+		total.alloc_data_count += free_list->alloc_data_count;
+		total.alloc_data_pages += free_list->alloc_data_pages;
+		total.free_log_count += free_list->free_log_count;
+		total.freed_log_pages += free_list->freed_log_pages;
+		total.free_data_count += free_list->free_data_count;
+		total.freed_data_pages += free_list->freed_data_pages;
+	}
+
+	nova_kv_free_list(seq, "shared_", nova_get_free_list(sb, SHARED_CPU));
+	nova_kv_free_list(seq, "", &total);
+	seq_printf(seq, "num_blocks=%lu\n", sbi->num_blocks);
+
+	return 0;
+}
+
+static int nova_kv_gc_show(struct seq_file *seq, void *v)
+{
+	struct super_block *sb = seq->private;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_stats *stats;
+	unsigned long count, pages, dead, budget;
+	int over;
+
+	stats = kmalloc(sizeof(struct nova_stats), GFP_KERNEL);
+	if (!stats)
+		return -ENOMEM;
+
+	nova_get_stats(sb, stats);
+
+	spin_lock(&sbi->gc_lock);
+	count = sbi->gc_cand_count;
+	pages = sbi->gc_cand_pages;
+	dead = sbi->gc_dead_total;
+	budget = sbi->gc_budget_pages;
+	over = sbi->gc_over_budget;
+	spin_unlock(&sbi->gc_lock);
+
+	seq_printf(seq, "candidates=%lu\n", count);
+	seq_printf(seq, "candidate_log_pages=%lu\n", pages);
+	seq_printf(seq, "candidate_dead_bytes=%lu\n", dead);
+	seq_printf(seq, "budget_pages=%lu\n", budget);
+	seq_printf(seq, "over_budget=%d\n", over);
+	seq_printf(seq, "fast_gc_count=%llu\n", stats->count[fast_gc_t]);
+	seq_printf(seq, "fast_checked_pages=%llu\n",
+			stats->io[fast_checked_pages]);
+	seq_printf(seq, "fast_gc_pages=%llu\n", stats->io[fast_gc_pages]);
+	seq_printf(seq, "thorough_gc_count=%llu\n",
+			stats->count[thorough_gc_t]);
+	seq_printf(seq, "thorough_checked_pages=%llu\n",
+			stats->io[thorough_checked_pages]);
+	seq_printf(seq, "thorough_gc_pages=%llu\n",
+			stats->io[thorough_gc_pages]);
+	seq_printf(seq, "log_cleaner_count=%llu\n",
+			stats->count[log_cleaner_t]);
+	seq_printf(seq, "gc_queued=%llu\n", stats->io[gc_queued]);
+	seq_printf(seq, "gc_inline=%llu\n", stats->io[gc_inline]);
+
+	kfree(stats);
+	return 0;
+}
+
+static int nova_kv_inode_map_show(struct seq_file *seq, void *v)
+{
+	struct super_block *sb = seq->private;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct inode_map *inode_map;
+	unsigned long allocated = 0, freed = 0, cached = 0, nodes = 0;
+	int i;
+
+	for (i = 0; i < sbi->cpus; i++) {
+		inode_map = &sbi->inode_maps[i];
+		seq_printf(seq, "cpu%d_allocated=%d\n", i,
+				inode_map->allocated);
+		seq_printf(seq, "cpu%d_freed=%d\n", i, inode_map->freed);
+		seq_printf(seq, "cpu%d_cached=%d\n", i, inode_map->ino_count);
+		seq_printf(seq, "cpu%d_range_nodes=%lu\n", i,
+				inode_map->num_range_node_inode);
+		allocated += inode_map->allocated;
+		freed += inode_map->freed;
+		cached += inode_map->ino_count;
+		nodes += inode_map->num_range_node_inode;
+	}
+
+	seq_printf(seq, "allocated=%lu\n", allocated);
+	seq_printf(seq, "freed=%lu\n", freed);
+	seq_printf(seq, "cached=%lu\n", cached);
+	seq_printf(seq, "range_nodes=%lu\n", nodes);
+	seq_printf(seq, "inodes_used=%lu\n", sbi->s_inodes_used_count);
+
+	return 0;
+}
+
+static int nova_kv_journal_show(struct seq_file *seq, void *v)
+{
+	struct super_block *sb = seq->private;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_stats *stats;
+	int i;
+
+	stats = kmalloc(sizeof(struct nova_stats), GFP_KERNEL);
+	if (!stats)
+		return -ENOMEM;
+
+	nova_get_stats(sb, stats);
+	seq_printf(seq, "transactions=%llu\n",
+			stats->count[create_trans_t] +
+			stats->count[link_trans_t]);
+	seq_printf(seq, "full_waits=%llu\n", stats->io[journal_full]);
+	seq_printf(seq, "ooo_commits=%llu\n", stats->io[journal_ooo_commits]);
+	for (i = 0; i < sbi->cpus; i++)
+		seq_printf(seq, "cpu%d_in_flight=%u\n", i,
+				nova_lite_journal_in_flight(sb, i));
+
+	kfree(stats);
+	return 0;
+}
+
+static int nova_kv_timing_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nova_kv_timing_show, PDE_DATA(inode));
+}
+
+static int nova_kv_io_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nova_kv_io_show, PDE_DATA(inode));
+}
+
+static int nova_kv_alloc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nova_kv_alloc_show, PDE_DATA(inode));
+}
+
+static int nova_kv_gc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nova_kv_gc_show, PDE_DATA(inode));
+}
+
+static int nova_kv_inode_map_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nova_kv_inode_map_show, PDE_DATA(inode));
+}
+
+static int nova_kv_journal_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nova_kv_journal_show, PDE_DATA(inode));
+}
+
+static const struct file_operations nova_kv_timing_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nova_kv_timing_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static const struct file_operations nova_kv_io_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nova_kv_io_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static const struct file_operations nova_kv_alloc_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nova_kv_alloc_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static const struct file_operations nova_kv_gc_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nova_kv_gc_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static const struct file_operations nova_kv_inode_map_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nova_kv_inode_map_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static const struct file_operations nova_kv_journal_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nova_kv_journal_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 void nova_sysfs_init(struct super_block *sb)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
@@ -81,13 +634,53 @@ void nova_sysfs_init(struct super_block *sb)
 	if (sbi->s_proc) {
 		proc_create_data("timing_stats", S_IRUGO, sbi->s_proc,
 				 &nova_seq_timing_fops, sb);
+		proc_create_data("latency_stats", S_IRUGO, sbi->s_proc,
+				 &nova_seq_latency_fops, sb);
+		proc_create_data("persist_stats", S_IRUGO, sbi->s_proc,
+				 &nova_seq_persist_fops, sb);
+		proc_create_data("write_amp", S_IRUGO | S_IWUSR, sbi->s_proc,
+				 &nova_seq_wa_fops, sb);
+		proc_create_data("gc_stats", S_IRUGO, sbi->s_proc,
+				 &nova_seq_gc_fops, sb);
+		proc_create_data("recovery", S_IRUGO, sbi->s_proc,
+				 &nova_seq_recovery_fops, sb);
 	}
 }
 
+/* The stats/ files read the allocator and journals, add them once mounted */
+void nova_sysfs_init_stats(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct proc_dir_entry *stats_dir;
+
+	if (!sbi->s_proc)
+		return;
+
+	stats_dir = proc_mkdir("stats", sbi->s_proc);
+	if (!stats_dir)
+		return;
+
+	proc_create_data("timing", S_IRUGO, stats_dir,
+			 &nova_kv_timing_fops, sb);
+	proc_create_data("io", S_IRUGO, stats_dir, &nova_kv_io_fops, sb);
+	proc_create_data("alloc", S_IRUGO, stats_dir, &nova_kv_alloc_fops, sb);
+	proc_create_data("gc", S_IRUGO, stats_dir, &nova_kv_gc_fops, sb);
+	proc_create_data("inode_map", S_IRUGO, stats_dir,
+			 &nova_kv_inode_map_fops, sb);
+	proc_create_data("journal", S_IRUGO, stats_dir,
+			 &nova_kv_journal_fops, sb);
+}
+
 void nova_sysfs_exit(struct super_block *sb)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
 
 	remove_proc_entry("timing_stats", sbi->s_proc);
+	remove_proc_entry("latency_stats", sbi->s_proc);
+	remove_proc_entry("persist_stats", sbi->s_proc);
+	remove_proc_entry("write_amp", sbi->s_proc);
+	remove_proc_entry("gc_stats", sbi->s_proc);
+	remove_proc_entry("recovery", sbi->s_proc);
+	remove_proc_subtree("stats", sbi->s_proc);
 	remove_proc_entry(sbi->s_bdev->bd_disk->disk_name, nova_proc_root);
 }